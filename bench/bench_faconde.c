@@ -0,0 +1,212 @@
+/* Times the string metrics of faconde, comparing a reference sequence to many
+ * others, for several sequence lengths, alphabet sizes and maximum distances.
+ * Usage: bench_faconde [number of sequences]
+ *
+ * Sequences are sorted, as are the words of an automaton, so that the
+ * memoized functions can reuse the matrix rows of shared prefixes. Half of
+ * them are variants of the reference sequence with a few edits, so that
+ * bounded kernels don't always give up early.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/lib/faconde.c"
+
+#define MAX_LEN 64
+
+static size_t nr_seqs;
+static char32_t (*seqs)[MAX_LEN + 1];
+static int32_t *lens;
+static char32_t ref[MAX_LEN + 1];
+static int32_t ref_len;
+static char32_t pat[MAX_LEN + 1];
+
+static double now(void)
+{
+   struct timespec ts;
+   timespec_get(&ts, TIME_UTC);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_seqs(const void *a, const void *b)
+{
+   const char32_t *x = a, *y = b;
+   while (*x && *x == *y) {
+      x++;
+      y++;
+   }
+   return *x < *y ? -1 : *x > *y;
+}
+
+/* Sequences of about "len" characters, drawn from "alpha" characters. Large
+ * alphabets start past 0xff, as CJK text does.
+ */
+static void make_seqs(int32_t len, int32_t alpha)
+{
+   const char32_t base = alpha > 26 ? 0x4e00 : 'a';
+
+   ref_len = len;
+   for (int32_t i = 0; i < len; i++)
+      ref[i] = base + rand() % alpha;
+   ref[len] = 0;
+
+   /* The glob pattern keeps the first character of the reference sequence,
+    * and two from its middle.
+    */
+   int32_t p = 0;
+   pat[p++] = ref[0];
+   pat[p++] = U'*';
+   for (int32_t i = len / 2; i < len / 2 + 2 && i < len - 1; i++)
+      pat[p++] = ref[i];
+   pat[p++] = U'*';
+   pat[p++] = U'?';
+   pat[p] = 0;
+
+   for (size_t i = 0; i < nr_seqs; i++) {
+      int32_t n = len + rand() % 5 - 2;
+      n = n < 1 ? 1 : n > MAX_LEN ? MAX_LEN : n;
+      if (i % 2) {
+         for (int32_t j = 0; j < n; j++)
+            seqs[i][j] = base + rand() % alpha;
+      } else {
+         for (int32_t j = 0; j < n; j++)
+            seqs[i][j] = j < len ? ref[j] : base + rand() % alpha;
+         for (int e = rand() % 3 + 1; e > 0; e--)
+            seqs[i][rand() % n] = base + rand() % alpha;
+      }
+      seqs[i][n] = 0;
+   }
+   qsort(seqs, nr_seqs, sizeof *seqs, cmp_seqs);
+   for (size_t i = 0; i < nr_seqs; i++) {
+      lens[i] = 0;
+      while (seqs[i][lens[i]])
+         lens[i]++;
+   }
+}
+
+/* A kernel compares the reference sequence to all sequences, and returns the
+ * sum of the results, so that the work can't be optimized away.
+ */
+typedef int64_t kernel(int32_t max_dist);
+
+static int64_t run_plain(int32_t (*fn)(const char32_t *, int32_t,
+                                       const char32_t *, int32_t))
+{
+   int64_t sum = 0;
+   for (size_t i = 0; i < nr_seqs; i++)
+      sum += fn(ref, ref_len, seqs[i], lens[i]);
+   return sum;
+}
+
+static int64_t run_memo(enum fc_metric metric, int32_t max_dist)
+{
+   struct fc_memo m;
+   fc_memo_init(&m, metric, MAX_LEN, max_dist);
+   fc_memo_set_ref(&m, ref, ref_len);
+   int64_t sum = 0;
+   for (size_t i = 0; i < nr_seqs; i++) {
+      const int32_t ret = fc_memo_compute(&m, seqs[i], lens[i]);
+      sum += ret == INT32_MAX ? -1 : ret;
+   }
+   fc_memo_fini(&m);
+   return sum;
+}
+
+static int64_t run_batch(enum fc_metric metric, int32_t max_dist)
+{
+   struct fc_batch b;
+   fc_batch_init(&b, metric, MAX_LEN, max_dist);
+   fc_batch_set_ref(&b, ref, ref_len);
+   int64_t sum = 0;
+   for (size_t i = 0; i < nr_seqs; i += FC_BATCH_SIZE) {
+      const char32_t *batch[FC_BATCH_SIZE];
+      int32_t ret[FC_BATCH_SIZE];
+      const int32_t n = FC_MIN(FC_BATCH_SIZE, nr_seqs - i);
+      for (int32_t k = 0; k < n; k++)
+         batch[k] = seqs[i + k];
+      fc_batch_compute(&b, batch, &lens[i], n, ret);
+      for (int32_t k = 0; k < n; k++)
+         sum += ret[k];
+   }
+   fc_batch_fini(&b);
+   return sum;
+}
+
+static int64_t time_levenshtein(int32_t d) { (void)d; return run_plain(fc_levenshtein); }
+static int64_t time_damerau(int32_t d) { (void)d; return run_plain(fc_damerau); }
+static int64_t time_lcsubstr(int32_t d) { (void)d; return run_plain(fc_lcsubstr); }
+static int64_t time_lcsubseq(int32_t d) { (void)d; return run_plain(fc_lcsubseq); }
+static int64_t time_lev_bounded(int32_t d) { return run_plain(fc_lev_bounded[d]); }
+static int64_t time_memo_levenshtein(int32_t d) { return run_memo(FC_LEVENSHTEIN, d); }
+static int64_t time_memo_damerau(int32_t d) { return run_memo(FC_DAMERAU, d); }
+static int64_t time_memo_lcsubstr(int32_t d) { return run_memo(FC_LCSUBSTR, d); }
+static int64_t time_memo_lcsubseq(int32_t d) { return run_memo(FC_LCSUBSEQ, d); }
+static int64_t time_batch_levenshtein(int32_t d) { return run_batch(FC_LEVENSHTEIN, d); }
+static int64_t time_batch_damerau(int32_t d) { return run_batch(FC_DAMERAU, d); }
+static int64_t time_batch_lcsubstr(int32_t d) { return run_batch(FC_LCSUBSTR, d); }
+static int64_t time_batch_lcsubseq(int32_t d) { return run_batch(FC_LCSUBSEQ, d); }
+
+static int64_t time_glob(int32_t d)
+{
+   (void)d;
+   int64_t sum = 0;
+   for (size_t i = 0; i < nr_seqs; i++)
+      sum += fc_glob(pat, seqs[i]);
+   return sum;
+}
+
+static const struct {
+   const char *name;
+   kernel *fn;
+   int32_t min_dist, max_dist;   /* Range of maximum distances to try. */
+} kernels[] = {
+   {"levenshtein", time_levenshtein, 0, 0},
+   {"memo_levenshtein", time_memo_levenshtein, 1, 3},
+   {"batch_levenshtein", time_batch_levenshtein, 1, 3},
+   {"lev_bounded", time_lev_bounded, 1, 2},
+   {"damerau", time_damerau, 0, 0},
+   {"memo_damerau", time_memo_damerau, 1, 3},
+   {"batch_damerau", time_batch_damerau, 1, 3},
+   {"lcsubstr", time_lcsubstr, 0, 0},
+   {"memo_lcsubstr", time_memo_lcsubstr, 0, 0},
+   {"batch_lcsubstr", time_batch_lcsubstr, 0, 0},
+   {"lcsubseq", time_lcsubseq, 0, 0},
+   {"memo_lcsubseq", time_memo_lcsubseq, 0, 0},
+   {"batch_lcsubseq", time_batch_lcsubseq, 0, 0},
+   {"glob", time_glob, 0, 0},
+};
+
+int main(int argc, char **argv)
+{
+   static const int32_t seq_lens[] = {4, 8, 16, 32};
+   static const int32_t alphas[] = {4, 26, 1000};
+
+   nr_seqs = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+   seqs = malloc(nr_seqs * sizeof *seqs);
+   lens = malloc(nr_seqs * sizeof *lens);
+
+   srand(0);
+   printf("%-18s %5s %4s %4s %10s\n", "kernel", "alpha", "len", "dist", "ns/seq");
+   for (size_t a = 0; a < sizeof alphas / sizeof *alphas; a++) {
+      for (size_t l = 0; l < sizeof seq_lens / sizeof *seq_lens; l++) {
+         make_seqs(seq_lens[l], alphas[a]);
+         for (size_t k = 0; k < sizeof kernels / sizeof *kernels; k++) {
+            for (int32_t d = kernels[k].min_dist; d <= kernels[k].max_dist; d++) {
+               double best = 0;
+               for (int round = 0; round < 3; round++) {
+                  double start = now();
+                  volatile int64_t sum = kernels[k].fn(d);
+                  (void)sum;
+                  double t = now() - start;
+                  if (!round || t < best)
+                     best = t;
+               }
+               printf("%-18s %5d %4d %4d %10.1f\n", kernels[k].name, alphas[a],
+                      seq_lens[l], d, best / nr_seqs * 1e9);
+            }
+         }
+      }
+   }
+   free(seqs);
+   free(lens);
+}
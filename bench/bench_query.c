@@ -0,0 +1,379 @@
+/* Times searches in every matching mode, over a synthetic lexicon or an
+ * existing automaton, and prints the throughput and latency percentiles of
+ * each mode as JSON. Usage:
+ *
+ *    bench_query [-n words] [-a ascii|latin1|cjk] [-l lexicon.mn]
+ *                [-q queries] [-p pages] [-t seconds] [-flat]
+ *
+ * -n and -a select the size and the alphabet of the synthetic lexicon, -l
+ * loads a numbered automaton instead. Each mode runs at most "queries"
+ * queries, or for "seconds" seconds, whichever comes first, and each query
+ * fetches up to "pages" results pages. -flat flattens the lexicon first.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../volubile.h"
+#include "../src/lib/mini.h"
+
+#define PAGE_SIZE 10
+
+struct script {
+   const char *name;
+   const char *const *chars;  /* Characters words are made of. */
+   size_t nr;
+};
+
+static const char *const ascii[] = {
+   "a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m",
+   "n", "o", "p", "q", "r", "s", "t", "u", "v", "w", "x", "y", "z",
+};
+
+/* French-like: mostly ASCII, with accented letters. */
+static const char *const latin1[] = {
+   "a", "b", "c", "d", "e", "f", "g", "i", "l", "m", "n", "o", "r",
+   "s", "t", "u", "é", "è", "à", "ç", "ê", "ô", "ù", "œ",
+};
+
+static const char *const cjk[] = {
+   "中", "文", "字", "日", "本", "語", "한", "국", "어", "的", "是", "人",
+};
+
+#define SCRIPT(name) {#name, name, sizeof name / sizeof *name}
+
+static const struct script scripts[] = {
+   SCRIPT(ascii),
+   SCRIPT(latin1),
+   SCRIPT(cjk),
+};
+
+static const char *const mode_names[] = {
+   [VB_AUTO] = "auto",
+   [VB_EXACT] = "exact",
+   [VB_PREFIX] = "prefix",
+   [VB_SUBSTR] = "substr",
+   [VB_SUFFIX] = "suffix",
+   [VB_GLOB] = "glob",
+   [VB_LEVENSHTEIN] = "levenshtein",
+   [VB_DAMERAU] = "damerau",
+   [VB_LCSUBSTR] = "lcsubstr",
+   [VB_LCSUBSEQ] = "lcsubseq",
+   [VB_REGEX] = "regex",
+   [VB_TOP_PREFIX] = "top_prefix",
+};
+
+_Static_assert(sizeof mode_names / sizeof *mode_names == VB_MODES_NR,
+               "missing mode name");
+
+static double now(void)
+{
+   struct timespec ts;
+   timespec_get(&ts, TIME_UTC);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(const char *msg, int err)
+{
+   fprintf(stderr, "bench_query: %s: %s\n", msg, vb_strerror(err));
+   exit(EXIT_FAILURE);
+}
+
+/* Words of the lexicon, in lexicographic order, which queries are made from. */
+static char **words;
+static size_t nr_words;
+
+static int cmp_words(const void *a, const void *b)
+{
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Random words of 3 to 12 characters, sorted, without duplicates. */
+static void make_words(const struct script *s, size_t nr)
+{
+   words = malloc(nr * sizeof *words);
+   for (size_t i = 0; i < nr; i++) {
+      char buf[12 * 4 + 1];
+      size_t len = 0;
+      for (int j = rand() % 10 + 3; j > 0; j--) {
+         const char *c = s->chars[rand() % s->nr];
+         memcpy(&buf[len], c, strlen(c));
+         len += strlen(c);
+      }
+      words[i] = malloc(len + 1);
+      memcpy(words[i], buf, len);
+      words[i][len] = '\0';
+   }
+   qsort(words, nr, sizeof *words, cmp_words);
+
+   nr_words = 0;
+   for (size_t i = 0; i < nr; i++) {
+      if (nr_words && !strcmp(words[nr_words - 1], words[i]))
+         free(words[i]);
+      else
+         words[nr_words++] = words[i];
+   }
+}
+
+static struct mini *build(void)
+{
+   struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+   if (!enc)
+      die("cannot build lexicon", VB_ENOMEM);
+   for (size_t i = 0; i < nr_words; i++)
+      if (mn_enc_add(enc, words[i], strlen(words[i])))
+         die("cannot build lexicon", VB_E2BIG);
+
+   FILE *fp = tmpfile();
+   struct mini *fsa;
+   if (!fp || mn_enc_dump_file(enc, fp) || (rewind(fp), mn_load_file(&fsa, fp)))
+      die("cannot build lexicon", VB_ENOMEM);
+   mn_enc_free(enc);
+   fclose(fp);
+   return fsa;
+}
+
+static struct mini *load(const char *path)
+{
+   FILE *fp = fopen(path, "rb");
+   struct mini *fsa;
+   if (!fp || mn_load_file(&fsa, fp)) {
+      fprintf(stderr, "bench_query: cannot load '%s'\n", path);
+      exit(EXIT_FAILURE);
+   }
+   fclose(fp);
+
+   struct mini_iter it;
+   const char *word;
+   size_t len;
+   nr_words = mn_size(fsa);
+   words = malloc(nr_words * sizeof *words);
+   nr_words = 0;
+   mn_iter_init(&it, fsa);
+   while ((word = mn_iter_next(&it, &len))) {
+      words[nr_words] = malloc(len + 1);
+      memcpy(words[nr_words++], word, len + 1);
+   }
+   return fsa;
+}
+
+/* Length, in bytes, of the first "nr" characters of a word, or of the whole
+ * word if it is shorter.
+ */
+static size_t head(const char *word, size_t nr)
+{
+   size_t i = 0;
+   while (word[i] && nr) {
+      i++;
+      while ((word[i] & 0xc0) == 0x80)
+         i++;
+      nr--;
+   }
+   return i;
+}
+
+/* Builds a query string for a mode from a random word of the lexicon, as a
+ * user typing it would: short prefixes for completion, a typo for fuzzy
+ * searches, and so on.
+ */
+static void make_query(char *str, enum vb_match_mode mode)
+{
+   const char *word = words[rand() % nr_words];
+   const size_t len = strlen(word);
+   const size_t h1 = head(word, 1), h2 = head(word, rand() % 3 + 1);
+
+   switch (mode) {
+   case VB_AUTO: {
+      static const char *const fmts[] = {"%.*s*", "#%.*s", "@%.*s", "%.*s"};
+      sprintf(str, fmts[rand() % 4], (int)h2, word);
+      break;
+   }
+   case VB_PREFIX: case VB_TOP_PREFIX:
+      sprintf(str, "%.*s", (int)h2, word);
+      break;
+   case VB_SUBSTR: {
+      const size_t start = head(word, rand() % 3);
+      sprintf(str, "%.*s", (int)head(&word[start], 2), &word[start]);
+      break;
+   }
+   case VB_SUFFIX:
+      sprintf(str, "%s", &word[head(word, 3) < len ? head(word, 3) : 0]);
+      break;
+   case VB_GLOB:
+      sprintf(str, "%.*s*%.*s*", (int)h1, word,
+              (int)head(&word[h1], 1), &word[h1]);
+      break;
+   case VB_REGEX:
+      sprintf(str, "%.*s.*(%.*s|%.*s).*", (int)h1, word,
+              (int)head(&word[h1], 1), &word[h1],
+              (int)head(&word[len / 2], 1), &word[len / 2]);
+      break;
+   case VB_LEVENSHTEIN: case VB_DAMERAU: {
+      /* Drop a character. */
+      const size_t pos = head(word, rand() % 4 + 1);
+      const size_t next = pos + head(&word[pos], 1);
+      sprintf(str, "%.*s%s", (int)pos, word, &word[next]);
+      break;
+   }
+   default:
+      strcpy(str, word);
+      break;
+   }
+}
+
+static int cmp_doubles(const void *a, const void *b)
+{
+   const double x = *(const double *)a, y = *(const double *)b;
+   return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted samples. */
+static double percentile(const double *samples, size_t nr, double p)
+{
+   size_t rank = p * nr;
+   return samples[rank < nr ? rank : nr - 1];
+}
+
+static void count(void *arg, const char *word, size_t len)
+{
+   (void)word;
+   (void)len;
+   (*(size_t *)arg)++;
+}
+
+static void run(const struct vb_lexicon *lex, enum vb_match_mode mode,
+                size_t max_queries, int max_pages, double max_time,
+                double *samples, bool last)
+{
+   size_t nr = 0, results = 0, errors = 0;
+   double total = 0;
+
+   while (nr < max_queries && total < max_time) {
+      char str[VB_MAX_WORD_LEN * 2 + 16];
+      make_query(str, mode);
+      struct vb_query query = VB_QUERY_INIT;
+      query.query = str;
+      query.len = strlen(str);
+      query.mode = mode;
+      query.page_size = PAGE_SIZE;
+
+      const double start = now();
+      for (int page = 0; page < max_pages && !query.pagination.last_page; page++) {
+         if (vb_lexicon_match(lex, &query, count, &results)) {
+            errors++;
+            break;
+         }
+      }
+      samples[nr] = now() - start;
+      total += samples[nr++];
+   }
+   qsort(samples, nr, sizeof *samples, cmp_doubles);
+
+   printf("    {\"mode\": \"%s\", \"queries\": %zu, \"errors\": %zu, "
+          "\"results\": %zu, \"qps\": %.1f, "
+          "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}%s\n",
+          mode_names[mode], nr, errors, results, nr / total,
+          percentile(samples, nr, .5) * 1e6, percentile(samples, nr, .99) * 1e6,
+          percentile(samples, nr, .999) * 1e6, last ? "" : ",");
+}
+
+int main(int argc, char **argv)
+{
+   size_t size = 100000, max_queries = 10000;
+   const struct script *script = &scripts[0];
+   const char *path = NULL;
+   int max_pages = 1;
+   double max_time = 2;
+   bool flat = false;
+
+   for (int i = 1; i < argc; i++) {
+      const char *opt = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+      if (!strcmp(opt, "-flat")) {
+         flat = true;
+         continue;
+      }
+      if (!val)
+         goto usage;
+      i++;
+      if (!strcmp(opt, "-n")) {
+         size = strtoul(val, NULL, 10);
+      } else if (!strcmp(opt, "-l")) {
+         path = val;
+      } else if (!strcmp(opt, "-q")) {
+         max_queries = strtoul(val, NULL, 10);
+      } else if (!strcmp(opt, "-p")) {
+         max_pages = atoi(val);
+      } else if (!strcmp(opt, "-t")) {
+         max_time = atof(val);
+      } else if (!strcmp(opt, "-a")) {
+         size_t j = 0;
+         while (j < sizeof scripts / sizeof *scripts && strcmp(scripts[j].name, val))
+            j++;
+         if (j == sizeof scripts / sizeof *scripts)
+            goto usage;
+         script = &scripts[j];
+      } else {
+         goto usage;
+      }
+   }
+   if (!size || !max_queries || max_pages < 1)
+      goto usage;
+
+   srand(0);
+   struct mini *fsa;
+   if (path) {
+      fsa = load(path);
+   } else {
+      make_words(script, size);
+      fsa = build();
+   }
+   if (!nr_words) {
+      fprintf(stderr, "bench_query: empty lexicon\n");
+      return EXIT_FAILURE;
+   }
+
+   struct vb_lexicon *lex;
+   int ret = vb_lexicon_new(&lex, fsa);
+   if (ret)
+      die("cannot create lexicon", ret);
+   if (flat && (ret = vb_lexicon_flatten(lex)))
+      die("cannot flatten lexicon", ret);
+
+   /* Scores follow a rough power law, as word frequencies do. */
+   int32_t *scores = malloc(nr_words * sizeof *scores);
+   if (!scores)
+      die("cannot set scores", VB_ENOMEM);
+   for (size_t i = 0; i < nr_words; i++)
+      scores[i] = RAND_MAX / (rand() % 1000 + 1);
+   if ((ret = vb_lexicon_set_scores(lex, scores)))
+      die("cannot set scores", ret);
+
+   printf("{\n");
+   printf("  \"version\": \"%s\",\n", VB_VERSION);
+   printf("  \"lexicon\": {\"source\": \"%s\", \"words\": %zu, "
+          "\"flattened\": %s},\n", path ? path : script->name, nr_words,
+          flat ? "true" : "false");
+   printf("  \"page_size\": %d,\n", PAGE_SIZE);
+   printf("  \"max_pages\": %d,\n", max_pages);
+   printf("  \"modes\": [\n");
+   double *samples = malloc(max_queries * sizeof *samples);
+   for (int mode = VB_AUTO; mode < VB_MODES_NR; mode++) {
+      run(lex, mode, max_queries, max_pages, max_time, samples,
+          mode == VB_MODES_NR - 1);
+      fflush(stdout);
+   }
+   printf("  ]\n}\n");
+
+   free(samples);
+   vb_lexicon_free(lex);
+   free(scores);
+   for (size_t i = 0; i < nr_words; i++)
+      free(words[i]);
+   free(words);
+   return EXIT_SUCCESS;
+
+usage:
+   fprintf(stderr, "Usage: %s [-n words] [-a ascii|latin1|cjk] [-l lexicon.mn] "
+           "[-q queries] [-p pages] [-t seconds] [-flat]\n", argv[0]);
+   return EXIT_FAILURE;
+}
@@ -0,0 +1,91 @@
+/* Times vb_utf8_decode() over synthetic lexicons written in different
+ * scripts. Usage: bench_utf8 [number of words]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/utf8.c"
+
+struct script {
+   const char *name;
+   const char *const *chars;  /* Characters words are made of. */
+   size_t nr;
+};
+
+static const char *const ascii[] = {
+   "a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m",
+   "n", "o", "p", "q", "r", "s", "t", "u", "v", "w", "x", "y", "z",
+};
+
+/* French-like: mostly ASCII, with accented letters. */
+static const char *const latin1[] = {
+   "a", "b", "c", "d", "e", "f", "g", "i", "l", "m", "n", "o", "r",
+   "s", "t", "u", "é", "è", "à", "ç", "ê", "ô", "ù", "œ",
+};
+
+static const char *const cjk[] = {
+   "中", "文", "字", "日", "本", "語", "한", "국", "어", "的", "是", "人",
+};
+
+#define SCRIPT(name) {#name, name, sizeof name / sizeof *name}
+
+static const struct script scripts[] = {
+   SCRIPT(ascii),
+   SCRIPT(latin1),
+   SCRIPT(cjk),
+};
+
+static double now(void)
+{
+   struct timespec ts;
+   timespec_get(&ts, TIME_UTC);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Words of 3 to 20 characters, laid out one after the other. */
+static char *make_words(const struct script *s, size_t nr, size_t *offsets)
+{
+   char *buf = malloc(nr * 20 * 4);
+   size_t len = 0;
+
+   for (size_t i = 0; i < nr; i++) {
+      offsets[i] = len;
+      for (int j = rand() % 18 + 3; j > 0; j--) {
+         const char *c = s->chars[rand() % s->nr];
+         memcpy(&buf[len], c, strlen(c));
+         len += strlen(c);
+      }
+   }
+   offsets[nr] = len;
+   return buf;
+}
+
+int main(int argc, char **argv)
+{
+   size_t nr = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+   size_t *offsets = malloc((nr + 1) * sizeof *offsets);
+   char32_t dest[MN_MAX_WORD_LEN + 1];
+
+   srand(0);
+   for (size_t i = 0; i < sizeof scripts / sizeof *scripts; i++) {
+      char *words = make_words(&scripts[i], nr, offsets);
+      double best = 0;
+      int64_t total = 0;
+      for (int round = 0; round < 5; round++) {
+         double start = now();
+         total = 0;
+         for (size_t j = 0; j < nr; j++)
+            total += vb_utf8_decode(dest, &words[offsets[j]],
+                                    offsets[j + 1] - offsets[j]);
+         double t = now() - start;
+         if (!round || t < best)
+            best = t;
+      }
+      printf("%-8s %8.1f MB/s %8.2f ns/word %8.2f chars/word\n",
+             scripts[i].name, offsets[nr] / best / 1e6, best / nr * 1e9,
+             (double)total / nr);
+      free(words);
+   }
+   free(offsets);
+}
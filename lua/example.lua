@@ -21,4 +21,5 @@ while true do
    end
    if matches.last_page then break end
    params.last_pos, params.last_weight = matches.last_pos, matches.last_weight
+   params.last_word = matches.last_word
 end
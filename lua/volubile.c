@@ -101,6 +101,7 @@ static int vb_lua_match_mode(const char *name)
       [VB_DAMERAU] = "damerau",
       [VB_LCSUBSTR] = "lcsubstr",
       [VB_LCSUBSEQ] = "lcsubseq",
+      [VB_REGEX] = "regex",
    };
    
    for (size_t i = 0; i < sizeof modes / sizeof *modes; i++)
@@ -121,11 +122,23 @@ static void map_params(lua_State *lua, int idx, struct vb_query *query)
 } while (0)
    _(pagination.last_pos, "last_pos");
    _(pagination.last_weight, "last_weight");
+   _(pagination.pages, "pages");
    _(page_size, "page_size");
    _(max_dist, "max_dist");
    _(prefix_len, "prefix_len");
 #undef _
 
+   lua_getfield(lua, idx, "last_word");
+   if (!lua_isnil(lua, -1)) {
+      size_t len;
+      const char *word = lua_tolstring(lua, -1, &len);
+      if (!word || len > VB_MAX_WORD_LEN)
+         luaL_error(lua, "invalid pagination word");
+      memcpy(query->pagination.last_word, word, len + 1);
+      query->pagination.last_len = len;
+   }
+   lua_pop(lua, 1);
+
    lua_getfield(lua, idx, "mode");
    if (!lua_isnil(lua, -1)) {
       const char *name = lua_tostring(lua, -1);
@@ -151,7 +164,7 @@ static int vb_lua_match(lua_State *lua)
       map_params(lua, 3, &query);
    }
    
-   lua_createtable(lua, query.page_size, 3);
+   lua_createtable(lua, query.page_size, 4);
    struct vb_lua_match_ctx ctx = {.lua = lua};
 
    int ret = vb_match(lexicon->fsa, &query, vb_lua_match_handle, &ctx);
@@ -164,6 +177,10 @@ static int vb_lua_match(lua_State *lua)
    lua_setfield(lua, -2, "last_pos");
    lua_pushnumber(lua, query.pagination.last_weight);
    lua_setfield(lua, -2, "last_weight");
+   lua_pushlstring(lua, query.pagination.last_word, query.pagination.last_len);
+   lua_setfield(lua, -2, "last_word");
+   lua_pushnumber(lua, query.pagination.pages);
+   lua_setfield(lua, -2, "pages");
    return 1;
 }
 
@@ -0,0 +1,151 @@
+#ifndef VB_PROTOCOL_H
+#define VB_PROTOCOL_H
+
+/* Wire protocol of volubile-server, see README.md in this directory. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../volubile.h"
+
+#define VB_MAX_REQUEST (1 << 16)    /* Maximum size of a request frame. */
+#define VB_MAX_RESPONSE (1 << 22)   /* Same for responses. */
+
+/* Request types. */
+enum {
+   VB_REQ_SEARCH,
+   VB_REQ_METRICS,
+};
+
+/* Names of the matching modes, which requests give by number. */
+static const char *const vb_mode_names[] = {
+   [VB_AUTO] = "auto",
+   [VB_EXACT] = "exact",
+   [VB_PREFIX] = "prefix",
+   [VB_SUBSTR] = "substr",
+   [VB_SUFFIX] = "suffix",
+   [VB_GLOB] = "glob",
+   [VB_LEVENSHTEIN] = "levenshtein",
+   [VB_DAMERAU] = "damerau",
+   [VB_LCSUBSTR] = "lcsubstr",
+   [VB_LCSUBSEQ] = "lcsubseq",
+   [VB_REGEX] = "regex",
+   [VB_TOP_PREFIX] = "top_prefix",
+};
+
+_Static_assert(sizeof vb_mode_names / sizeof *vb_mode_names == VB_MODES_NR,
+               "missing mode name");
+
+/* Request flags. */
+#define VB_REQ_FOLD 1
+
+/* Status of the response to a malformed request. Other statuses are the error
+ * codes of the library.
+ */
+#define VB_EPROTO 255
+
+/* Growable buffer, for building frames. Allocation failures are sticky. */
+struct vb_buf {
+   uint8_t *data;
+   size_t len;
+   size_t max;
+   bool failed;
+};
+
+/* Makes room for "len" more bytes, and returns where they go, or NULL. */
+static inline uint8_t *vb_buf_reserve(struct vb_buf *b, size_t len)
+{
+   if (b->failed)
+      return NULL;
+   if (b->len + len > b->max) {
+      size_t max = b->max ? b->max * 2 : 4096;
+      while (b->len + len > max)
+         max *= 2;
+      uint8_t *data = realloc(b->data, max);
+      if (!data) {
+         b->failed = true;
+         return NULL;
+      }
+      b->data = data;
+      b->max = max;
+   }
+   uint8_t *p = &b->data[b->len];
+   b->len += len;
+   return p;
+}
+
+static inline void vb_put_le(uint8_t *p, uint32_t val, int bytes)
+{
+   for (int i = 0; i < bytes; i++)
+      p[i] = val >> (8 * i);
+}
+
+static inline uint32_t vb_get_le(const uint8_t *p, int bytes)
+{
+   uint32_t val = 0;
+   for (int i = 0; i < bytes; i++)
+      val |= (uint32_t)p[i] << (8 * i);
+   return val;
+}
+
+static inline void vb_buf_int(struct vb_buf *b, uint32_t val, int bytes)
+{
+   uint8_t *p = vb_buf_reserve(b, bytes);
+   if (p)
+      vb_put_le(p, val, bytes);
+}
+
+static inline void vb_buf_bytes(struct vb_buf *b, const void *data, size_t len)
+{
+   uint8_t *p = vb_buf_reserve(b, len);
+   if (p && len)
+      memcpy(p, data, len);
+}
+
+/* Starts a frame, whose length is filled in by vb_buf_end(). */
+static inline void vb_buf_begin(struct vb_buf *b)
+{
+   b->len = 0;
+   b->failed = false;
+   vb_buf_int(b, 0, 4);
+}
+
+static inline void vb_buf_end(struct vb_buf *b)
+{
+   if (!b->failed)
+      vb_put_le(b->data, b->len - 4, 4);
+}
+
+/* Reader over the body of a frame. Reading past its end sets "failed", and
+ * returns zeroes.
+ */
+struct vb_frame {
+   const uint8_t *data;
+   size_t len;
+   size_t pos;
+   bool failed;
+};
+
+static inline uint32_t vb_frame_int(struct vb_frame *f, int bytes)
+{
+   if (f->len - f->pos < (size_t)bytes) {
+      f->failed = true;
+      return 0;
+   }
+   f->pos += bytes;
+   return vb_get_le(&f->data[f->pos - bytes], bytes);
+}
+
+static inline const void *vb_frame_bytes(struct vb_frame *f, size_t len)
+{
+   if (f->len - f->pos < len) {
+      f->failed = true;
+      return "";
+   }
+   f->pos += len;
+   return &f->data[f->pos - len];
+}
+
+#endif
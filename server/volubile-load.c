@@ -0,0 +1,448 @@
+/* Load generator for volubile-server. Keeps a number of requests in flight on
+ * each of several connections, for a given time, and prints the throughput and
+ * latency percentiles of the requests as JSON. Usage:
+ *
+ *    volubile-load [-c connections] [-d depth] [-t seconds] [-m mode]
+ *                  [-l mask] [-p pages] [-fold] -w words.txt socket
+ *    volubile-load -metrics socket
+ *
+ * Queries are made from the words of "words.txt", one per line, as in
+ * bench/bench_query. "depth" is the number of requests pipelined on each
+ * connection. Each query fetches up to "pages" results pages, following the
+ * tokens of the server. "mask" selects the lexicons searched, all of them by
+ * default. -metrics prints the metrics of the server instead.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../volubile.h"
+#include "protocol.h"
+
+#define PAGE_SIZE 10
+#define MAX_DEPTH 1024
+
+static const char *socket_path;
+static int nr_conns = 4, depth = 16, max_pages = 1, mode = VB_AUTO;
+static uint16_t mask;
+static bool fold;
+static double duration = 2;
+
+static char **words;
+static size_t nr_words;
+
+static double now(void)
+{
+   struct timespec ts;
+   timespec_get(&ts, TIME_UTC);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(const char *msg)
+{
+   fprintf(stderr, "volubile-load: %s\n", msg);
+   exit(EXIT_FAILURE);
+}
+
+static void load_words(const char *path)
+{
+   FILE *fp = fopen(path, "r");
+   if (!fp)
+      die("cannot open words file");
+
+   char line[VB_MAX_WORD_LEN + 2];
+   size_t max = 0;
+   while (fgets(line, sizeof line, fp)) {
+      const size_t len = strcspn(line, "\n");
+      if (!len)
+         continue;
+      if (nr_words == max) {
+         max = max ? max * 2 : 1024;
+         words = realloc(words, max * sizeof *words);
+         if (!words)
+            die("out of memory");
+      }
+      words[nr_words] = malloc(len + 1);
+      memcpy(words[nr_words], line, len);
+      words[nr_words++][len] = '\0';
+   }
+   fclose(fp);
+   if (!nr_words)
+      die("no words to make queries from");
+}
+
+/* Length, in bytes, of the first "nr" characters of a word, or of the whole
+ * word if it is shorter.
+ */
+static size_t head(const char *word, size_t nr)
+{
+   size_t i = 0;
+   while (word[i] && nr) {
+      i++;
+      while ((word[i] & 0xc0) == 0x80)
+         i++;
+      nr--;
+   }
+   return i;
+}
+
+/* Same as in bench/bench_query.c. */
+static void make_query(char *str, unsigned *seed)
+{
+   const char *word = words[rand_r(seed) % nr_words];
+   const size_t len = strlen(word);
+   const size_t h1 = head(word, 1), h2 = head(word, rand_r(seed) % 3 + 1);
+
+   switch (mode) {
+   case VB_AUTO: {
+      static const char *const fmts[] = {"%.*s*", "#%.*s", "@%.*s", "%.*s"};
+      sprintf(str, fmts[rand_r(seed) % 4], (int)h2, word);
+      break;
+   }
+   case VB_PREFIX: case VB_TOP_PREFIX:
+      sprintf(str, "%.*s", (int)h2, word);
+      break;
+   case VB_SUBSTR: {
+      const size_t start = head(word, rand_r(seed) % 3);
+      sprintf(str, "%.*s", (int)head(&word[start], 2), &word[start]);
+      break;
+   }
+   case VB_SUFFIX:
+      sprintf(str, "%s", &word[head(word, 3) < len ? head(word, 3) : 0]);
+      break;
+   case VB_GLOB:
+      sprintf(str, "%.*s*%.*s*", (int)h1, word,
+              (int)head(&word[h1], 1), &word[h1]);
+      break;
+   case VB_REGEX:
+      sprintf(str, "%.*s.*(%.*s|%.*s).*", (int)h1, word,
+              (int)head(&word[h1], 1), &word[h1],
+              (int)head(&word[len / 2], 1), &word[len / 2]);
+      break;
+   case VB_LEVENSHTEIN: case VB_DAMERAU: {
+      /* Drop a character. */
+      const size_t pos = head(word, rand_r(seed) % 4 + 1);
+      const size_t next = pos + head(&word[pos], 1);
+      sprintf(str, "%.*s%s", (int)pos, word, &word[next]);
+      break;
+   }
+   default:
+      strcpy(str, word);
+      break;
+   }
+}
+
+static int connect_to(const char *path)
+{
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (strlen(path) >= sizeof addr.sun_path)
+      die("socket path too long");
+   strcpy(addr.sun_path, path);
+
+   const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof addr))
+      die("cannot connect to server");
+   return fd;
+}
+
+static bool send_all(int fd, const struct vb_buf *b)
+{
+   for (size_t done = 0; done < b->len; ) {
+      const ssize_t n = send(fd, &b->data[done], b->len - done, 0);
+      if (n <= 0)
+         return false;
+      done += n;
+   }
+   return true;
+}
+
+static bool recv_all(int fd, void *buf, size_t len)
+{
+   for (size_t done = 0; done < len; ) {
+      const ssize_t n = read(fd, (uint8_t *)buf + done, len - done);
+      if (n <= 0)
+         return false;
+      done += n;
+   }
+   return true;
+}
+
+/* Reads a response frame into "b". */
+static bool recv_frame(int fd, struct vb_buf *b)
+{
+   uint8_t len[4];
+   if (!recv_all(fd, len, 4) || vb_get_le(len, 4) > VB_MAX_RESPONSE)
+      return false;
+   b->len = 0;
+   uint8_t *p = vb_buf_reserve(b, vb_get_le(len, 4));
+   return p && recv_all(fd, p, b->len);
+}
+
+
+/*******************************************************************************
+ * Load
+ ******************************************************************************/
+
+/* A request in flight. Its id is its index in the table of its connection. */
+struct slot {
+   char query[VB_MAX_WORD_LEN * 2 + 16];
+   int page;
+   uint8_t token[2 + VB_MAX_SHARDS * (15 + VB_MAX_WORD_LEN)];
+   size_t token_len;
+   double start;
+};
+
+struct client {
+   unsigned seed;
+   double end;
+   size_t requests, errors, words;
+   double *samples;           /* Latency of each request. */
+   size_t nr_samples, max_samples;
+   struct slot slots[MAX_DEPTH];
+   struct vb_buf in, out;
+};
+
+static void send_request(struct client *c, int fd, uint32_t id)
+{
+   struct slot *s = &c->slots[id];
+   if (!s->page)
+      make_query(s->query, &c->seed);
+
+   struct vb_buf *b = &c->out;
+   const size_t qlen = strlen(s->query);
+   const size_t tlen = s->page ? s->token_len : 0;
+   vb_buf_begin(b);
+   vb_buf_int(b, id, 4);
+   vb_buf_int(b, VB_REQ_SEARCH, 1);
+   vb_buf_int(b, mode, 1);
+   vb_buf_int(b, fold ? VB_REQ_FOLD : 0, 1);
+   vb_buf_int(b, PAGE_SIZE, 1);
+   vb_buf_int(b, mask, 2);
+   vb_buf_int(b, 3, 1);
+   vb_buf_int(b, 1, 1);
+   vb_buf_int(b, qlen, 2);
+   vb_buf_bytes(b, s->query, qlen);
+   vb_buf_int(b, tlen, 2);
+   vb_buf_bytes(b, s->token, tlen);
+   vb_buf_end(b);
+   s->start = now();
+   if (b->failed || !send_all(fd, b))
+      die("cannot send request");
+}
+
+/* Reads a search response, and returns whether the query has more pages to
+ * fetch.
+ */
+static bool read_response(struct client *c, struct slot *s, struct vb_frame *f)
+{
+   const uint8_t status = vb_frame_int(f, 1);
+   const uint8_t last_page = vb_frame_int(f, 1);
+   const uint16_t nr = vb_frame_int(f, 2);
+   for (uint16_t i = 0; i < nr; i++) {
+      vb_frame_int(f, 1);
+      vb_frame_bytes(f, vb_frame_int(f, 2));
+   }
+   const uint16_t tlen = vb_frame_int(f, 2);
+   const void *token = vb_frame_bytes(f, tlen);
+   if (f->failed || tlen > sizeof s->token)
+      f->failed = true;
+   else
+      memcpy(s->token, token, s->token_len = tlen);
+
+   if (f->failed || f->pos != f->len || status) {
+      c->errors++;
+      return false;
+   }
+   c->words += nr;
+   return !last_page;
+}
+
+static int run_client(void *arg)
+{
+   struct client *c = arg;
+   const int fd = connect_to(socket_path);
+   int in_flight = 0;
+
+   for (int i = 0; i < depth; i++, in_flight++)
+      send_request(c, fd, i);
+   while (in_flight) {
+      if (!recv_frame(fd, &c->in))
+         die("connection lost");
+      const double t = now();
+      struct vb_frame f = {.data = c->in.data, .len = c->in.len};
+      const uint32_t id = vb_frame_int(&f, 4);
+      if (f.failed || id >= (uint32_t)depth)
+         die("bad response id");
+
+      struct slot *s = &c->slots[id];
+      if (c->nr_samples == c->max_samples) {
+         c->max_samples = c->max_samples ? c->max_samples * 2 : 4096;
+         c->samples = realloc(c->samples, c->max_samples * sizeof *c->samples);
+         if (!c->samples)
+            die("out of memory");
+      }
+      c->samples[c->nr_samples++] = t - s->start;
+      c->requests++;
+
+      s->page = read_response(c, s, &f) && s->page + 1 < max_pages ? s->page + 1 : 0;
+      if (t < c->end)
+         send_request(c, fd, id);
+      else
+         in_flight--;
+   }
+   close(fd);
+   return 0;
+}
+
+static int cmp_doubles(const void *a, const void *b)
+{
+   const double x = *(const double *)a, y = *(const double *)b;
+   return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted samples. */
+static double percentile(const double *samples, size_t nr, double p)
+{
+   size_t rank = p * nr;
+   return nr ? samples[rank < nr ? rank : nr - 1] : 0;
+}
+
+static int load(void)
+{
+   static struct client clients[256];
+   thrd_t threads[256];
+   const double start = now();
+
+   for (int i = 0; i < nr_conns; i++) {
+      clients[i].seed = i + 1;
+      clients[i].end = start + duration;
+      if (thrd_create(&threads[i], run_client, &clients[i]) != thrd_success)
+         die("cannot start clients");
+   }
+   size_t requests = 0, errors = 0, results = 0, nr = 0;
+   for (int i = 0; i < nr_conns; i++) {
+      thrd_join(threads[i], NULL);
+      requests += clients[i].requests;
+      errors += clients[i].errors;
+      results += clients[i].words;
+      nr += clients[i].nr_samples;
+   }
+   const double elapsed = now() - start;
+
+   double *samples = malloc((nr ? nr : 1) * sizeof *samples);
+   if (!samples)
+      die("out of memory");
+   nr = 0;
+   for (int i = 0; i < nr_conns; i++) {
+      memcpy(&samples[nr], clients[i].samples,
+             clients[i].nr_samples * sizeof *samples);
+      nr += clients[i].nr_samples;
+      free(clients[i].samples);
+      free(clients[i].in.data);
+      free(clients[i].out.data);
+   }
+   qsort(samples, nr, sizeof *samples, cmp_doubles);
+
+   printf("{\"mode\": \"%s\", \"connections\": %d, \"depth\": %d, "
+          "\"requests\": %zu, \"errors\": %zu, \"results\": %zu, "
+          "\"rps\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+          "\"p999_us\": %.2f}\n",
+          vb_mode_names[mode], nr_conns, depth, requests, errors, results,
+          requests / elapsed, percentile(samples, nr, .5) * 1e6,
+          percentile(samples, nr, .99) * 1e6,
+          percentile(samples, nr, .999) * 1e6);
+   free(samples);
+   return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int metrics(void)
+{
+   const int fd = connect_to(socket_path);
+   struct vb_buf b = {0};
+
+   vb_buf_begin(&b);
+   vb_buf_int(&b, 0, 4);
+   vb_buf_int(&b, VB_REQ_METRICS, 1);
+   vb_buf_end(&b);
+   if (b.failed || !send_all(fd, &b) || !recv_frame(fd, &b))
+      die("cannot get metrics");
+   close(fd);
+
+   struct vb_frame f = {.data = b.data, .len = b.len};
+   vb_frame_int(&f, 4);
+   if (vb_frame_int(&f, 1) != VB_OK || f.failed)
+      die("cannot get metrics");
+   fwrite(&b.data[f.pos], 1, f.len - f.pos, stdout);
+   free(b.data);
+   return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+   const char *words_path = NULL;
+   bool get_metrics = false;
+   int i;
+
+   for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+      const char *opt = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+      if (!strcmp(opt, "-metrics")) {
+         get_metrics = true;
+         continue;
+      }
+      if (!strcmp(opt, "-fold")) {
+         fold = true;
+         continue;
+      }
+      if (!val)
+         goto usage;
+      i++;
+      if (!strcmp(opt, "-c")) {
+         nr_conns = atoi(val);
+      } else if (!strcmp(opt, "-d")) {
+         depth = atoi(val);
+      } else if (!strcmp(opt, "-t")) {
+         duration = atof(val);
+      } else if (!strcmp(opt, "-p")) {
+         max_pages = atoi(val);
+      } else if (!strcmp(opt, "-l")) {
+         mask = strtoul(val, NULL, 0);
+      } else if (!strcmp(opt, "-w")) {
+         words_path = val;
+      } else if (!strcmp(opt, "-m")) {
+         mode = 0;
+         while (mode < VB_MODES_NR && strcmp(vb_mode_names[mode], val))
+            mode++;
+         if (mode == VB_MODES_NR)
+            goto usage;
+      } else {
+         goto usage;
+      }
+   }
+   if (argc - i != 1)
+      goto usage;
+   socket_path = argv[i];
+   if (get_metrics)
+      return metrics();
+
+   if (!words_path || nr_conns < 1 || nr_conns > 256 || depth < 1
+       || depth > MAX_DEPTH || max_pages < 1)
+      goto usage;
+   load_words(words_path);
+   const int ret = load();
+   for (size_t k = 0; k < nr_words; k++)
+      free(words[k]);
+   free(words);
+   return ret;
+
+usage:
+   fprintf(stderr, "Usage: %s [-c connections] [-d depth] [-t seconds] "
+           "[-m mode] [-l mask] [-p pages] [-fold] -w words.txt socket\n"
+           "       %s -metrics socket\n", argv[0], argv[0]);
+   return EXIT_FAILURE;
+}
@@ -0,0 +1,728 @@
+/* Search daemon. Loads lexicons once, and answers the queries of local clients
+ * over a Unix socket, with a fixed pool of worker threads. Usage:
+ *
+ *    volubile-server [-t threads] [-flat] [-fold] [-slow ms] socket
+ *                    lexicon.mn[:scores] ...
+ *
+ * -t sets the number of workers, one per CPU by default. -flat and -fold
+ * flatten the lexicons and build their folded index. -slow logs to stderr the
+ * searches that take at least that many milliseconds. Scores files are arrays
+ * of 32-bit integers in native byte order, one per word of the lexicon. The
+ * protocol is described in README.md in this directory.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "../volubile.h"
+#include "../src/lib/mini.h"
+#include "protocol.h"
+
+#define MAX_THREADS 256
+#define MAX_CONNS 1024
+#define MAX_JOBS 4096         /* Requests queued for workers at most. */
+#define SEND_TIMEOUT 10       /* Seconds a worker waits on a client. */
+
+static void die(const char *fmt, const char *arg)
+{
+   fprintf(stderr, "volubile-server: ");
+   fprintf(stderr, fmt, arg);
+   fprintf(stderr, "\n");
+   exit(EXIT_FAILURE);
+}
+
+
+/*******************************************************************************
+ * Lexicons
+ ******************************************************************************/
+
+struct lexicon {
+   struct vb_lexicon *lex;
+   const int32_t *scores;     /* Mapped scores file, or NULL. */
+   size_t scores_size;
+};
+
+static struct lexicon lexicons[VB_MAX_SHARDS];
+static size_t nr_lexicons;
+
+static const void *map_file(const char *path, size_t *size)
+{
+   const int fd = open(path, O_RDONLY);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st))
+      die("cannot open '%s'", path);
+   *size = st.st_size;
+   void *data = *size ? mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+   if (data == MAP_FAILED)
+      die("cannot map '%s'", path);
+   close(fd);
+   return data;
+}
+
+struct reader {
+   const uint8_t *data;
+   size_t size;
+};
+
+static int read_mapped(void *arg, void *buf, size_t size)
+{
+   struct reader *r = arg;
+
+   if (size > r->size)
+      return -1;
+   memcpy(buf, r->data, size);
+   r->data += size;
+   r->size -= size;
+   return 0;
+}
+
+/* Automata are decoded into memory of their own when loaded, so their file is
+ * unmapped afterwards. Scores are used as they are, so they stay mapped, and
+ * are shared by all the processes that map the same file.
+ */
+static void load_lexicon(char *spec, bool flat, bool fold)
+{
+   struct lexicon *l = &lexicons[nr_lexicons++];
+   char *scores_path = strchr(spec, ':');
+   if (scores_path)
+      *scores_path++ = '\0';
+
+   size_t size;
+   const void *data = map_file(spec, &size);
+   struct reader r = {data, size};
+   struct mini *fsa;
+   if (mn_load(&fsa, read_mapped, &r))
+      die("cannot load '%s'", spec);
+   munmap((void *)data, size);
+
+   if (vb_lexicon_new(&l->lex, fsa))
+      die("cannot create lexicon from '%s'", spec);
+   if (scores_path) {
+      l->scores = map_file(scores_path, &l->scores_size);
+      if (l->scores_size != mn_size(fsa) * sizeof *l->scores)
+         die("scores file '%s' doesn't match its lexicon", scores_path);
+      if (vb_lexicon_set_scores(l->lex, l->scores))
+         die("cannot set scores of '%s'", spec);
+   }
+   if (flat && vb_lexicon_flatten(l->lex))
+      die("cannot flatten '%s'", spec);
+   if (fold && vb_lexicon_fold(l->lex))
+      die("cannot fold '%s'", spec);
+}
+
+
+/*******************************************************************************
+ * Connections and jobs
+ ******************************************************************************/
+
+/* A connection is referenced by the I/O thread until the client hangs up, and
+ * by each of its requests until it is answered. The socket is closed once the
+ * last reference is dropped, so that its descriptor can't be reused while a
+ * worker still writes to it.
+ */
+struct conn {
+   int fd;
+   atomic_uint refs;
+   mtx_t write_lock;          /* Responses are written whole, one at a time. */
+   uint8_t *buf;              /* Bytes read, not yet made into requests. */
+   size_t len;
+   size_t max;
+};
+
+struct job {
+   struct job *next;
+   struct conn *conn;
+   size_t len;
+   uint8_t data[];            /* Body of the request frame. */
+};
+
+static struct {
+   mtx_t lock;
+   cnd_t nonempty;
+   struct job *head, *tail;
+   size_t nr;
+   bool full;                 /* A job was refused since the last pop. */
+   bool closed;
+} queue;
+
+static int room[2];           /* Self-pipe written to once a full queue pops. */
+
+static atomic_ullong nr_requests, nr_protocol_errors;
+static atomic_uint nr_conns;
+
+static void conn_unref(struct conn *c)
+{
+   if (atomic_fetch_sub(&c->refs, 1) != 1)
+      return;
+   close(c->fd);
+   mtx_destroy(&c->write_lock);
+   free(c->buf);
+   free(c);
+   atomic_fetch_sub(&nr_conns, 1);
+}
+
+/* Queues a job, unless the queue is full. The I/O thread is then told through
+ * the "room" pipe once a job is taken, rather than waiting for it.
+ */
+static bool queue_push(struct job *job)
+{
+   mtx_lock(&queue.lock);
+   if (queue.nr == MAX_JOBS) {
+      queue.full = true;
+      mtx_unlock(&queue.lock);
+      return false;
+   }
+   job->next = NULL;
+   if (queue.tail)
+      queue.tail->next = job;
+   else
+      queue.head = job;
+   queue.tail = job;
+   queue.nr++;
+   cnd_signal(&queue.nonempty);
+   mtx_unlock(&queue.lock);
+   return true;
+}
+
+/* Returns the next job, or NULL once the queue is closed and drained. */
+static struct job *queue_pop(void)
+{
+   mtx_lock(&queue.lock);
+   while (!queue.head && !queue.closed)
+      cnd_wait(&queue.nonempty, &queue.lock);
+   struct job *job = queue.head;
+   if (job) {
+      queue.head = job->next;
+      if (!queue.head)
+         queue.tail = NULL;
+      queue.nr--;
+      if (queue.full) {
+         queue.full = false;
+         const ssize_t n = write(room[1], "", 1);
+         (void)n;
+      }
+   }
+   mtx_unlock(&queue.lock);
+   return job;
+}
+
+
+/*******************************************************************************
+ * Workers
+ ******************************************************************************/
+
+/* What a worker needs for answering requests, allocated once. */
+struct workspace {
+   struct vb_buf out;
+   struct vb_federated_pagination pagination;
+   const struct vb_lexicon *shards[VB_MAX_SHARDS];
+   uint8_t index[VB_MAX_SHARDS];    /* Lexicon number of each shard. */
+   char query[VB_MAX_REQUEST + 1];
+   struct vb_metrics metrics;
+};
+
+static void gather(void *arg, size_t shard, const char *word, size_t len)
+{
+   struct workspace *w = arg;
+
+   vb_buf_int(&w->out, w->index[shard], 1);
+   vb_buf_int(&w->out, len, 2);
+   vb_buf_bytes(&w->out, word, len);
+   if (!w->out.failed) {
+      /* Words count, after the frame length, id, status and last page flag. */
+      uint8_t *nr = &w->out.data[10];
+      vb_put_le(nr, vb_get_le(nr, 2) + 1, 2);
+   }
+}
+
+static void gather_one(void *arg, const char *word, size_t len)
+{
+   gather(arg, 0, word, len);
+}
+
+/* Same as vb_federated_match(), for a single shard, which is searched directly
+ * with the pagination data kept for it.
+ */
+static int search_one(struct workspace *w, struct vb_query *q)
+{
+   struct vb_federated_pagination *p = &w->pagination;
+   struct vb_shard_cursor *cur = &p->shards[0];
+   if (p->nr_shards > 1)
+      return VB_ESHARDS;
+   p->nr_shards = 1;
+   if (p->last_page)
+      return VB_OK;
+
+   struct vb_pagination *qp = &q->pagination;
+   qp->last_page = cur->last_page;
+   qp->last_pos = cur->last_pos;
+   qp->last_weight = cur->last_weight;
+   qp->last_len = cur->last_len;
+   memcpy(qp->last_word, cur->last_word, cur->last_len + 1);
+   qp->pages = cur->pages;
+
+   const int ret = vb_lexicon_match(w->shards[0], q, gather_one, w);
+   cur->last_page = qp->last_page;
+   cur->last_pos = qp->last_pos;
+   cur->last_weight = qp->last_weight;
+   cur->last_len = qp->last_len;
+   memcpy(cur->last_word, qp->last_word, qp->last_len + 1);
+   cur->pages = qp->pages;
+   p->last_page = cur->last_page;
+   return ret;
+}
+
+/* Appends the response to a search to the frame started, after its id. */
+static void search(struct workspace *w, struct vb_frame *f)
+{
+   const uint8_t mode = vb_frame_int(f, 1);
+   const uint8_t flags = vb_frame_int(f, 1);
+   const uint8_t page_size = vb_frame_int(f, 1);
+   const uint16_t mask = vb_frame_int(f, 2);
+   const int8_t max_dist = vb_frame_int(f, 1);
+   const uint8_t prefix_len = vb_frame_int(f, 1);
+   const uint16_t qlen = vb_frame_int(f, 2);
+   const char *str = vb_frame_bytes(f, qlen);
+   const uint16_t tlen = vb_frame_int(f, 2);
+   const void *token = vb_frame_bytes(f, tlen);
+
+   /* Status, last page flag and number of words, patched below. */
+   const size_t header = w->out.len;
+   vb_buf_int(&w->out, VB_EPROTO, 1);
+   vb_buf_int(&w->out, 1, 1);
+   vb_buf_int(&w->out, 0, 2);
+   if (f->failed || f->pos != f->len || mode >= VB_MODES_NR
+       || mask >> nr_lexicons)
+      goto proto;
+
+   size_t nr = 0;
+   for (size_t i = 0; i < nr_lexicons; i++) {
+      if (mask && !(mask & 1 << i))
+         continue;
+      w->shards[nr] = lexicons[i].lex;
+      w->index[nr++] = i;
+   }
+   memcpy(w->query, str, qlen);
+   w->query[qlen] = '\0';
+   struct vb_query query = VB_QUERY_INIT;
+   query.query = w->query;
+   query.len = qlen;
+   query.mode = mode;
+   query.page_size = page_size;
+   query.max_dist = max_dist;
+   query.prefix_len = prefix_len;
+   query.fold = flags & VB_REQ_FOLD;
+
+   int ret;
+   if (tlen)
+      ret = vb_federated_untoken(&w->pagination, token, tlen);
+   else
+      ret = (memset(&w->pagination, 0, sizeof w->pagination), VB_OK);
+   if (!ret && nr == 1)
+      ret = search_one(w, &query);
+   else if (!ret)
+      ret = vb_federated_match(w->shards, nr, &query, &w->pagination, gather, w);
+   if (ret) {
+      w->out.len = header;
+      vb_buf_int(&w->out, ret, 1);
+      vb_buf_int(&w->out, 1, 1);
+      vb_buf_int(&w->out, 0, 2);
+      vb_buf_int(&w->out, 0, 2);
+      return;
+   }
+
+   /* No token is needed once the last page is reached. */
+   if (!w->out.failed) {
+      w->out.data[header] = VB_OK;
+      w->out.data[header + 1] = w->pagination.last_page;
+   }
+   size_t len = 0;
+   if (!w->pagination.last_page)
+      len = vb_federated_token(&w->pagination, NULL, 0);
+   vb_buf_int(&w->out, len, 2);
+   uint8_t *p = vb_buf_reserve(&w->out, len);
+   if (p)
+      vb_federated_token(&w->pagination, p, len);
+   return;
+
+proto:
+   atomic_fetch_add(&nr_protocol_errors, 1);
+   vb_buf_int(&w->out, 0, 2);
+}
+
+static void metrics(struct workspace *w, struct vb_frame *f)
+{
+   if (f->pos != f->len) {
+      atomic_fetch_add(&nr_protocol_errors, 1);
+      vb_buf_int(&w->out, VB_EPROTO, 1);
+      return;
+   }
+   vb_buf_int(&w->out, VB_OK, 1);
+
+   vb_metrics_snapshot(&w->metrics);
+   const size_t len = vb_metrics_export(&w->metrics, NULL, 0);
+   char *p = (char *)vb_buf_reserve(&w->out, len + 1);
+   if (!p)
+      return;
+   vb_metrics_export(&w->metrics, p, len + 1);
+   w->out.len--;
+
+   char buf[512];
+   const int n = snprintf(buf, sizeof buf,
+      "# TYPE volubile_server_requests_total counter\n"
+      "volubile_server_requests_total %llu\n"
+      "# TYPE volubile_server_protocol_errors_total counter\n"
+      "volubile_server_protocol_errors_total %llu\n"
+      "# TYPE volubile_server_connections gauge\n"
+      "volubile_server_connections %u\n",
+      atomic_load(&nr_requests), atomic_load(&nr_protocol_errors),
+      atomic_load(&nr_conns));
+   vb_buf_bytes(&w->out, buf, n);
+}
+
+/* Writes a response whole. A client that doesn't read its responses is cut
+ * off, rather than holding up a worker.
+ */
+static void respond(struct conn *c, const struct vb_buf *out)
+{
+   mtx_lock(&c->write_lock);
+   for (size_t done = 0; done < out->len; ) {
+      const ssize_t n = send(c->fd, &out->data[done], out->len - done, 0);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0) {
+         shutdown(c->fd, SHUT_RDWR);
+         break;
+      }
+      done += n;
+   }
+   mtx_unlock(&c->write_lock);
+}
+
+static int worker(void *arg)
+{
+   struct workspace *w = arg;
+   struct job *job;
+
+   while ((job = queue_pop())) {
+      struct vb_frame f = {.data = job->data, .len = job->len};
+      const uint32_t id = vb_frame_int(&f, 4);
+      const uint8_t type = vb_frame_int(&f, 1);
+
+      vb_buf_begin(&w->out);
+      vb_buf_int(&w->out, id, 4);
+      if (f.failed) {
+         atomic_fetch_add(&nr_protocol_errors, 1);
+         vb_buf_int(&w->out, VB_EPROTO, 1);
+      } else if (type == VB_REQ_SEARCH) {
+         search(w, &f);
+      } else if (type == VB_REQ_METRICS) {
+         metrics(w, &f);
+      } else {
+         atomic_fetch_add(&nr_protocol_errors, 1);
+         vb_buf_int(&w->out, VB_EPROTO, 1);
+      }
+      vb_buf_end(&w->out);
+      atomic_fetch_add(&nr_requests, 1);
+
+      if (w->out.failed || w->out.len > 4 + VB_MAX_RESPONSE) {
+         /* Can't be answered, so hang up on the client. */
+         shutdown(job->conn->fd, SHUT_RDWR);
+      } else {
+         respond(job->conn, &w->out);
+      }
+      conn_unref(job->conn);
+      free(job);
+   }
+   return 0;
+}
+
+
+/*******************************************************************************
+ * I/O thread
+ ******************************************************************************/
+
+static int wakeup[2];         /* Self-pipe written to on shutdown. */
+
+static void on_signal(int sig)
+{
+   (void)sig;
+   const int saved = errno;
+   const ssize_t n = write(wakeup[1], "", 1);
+   (void)n;
+   errno = saved;
+}
+
+static int listen_on(const char *path)
+{
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (strlen(path) >= sizeof addr.sun_path)
+      die("socket path '%s' is too long", path);
+   strcpy(addr.sun_path, path);
+
+   const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0)
+      die("cannot create socket '%s'", path);
+   unlink(path);
+   if (bind(fd, (struct sockaddr *)&addr, sizeof addr) || listen(fd, 128))
+      die("cannot listen on '%s'", path);
+   return fd;
+}
+
+static struct conn *accept_conn(int lfd)
+{
+   const int fd = accept(lfd, NULL, NULL);
+   if (fd < 0)
+      return NULL;
+   if (atomic_load(&nr_conns) == MAX_CONNS) {
+      close(fd);
+      return NULL;
+   }
+   const struct timeval timeout = {.tv_sec = SEND_TIMEOUT};
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+   struct conn *c = calloc(1, sizeof *c);
+   if (!c || mtx_init(&c->write_lock, mtx_plain) != thrd_success) {
+      free(c);
+      close(fd);
+      return NULL;
+   }
+   c->fd = fd;
+   atomic_init(&c->refs, 1);
+   atomic_fetch_add(&nr_conns, 1);
+   return c;
+}
+
+/* Queues the complete requests read from a connection, until the queue is
+ * full, in which case "stalled" is set and the others are kept for later.
+ * Returns false if the connection must be dropped.
+ */
+static bool queue_requests(struct conn *c, bool *stalled)
+{
+   size_t pos = 0;
+   while (c->len - pos >= 4) {
+      const size_t len = vb_get_le(&c->buf[pos], 4);
+      if (len > VB_MAX_REQUEST)
+         return false;
+      if (c->len - pos - 4 < len)
+         break;
+      struct job *job = malloc(sizeof *job + len);
+      if (!job)
+         return false;
+      job->conn = c;
+      job->len = len;
+      memcpy(job->data, &c->buf[pos + 4], len);
+      atomic_fetch_add(&c->refs, 1);
+      if (!queue_push(job)) {
+         atomic_fetch_sub(&c->refs, 1);
+         free(job);
+         *stalled = true;
+         break;
+      }
+      pos += 4 + len;
+   }
+   memmove(c->buf, &c->buf[pos], c->len - pos);
+   c->len -= pos;
+   return true;
+}
+
+/* Reads what is available, and queues the complete requests. Requests left
+ * over from when the queue was full are queued first, so that the buffer never
+ * holds more than one incomplete request when read into. Returns false if the
+ * connection must be dropped.
+ */
+static bool read_conn(struct conn *c, bool *stalled)
+{
+   if (!queue_requests(c, stalled))
+      return false;
+   if (*stalled)
+      return true;
+   if (c->max - c->len < 4096) {
+      const size_t max = c->max ? c->max * 2 : 8192;
+      if (max > 2 * (4 + VB_MAX_REQUEST))
+         return false;
+      uint8_t *buf = realloc(c->buf, max);
+      if (!buf)
+         return false;
+      c->buf = buf;
+      c->max = max;
+   }
+   const ssize_t n = read(c->fd, &c->buf[c->len], c->max - c->len);
+   if (n < 0 && errno == EINTR)
+      return true;
+   if (n <= 0)
+      return false;
+   c->len += n;
+   return queue_requests(c, stalled);
+}
+
+/* The self-pipes and the listening socket come first, then the connections. */
+#define FIRST_CONN 3
+
+/* Connections are no longer read while the queue is full, so that clients wait
+ * for their responses instead, and the listening socket is left alone while
+ * the table of connections is.
+ */
+static void serve(int lfd)
+{
+   static struct pollfd fds[FIRST_CONN + MAX_CONNS];
+   static struct conn *conns[FIRST_CONN + MAX_CONNS];
+   size_t nr = FIRST_CONN;
+   bool stalled = false;
+
+   fds[0] = (struct pollfd){.fd = wakeup[0], .events = POLLIN};
+   fds[1] = (struct pollfd){.fd = room[0], .events = POLLIN};
+   fds[2] = (struct pollfd){.fd = lfd};
+   for (;;) {
+      fds[2].events = nr < FIRST_CONN + MAX_CONNS ? POLLIN : 0;
+      const bool polled = !stalled;
+      if (poll(fds, polled ? nr : FIRST_CONN, -1) < 0) {
+         if (errno == EINTR)
+            continue;
+         die("%s", strerror(errno));
+      }
+      if (fds[0].revents)
+         break;
+      if (fds[1].revents) {
+         /* Queue the requests left over first. */
+         char buf[64];
+         const ssize_t n = read(room[0], buf, sizeof buf);
+         (void)n;
+         stalled = false;
+         for (size_t i = FIRST_CONN; i < nr && !stalled; i++) {
+            if (queue_requests(conns[i], &stalled))
+               continue;
+            conn_unref(conns[i]);
+            fds[i] = fds[--nr];
+            conns[i--] = conns[nr];
+         }
+      }
+      for (size_t i = FIRST_CONN; polled && i < nr && !stalled; i++) {
+         if (!fds[i].revents || read_conn(conns[i], &stalled))
+            continue;
+         conn_unref(conns[i]);
+         fds[i] = fds[--nr];
+         conns[i--] = conns[nr];
+      }
+      if (fds[2].revents && nr < FIRST_CONN + MAX_CONNS) {
+         struct conn *c = accept_conn(lfd);
+         if (c) {
+            fds[nr] = (struct pollfd){.fd = c->fd, .events = POLLIN};
+            conns[nr++] = c;
+         }
+      }
+   }
+   for (size_t i = FIRST_CONN; i < nr; i++)
+      conn_unref(conns[i]);
+}
+
+
+/*******************************************************************************
+ * Main
+ ******************************************************************************/
+
+static void log_slow(void *arg, const struct vb_query *q,
+                     enum vb_match_mode mode, const struct vb_stats *st)
+{
+   (void)arg;
+   fprintf(stderr, "volubile-server: slow search: mode %s, query '%.*s', "
+           "%llu words visited\n", vb_mode_names[mode], (int)q->len, q->query,
+           (unsigned long long)st->words_visited);
+}
+
+int main(int argc, char **argv)
+{
+   long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+   bool flat = false, fold = false;
+   double slow_ms = 0;
+   int i;
+
+   for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+      const char *opt = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+      if (!strcmp(opt, "-flat")) {
+         flat = true;
+      } else if (!strcmp(opt, "-fold")) {
+         fold = true;
+      } else if (!strcmp(opt, "-t") && val) {
+         nr_threads = atol(val);
+         i++;
+      } else if (!strcmp(opt, "-slow") && val) {
+         slow_ms = atof(val);
+         i++;
+      } else {
+         goto usage;
+      }
+   }
+   if (argc - i < 2 || argc - i - 1 > VB_MAX_SHARDS || nr_threads < 1
+       || nr_threads > MAX_THREADS)
+      goto usage;
+
+   const char *path = argv[i++];
+   while (i < argc)
+      load_lexicon(argv[i++], flat, fold);
+
+   vb_metrics_enable(true);
+   if (slow_ms > 0)
+      vb_metrics_set_slow_hook(slow_ms * 1e6, log_slow, NULL);
+
+   /* Signals interrupt poll() rather than restarting it. */
+   if (pipe(wakeup) || pipe(room))
+      die("%s", strerror(errno));
+   struct sigaction sa = {.sa_handler = on_signal};
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   signal(SIGPIPE, SIG_IGN);
+
+   const int lfd = listen_on(path);
+   mtx_init(&queue.lock, mtx_plain);
+   cnd_init(&queue.nonempty);
+
+   static thrd_t threads[MAX_THREADS];
+   static struct workspace *workspaces[MAX_THREADS];
+   for (long t = 0; t < nr_threads; t++) {
+      workspaces[t] = calloc(1, sizeof *workspaces[t]);
+      if (!workspaces[t]
+          || thrd_create(&threads[t], worker, workspaces[t]) != thrd_success)
+         die("%s", "cannot start workers");
+   }
+
+   serve(lfd);
+
+   /* Answer the requests already queued, then stop. */
+   close(lfd);
+   unlink(path);
+   mtx_lock(&queue.lock);
+   queue.closed = true;
+   cnd_broadcast(&queue.nonempty);
+   mtx_unlock(&queue.lock);
+   for (long t = 0; t < nr_threads; t++) {
+      thrd_join(threads[t], NULL);
+      free(workspaces[t]->out.data);
+      free(workspaces[t]);
+   }
+   for (size_t l = 0; l < nr_lexicons; l++) {
+      vb_lexicon_free(lexicons[l].lex);
+      if (lexicons[l].scores)
+         munmap((void *)lexicons[l].scores, lexicons[l].scores_size);
+   }
+   return EXIT_SUCCESS;
+
+usage:
+   fprintf(stderr, "Usage: %s [-t threads] [-flat] [-fold] [-slow ms] socket "
+           "lexicon.mn[:scores] ...\n", argv[0]);
+   return EXIT_FAILURE;
+}
@@ -12,6 +12,14 @@ const char *vb_strerror(int err)
       [VB_EQUTF8] = "query string is not valid UTF-8",
       [VB_ELUTF8] = "lexicon contains an invalid UTF-8 string",
       [VB_EFSA] = "lexicon is not a numbered automaton",
+      [VB_EWORD] = "attempt to add an empty, too long or non-UTF-8 word",
+      [VB_E2BIG] = "lexicon has grown too large",
+      [VB_ENOMEM] = "out of memory",
+      [VB_EREGEX] = "invalid or too complex regular expression",
+      [VB_EFOLD] = "lexicon has no up-to-date folded index",
+      [VB_ESCORES] = "lexicon has no up-to-date word scores",
+      [VB_EINTR] = "search interrupted",
+      [VB_ESHARDS] = "too many shards, or pagination token for other shards",
    };
    
    if (err >= 0 && (size_t)err < sizeof tbl / sizeof *tbl)
@@ -19,13 +27,39 @@ const char *vb_strerror(int err)
    return "unknown error";
 }
 
-int vb_match(const struct mini *lex, struct vb_query *q,
+int vb_match(const struct mini *fsa, struct vb_query *q,
              void (*callback)(void *arg, const char *token, size_t len),
              void *arg)
 {
-   if (mn_type(lex) != MN_NUMBERED)
-      return VB_EFSA;
+   struct vb_lexicon lex;
+   vb_lexicon_view(&lex, fsa);
+   return vb_lexicon_match(&lex, q, callback, arg);
+}
+
+/* Adds the counters of a search to those of its query. */
+_Static_assert(sizeof(struct vb_stats) % sizeof(uint64_t) == 0,
+               "statistics must be made of counters only");
+
+static void vb_stats_add(struct vb_stats *dest, const struct vb_stats *src)
+{
+   uint64_t *d = (uint64_t *)dest;
+   const uint64_t *s = (const uint64_t *)src;
+
+   for (size_t i = 0; i < sizeof *dest / sizeof *d; i++)
+      d[i] += s[i];
+}
+
+int vb_lexicon_match(const struct vb_lexicon *lex, struct vb_query *q,
+                     void (*callback)(void *arg, const char *token, size_t len),
+                     void *arg)
+{
+   return vb_lexicon_match_ranked(lex, q, callback, arg, NULL);
+}
 
+int vb_lexicon_match_ranked(const struct vb_lexicon *lex, struct vb_query *q,
+                            void (*callback)(void *arg, const char *token, size_t len),
+                            void *arg, struct vb_rank *rank)
+{
    if (q->page_size > VB_MAX_PAGE_SIZE)
       return VB_EPAGE;
 
@@ -37,6 +71,8 @@ int vb_match(const struct mini *lex, struct vb_query *q,
     */
    if (q->len > MN_MAX_WORD_LEN)
       return VB_E2LONG;
+   if (q->fold && (!lex->folded || vb_lexicon_pending(lex)))
+      return VB_EFOLD;
 
    if (q->page_size == 0 || q->pagination.last_pos == UINT32_MAX)
       q->pagination.last_page = true;
@@ -48,18 +84,64 @@ int vb_match(const struct mini *lex, struct vb_query *q,
       .mode = q->mode,
       .str = q->query,
       .len = q->len,
+      .fold = q->fold,
+      .numbered = mn_type(lex->base) == MN_NUMBERED,
       .handler = callback,
       .arg = arg,
+      .stats = q->stats,
+      .limits = q->limits,
+      .rank = rank,
    };
    if (c.mode >= sizeof vb_match_funcs / sizeof *vb_match_funcs)
       c.mode = VB_AUTO;
 
+   /* Metrics need the statistics of this search alone. */
+   struct vb_stats stats;
+   const bool metrics = vb_metrics_enabled();
+   if (metrics) {
+      memset(&stats, 0, sizeof stats);
+      c.stats = &stats;
+   }
+   const uint32_t page = q->pagination.pages;
+
+   /* The search phase is timed as a whole, so the time taken to report the
+    * results, when this is done apart, is subtracted from it afterwards.
+    */
+   uint64_t start = 0, report_ns = 0;
+   if (c.stats || (c.limits && c.limits->max_ns)) {
+      start = vb_now_ns();
+      if (c.stats)
+         report_ns = c.stats->report_ns;
+      if (c.limits)
+         c.deadline = start + c.limits->max_ns;
+   }
+
    char buf[MN_MAX_WORD_LEN + 1];
    vb_parse_query(&c, buf);
 
-   int ret = vb_match_funcs[c.mode](lex, &c);
+   uint64_t parsed = 0;
+   if (c.stats) {
+      parsed = vb_now_ns();
+      c.stats->parse_ns += parsed - start;
+   }
+
+   int ret = c.fold ? vb_folded_match(lex, &c) : vb_match_funcs[c.mode](lex, &c);
    if (q->pagination.last_page)
       q->pagination.last_pos = UINT32_MAX;
 
+   /* Slices of an interrupted page are counted as part of that page. */
+   if (ret != VB_EINTR)
+      q->pagination.pages++;
+
+   if (c.stats)
+      c.stats->search_ns += vb_now_ns() - parsed
+                            - (c.stats->report_ns - report_ns);
+
+   if (metrics) {
+      vb_metrics_record(q, c.mode, page, &stats);
+      if (q->stats)
+         vb_stats_add(q->stats, &stats);
+   }
+
    return ret;
 }
@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "priv.h"
+
+/* Decodes the words of an arena. Leaves "chars" to NULL if one of them is not
+ * valid UTF-8.
+ */
+static int vb_arena_decode(struct vb_arena *arena)
+{
+   char32_t buf[MN_MAX_WORD_LEN + 1];
+   char32_t max_char = 0;
+   uint32_t total = 0;
+
+   /* Find out the number of code points, and how wide they must be. */
+   for (uint32_t idx = 0; idx < arena->size; idx++) {
+      const uint32_t start = arena->offsets[idx];
+      int32_t len = vb_utf8_decode(buf, &arena->words[start],
+                                   arena->offsets[idx + 1] - start - 1);
+      if (len < 0)
+         return VB_OK;
+      for (int32_t i = 0; i < len; i++)
+         if (buf[i] > max_char)
+            max_char = buf[i];
+      total += len;
+   }
+   arena->width = max_char <= UINT8_MAX ? 1 : max_char <= UINT16_MAX ? 2 : 4;
+
+   arena->char_offsets = malloc(sizeof *arena->char_offsets
+                                * ((size_t)arena->size + 1));
+   arena->chars = malloc(total ? (size_t)total * arena->width : 1);
+   if (!arena->char_offsets || !arena->chars)
+      return VB_ENOMEM;
+
+   uint32_t pos = 0;
+   for (uint32_t idx = 0; idx < arena->size; idx++) {
+      const uint32_t start = arena->offsets[idx];
+      int32_t len = vb_utf8_decode(buf, &arena->words[start],
+                                   arena->offsets[idx + 1] - start - 1);
+      arena->char_offsets[idx] = pos;
+      for (int32_t i = 0; i < len; i++, pos++) {
+         switch (arena->width) {
+         case 1:
+            ((uint8_t *)arena->chars)[pos] = buf[i];
+            break;
+         case 2:
+            ((uint16_t *)arena->chars)[pos] = buf[i];
+            break;
+         default:
+            ((char32_t *)arena->chars)[pos] = buf[i];
+            break;
+         }
+      }
+   }
+   arena->char_offsets[arena->size] = pos;
+   return VB_OK;
+}
+
+int vb_arena_new(struct vb_arena **arenap, const struct mini *fsa)
+{
+   *arenap = NULL;
+
+   struct vb_arena *arena = malloc(sizeof *arena);
+   if (!arena)
+      return VB_ENOMEM;
+   arena->size = mn_size(fsa);
+   arena->offsets = malloc(sizeof *arena->offsets * ((size_t)arena->size + 1));
+   arena->words = NULL;
+   arena->chars = NULL;
+   arena->char_offsets = NULL;
+   if (!arena->offsets)
+      goto oom;
+
+   struct mini_iter it;
+   const char *word;
+   size_t len, total = 0, max = 0;
+   uint32_t idx = 0;
+   mn_iter_init(&it, fsa);
+   while ((word = mn_iter_next(&it, &len))) {
+      if (total + len + 1 > UINT32_MAX) {
+         vb_arena_free(arena);
+         return VB_E2BIG;
+      }
+      if (total + len + 1 > max) {
+         size_t new_max = max ? max * 2 : 1 << 16;
+         char *words = realloc(arena->words, new_max);
+         if (!words)
+            goto oom;
+         arena->words = words;
+         max = new_max;
+      }
+      arena->offsets[idx++] = total;
+      memcpy(&arena->words[total], word, len + 1);
+      total += len + 1;
+   }
+   arena->offsets[idx] = total;
+
+   /* Give back what we don't need. */
+   char *words = realloc(arena->words, total ? total : 1);
+   if (words)
+      arena->words = words;
+
+   int ret = vb_arena_decode(arena);
+   if (ret) {
+      vb_arena_free(arena);
+      return ret;
+   }
+   *arenap = arena;
+   return VB_OK;
+
+oom:
+   vb_arena_free(arena);
+   return VB_ENOMEM;
+}
+
+void vb_arena_free(struct vb_arena *arena)
+{
+   if (!arena)
+      return;
+   free(arena->words);
+   free(arena->offsets);
+   free(arena->chars);
+   free(arena->char_offsets);
+   free(arena);
+}
+
+/* Candidate positions are those where both the first and the last byte of the
+ * needle match. With SSE2, we check 16 positions at a time.
+ */
+const char *vb_memmem(const char *hay, size_t hay_len,
+                      const char *needle, size_t len)
+{
+   if (len == 0)
+      return hay;
+   if (hay_len < len)
+      return NULL;
+
+   const size_t lim = hay_len - len + 1;  /* Number of candidate positions. */
+   size_t i = 0;
+#ifdef __SSE2__
+   const __m128i first = _mm_set1_epi8(needle[0]);
+   const __m128i last = _mm_set1_epi8(needle[len - 1]);
+   for (; i + 16 <= lim; i += 16) {
+      __m128i head = _mm_loadu_si128((const __m128i *)&hay[i]);
+      __m128i tail = _mm_loadu_si128((const __m128i *)&hay[i + len - 1]);
+      unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+         _mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+      while (mask) {
+         unsigned bit = __builtin_ctz(mask);
+         if (!memcmp(&hay[i + bit], needle, len))
+            return &hay[i + bit];
+         mask &= mask - 1;
+      }
+   }
+#endif
+   for (; i < lim; i++)
+      if (hay[i] == needle[0] && !memcmp(&hay[i], needle, len))
+         return &hay[i];
+   return NULL;
+}
+
+uint32_t vb_arena_find(const struct vb_arena *arena, uint32_t idx,
+                       const char *str, size_t len)
+{
+   if (idx >= arena->size)
+      return arena->size;
+
+   const uint32_t start = arena->offsets[idx];
+   const char *hit = vb_memmem(&arena->words[start],
+                               arena->offsets[arena->size] - start, str, len);
+   if (!hit)
+      return arena->size;
+
+   /* Find the last word that starts at or before the hit. */
+   const uint32_t off = hit - arena->words;
+   uint32_t low = idx, high = arena->size;
+   while (low < high) {
+      uint32_t mid = low + ((high - low) >> 1);
+      if (arena->offsets[mid] <= off)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low - 1;
+}
+
+void vb_arena_range(const struct vb_arena *arena, const char *prefix,
+                    size_t len, uint32_t *first, uint32_t *end)
+{
+   uint32_t low = 0, high = arena->size;
+
+   /* First word >= the prefix. */
+   while (low < high) {
+      uint32_t mid = low + ((high - low) >> 1);
+      const char *word = &arena->words[arena->offsets[mid]];
+      size_t word_len = arena->offsets[mid + 1] - arena->offsets[mid] - 1;
+      if (lmemcmp(word, word_len, prefix, len) < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   *first = low;
+
+   /* First word after it that doesn't start with the prefix. */
+   high = arena->size;
+   while (low < high) {
+      uint32_t mid = low + ((high - low) >> 1);
+      const char *word = &arena->words[arena->offsets[mid]];
+      size_t word_len = arena->offsets[mid + 1] - arena->offsets[mid] - 1;
+      if (word_len >= len && !memcmp(word, prefix, len))
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   *end = low;
+}
@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "api.h"
+#include "priv.h"
+
+#define VB_CACHE_SHARDS 16
+
+/* A cached results page. Pages are chained in a hash table, and in a list
+ * ordered from the most recently used to the least recently used one.
+ */
+struct vb_cache_entry {
+   struct vb_cache_entry *next;     /* Next entry of the same bucket. */
+   struct vb_cache_entry *newer;
+   struct vb_cache_entry *older;
+   uint64_t hash;
+   size_t size;                     /* Bytes taken by the entry. */
+
+   /* Pagination data after the page was fetched. */
+   struct vb_pagination pagination;
+
+   /* The key, then the words of the page, each followed by a nul byte. */
+   size_t key_len;
+   size_t words_len;
+   char data[];
+};
+
+struct vb_cache_shard {
+   mtx_t lock;
+   uint64_t lexicon;                /* Lexicon the pages come from. */
+   struct vb_cache_entry **buckets;
+   size_t nr_buckets;               /* Power of two. */
+   struct vb_cache_entry *newest;
+   struct vb_cache_entry *oldest;
+   size_t entries;
+   size_t size;
+   size_t max_size;
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t evictions;
+   uint64_t invalidations;
+};
+
+struct vb_cache {
+   struct vb_handle *handle;
+   struct vb_cache_shard shards[VB_CACHE_SHARDS];
+};
+
+/* The fixed part of the key of a page, followed by the query string.
+ * Parameters that the matching mode doesn't use are zeroed, so that they don't
+ * make otherwise identical queries different. Lexicons are numbered automata,
+ * so searches are resumed from the last position and weight alone.
+ */
+struct vb_cache_key {
+   uint32_t mode;
+   uint32_t fold;
+   uint32_t page_size;
+   int32_t max_dist;
+   uint32_t prefix_len;
+   uint32_t last_pos;
+   int32_t last_weight;
+   uint32_t len;
+};
+
+#define VB_CACHE_MAX_KEY (sizeof(struct vb_cache_key) + MN_MAX_WORD_LEN)
+
+static size_t vb_cache_key(const struct vb_query *q, char key[static VB_CACHE_MAX_KEY])
+{
+   struct vb_match_ctx c = {
+      .query = (struct vb_query *)q,
+      .mode = q->mode < VB_MODES_NR ? q->mode : VB_AUTO,
+      .str = q->query,
+      .len = q->len,
+      .fold = q->fold,
+   };
+   char buf[MN_MAX_WORD_LEN + 1];
+   vb_parse_query(&c, buf);
+
+   const bool fuzzy = c.mode >= VB_LEVENSHTEIN && c.mode <= VB_LCSUBSEQ;
+   struct vb_cache_key k = {
+      .mode = c.mode,
+      .fold = c.fold,
+      .page_size = q->page_size,
+      .max_dist = c.mode == VB_LEVENSHTEIN || c.mode == VB_DAMERAU ? q->max_dist : 0,
+      .prefix_len = fuzzy && c.mode != VB_LCSUBSTR ? q->prefix_len : 0,
+      .last_pos = q->pagination.last_pos,
+      .last_weight = q->pagination.last_weight,
+      .len = c.len,
+   };
+   memcpy(key, &k, sizeof k);
+   memcpy(&key[sizeof k], c.str, c.len);
+   return sizeof k + c.len;
+}
+
+/* FNV-1a. */
+static uint64_t vb_cache_hash(const char *key, size_t len)
+{
+   uint64_t h = UINT64_C(0xcbf29ce484222325);
+   for (size_t i = 0; i < len; i++) {
+      h ^= (uint8_t)key[i];
+      h *= UINT64_C(0x100000001b3);
+   }
+   return h;
+}
+
+static struct vb_cache_entry **vb_cache_bucket(struct vb_cache_shard *sh, uint64_t hash)
+{
+   return &sh->buckets[hash & (sh->nr_buckets - 1)];
+}
+
+static struct vb_cache_entry *vb_cache_find(struct vb_cache_shard *sh, uint64_t hash,
+                                            const char *key, size_t len)
+{
+   for (struct vb_cache_entry *e = *vb_cache_bucket(sh, hash); e; e = e->next)
+      if (e->hash == hash && e->key_len == len && !memcmp(e->data, key, len))
+         return e;
+   return NULL;
+}
+
+static void vb_cache_lru_unlink(struct vb_cache_shard *sh, struct vb_cache_entry *e)
+{
+   if (e->newer)
+      e->newer->older = e->older;
+   else
+      sh->newest = e->older;
+   if (e->older)
+      e->older->newer = e->newer;
+   else
+      sh->oldest = e->newer;
+}
+
+static void vb_cache_lru_push(struct vb_cache_shard *sh, struct vb_cache_entry *e)
+{
+   e->newer = NULL;
+   e->older = sh->newest;
+   if (sh->newest)
+      sh->newest->newer = e;
+   else
+      sh->oldest = e;
+   sh->newest = e;
+}
+
+static void vb_cache_remove(struct vb_cache_shard *sh, struct vb_cache_entry *e)
+{
+   struct vb_cache_entry **p = vb_cache_bucket(sh, e->hash);
+   while (*p != e)
+      p = &(*p)->next;
+   *p = e->next;
+   vb_cache_lru_unlink(sh, e);
+   sh->entries--;
+   sh->size -= e->size;
+   free(e);
+}
+
+/* Drops all the pages of a shard. */
+static void vb_cache_clear(struct vb_cache_shard *sh)
+{
+   struct vb_cache_entry *e = sh->newest;
+   while (e) {
+      struct vb_cache_entry *older = e->older;
+      free(e);
+      e = older;
+   }
+   memset(sh->buckets, 0, sh->nr_buckets * sizeof *sh->buckets);
+   sh->invalidations += sh->entries;
+   sh->newest = sh->oldest = NULL;
+   sh->entries = 0;
+   sh->size = 0;
+}
+
+/* Doubles the number of buckets of a shard, if possible. */
+static void vb_cache_grow(struct vb_cache_shard *sh)
+{
+   const size_t nr = sh->nr_buckets * 2;
+   struct vb_cache_entry **buckets = calloc(nr, sizeof *buckets);
+   if (!buckets)
+      return;
+   for (size_t i = 0; i < sh->nr_buckets; i++) {
+      struct vb_cache_entry *e = sh->buckets[i];
+      while (e) {
+         struct vb_cache_entry *next = e->next;
+         e->next = buckets[e->hash & (nr - 1)];
+         buckets[e->hash & (nr - 1)] = e;
+         e = next;
+      }
+   }
+   free(sh->buckets);
+   sh->buckets = buckets;
+   sh->nr_buckets = nr;
+}
+
+/* Adds a page to a shard, evicting the least recently used ones as needed.
+ * Takes ownership of the entry.
+ */
+static void vb_cache_insert(struct vb_cache_shard *sh, struct vb_cache_entry *e)
+{
+   if (e->size > sh->max_size
+       || vb_cache_find(sh, e->hash, e->data, e->key_len)) {
+      free(e);
+      return;
+   }
+   while (sh->size + e->size > sh->max_size) {
+      vb_cache_remove(sh, sh->oldest);
+      sh->evictions++;
+   }
+   if (sh->entries >= sh->nr_buckets)
+      vb_cache_grow(sh);
+
+   struct vb_cache_entry **bucket = vb_cache_bucket(sh, e->hash);
+   e->next = *bucket;
+   *bucket = e;
+   vb_cache_lru_push(sh, e);
+   sh->entries++;
+   sh->size += e->size;
+}
+
+int vb_cache_new(struct vb_cache **cachep, struct vb_handle *h, size_t max_size)
+{
+   *cachep = NULL;
+
+   struct vb_cache *cache = calloc(1, sizeof *cache);
+   if (!cache)
+      return VB_ENOMEM;
+   cache->handle = h;
+
+   size_t i;
+   for (i = 0; i < VB_CACHE_SHARDS; i++) {
+      struct vb_cache_shard *sh = &cache->shards[i];
+      sh->nr_buckets = 64;
+      sh->buckets = calloc(sh->nr_buckets, sizeof *sh->buckets);
+      sh->max_size = max_size / VB_CACHE_SHARDS;
+      if (!sh->buckets || mtx_init(&sh->lock, mtx_plain) != thrd_success) {
+         free(sh->buckets);
+         break;
+      }
+   }
+   if (i < VB_CACHE_SHARDS) {
+      while (i--) {
+         mtx_destroy(&cache->shards[i].lock);
+         free(cache->shards[i].buckets);
+      }
+      free(cache);
+      return VB_ENOMEM;
+   }
+   *cachep = cache;
+   return VB_OK;
+}
+
+void vb_cache_free(struct vb_cache *cache)
+{
+   if (!cache)
+      return;
+   for (size_t i = 0; i < VB_CACHE_SHARDS; i++) {
+      struct vb_cache_shard *sh = &cache->shards[i];
+      vb_cache_clear(sh);
+      free(sh->buckets);
+      mtx_destroy(&sh->lock);
+   }
+   free(cache);
+}
+
+void vb_cache_stats(struct vb_cache *cache, struct vb_cache_stats *st)
+{
+   memset(st, 0, sizeof *st);
+   for (size_t i = 0; i < VB_CACHE_SHARDS; i++) {
+      struct vb_cache_shard *sh = &cache->shards[i];
+      mtx_lock(&sh->lock);
+      st->hits += sh->hits;
+      st->misses += sh->misses;
+      st->evictions += sh->evictions;
+      st->invalidations += sh->invalidations;
+      st->entries += sh->entries;
+      st->size += sh->size;
+      mtx_unlock(&sh->lock);
+   }
+}
+
+/* Words of a page being fetched, which are passed on to the caller and kept
+ * for caching the page.
+ */
+struct vb_cache_words {
+   char *data;
+   size_t len;
+   size_t max;
+   bool failed;         /* Ran out of memory. */
+   void (*handler)(void *arg, const char *token, size_t len);
+   void *arg;
+};
+
+static void vb_cache_gather(void *arg, const char *word, size_t len)
+{
+   struct vb_cache_words *w = arg;
+
+   w->handler(w->arg, word, len);
+   if (w->failed)
+      return;
+   if (w->len + len + 1 > w->max) {
+      size_t max = w->max ? w->max * 2 : 1024;
+      while (w->len + len + 1 > max)
+         max *= 2;
+      char *data = realloc(w->data, max);
+      if (!data) {
+         w->failed = true;
+         return;
+      }
+      w->data = data;
+      w->max = max;
+   }
+   memcpy(&w->data[w->len], word, len);
+   w->data[w->len + len] = '\0';
+   w->len += len + 1;
+}
+
+/* Calls a handler for each word of a list of nul-terminated words. */
+static void vb_cache_replay(const char *words, size_t len,
+                            void (*handler)(void *arg, const char *token, size_t len),
+                            void *arg)
+{
+   for (size_t pos = 0; pos < len; ) {
+      const size_t word_len = strlen(&words[pos]);
+      handler(arg, &words[pos], word_len);
+      pos += word_len + 1;
+   }
+}
+
+int vb_cache_match(struct vb_cache *cache, struct vb_query *q,
+                   void (*handler)(void *arg, const char *token, size_t len),
+                   void *arg)
+{
+   /* Let the search deal with invalid queries and exhausted ones. */
+   if (q->page_size == 0 || q->page_size > VB_MAX_PAGE_SIZE
+       || q->len > MN_MAX_WORD_LEN || q->pagination.last_page
+       || q->pagination.last_pos == UINT32_MAX)
+      return vb_handle_match(cache->handle, q, handler, arg);
+
+   unsigned ticket;
+   const struct vb_lexicon *lex = vb_handle_acquire(cache->handle, &ticket);
+
+   char key[VB_CACHE_MAX_KEY];
+   const size_t key_len = vb_cache_key(q, key);
+   const uint64_t hash = vb_cache_hash(key, key_len);
+   struct vb_cache_shard *sh = &cache->shards[(hash >> 32) % VB_CACHE_SHARDS];
+
+   /* Pages of a previous version of the lexicon are dropped. Searches still
+    * using a previous version while a newer one is cached are not cached.
+    */
+   mtx_lock(&sh->lock);
+   if (lex->id > sh->lexicon) {
+      vb_cache_clear(sh);
+      sh->lexicon = lex->id;
+   }
+   struct vb_cache_entry *e = NULL;
+   if (lex->id == sh->lexicon)
+      e = vb_cache_find(sh, hash, key, key_len);
+   if (e) {
+      /* Copy the page, so that the handler is called without the lock. */
+      char buf[4096];
+      char *words = e->words_len <= sizeof buf ? buf : malloc(e->words_len);
+      if (words) {
+         sh->hits++;
+         vb_cache_lru_unlink(sh, e);
+         vb_cache_lru_push(sh, e);
+         memcpy(words, &e->data[e->key_len], e->words_len);
+         const size_t words_len = e->words_len;
+         const uint32_t pages = q->pagination.pages;
+         q->pagination = e->pagination;
+         q->pagination.pages = pages + 1;
+         mtx_unlock(&sh->lock);
+         vb_handle_release(cache->handle, ticket);
+
+         vb_cache_replay(words, words_len, handler, arg);
+         if (words != buf)
+            free(words);
+         return VB_OK;
+      }
+   }
+   sh->misses++;
+   mtx_unlock(&sh->lock);
+
+   struct vb_cache_words w = {.handler = handler, .arg = arg};
+   int ret = vb_lexicon_match(lex, q, vb_cache_gather, &w);
+   const uint64_t id = lex->id;
+   vb_handle_release(cache->handle, ticket);
+
+   if (ret || w.failed) {
+      free(w.data);
+      return ret;
+   }
+   const size_t size = sizeof *e + key_len + w.len;
+   e = malloc(size);
+   if (e) {
+      e->hash = hash;
+      e->size = size;
+      e->pagination = q->pagination;
+      e->key_len = key_len;
+      e->words_len = w.len;
+      memcpy(e->data, key, key_len);
+      if (w.len)
+         memcpy(&e->data[key_len], w.data, w.len);
+
+      mtx_lock(&sh->lock);
+      if (id == sh->lexicon)
+         vb_cache_insert(sh, e);
+      else
+         free(e);
+      mtx_unlock(&sh->lock);
+   }
+   free(w.data);
+   return VB_OK;
+}
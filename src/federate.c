@@ -0,0 +1,464 @@
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include "api.h"
+#include "priv.h"
+
+/* Results page of a shard. For each slot of the page, we keep the word as
+ * ranked, followed by the words reported for it, each followed by a nul byte,
+ * and the pagination data recorded for it, from which the search of the shard
+ * resumes once the slot is merged.
+ */
+struct vb_shard_page {
+   struct {
+      int32_t weight;
+      int32_t score;
+      size_t start;        /* Offset of the ranked word in "words". */
+      uint32_t nr;         /* Number of words reported. */
+      uint32_t pos;
+      int32_t last_weight;
+      bool after;
+   } slots[VB_MAX_PAGE_SIZE];
+   uint32_t nr_slots;
+   uint32_t taken;         /* Slots merged into the federated page so far. */
+
+   char *words;
+   size_t len;
+   size_t max;
+   bool failed;            /* Ran out of memory. */
+};
+
+struct vb_shard_search {
+   const struct vb_lexicon *lex;
+   struct vb_query query;  /* Copy of the query, with the shard pagination. */
+   struct vb_rank rank;
+   struct vb_shard_page page;
+   int ret;
+
+   /* Link in the queue of the pool, and number of searches of the same call
+    * not yet done.
+    */
+   struct vb_shard_search *next;
+   size_t *pending;
+};
+
+static void vb_shard_append(struct vb_shard_page *p, const char *word, size_t len)
+{
+   if (p->len + len + 1 > p->max) {
+      size_t max = p->max ? p->max * 2 : 1024;
+      while (p->len + len + 1 > max)
+         max *= 2;
+      char *words = realloc(p->words, max);
+      if (!words) {
+         p->failed = true;
+         return;
+      }
+      p->words = words;
+      p->max = max;
+   }
+   memcpy(&p->words[p->len], word, len);
+   p->words[p->len + len] = '\0';
+   p->len += len + 1;
+}
+
+static void vb_shard_gather(void *arg, const char *word, size_t len)
+{
+   struct vb_shard_search *s = arg;
+   struct vb_shard_page *p = &s->page;
+
+   if (p->failed)
+      return;
+   if (s->rank.slot > p->nr_slots) {
+      p->slots[p->nr_slots].weight = s->rank.weight;
+      p->slots[p->nr_slots].score = s->rank.score;
+      p->slots[p->nr_slots].start = p->len;
+      p->slots[p->nr_slots].nr = 0;
+      p->slots[p->nr_slots].pos = s->rank.pos;
+      p->slots[p->nr_slots].last_weight = s->rank.last_weight;
+      p->slots[p->nr_slots].after = s->rank.after;
+      p->nr_slots++;
+      vb_shard_append(p, s->rank.word, s->rank.len);
+   }
+   p->slots[p->nr_slots - 1].nr++;
+   vb_shard_append(p, word, len);
+}
+
+static void vb_cursor_load(struct vb_pagination *p,
+                           const struct vb_shard_cursor *cur)
+{
+   memset(p, 0, sizeof *p);
+   p->last_page = cur->last_page;
+   p->last_pos = cur->last_pos;
+   p->last_weight = cur->last_weight;
+   p->last_len = cur->last_len;
+   memcpy(p->last_word, cur->last_word, cur->last_len + 1);
+   p->pages = cur->pages;
+}
+
+static void vb_cursor_save(struct vb_shard_cursor *cur,
+                           const struct vb_pagination *p)
+{
+   cur->last_page = p->last_page;
+   cur->last_pos = p->last_pos;
+   cur->last_weight = p->last_weight;
+   cur->last_len = p->last_len;
+   memcpy(cur->last_word, p->last_word, p->last_len + 1);
+   cur->pages = p->pages;
+}
+
+/* Moves the cursor of a shard whose page was partly merged to the slots left,
+ * as a search for a page made of the slots taken would. Searches that rank
+ * words by weight or score resume after the last slot taken, the others at
+ * the first slot left.
+ */
+static void vb_cursor_take(struct vb_shard_cursor *cur,
+                           const struct vb_shard_page *p)
+{
+   uint32_t i = p->taken - 1;
+   if (!p->slots[i].after)
+      i++;
+   const char *word = &p->words[p->slots[i].start];
+
+   cur->last_page = false;
+   cur->last_pos = p->slots[i].pos;
+   cur->last_weight = p->slots[i].last_weight;
+   cur->last_len = strlen(word);
+   memcpy(cur->last_word, word, cur->last_len + 1);
+   cur->pages++;
+}
+
+static void vb_shard_run(struct vb_shard_search *s)
+{
+   s->ret = vb_lexicon_match_ranked(s->lex, &s->query, vb_shard_gather, s,
+                                    &s->rank);
+   if (!s->ret && s->page.failed)
+      s->ret = VB_ENOMEM;
+}
+
+/* Pool of threads that run the searches of the shards, shared by all the
+ * federated searches. Threads are started as searches are queued, up to one
+ * less than the maximum number of shards, since the calling thread runs
+ * searches too, and are kept for the life of the process.
+ */
+static struct {
+   mtx_t lock;
+   cnd_t work;                      /* Signaled when searches are queued. */
+   cnd_t done;                      /* Broadcast when a search is done. */
+   struct vb_shard_search *queue;
+   size_t nr_queued;
+   size_t nr_threads;
+   size_t nr_idle;
+   bool ok;                         /* Whether the pool could be set up. */
+} vb_pool;
+
+static once_flag vb_pool_once = ONCE_FLAG_INIT;
+
+static void vb_pool_init(void)
+{
+   if (mtx_init(&vb_pool.lock, mtx_plain) != thrd_success)
+      return;
+   if (cnd_init(&vb_pool.work) != thrd_success) {
+      mtx_destroy(&vb_pool.lock);
+      return;
+   }
+   if (cnd_init(&vb_pool.done) != thrd_success) {
+      cnd_destroy(&vb_pool.work);
+      mtx_destroy(&vb_pool.lock);
+      return;
+   }
+   vb_pool.ok = true;
+}
+
+/* Takes the first queued search, if any, or the first one of a call. Must be
+ * called with the lock held.
+ */
+static struct vb_shard_search *vb_pool_take(const size_t *pending)
+{
+   struct vb_shard_search **link = &vb_pool.queue;
+   while (*link && pending && (*link)->pending != pending)
+      link = &(*link)->next;
+
+   struct vb_shard_search *s = *link;
+   if (s) {
+      *link = s->next;
+      vb_pool.nr_queued--;
+   }
+   return s;
+}
+
+/* Runs a search taken from the queue, and tells its caller once all the
+ * searches of the call are done. Must be called with the lock held.
+ */
+static void vb_pool_run(struct vb_shard_search *s)
+{
+   mtx_unlock(&vb_pool.lock);
+   vb_shard_run(s);
+   mtx_lock(&vb_pool.lock);
+   if (!--*s->pending)
+      cnd_broadcast(&vb_pool.done);
+}
+
+static int vb_pool_worker(void *arg)
+{
+   (void)arg;
+
+   /* Threads are counted as idle from the time they are started. */
+   mtx_lock(&vb_pool.lock);
+   for (;;) {
+      struct vb_shard_search *s = vb_pool_take(NULL);
+      if (s) {
+         vb_pool.nr_idle--;
+         vb_pool_run(s);
+         vb_pool.nr_idle++;
+      } else {
+         cnd_wait(&vb_pool.work, &vb_pool.lock);
+      }
+   }
+   return 0;
+}
+
+/* Runs the searches flagged in "run", in parallel. A single search, as well
+ * as those no thread of the pool takes, runs in the calling thread.
+ */
+static void vb_shards_run(struct vb_shard_search *searches, size_t nr,
+                          const bool *run)
+{
+   struct vb_shard_search *todo[VB_MAX_SHARDS];
+   size_t nr_todo = 0;
+   for (size_t i = 0; i < nr; i++)
+      if (run[i])
+         todo[nr_todo++] = &searches[i];
+   if (nr_todo > 1)
+      call_once(&vb_pool_once, vb_pool_init);
+   if (nr_todo <= 1 || !vb_pool.ok) {
+      for (size_t i = 0; i < nr_todo; i++)
+         vb_shard_run(todo[i]);
+      return;
+   }
+
+   /* The first search is made by the calling thread, the others are queued,
+    * and threads are started for those that no idle thread can take.
+    */
+   size_t pending = nr_todo;
+   mtx_lock(&vb_pool.lock);
+   for (size_t i = 1; i < nr_todo; i++) {
+      todo[i]->pending = &pending;
+      todo[i]->next = vb_pool.queue;
+      vb_pool.queue = todo[i];
+      vb_pool.nr_queued++;
+   }
+   while (vb_pool.nr_idle < vb_pool.nr_queued
+          && vb_pool.nr_threads < VB_MAX_SHARDS - 1) {
+      thrd_t thread;
+      if (thrd_create(&thread, vb_pool_worker, NULL) != thrd_success)
+         break;
+      thrd_detach(thread);
+      vb_pool.nr_threads++;
+      vb_pool.nr_idle++;
+   }
+   cnd_broadcast(&vb_pool.work);
+   mtx_unlock(&vb_pool.lock);
+
+   vb_shard_run(todo[0]);
+
+   mtx_lock(&vb_pool.lock);
+   pending--;
+   struct vb_shard_search *s;
+   while ((s = vb_pool_take(&pending)))
+      vb_pool_run(s);
+   while (pending)
+      cnd_wait(&vb_pool.done, &vb_pool.lock);
+   mtx_unlock(&vb_pool.lock);
+}
+
+/* Compares the next slots of two shards. Ties go to the shard that comes first. */
+static int vb_slot_cmp(const struct vb_shard_search *a,
+                       const struct vb_shard_search *b)
+{
+   const struct vb_shard_page *pa = &a->page, *pb = &b->page;
+   const uint32_t i = pa->taken, j = pb->taken;
+
+   if (pa->slots[i].weight != pb->slots[j].weight)
+      return pa->slots[i].weight < pb->slots[j].weight ? -1 : 1;
+   if (pa->slots[i].score != pb->slots[j].score)
+      return pa->slots[i].score > pb->slots[j].score ? -1 : 1;
+   const char *wa = &pa->words[pa->slots[i].start];
+   const char *wb = &pb->words[pb->slots[j].start];
+   const int cmp = strcmp(wa, wb);
+   if (cmp)
+      return cmp;
+   return a < b ? -1 : a > b;
+}
+
+int vb_federated_match(const struct vb_lexicon *const *shards, size_t nr,
+                       const struct vb_query *q,
+                       struct vb_federated_pagination *p,
+                       void (*handler)(void *arg, size_t shard,
+                                       const char *token, size_t len),
+                       void *arg)
+{
+   if (nr > VB_MAX_SHARDS || (p->nr_shards && p->nr_shards != nr))
+      return VB_ESHARDS;
+   if (q->page_size > VB_MAX_PAGE_SIZE)
+      return VB_EPAGE;
+   p->nr_shards = nr;
+   if (q->page_size == 0 || !nr)
+      p->last_page = true;
+   if (p->last_page)
+      return VB_OK;
+
+   struct vb_shard_search *searches = calloc(nr, sizeof *searches);
+   if (!searches)
+      return VB_ENOMEM;
+
+   bool run[VB_MAX_SHARDS] = {0};
+   for (size_t i = 0; i < nr; i++) {
+      struct vb_shard_search *s = &searches[i];
+      s->lex = shards[i];
+      s->query = *q;
+      s->query.stats = NULL;
+      s->query.limits = NULL;
+      vb_cursor_load(&s->query.pagination, &p->shards[i]);
+      run[i] = !p->shards[i].last_page;
+   }
+   vb_shards_run(searches, nr, run);
+
+   int ret = VB_OK;
+   for (size_t i = 0; i < nr && !ret; i++)
+      if (run[i])
+         ret = searches[i].ret;
+   if (ret)
+      goto fini;
+
+   /* Merge the pages, taking the best slot of all shards each time. */
+   for (size_t n = 0; n < q->page_size; n++) {
+      struct vb_shard_search *best = NULL;
+      for (size_t i = 0; i < nr; i++) {
+         struct vb_shard_search *s = &searches[i];
+         if (run[i] && s->page.taken < s->page.nr_slots
+             && (!best || vb_slot_cmp(s, best) < 0))
+            best = s;
+      }
+      if (!best)
+         break;
+
+      struct vb_shard_page *page = &best->page;
+      const size_t shard = best - searches;
+      size_t pos = page->slots[page->taken].start;
+      pos += strlen(&page->words[pos]) + 1;
+      for (uint32_t k = 0; k < page->slots[page->taken].nr; k++) {
+         const size_t len = strlen(&page->words[pos]);
+         handler(arg, shard, &page->words[pos], len);
+         pos += len + 1;
+      }
+      page->taken++;
+   }
+
+   /* Shards whose page was wholly taken carry on from where their search
+    * stopped, and those that weren't taken from at all stay where they are.
+    * The others resume from the slots they recorded.
+    */
+   for (size_t i = 0; i < nr; i++) {
+      struct vb_shard_search *s = &searches[i];
+      if (!run[i])
+         continue;
+      if (s->page.taken == s->page.nr_slots)
+         vb_cursor_save(&p->shards[i], &s->query.pagination);
+      else if (s->page.taken)
+         vb_cursor_take(&p->shards[i], &s->page);
+   }
+
+   p->last_page = true;
+   for (size_t i = 0; i < nr; i++)
+      if (!p->shards[i].last_page)
+         p->last_page = false;
+
+fini:
+   for (size_t i = 0; i < nr; i++)
+      free(searches[i].page.words);
+   free(searches);
+   return ret;
+}
+
+
+/*******************************************************************************
+ * Tokens.
+ ******************************************************************************/
+
+struct vb_token {
+   uint8_t *buf;
+   size_t size;
+   size_t len;
+};
+
+static void vb_token_put(struct vb_token *t, uint32_t val, int bytes)
+{
+   for (int i = 0; i < bytes; i++, t->len++)
+      if (t->len < t->size)
+         t->buf[t->len] = val >> (8 * i);
+}
+
+size_t vb_federated_token(const struct vb_federated_pagination *p,
+                          void *buf, size_t size)
+{
+   struct vb_token t = {.buf = buf, .size = size};
+
+   vb_token_put(&t, p->nr_shards, 1);
+   vb_token_put(&t, p->last_page, 1);
+   for (uint32_t i = 0; i < p->nr_shards && i < VB_MAX_SHARDS; i++) {
+      const struct vb_shard_cursor *cur = &p->shards[i];
+      vb_token_put(&t, cur->last_page, 1);
+      vb_token_put(&t, cur->last_pos, 4);
+      vb_token_put(&t, (uint32_t)cur->last_weight, 4);
+      vb_token_put(&t, cur->pages, 4);
+      vb_token_put(&t, cur->last_len, 2);
+      for (size_t k = 0; k < cur->last_len; k++)
+         vb_token_put(&t, (uint8_t)cur->last_word[k], 1);
+   }
+   return t.len;
+}
+
+static bool vb_token_get(struct vb_token *t, uint32_t *val, int bytes)
+{
+   if (t->len + bytes > t->size)
+      return false;
+   *val = 0;
+   for (int i = 0; i < bytes; i++)
+      *val |= (uint32_t)t->buf[t->len++] << (8 * i);
+   return true;
+}
+
+int vb_federated_untoken(struct vb_federated_pagination *p,
+                         const void *token, size_t len)
+{
+   struct vb_token t = {.buf = (uint8_t *)token, .size = len};
+   uint32_t nr, last_page;
+
+   memset(p, 0, sizeof *p);
+   if (!vb_token_get(&t, &nr, 1) || nr > VB_MAX_SHARDS
+       || !vb_token_get(&t, &last_page, 1))
+      return VB_ESHARDS;
+   p->nr_shards = nr;
+   p->last_page = last_page;
+
+   for (uint32_t i = 0; i < nr; i++) {
+      struct vb_shard_cursor *cur = &p->shards[i];
+      uint32_t last_pos, weight, pages, word_len;
+      if (!vb_token_get(&t, &last_page, 1) || !vb_token_get(&t, &last_pos, 4)
+          || !vb_token_get(&t, &weight, 4) || !vb_token_get(&t, &pages, 4)
+          || !vb_token_get(&t, &word_len, 2)
+          || word_len > VB_MAX_WORD_LEN || t.len + word_len > t.size)
+         return VB_ESHARDS;
+      cur->last_page = last_page;
+      cur->last_pos = last_pos;
+      cur->last_weight = (int32_t)weight;
+      cur->pages = pages;
+      cur->last_len = word_len;
+      memcpy(cur->last_word, &t.buf[t.len], word_len);
+      cur->last_word[word_len] = '\0';
+      t.len += word_len;
+   }
+   if (t.len != t.size)
+      return VB_ESHARDS;
+   return VB_OK;
+}
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include "priv.h"
+
+/* A word of the base automaton, folded. */
+struct vb_fold_entry {
+   union {
+      size_t offset;    /* While the buffer of folded words can still move. */
+      const char *str;
+   };
+   uint32_t len;
+   uint32_t pos;     /* Ordinal of the original word. */
+};
+
+/* Folded forms are sorted, and the words that have the same folded form are
+ * kept in the order of the base automaton.
+ */
+static int vb_fold_entry_cmp(const void *a, const void *b)
+{
+   const struct vb_fold_entry *x = a, *y = b;
+
+   int cmp = lmemcmp(x->str, x->len, y->str, y->len);
+   if (cmp)
+      return cmp;
+   return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/* Folds all the words of an automaton. Words whose folded form is empty,
+ * because they are made of combining marks only, are left out.
+ */
+static int vb_fold_words(const struct mini *base, char **bufp,
+                         struct vb_fold_entry **entriesp, uint32_t *nr)
+{
+   const uint32_t size = mn_size(base);
+   struct vb_fold_entry *entries = malloc(sizeof *entries * (size ? size : 1));
+   char *buf = NULL;
+   size_t total = 0, max = 0;
+   *nr = 0;
+
+   if (!entries)
+      return VB_ENOMEM;
+
+   struct mini_iter it;
+   const char *word;
+   size_t len;
+   uint32_t pos = 0;
+   mn_iter_init(&it, base);
+   while ((word = mn_iter_next(&it, &len))) {
+      pos++;
+      if (total + len + 1 > max) {
+         size_t new_max = max ? max * 2 : 1 << 16;
+         char *new_buf = realloc(buf, new_max);
+         if (!new_buf) {
+            free(buf);
+            free(entries);
+            return VB_ENOMEM;
+         }
+         buf = new_buf;
+         max = new_max;
+      }
+      const size_t flen = vb_utf8_fold(&buf[total], word, len);
+      if (!flen)
+         continue;
+      entries[*nr] = (struct vb_fold_entry){
+         .offset = total,
+         .len = flen,
+         .pos = pos,
+      };
+      (*nr)++;
+      total += flen + 1;
+   }
+
+   for (uint32_t i = 0; i < *nr; i++)
+      entries[i].str = &buf[entries[i].offset];
+   *bufp = buf;
+   *entriesp = entries;
+   return VB_OK;
+}
+
+int vb_folded_new(struct vb_folded **foldedp, const struct mini *base)
+{
+   *foldedp = NULL;
+
+   char *buf;
+   struct vb_fold_entry *entries;
+   uint32_t nr;
+   int ret = vb_fold_words(base, &buf, &entries, &nr);
+   if (ret)
+      return ret;
+   qsort(entries, nr, sizeof *entries, vb_fold_entry_cmp);
+
+   struct vb_folded *folded = calloc(1, sizeof *folded);
+   struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+   if (folded) {
+      folded->words = malloc(sizeof *folded->words * (nr ? nr : 1));
+      folded->starts = malloc(sizeof *folded->starts * ((size_t)nr + 1));
+   }
+   if (!folded || !enc || !folded->words || !folded->starts) {
+      mn_enc_free(enc);
+      ret = VB_ENOMEM;
+      goto fini;
+   }
+
+   /* Words that have the same folded form are consecutive. */
+   uint32_t nr_forms = 0;
+   int mn_ret = MN_OK;
+   for (uint32_t i = 0; i < nr && !mn_ret; i++) {
+      if (!i || lmemcmp(entries[i].str, entries[i].len,
+                        entries[i - 1].str, entries[i - 1].len)) {
+         folded->starts[nr_forms++] = i;
+         mn_ret = mn_enc_add(enc, entries[i].str, entries[i].len);
+      }
+      folded->words[i] = entries[i].pos;
+   }
+   folded->starts[nr_forms] = nr;
+   ret = vb_enc_load(enc, mn_ret, &folded->fsa);
+
+fini:
+   free(buf);
+   free(entries);
+   if (ret)
+      vb_folded_free(folded);
+   else
+      *foldedp = folded;
+   return ret;
+}
+
+void vb_folded_free(struct vb_folded *folded)
+{
+   if (!folded)
+      return;
+   mn_free(folded->fsa);
+   vb_arena_free(folded->arena);
+   free(folded->starts);
+   free(folded->words);
+   free(folded);
+}
+
+struct vb_unfold {
+   const struct vb_lexicon *lex;
+   void (*handler)(void *arg, const char *token, size_t len);
+   void *arg;
+   struct vb_stats *stats;
+};
+
+/* Reports the words a matching folded form stands for. */
+static void vb_unfold(void *arg, const char *word, size_t len)
+{
+   const struct vb_unfold *u = arg;
+   const struct vb_folded *folded = u->lex->folded;
+   char buf[MN_MAX_WORD_LEN + 1];
+
+   const uint32_t pos = mn_locate(folded->fsa, word, len);
+   for (uint32_t i = folded->starts[pos - 1]; i < folded->starts[pos]; i++) {
+      const size_t orig_len = mn_extract(u->lex->base, folded->words[i], buf);
+      u->handler(u->arg, buf, orig_len);
+      VB_STAT(u, extracts, 1);
+   }
+}
+
+int vb_folded_match(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   struct vb_lexicon view;
+   vb_lexicon_view(&view, lex->folded->fsa);
+   view.arena = lex->folded->arena;
+   view.valid_utf8 = lex->valid_utf8;
+
+   struct vb_unfold u = {
+      .lex = lex,
+      .handler = c->handler,
+      .arg = c->arg,
+      .stats = c->stats,
+   };
+   c->handler = vb_unfold;
+   c->arg = &u;
+   return vb_match_funcs[c->mode](&view, c);
+}
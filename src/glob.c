@@ -0,0 +1,270 @@
+#include <string.h>
+#include "priv.h"
+
+/* Parses a group, "pat" pointing just after the opening bracket. Returns the
+ * index of the closing bracket, or -1 if there is none.
+ */
+static int32_t vb_glob_set(struct vb_glob *g, const char32_t *pat, int32_t len)
+{
+   struct vb_glob_set *set = &g->sets[g->nr_sets++];
+   int32_t i = 0;
+
+   set->invert = i < len && pat[i] == '^';
+   i += set->invert;
+   set->start = g->nr_set_chars;
+   set->ascii[0] = set->ascii[1] = 0;
+
+   /* A closing bracket in first position is a literal. */
+   for (int32_t first = i; i < len && (pat[i] != ']' || i == first); i++) {
+      if (pat[i] < 0x80)
+         set->ascii[pat[i] >> 6] |= UINT64_C(1) << (pat[i] & 63);
+      else
+         g->set_chars[g->nr_set_chars++] = pat[i];
+   }
+   set->end = g->nr_set_chars;
+   return i < len ? i : -1;
+}
+
+/* Adds the literal characters of the pattern that precede "end" and that
+ * follow the last wildcard as a required fragment.
+ */
+static void vb_glob_fragment(struct vb_glob *g, const char32_t *pat,
+                             int32_t start, int32_t end, bool at_end)
+{
+   if (start == end)
+      return;
+
+   struct vb_glob_fragment *f = &g->fragments[g->nr_fragments++];
+   f->start = g->nr_bytes;
+   for (int32_t i = start; i < end; i++)
+      g->nr_bytes += vb_utf8_encode(&g->bytes[g->nr_bytes], pat[i]);
+   f->len = g->nr_bytes - f->start;
+   f->at_start = start == 0;
+   f->at_end = at_end;
+}
+
+int vb_glob_compile(struct vb_glob *g, const char *pat, size_t len)
+{
+   char32_t upat[MN_MAX_WORD_LEN + 1];
+   const int32_t ulen = vb_utf8_decode(upat, pat, len);
+   if (ulen < 0)
+      return VB_EQUTF8;
+
+   g->nr_atoms = g->nr_sets = g->nr_set_chars = 0;
+   g->nr_fragments = g->nr_bytes = 0;
+   g->only_literals = true;
+   g->invalid = false;
+
+   int32_t lit_start = 0;  /* Start of the current run of literals. */
+   for (int32_t i = 0; i < ulen; i++) {
+      struct vb_glob_atom *atom = &g->atoms[g->nr_atoms];
+
+      switch (upat[i]) {
+      case '*':
+         vb_glob_fragment(g, upat, lit_start, i, false);
+         /* Consecutive stars are the same as a single one. */
+         if (!g->nr_atoms || atom[-1].type != VB_GLOB_STAR) {
+            atom->type = VB_GLOB_STAR;
+            g->nr_atoms++;
+         }
+         lit_start = i + 1;
+         break;
+      case '?':
+         vb_glob_fragment(g, upat, lit_start, i, false);
+         atom->type = VB_GLOB_ANY;
+         g->nr_atoms++;
+         g->only_literals = false;
+         lit_start = i + 1;
+         break;
+      case '[': {
+         vb_glob_fragment(g, upat, lit_start, i, false);
+         int32_t end = vb_glob_set(g, &upat[i + 1], ulen - i - 1);
+         if (end < 0) {
+            g->invalid = true;
+            return VB_OK;
+         }
+         atom->type = VB_GLOB_SET;
+         atom->set = g->nr_sets - 1;
+         g->nr_atoms++;
+         g->only_literals = false;
+         i += end + 1;
+         lit_start = i + 1;
+         break;
+      }
+      default:
+         atom->type = VB_GLOB_CHAR;
+         atom->c = upat[i];
+         g->nr_atoms++;
+         break;
+      }
+   }
+   vb_glob_fragment(g, upat, lit_start, ulen, true);
+   return VB_OK;
+}
+
+/* Checks that a word contains the literal fragments of the pattern, in order,
+ * and, for the first and last ones, at the expected place. The fragments are
+ * looked for at the leftmost position possible, so this can only reject words
+ * that wouldn't match anyway. If the pattern has no other atoms than literals
+ * and stars, this is enough to tell whether the word matches.
+ */
+bool vb_glob_prefilter(const struct vb_glob *g, const char *word, size_t len)
+{
+   size_t pos = 0;
+
+   if (!g->nr_atoms)
+      return len == 0;
+
+   for (uint32_t i = 0; i < g->nr_fragments; i++) {
+      const struct vb_glob_fragment *f = &g->fragments[i];
+      const char *bytes = &g->bytes[f->start];
+
+      if (f->at_end) {
+         if (len - pos < f->len || memcmp(&word[len - f->len], bytes, f->len))
+            return false;
+         if (f->at_start && len != f->len)
+            return false;
+         pos = len;
+      } else if (f->at_start) {
+         if (len < f->len || memcmp(word, bytes, f->len))
+            return false;
+         pos = f->len;
+      } else {
+         const char *hit = vb_memmem(&word[pos], len - pos, bytes, f->len);
+         if (!hit)
+            return false;
+         pos = hit - word + f->len;
+      }
+   }
+   return true;
+}
+
+static bool vb_glob_in_set(const struct vb_glob *g,
+                           const struct vb_glob_set *set, char32_t c)
+{
+   bool found = false;
+
+   if (c < 0x80) {
+      found = set->ascii[c >> 6] & (UINT64_C(1) << (c & 63));
+   } else {
+      for (uint32_t i = set->start; i < set->end; i++) {
+         if (g->set_chars[i] == c) {
+            found = true;
+            break;
+         }
+      }
+   }
+   return found != set->invert;
+}
+
+/* Checks if a sequence of atoms that doesn't contain stars matches a string
+ * of the same length.
+ */
+static bool vb_glob_segment(const struct vb_glob *g,
+                            const struct vb_glob_atom *atoms,
+                            const char32_t *str, int32_t len)
+{
+   for (int32_t i = 0; i < len; i++) {
+      switch (atoms[i].type) {
+      case VB_GLOB_CHAR:
+         if (atoms[i].c != str[i])
+            return false;
+         break;
+      case VB_GLOB_SET:
+         if (!vb_glob_in_set(g, &g->sets[atoms[i].set], str[i]))
+            return false;
+         break;
+      default:
+         break;
+      }
+   }
+   return true;
+}
+
+/* Number of atoms before the next star, or the end of the pattern. */
+static int32_t vb_glob_segment_len(const struct vb_glob *g, int32_t start)
+{
+   int32_t i = start;
+   while (i < (int32_t)g->nr_atoms && g->atoms[i].type != VB_GLOB_STAR)
+      i++;
+   return i - start;
+}
+
+/* Since every atom but stars matches exactly one character, the pattern can be
+ * seen as a series of fixed-length segments separated by stars. The first one
+ * must match at the start of the string, the last one at its end, and the
+ * others in between, in order, without overlapping. Matching each of them at
+ * the leftmost position possible leaves the most room for the next ones, so we
+ * never need to backtrack.
+ */
+static bool vb_glob_run(const struct vb_glob *g, const char32_t *str,
+                        int32_t len)
+{
+   const struct vb_glob_atom *atoms = g->atoms;
+   const int32_t nr_atoms = g->nr_atoms;
+
+   int32_t seg_len = vb_glob_segment_len(g, 0);
+   if (seg_len == nr_atoms)
+      return len == seg_len && vb_glob_segment(g, atoms, str, len);
+   if (len < seg_len || !vb_glob_segment(g, atoms, str, seg_len))
+      return false;
+
+   int32_t pos = seg_len;          /* In the string. */
+   int32_t i = seg_len + 1;        /* In the pattern, just after a star. */
+
+   /* Same for the last segment. */
+   int32_t last = nr_atoms;
+   while (last > i && atoms[last - 1].type != VB_GLOB_STAR)
+      last--;
+   const int32_t last_len = nr_atoms - last;
+   if (len - pos < last_len
+       || !vb_glob_segment(g, &atoms[last], &str[len - last_len], last_len))
+      return false;
+   const int32_t end = len - last_len;
+
+   while (i < last) {
+      seg_len = vb_glob_segment_len(g, i);
+      for (;;) {
+         if (end - pos < seg_len)
+            return false;
+         if (vb_glob_segment(g, &atoms[i], &str[pos], seg_len))
+            break;
+         pos++;
+      }
+      pos += seg_len;
+      i += seg_len + 1;
+   }
+   return true;
+}
+
+int vb_glob_match(const struct vb_glob *g, const char *word, size_t len,
+                  bool valid_utf8)
+{
+   if (g->invalid || !vb_glob_prefilter(g, word, len))
+      return 0;
+   if (g->only_literals)
+      return 1;
+
+   char32_t uword[MN_MAX_WORD_LEN + 1];
+   const int32_t ulen = valid_utf8 ? vb_utf8_decode_valid(uword, word, len)
+                                   : vb_utf8_decode(uword, word, len);
+   if (ulen < 0)
+      return -1;
+   return vb_glob_run(g, uword, ulen);
+}
+
+int vb_glob_match_iter(const struct vb_glob *g, struct vb_iter *it,
+                       const char *word, size_t len,
+                       size_t pfx_len, int32_t pfx_chars)
+{
+   if (g->invalid || !vb_glob_prefilter(g, &word[pfx_len], len - pfx_len))
+      return 0;
+   if (g->only_literals)
+      return 1;
+
+   int32_t ulen;
+   const char32_t *uword = vb_iter_chars(it, word, len, &ulen);
+   if (!uword)
+      return -1;
+   return vb_glob_run(g, &uword[pfx_chars], ulen - pfx_chars);
+}
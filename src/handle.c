@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+#include "api.h"
+#include "priv.h"
+
+/* Readers register themselves in one of two counters, depending on the parity
+ * of the epoch they observed. A writer that replaces the lexicon then starts a
+ * new epoch, so that new readers register in the other counter, and waits for
+ * the counter of the previous epoch to drop to zero, at which point no reader
+ * can still be using the replaced lexicon. This is a simplified form of RCU.
+ * Readers never wait: they only retry registering if a replacement happens
+ * while they are doing so.
+ */
+struct vb_handle {
+   _Atomic(struct vb_lexicon *) lexicon;
+   atomic_uint epoch;
+   atomic_uint readers[2];
+   mtx_t lock;             /* Serializes writers. */
+};
+
+int vb_handle_new(struct vb_handle **hp, struct vb_lexicon *lex)
+{
+   struct vb_handle *h = malloc(sizeof *h);
+   if (!h) {
+      *hp = NULL;
+      return VB_ENOMEM;
+   }
+   if (mtx_init(&h->lock, mtx_plain) != thrd_success) {
+      free(h);
+      *hp = NULL;
+      return VB_ENOMEM;
+   }
+   atomic_init(&h->lexicon, lex);
+   atomic_init(&h->epoch, 0);
+   atomic_init(&h->readers[0], 0);
+   atomic_init(&h->readers[1], 0);
+   *hp = h;
+   return VB_OK;
+}
+
+void vb_handle_free(struct vb_handle *h)
+{
+   if (!h)
+      return;
+   vb_lexicon_free(atomic_load(&h->lexicon));
+   mtx_destroy(&h->lock);
+   free(h);
+}
+
+const struct vb_lexicon *vb_handle_acquire(struct vb_handle *h, unsigned *ticket)
+{
+   for (;;) {
+      unsigned epoch = atomic_load(&h->epoch);
+      atomic_fetch_add(&h->readers[epoch & 1], 1);
+      if (atomic_load(&h->epoch) == epoch) {
+         *ticket = epoch & 1;
+         return atomic_load(&h->lexicon);
+      }
+      atomic_fetch_sub(&h->readers[epoch & 1], 1);
+   }
+}
+
+void vb_handle_release(struct vb_handle *h, unsigned ticket)
+{
+   atomic_fetch_sub(&h->readers[ticket & 1], 1);
+}
+
+void vb_handle_publish(struct vb_handle *h, struct vb_lexicon *lex)
+{
+   mtx_lock(&h->lock);
+   struct vb_lexicon *old = atomic_exchange(&h->lexicon, lex);
+   unsigned epoch = atomic_fetch_add(&h->epoch, 1);
+   while (atomic_load(&h->readers[epoch & 1]))
+      thrd_yield();
+   mtx_unlock(&h->lock);
+
+   vb_lexicon_free(old);
+}
+
+int vb_handle_match(struct vb_handle *h, struct vb_query *q,
+                    void (*callback)(void *arg, const char *token, size_t len),
+                    void *arg)
+{
+   unsigned ticket;
+   const struct vb_lexicon *lex = vb_handle_acquire(h, &ticket);
+   int ret = vb_lexicon_match(lex, q, callback, arg);
+   vb_handle_release(h, ticket);
+   return ret;
+}
@@ -47,6 +47,31 @@ static void NAME##_push(struct NAME *heap, T item)                             \
    }                                                                           \
 }                                                                              \
                                                                                \
+/* Removes the largest item and returns it. The heap must not be empty. */    \
+static T NAME##_pop(struct NAME *heap)                                         \
+{                                                                              \
+   assert(heap->size > 0);                                                     \
+   T *restrict data = heap->data;                                              \
+   const T top = data[0];                                                      \
+   const T item = data[--heap->size];                                          \
+   const size_t size = heap->size;                                             \
+                                                                               \
+   size_t cur = 0;                                                             \
+   for (;;) {                                                                  \
+      size_t child = (cur << 1) + 1;                                           \
+      if (child >= size)                                                       \
+         break;                                                                \
+      if (child + 1 < size && COMPAR(data[child], data[child + 1]) < 0)        \
+         child++;                                                              \
+      if (COMPAR(item, data[child]) >= 0)                                      \
+         break;                                                                \
+      data[cur] = data[child];                                                 \
+      cur = child;                                                             \
+   }                                                                           \
+   data[cur] = item;                                                           \
+   return top;                                                                 \
+}                                                                              \
+                                                                               \
 static int NAME##_qsort_cmp_(const void *a, const void *b)                     \
 {                                                                              \
    return COMPAR(*(const T *)a, *(const T *)b);                                \
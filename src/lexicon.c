@@ -0,0 +1,606 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "api.h"
+#include "priv.h"
+#include "lib/mini.h"
+
+static bool has_edits(const struct vb_lexicon *lex)
+{
+   return lex->added.size || lex->removed.size;
+}
+
+/* Returns a lexicon identifier never used before. */
+static uint64_t new_id(void)
+{
+   static atomic_uint_least64_t last_id;
+   return atomic_fetch_add(&last_id, 1) + 1;
+}
+
+
+/*******************************************************************************
+ * Word arrays.
+ ******************************************************************************/
+
+/* Returns the index of the first word >= the given one. */
+static size_t words_bound(const struct vb_words *ws, const char *str, size_t len)
+{
+   size_t low = 0, high = ws->size;
+
+   while (low < high) {
+      size_t mid = low + ((high - low) >> 1);
+      if (lmemcmp(ws->data[mid].str, ws->data[mid].len, str, len) < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+static bool words_find(const struct vb_words *ws, const char *str, size_t len,
+                       size_t *idx)
+{
+   *idx = words_bound(ws, str, len);
+   return *idx < ws->size
+       && !lmemcmp(ws->data[*idx].str, ws->data[*idx].len, str, len);
+}
+
+static int words_insert(struct vb_words *ws, size_t idx,
+                        const char *str, size_t len, uint32_t pos)
+{
+   if (ws->size == ws->max) {
+      size_t max = ws->max ? ws->max * 2 : 16;
+      struct vb_word *data = realloc(ws->data, max * sizeof *data);
+      if (!data)
+         return VB_ENOMEM;
+      ws->data = data;
+      ws->max = max;
+   }
+
+   char *copy = malloc(len + 1);
+   if (!copy)
+      return VB_ENOMEM;
+   memcpy(copy, str, len);
+   copy[len] = '\0';
+
+   memmove(&ws->data[idx + 1], &ws->data[idx], (ws->size - idx) * sizeof *ws->data);
+   ws->data[idx] = (struct vb_word){.str = copy, .len = len, .pos = pos};
+   ws->size++;
+   return VB_OK;
+}
+
+static void words_delete(struct vb_words *ws, size_t idx)
+{
+   free(ws->data[idx].str);
+   ws->size--;
+   memmove(&ws->data[idx], &ws->data[idx + 1], (ws->size - idx) * sizeof *ws->data);
+}
+
+static void words_fini(struct vb_words *ws)
+{
+   for (size_t i = 0; i < ws->size; i++)
+      free(ws->data[i].str);
+   free(ws->data);
+}
+
+/* Number of removed words whose ordinal in the base automaton is <= pos. */
+static size_t removed_upto(const struct vb_lexicon *lex, uint32_t pos)
+{
+   size_t low = 0, high = lex->removed.size;
+
+   while (low < high) {
+      size_t mid = low + ((high - low) >> 1);
+      if (lex->removed.data[mid].pos <= pos)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+/* Number of words of the base automaton that sort before the given one. */
+static uint32_t base_before(const struct vb_lexicon *lex,
+                            const char *str, size_t len)
+{
+   struct mini_iter it;
+   uint32_t pos = mn_iter_inits(&it, lex->base, str, len);
+   return pos ? pos - 1 : lex->base_size;
+}
+
+/* Position, in the whole lexicon, of the added word at the given index. */
+static uint32_t added_pos(const struct vb_lexicon *lex, size_t idx)
+{
+   uint32_t before = lex->added.data[idx].pos;
+   return before - removed_upto(lex, before) + idx + 1;
+}
+
+
+/*******************************************************************************
+ * Lexicon.
+ ******************************************************************************/
+
+void vb_lexicon_view(struct vb_lexicon *lex, const struct mini *base)
+{
+   /* Counting the words of a standard automaton requires traversing it, and
+    * we only need the count for applying edits, which such views never have.
+    */
+   *lex = (struct vb_lexicon){
+      .base = (struct mini *)base,
+      .base_size = mn_type(base) == MN_NUMBERED ? mn_size(base) : 0,
+   };
+}
+
+/* Checks that all words of an automaton are valid UTF-8. */
+static bool check_utf8(const struct mini *fsa)
+{
+   struct mini_iter it;
+   const char *word;
+   size_t len;
+
+   mn_iter_init(&it, fsa);
+   while ((word = mn_iter_next(&it, &len)))
+      if (!vb_utf8_check(word, len))
+         return false;
+   return true;
+}
+
+/* Same as vb_lexicon_new(), but doesn't check the words if "valid_utf8" is
+ * set.
+ */
+static int lexicon_new(struct vb_lexicon **lexp, struct mini *base,
+                       bool valid_utf8)
+{
+   *lexp = NULL;
+
+   if (mn_type(base) != MN_NUMBERED)
+      return VB_EFSA;
+   if (!valid_utf8 && !check_utf8(base))
+      return VB_ELUTF8;
+
+   struct vb_lexicon *lex = malloc(sizeof *lex);
+   if (!lex)
+      return VB_ENOMEM;
+   vb_lexicon_view(lex, base);
+   lex->valid_utf8 = true;
+   lex->id = new_id();
+   *lexp = lex;
+   return VB_OK;
+}
+
+int vb_lexicon_new(struct vb_lexicon **lexp, struct mini *base)
+{
+   return lexicon_new(lexp, base, false);
+}
+
+void vb_lexicon_free(struct vb_lexicon *lex)
+{
+   if (!lex)
+      return;
+   words_fini(&lex->added);
+   words_fini(&lex->removed);
+   vb_arena_free(lex->arena);
+   vb_folded_free(lex->folded);
+   vb_scores_free(lex->scores);
+   mn_free(lex->base);
+   free(lex);
+}
+
+uint32_t vb_lexicon_size(const struct vb_lexicon *lex)
+{
+   return lex->base_size + lex->added.size - lex->removed.size;
+}
+
+size_t vb_lexicon_pending(const struct vb_lexicon *lex)
+{
+   return lex->added.size + lex->removed.size;
+}
+
+int vb_lexicon_add(struct vb_lexicon *lex, const char *word, size_t len)
+{
+   if (len == 0 || len > MN_MAX_WORD_LEN || !vb_utf8_check(word, len))
+      return VB_EWORD;
+
+   lex->id = new_id();
+   size_t idx;
+   if (words_find(&lex->removed, word, len, &idx)) {
+      words_delete(&lex->removed, idx);
+      return VB_OK;
+   }
+   if (words_find(&lex->added, word, len, &idx) || mn_contains(lex->base, word, len))
+      return VB_OK;
+   return words_insert(&lex->added, idx, word, len, base_before(lex, word, len));
+}
+
+int vb_lexicon_remove(struct vb_lexicon *lex, const char *word, size_t len)
+{
+   if (len == 0 || len > MN_MAX_WORD_LEN)
+      return VB_OK;
+
+   lex->id = new_id();
+   size_t idx;
+   if (words_find(&lex->added, word, len, &idx)) {
+      words_delete(&lex->added, idx);
+      return VB_OK;
+   }
+   uint32_t pos = mn_locate(lex->base, word, len);
+   if (!pos || words_find(&lex->removed, word, len, &idx))
+      return VB_OK;
+   return words_insert(&lex->removed, idx, word, len, pos);
+}
+
+int vb_lexicon_flatten(struct vb_lexicon *lex)
+{
+   int ret = VB_OK;
+
+   if (!lex->arena)
+      ret = vb_arena_new(&lex->arena, lex->base);
+   if (!ret && lex->folded && !lex->folded->arena)
+      ret = vb_arena_new(&lex->folded->arena, lex->folded->fsa);
+   return ret;
+}
+
+int vb_lexicon_fold(struct vb_lexicon *lex)
+{
+   if (lex->folded)
+      return VB_OK;
+
+   int ret = vb_folded_new(&lex->folded, lex->base);
+   if (!ret && lex->arena)
+      ret = vb_lexicon_flatten(lex);
+   return ret;
+}
+
+int vb_lexicon_set_scores(struct vb_lexicon *lex, const int32_t *scores)
+{
+   struct vb_scores *s = NULL;
+
+   if (scores) {
+      int ret = vb_scores_new(&s, scores, lex->base_size);
+      if (ret)
+         return ret;
+   }
+   vb_scores_free(lex->scores);
+   lex->scores = s;
+   lex->id = new_id();
+   return VB_OK;
+}
+
+const struct vb_scores *vb_lexicon_scores(const struct vb_lexicon *lex)
+{
+   return has_edits(lex) ? NULL : lex->scores;
+}
+
+const struct vb_arena *vb_lexicon_arena(const struct vb_lexicon *lex)
+{
+   return has_edits(lex) ? NULL : lex->arena;
+}
+
+bool vb_lexicon_contains(const struct vb_lexicon *lex, const char *word,
+                         size_t len)
+{
+   if (has_edits(lex)) {
+      size_t idx;
+      if (words_find(&lex->added, word, len, &idx))
+         return true;
+      if (words_find(&lex->removed, word, len, &idx))
+         return false;
+   }
+   return mn_contains(lex->base, word, len);
+}
+
+size_t vb_lexicon_extract(const struct vb_lexicon *lex, uint32_t pos,
+                          char buf[static MN_MAX_WORD_LEN + 1])
+{
+   if (!has_edits(lex))
+      return mn_extract(lex->base, pos, buf);
+
+   struct vb_iter it;
+   const char *word;
+   size_t len;
+   if (!vb_iter_initn(&it, lex, pos) || !(word = vb_iter_next(&it, &len))) {
+      buf[0] = '\0';
+      return 0;
+   }
+   memcpy(buf, word, len + 1);
+   return len;
+}
+
+
+/*******************************************************************************
+ * Compaction.
+ ******************************************************************************/
+
+struct vb_buffer {
+   char *data;
+   size_t size;
+   size_t max;
+};
+
+static int vb_buffer_write(void *arg, const void *data, size_t size)
+{
+   struct vb_buffer *buf = arg;
+
+   if (buf->size + size > buf->max) {
+      size_t max = buf->max ? buf->max : 4096;
+      while (max < buf->size + size)
+         max *= 2;
+      char *new_data = realloc(buf->data, max);
+      if (!new_data)
+         return -1;
+      buf->data = new_data;
+      buf->max = max;
+   }
+   memcpy(&buf->data[buf->size], data, size);
+   buf->size += size;
+   return 0;
+}
+
+static int vb_buffer_read(void *arg, void *data, size_t size)
+{
+   struct vb_buffer *buf = arg;
+
+   if (buf->size + size > buf->max)
+      return -1;
+   memcpy(data, &buf->data[buf->size], size);
+   buf->size += size;
+   return 0;
+}
+
+int vb_enc_load(struct mini_enc *enc, int ret, struct mini **fsap)
+{
+   *fsap = NULL;
+
+   struct vb_buffer buf = {0};
+   if (!ret)
+      ret = mn_enc_dump(enc, vb_buffer_write, &buf);
+   mn_enc_free(enc);
+
+   if (!ret) {
+      buf.max = buf.size;
+      buf.size = 0;
+      ret = mn_load(fsap, vb_buffer_read, &buf);
+   }
+   free(buf.data);
+
+   switch (ret) {
+   case MN_OK:
+      return VB_OK;
+   case MN_E2BIG:
+      return VB_E2BIG;
+   default:
+      return VB_ENOMEM;
+   }
+}
+
+int vb_lexicon_compact(const struct vb_lexicon *lex, struct vb_lexicon **lexp)
+{
+   *lexp = NULL;
+
+   struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+   if (!enc)
+      return VB_ENOMEM;
+
+   int ret = MN_OK;
+   struct vb_iter it;
+   const char *word;
+   size_t len;
+   vb_iter_init(&it, lex);
+   while ((word = vb_iter_next(&it, &len)) && !ret)
+      ret = mn_enc_add(enc, word, len);
+
+   struct mini *base;
+   if ((ret = vb_enc_load(enc, ret, &base)))
+      return ret;
+
+   /* The words come from a lexicon, so they have already been checked. */
+   ret = lexicon_new(lexp, base, true);
+   if (ret) {
+      mn_free(base);
+      return ret;
+   }
+   if ((lex->arena && (ret = vb_lexicon_flatten(*lexp)))
+       || (lex->folded && (ret = vb_lexicon_fold(*lexp)))) {
+      vb_lexicon_free(*lexp);
+      *lexp = NULL;
+   }
+   return ret;
+}
+
+
+/*******************************************************************************
+ * Iterator.
+ ******************************************************************************/
+
+static void iter_reset(struct vb_iter *it, const struct vb_lexicon *lex)
+{
+   it->lex = lex;
+   it->word = NULL;
+   it->len = 0;
+   it->pos = 0;
+   it->added = 0;
+   it->removed = 0;
+   it->prefix = NULL;
+   it->prefix_len = 0;
+   it->accept = NULL;
+   it->arg = NULL;
+   it->decoded = 0;
+   it->utf8_bytes = 0;
+}
+
+uint32_t vb_iter_init(struct vb_iter *it, const struct vb_lexicon *lex)
+{
+   iter_reset(it, lex);
+   uint32_t pos = mn_iter_init(&it->it, lex->base);
+   return pos || lex->added.size;
+}
+
+uint32_t vb_iter_initp(struct vb_iter *it, const struct vb_lexicon *lex,
+                       const char *prefix, size_t len)
+{
+   iter_reset(it, lex);
+   uint32_t pos = mn_iter_initp(&it->it, lex->base, prefix, len);
+   if (!has_edits(lex))
+      return pos;
+
+   it->prefix = prefix;
+   it->prefix_len = len;
+   it->added = words_bound(&lex->added, prefix, len);
+
+   /* Position of the first word >= the prefix, if it is prefixed by it. */
+   uint32_t before = pos ? pos - 1 : base_before(lex, prefix, len);
+   it->pos = before;
+   it->removed = removed_upto(lex, before);
+
+   if (!pos) {
+      if (it->added == lex->added.size)
+         return 0;
+      const struct vb_word *w = &lex->added.data[it->added];
+      if (w->len < len || memcmp(w->str, prefix, len))
+         return 0;
+   }
+   return before - it->removed + it->added + 1;
+}
+
+uint32_t vb_iter_inits(struct vb_iter *it, const struct vb_lexicon *lex,
+                       const char *word, size_t len)
+{
+   if (!has_edits(lex)) {
+      iter_reset(it, lex);
+      return mn_iter_inits(&it->it, lex->base, word, len);
+   }
+
+   /* Position of the first word >= the given one. */
+   uint32_t before = base_before(lex, word, len);
+   uint32_t pos = before - removed_upto(lex, before)
+                + words_bound(&lex->added, word, len) + 1;
+   return vb_iter_initn(it, lex, pos);
+}
+
+uint32_t vb_iter_initn(struct vb_iter *it, const struct vb_lexicon *lex,
+                       uint32_t pos)
+{
+   iter_reset(it, lex);
+   if (!has_edits(lex))
+      return mn_iter_initn(&it->it, lex->base, pos);
+
+   if (pos == 0 || pos > vb_lexicon_size(lex)) {
+      mn_iter_initn(&it->it, lex->base, 0);
+      return 0;
+   }
+
+   /* Find the number of added words that come before the requested one. */
+   size_t low = 0, high = lex->added.size;
+   while (low < high) {
+      size_t mid = low + ((high - low) >> 1);
+      if (added_pos(lex, mid) < pos)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   it->added = low;
+
+   uint32_t base_pos;
+   if (low < lex->added.size && added_pos(lex, low) == pos) {
+      /* The requested word is an added one. */
+      base_pos = lex->added.data[low].pos + 1;
+      it->removed = removed_upto(lex, base_pos - 1);
+   } else {
+      /* The requested word is in the base automaton. Skip removed words. */
+      base_pos = pos - low;
+      size_t i = 0;
+      while (i < lex->removed.size && lex->removed.data[i].pos <= base_pos) {
+         base_pos++;
+         i++;
+      }
+      it->removed = i;
+   }
+   it->pos = base_pos - 1;
+   mn_iter_initn(&it->it, lex->base, base_pos);
+   return pos;
+}
+
+void vb_iter_filter(struct vb_iter *it,
+                    int (*accept)(void *arg, size_t depth, uint8_t chr),
+                    void *arg)
+{
+   it->accept = accept;
+   it->arg = arg;
+}
+
+static const char *iter_next_base(struct vb_iter *it, size_t *len)
+{
+   const char *word = it->accept
+      ? mn_iter_next_filter(&it->it, len, it->accept, it->arg)
+      : mn_iter_next(&it->it, len);
+   if (it->it.shared < it->decoded)
+      it->decoded = it->it.shared;
+   return word;
+}
+
+const char *vb_iter_next(struct vb_iter *it, size_t *len)
+{
+   const struct vb_lexicon *lex = it->lex;
+   if (!has_edits(lex))
+      return iter_next_base(it, len);
+
+   if (!it->word) {
+      while ((it->word = iter_next_base(it, &it->len))) {
+         /* Filtered words are not consecutive. */
+         if (it->accept) {
+            it->pos = mn_locate(lex->base, it->word, it->len);
+            while (it->removed < lex->removed.size
+                   && lex->removed.data[it->removed].pos < it->pos)
+               it->removed++;
+         } else {
+            it->pos++;
+         }
+         if (it->removed == lex->removed.size || lex->removed.data[it->removed].pos != it->pos)
+            break;
+         it->removed++;
+      }
+   }
+
+   const struct vb_word *added = NULL;
+   if (it->added < lex->added.size) {
+      added = &lex->added.data[it->added];
+      if (it->prefix && (added->len < it->prefix_len || memcmp(added->str, it->prefix, it->prefix_len))) {
+         it->added = lex->added.size;
+         added = NULL;
+      }
+   }
+
+   if (it->word && (!added || lmemcmp(it->word, it->len, added->str, added->len) < 0)) {
+      const char *word = it->word;
+      it->word = NULL;
+      if (len)
+         *len = it->len;
+      return word;
+   }
+   if (added) {
+      it->added++;
+      if (len)
+         *len = added->len;
+      return added->str;
+   }
+   if (len)
+      *len = 0;
+   return NULL;
+}
+
+const char32_t *vb_iter_chars(struct vb_iter *it, const char *word, size_t len,
+                              int32_t *nr)
+{
+   const bool check = !it->lex->valid_utf8;
+
+   /* Added words have nothing in common with the current base word. */
+   if (word != it->it.word)
+      it->decoded = 0;
+   it->utf8_bytes += len - it->decoded;
+   *nr = vb_utf8_decode_next(&it->chars, word, len, it->decoded, check);
+   if (*nr < 0) {
+      it->decoded = 0;
+      return NULL;
+   }
+   it->decoded = word == it->it.word ? len : 0;
+   return it->chars.chars;
+}
@@ -147,6 +147,10 @@ struct fc_memo {
    char32_t *seq2;         /* Previous sequence seen. */
    int32_t len2;           /* Length of this sequence. */
    int32_t max_dist;       /* Maximum allowed distance (for Levenshtein). */
+   uint64_t sig;           /* Characters of the reference sequence, modulo 64. */
+   /* Work done so far, which callers can read and reset as they see fit. */
+   uint64_t cells;         /* Matrix cells computed. */
+   uint64_t hits;          /* Comparisons that reused part of the matrix. */
 };
 
 /* Initializer.
@@ -188,6 +192,59 @@ int32_t fc_memo_damerau(struct fc_memo *, const char32_t *, int32_t);
 int32_t fc_memo_lcsubstr(struct fc_memo *, const char32_t *, int32_t);
 int32_t fc_memo_lcsubseq(struct fc_memo *, const char32_t *, int32_t);
 
+
+/*******************************************************************************
+ * Batched string metrics.
+ ******************************************************************************/
+
+/* Number of sequences compared at once. */
+#define FC_BATCH_SIZE 8
+
+/* Compares a reference sequence to several other sequences at once.
+ * Each sequence gets its own lane in vectors of 16-bit cells, and the matrices
+ * of all sequences are filled in together, one column at a time. This works
+ * best when the sequences of a batch have similar lengths, since all of them
+ * are processed up to the length of the longest one. Contrary to the memoized
+ * functions, nothing is reused from one call to the next.
+ */
+struct fc_batch {
+   enum fc_metric metric;
+   int32_t max_len;     /* Maximum possible length of a sequence. */
+   int32_t max_dist;    /* Maximum allowed distance (for Levenshtein). */
+   int32_t len1;        /* Length of the reference sequence. */
+   void *ids1;          /* Reference sequence, as character identifiers. */
+   void *ids2;          /* Compared sequences, as character identifiers. */
+   void *columns;       /* Last three columns of the matrices. */
+   char32_t *chars;     /* Characters > 0xff of the reference sequence. */
+   int32_t nchars;      /* Number of such characters. */
+};
+
+/* Initializer.
+ * metric: the metric to use.
+ * max_len: the maximum possible length of a sequence (or higher).
+ * max_dist: the maximum allowed edit distance (the lower, the faster). This
+ * parameter is only used if the chosen metric is Levenshtein or Damerau.
+ */
+void fc_batch_init(struct fc_batch *, enum fc_metric metric, int32_t max_len,
+                   int32_t max_dist);
+
+/* Destructor. */
+void fc_batch_fini(struct fc_batch *);
+
+/* Sets the reference sequence.
+ * Contrary to fc_memo_set_ref(), the sequence is not referenced afterwards.
+ */
+void fc_batch_set_ref(struct fc_batch *, const char32_t *seq1, int32_t len1);
+
+/* Compares the reference sequence to "nr" sequences, "nr" being at most
+ * FC_BATCH_SIZE, and writes the results to "ret". These are the values the
+ * memoized functions would return, except for Levenshtein and Damerau
+ * distances larger than the maximum allowed one, which are only guaranteed to
+ * be larger than it.
+ */
+void fc_batch_compute(struct fc_batch *, const char32_t *const seqs[],
+                      const int32_t lens[], int32_t nr, int32_t ret[]);
+
 #endif
 #line 2 "glob.c"
 
@@ -222,15 +279,15 @@ bool fc_glob(const char32_t *pat, const char32_t *str)
             invert = true;
             pat++;
          }
-         while ((*pat == *str) == invert) {
-            if (!*pat || *pat == U']')
-               return false;
-            pat++;
-         }
-         do {
-            if (!*pat++)
-               return false;
-         } while (*pat != U']');
+         /* A closing bracket in first position is a literal. The closing
+          * bracket of the group must not be compared to the string.
+          */
+         const char32_t *first = pat;
+         bool found = false;
+         for (; *pat && (*pat != U']' || pat == first); pat++)
+            found |= *pat == *str;
+         if (!*pat || !*str || found == invert)
+            return false;
          pat++;
          str++;
          break;
@@ -293,6 +350,9 @@ void *fc_malloc(size_t size)
 #line 1 "metric.c"
 #include <limits.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #line 1 "macro.h"
 #ifndef FC_MACRO_H
 #define FC_MACRO_H
@@ -998,6 +1058,8 @@ void fc_memo_init(struct fc_memo *ctx, enum fc_metric metric, int32_t max_len,
 
    ctx->seq1 = NULL;
    ctx->len1 = 0;
+   ctx->cells = 0;
+   ctx->hits = 0;
 
    switch (metric) {
 
@@ -1018,11 +1080,16 @@ void fc_memo_init(struct fc_memo *ctx, enum fc_metric metric, int32_t max_len,
    }
    case FC_LCSUBSTR: {
       ctx->compute = fc_memo_lcsubstr;
-      /* We add one additional column on the right of the matrix for storing
-       * the length of the longest common substring found so far, for each row.
-       * This is necessary because the last row doesn't necessarily contain it.
+      /* Cells are 16 bits wide, so that we can fill in 8 of them at a time. We
+       * add one additional row at the end of the matrix for storing the length
+       * of the longest common substring found so far, for each row of the
+       * matrix. This is necessary because the last row doesn't necessarily
+       * contain it. It starts one row of cells further, so that it is aligned
+       * even if the matrix has an odd number of cells.
        */
-      memo_calloc(ctx, max_len, sizeof(int32_t[ctx->mdim + 1][ctx->mdim]));
+      static_assert(FC_MAX_SEQ_LEN <= INT16_MAX, "");
+      memo_calloc(ctx, max_len, sizeof(int16_t[ctx->mdim + 1][ctx->mdim])
+                                + sizeof(int32_t[ctx->mdim]));
       break;
    }
    case FC_LCSUBSEQ: {
@@ -1061,6 +1128,44 @@ void fc_memo_set_ref(struct fc_memo *ctx,
    ctx->seq1 = seq1;
    ctx->len1 = len1;
    ctx->len2 = 0;
+   ctx->sig = 0;
+   for (int32_t i = 0; i < len1; i++)
+      ctx->sig |= UINT64_C(1) << (seq1[i] & 63);
+}
+
+/* Fills in the row of the longest common substring matrix that corresponds to
+ * a character "c" of the second sequence, given the previous row. Returns the
+ * largest value of the row. With SSE2, we process 8 cells at a time.
+ */
+static int32_t lcsubstr_row(int16_t *restrict row, const int16_t *restrict up,
+                            const char32_t *seq1, int32_t len1, char32_t c)
+{
+   int32_t j = 0, max_len = 0;
+#ifdef __SSE2__
+   const __m128i cv = _mm_set1_epi32(c);
+   const __m128i one = _mm_set1_epi16(1);
+   __m128i max_v = _mm_setzero_si128();
+   for (; j + 8 <= len1; j += 8) {
+      const __m128i lo = _mm_loadu_si128((const __m128i *)&seq1[j]);
+      const __m128i hi = _mm_loadu_si128((const __m128i *)&seq1[j + 4]);
+      const __m128i eq = _mm_packs_epi32(_mm_cmpeq_epi32(lo, cv),
+                                         _mm_cmpeq_epi32(hi, cv));
+      const __m128i diag = _mm_loadu_si128((const __m128i *)&up[j]);
+      const __m128i val = _mm_and_si128(eq, _mm_add_epi16(diag, one));
+      _mm_storeu_si128((__m128i *)&row[j + 1], val);
+      max_v = _mm_max_epi16(max_v, val);
+   }
+   max_v = _mm_max_epi16(max_v, _mm_srli_si128(max_v, 8));
+   max_v = _mm_max_epi16(max_v, _mm_srli_si128(max_v, 4));
+   max_v = _mm_max_epi16(max_v, _mm_srli_si128(max_v, 2));
+   max_len = _mm_extract_epi16(max_v, 0);
+#endif
+   for (; j < len1; j++) {
+      row[j + 1] = seq1[j] == c ? up[j] + 1 : 0;
+      if (max_len < row[j + 1])
+         max_len = row[j + 1];
+   }
+   return max_len;
 }
 
 int32_t fc_memo_lcsubstr(struct fc_memo *ctx, const char32_t *seq2, int32_t len2)
@@ -1070,8 +1175,8 @@ int32_t fc_memo_lcsubstr(struct fc_memo *ctx, const char32_t *seq2, int32_t len2
    const char32_t *seq1 = ctx->seq1;
    const int32_t len1 = ctx->len1;
    char32_t *old_seq2 = ctx->seq2;
-   int32_t (*matrix)[ctx->mdim] = ctx->matrix;
-   const int32_t max_lens = ctx->mdim;
+   int16_t (*matrix)[ctx->mdim] = ctx->matrix;
+   int32_t *max_lens = (int32_t *)&matrix[ctx->mdim + 1];
 
    int32_t skip = 0, min_len2 = FC_MIN(ctx->len2, len2);
    while (skip < min_len2 && old_seq2[skip] == seq2[skip])
@@ -1079,19 +1184,21 @@ int32_t fc_memo_lcsubstr(struct fc_memo *ctx, const char32_t *seq2, int32_t len2
    memcpy(&old_seq2[skip], &seq2[skip], (len2 - skip) * sizeof *seq2);
    ctx->len2 = len2;
 
-   int32_t max_len = matrix[max_lens][skip];
+   ctx->cells += (uint64_t)(len2 - skip) * len1;
+   ctx->hits += skip > 0;
+
+   int32_t max_len = max_lens[skip];
    for (int32_t i = skip + 1; i <= len2; i++) {
-      for (int32_t j = 1; j <= len1; j++) {
-         if (seq1[j - 1] == seq2[i - 1]) {
-            int32_t up_left = matrix[i - 1][j - 1] + 1;
-            matrix[i][j] = up_left;
-            if (max_len < up_left)
-               max_len = up_left;
-         } else {
-            matrix[i][j] = 0;
-         }
+      const char32_t c = seq2[i - 1];
+      if (ctx->sig & (UINT64_C(1) << (c & 63))) {
+         const int32_t row_max = lcsubstr_row(matrix[i], matrix[i - 1], seq1, len1, c);
+         if (max_len < row_max)
+            max_len = row_max;
+      } else {
+         /* The character doesn't appear in the reference sequence. */
+         memset(&matrix[i][1], 0, len1 * sizeof **matrix);
       }
-      matrix[max_lens][i] = max_len;
+      max_lens[i] = max_len;
    }
 
    return max_len;
@@ -1112,6 +1219,8 @@ int32_t fc_memo_lcsubseq(struct fc_memo *ctx,
       skip++;
    memcpy(&old_seq2[skip], &seq2[skip], (len2 - skip) * sizeof *seq2);
    ctx->len2 = len2;
+   ctx->cells += (uint64_t)(len2 - skip) * len1;
+   ctx->hits += skip > 0;
 
    for (int32_t i = 1; i <= len1; i++) {
       for (int32_t j = skip + 1; j <= len2; j++) {
@@ -1169,6 +1278,8 @@ static int32_t fc_memo_distance(struct fc_memo *ctx,
    }
    memcpy(&old_seq2[skip], &seq2[skip], (len2 - skip) * sizeof *seq2);
    ctx->len2 = len2;
+   ctx->cells += (uint64_t)(len2 - skip) * len1;
+   ctx->hits += skip > 0;
 
    for (int32_t i = 1; i <= len1; i++) {
       for (int32_t j = skip + 1; j <= len2; j++) {
@@ -1208,3 +1319,288 @@ void fc_memo_fini(struct fc_memo *ctx)
 {
    fc_free(ctx->seq2);
 }
+#line 1 "batch.c"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* A vector of 16-bit cells, one per sequence of a batch. Without SSE2, the
+ * operations below are performed lane by lane.
+ */
+#ifdef __SSE2__
+
+typedef __m128i lanes;
+
+static_assert(sizeof(lanes) == FC_BATCH_SIZE * sizeof(int16_t), "");
+
+static inline lanes l_set1(int16_t x) { return _mm_set1_epi16(x); }
+static inline lanes l_add(lanes a, lanes b) { return _mm_add_epi16(a, b); }
+static inline lanes l_min(lanes a, lanes b) { return _mm_min_epi16(a, b); }
+static inline lanes l_max(lanes a, lanes b) { return _mm_max_epi16(a, b); }
+static inline lanes l_eq(lanes a, lanes b) { return _mm_cmpeq_epi16(a, b); }
+static inline lanes l_gt(lanes a, lanes b) { return _mm_cmpgt_epi16(a, b); }
+static inline lanes l_and(lanes a, lanes b) { return _mm_and_si128(a, b); }
+static inline lanes l_or(lanes a, lanes b) { return _mm_or_si128(a, b); }
+/* ~a & b */
+static inline lanes l_andnot(lanes a, lanes b) { return _mm_andnot_si128(a, b); }
+/* Whether all lanes of a mask are set. */
+static inline bool l_all(lanes mask) { return _mm_movemask_epi8(mask) == 0xffff; }
+
+#else
+
+typedef struct {
+   int16_t v[FC_BATCH_SIZE];
+} lanes;
+
+#define LANES_OP(name, expr)                                                   \
+static inline lanes name(lanes a, lanes b)                                     \
+{                                                                              \
+   lanes r;                                                                    \
+   for (int k = 0; k < FC_BATCH_SIZE; k++)                                     \
+      r.v[k] = (expr);                                                         \
+   return r;                                                                   \
+}
+
+LANES_OP(l_add, a.v[k] + b.v[k])
+LANES_OP(l_min, FC_MIN(a.v[k], b.v[k]))
+LANES_OP(l_max, FC_MAX(a.v[k], b.v[k]))
+LANES_OP(l_eq, a.v[k] == b.v[k] ? -1 : 0)
+LANES_OP(l_gt, a.v[k] > b.v[k] ? -1 : 0)
+LANES_OP(l_and, a.v[k] & b.v[k])
+LANES_OP(l_or, a.v[k] | b.v[k])
+LANES_OP(l_andnot, ~a.v[k] & b.v[k])
+
+#undef LANES_OP
+
+static inline lanes l_set1(int16_t x)
+{
+   lanes r;
+   for (int k = 0; k < FC_BATCH_SIZE; k++)
+      r.v[k] = x;
+   return r;
+}
+
+static inline bool l_all(lanes mask)
+{
+   for (int k = 0; k < FC_BATCH_SIZE; k++)
+      if (!mask.v[k])
+         return false;
+   return true;
+}
+
+#endif
+
+/* Selects the lanes of "a" where "mask" is set, and those of "b" elsewhere. */
+static inline lanes l_select(lanes mask, lanes a, lanes b)
+{
+   return l_or(l_and(mask, a), l_andnot(mask, b));
+}
+
+/* Characters are compared through small identifiers that fit in a lane.
+ * Characters <= 0xff are their own identifier, plus one. Larger ones are
+ * numbered after them, in order of appearance in the reference sequence.
+ * Larger characters that don't appear in the reference sequence get the
+ * identifier 0, which doesn't match anything in the reference sequence.
+ */
+static int16_t batch_char_id(const struct fc_batch *b, char32_t c)
+{
+   if (c <= 0xff)
+      return c + 1;
+   for (int32_t i = 0; i < b->nchars; i++)
+      if (b->chars[i] == c)
+         return 0x100 + i + 1;
+   return 0;
+}
+
+void fc_batch_init(struct fc_batch *b, enum fc_metric metric, int32_t max_len,
+                   int32_t max_dist)
+{
+   assert(IN_RANGE(max_len) && metric >= 0 && metric < FC_METRIC_NR);
+
+   b->metric = metric;
+   b->max_len = max_len;
+   b->max_dist = max_dist;
+   b->len1 = 0;
+   b->nchars = 0;
+
+   /* Reference sequence, compared sequences, and three columns. */
+   const size_t nr = (size_t)max_len * 2 + ((size_t)max_len + 1) * 3;
+   b->ids1 = fc_malloc(nr * sizeof(lanes) + max_len * sizeof *b->chars + 1);
+   b->ids2 = (lanes *)b->ids1 + max_len;
+   b->columns = (lanes *)b->ids2 + max_len;
+   b->chars = (char32_t *)((lanes *)b->columns + ((size_t)max_len + 1) * 3);
+}
+
+void fc_batch_fini(struct fc_batch *b)
+{
+   fc_free(b->ids1);
+}
+
+void fc_batch_set_ref(struct fc_batch *b, const char32_t *seq1, int32_t len1)
+{
+   assert(len1 >= 0 && len1 <= b->max_len);
+
+   lanes *ids1 = b->ids1;
+   b->len1 = len1;
+   b->nchars = 0;
+   for (int32_t i = 0; i < len1; i++) {
+      int16_t id = batch_char_id(b, seq1[i]);
+      if (!id) {
+         b->chars[b->nchars++] = seq1[i];
+         id = 0x100 + b->nchars;
+      }
+      ids1[i] = l_set1(id);
+   }
+}
+
+/* Levenshtein or Damerau distances. We stop as soon as the distances of the
+ * sequences that are not done yet are known to exceed the maximum allowed one.
+ */
+static lanes batch_distance(struct fc_batch *b, int32_t len2, lanes lens,
+                            bool transpos)
+{
+   const int32_t len1 = b->len1;
+   const lanes *ids1 = b->ids1, *ids2 = b->ids2;
+   lanes *prev2 = b->columns;
+   lanes *prev = prev2 + len1 + 1;
+   lanes *cur = prev + len1 + 1;
+   const lanes one = l_set1(1);
+   const lanes max_dist = l_set1(FC_MIN(b->max_dist, INT16_MAX - 1));
+
+   for (int32_t i = 0; i <= len1; i++)
+      prev[i] = l_set1(i);
+   lanes ret = prev[len1], prev_min = prev[0];
+
+   for (int32_t j = 1; j <= len2; j++) {
+      const lanes c2 = ids2[j - 1];
+      lanes min = cur[0] = l_set1(j);
+      for (int32_t i = 1; i <= len1; i++) {
+         const lanes eq = l_eq(ids1[i - 1], c2);
+         const lanes sub = l_add(prev[i - 1], l_andnot(eq, one));
+         lanes val = l_min(sub, l_add(l_min(prev[i], cur[i - 1]), one));
+         if (transpos && i > 1 && j > 1) {
+            const lanes tr = l_and(l_eq(ids1[i - 2], c2),
+                                   l_eq(ids1[i - 1], ids2[j - 2]));
+            val = l_min(val, l_select(tr, l_add(prev2[i - 2], one), val));
+         }
+         cur[i] = val;
+         min = l_min(min, val);
+      }
+      ret = l_select(l_eq(lens, l_set1(j)), cur[len1], ret);
+
+      /* Values of the next columns can't be lower than this. Damerau looks two
+       * columns back, so we must also take the previous one into account.
+       */
+      const lanes bound = transpos ? l_min(min, l_add(prev_min, one)) : min;
+      const lanes pending = l_gt(lens, l_set1(j));
+      if (l_all(l_or(l_gt(bound, max_dist), l_eq(pending, l_set1(0))))) {
+         ret = l_select(pending, l_add(max_dist, one), ret);
+         break;
+      }
+      prev_min = min;
+      FC_SWAP3(lanes *, prev2, prev, cur);
+   }
+   return ret;
+}
+
+static lanes batch_lcsubstr(struct fc_batch *b, int32_t len2, lanes lens)
+{
+   const int32_t len1 = b->len1;
+   const lanes *ids1 = b->ids1, *ids2 = b->ids2;
+   lanes *prev = b->columns;
+   lanes *cur = prev + len1 + 1;
+   const lanes one = l_set1(1);
+
+   for (int32_t i = 0; i <= len1; i++)
+      prev[i] = l_set1(0);
+   cur[0] = prev[0];
+   lanes max_len = prev[0], ret = prev[0];
+
+   for (int32_t j = 1; j <= len2; j++) {
+      const lanes c2 = ids2[j - 1];
+      for (int32_t i = 1; i <= len1; i++) {
+         const lanes val = l_and(l_eq(ids1[i - 1], c2), l_add(prev[i - 1], one));
+         max_len = l_max(max_len, val);
+         cur[i] = val;
+      }
+      ret = l_select(l_eq(lens, l_set1(j)), max_len, ret);
+      FC_SWAP(lanes *, prev, cur);
+   }
+   return ret;
+}
+
+static lanes batch_lcsubseq(struct fc_batch *b, int32_t len2, lanes lens)
+{
+   const int32_t len1 = b->len1;
+   const lanes *ids1 = b->ids1, *ids2 = b->ids2;
+   lanes *prev = b->columns;
+   lanes *cur = prev + len1 + 1;
+   const lanes one = l_set1(1);
+
+   for (int32_t i = 0; i <= len1; i++)
+      prev[i] = l_set1(0);
+   cur[0] = prev[0];
+   lanes ret = prev[0];
+
+   for (int32_t j = 1; j <= len2; j++) {
+      const lanes c2 = ids2[j - 1];
+      for (int32_t i = 1; i <= len1; i++) {
+         const lanes eq = l_eq(ids1[i - 1], c2);
+         cur[i] = l_select(eq, l_add(prev[i - 1], one),
+                           l_max(prev[i], cur[i - 1]));
+      }
+      ret = l_select(l_eq(lens, l_set1(j)), cur[len1], ret);
+      FC_SWAP(lanes *, prev, cur);
+   }
+   return ret;
+}
+
+void fc_batch_compute(struct fc_batch *b, const char32_t *const seqs[],
+                      const int32_t lens[], int32_t nr, int32_t ret[])
+{
+   assert(nr >= 0 && nr <= FC_BATCH_SIZE);
+
+   /* Unused lanes get an empty sequence. */
+   int16_t lens2[FC_BATCH_SIZE] = {0};
+   int32_t len2 = 0;
+   for (int32_t k = 0; k < nr; k++) {
+      assert(lens[k] >= 0 && lens[k] <= b->max_len);
+      lens2[k] = lens[k];
+      if (lens[k] > len2)
+         len2 = lens[k];
+   }
+
+   /* Transpose the sequences so that the identifiers of their j-th characters
+    * can be loaded at once.
+    */
+   int16_t (*ids2)[FC_BATCH_SIZE] = b->ids2;
+   memset(ids2, 0, len2 * sizeof *ids2);
+   for (int32_t k = 0; k < nr; k++)
+      for (int32_t j = 0; j < lens[k]; j++)
+         ids2[j][k] = batch_char_id(b, seqs[k][j]);
+
+   lanes lens_v;
+   memcpy(&lens_v, lens2, sizeof lens_v);
+
+   lanes res;
+   switch (b->metric) {
+   case FC_LEVENSHTEIN:
+      res = batch_distance(b, len2, lens_v, false);
+      break;
+   case FC_DAMERAU:
+      res = batch_distance(b, len2, lens_v, true);
+      break;
+   case FC_LCSUBSTR:
+      res = batch_lcsubstr(b, len2, lens_v);
+      break;
+   default:
+      res = batch_lcsubseq(b, len2, lens_v);
+      break;
+   }
+
+   int16_t out[FC_BATCH_SIZE];
+   memcpy(out, &res, sizeof out);
+   for (int32_t k = 0; k < nr; k++)
+      ret[k] = out[k];
+}
@@ -145,6 +145,10 @@ struct fc_memo {
    char32_t *seq2;         /* Previous sequence seen. */
    int32_t len2;           /* Length of this sequence. */
    int32_t max_dist;       /* Maximum allowed distance (for Levenshtein). */
+   uint64_t sig;           /* Characters of the reference sequence, modulo 64. */
+   /* Work done so far, which callers can read and reset as they see fit. */
+   uint64_t cells;         /* Matrix cells computed. */
+   uint64_t hits;          /* Comparisons that reused part of the matrix. */
 };
 
 /* Initializer.
@@ -186,4 +190,57 @@ int32_t fc_memo_damerau(struct fc_memo *, const char32_t *, int32_t);
 int32_t fc_memo_lcsubstr(struct fc_memo *, const char32_t *, int32_t);
 int32_t fc_memo_lcsubseq(struct fc_memo *, const char32_t *, int32_t);
 
+
+/*******************************************************************************
+ * Batched string metrics.
+ ******************************************************************************/
+
+/* Number of sequences compared at once. */
+#define FC_BATCH_SIZE 8
+
+/* Compares a reference sequence to several other sequences at once.
+ * Each sequence gets its own lane in vectors of 16-bit cells, and the matrices
+ * of all sequences are filled in together, one column at a time. This works
+ * best when the sequences of a batch have similar lengths, since all of them
+ * are processed up to the length of the longest one. Contrary to the memoized
+ * functions, nothing is reused from one call to the next.
+ */
+struct fc_batch {
+   enum fc_metric metric;
+   int32_t max_len;     /* Maximum possible length of a sequence. */
+   int32_t max_dist;    /* Maximum allowed distance (for Levenshtein). */
+   int32_t len1;        /* Length of the reference sequence. */
+   void *ids1;          /* Reference sequence, as character identifiers. */
+   void *ids2;          /* Compared sequences, as character identifiers. */
+   void *columns;       /* Last three columns of the matrices. */
+   char32_t *chars;     /* Characters > 0xff of the reference sequence. */
+   int32_t nchars;      /* Number of such characters. */
+};
+
+/* Initializer.
+ * metric: the metric to use.
+ * max_len: the maximum possible length of a sequence (or higher).
+ * max_dist: the maximum allowed edit distance (the lower, the faster). This
+ * parameter is only used if the chosen metric is Levenshtein or Damerau.
+ */
+void fc_batch_init(struct fc_batch *, enum fc_metric metric, int32_t max_len,
+                   int32_t max_dist);
+
+/* Destructor. */
+void fc_batch_fini(struct fc_batch *);
+
+/* Sets the reference sequence.
+ * Contrary to fc_memo_set_ref(), the sequence is not referenced afterwards.
+ */
+void fc_batch_set_ref(struct fc_batch *, const char32_t *seq1, int32_t len1);
+
+/* Compares the reference sequence to "nr" sequences, "nr" being at most
+ * FC_BATCH_SIZE, and writes the results to "ret". These are the values the
+ * memoized functions would return, except for Levenshtein and Damerau
+ * distances larger than the maximum allowed one, which are only guaranteed to
+ * be larger than it.
+ */
+void fc_batch_compute(struct fc_batch *, const char32_t *const seqs[],
+                      const int32_t lens[], int32_t nr, int32_t ret[]);
+
 #endif
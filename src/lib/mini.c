@@ -60,6 +60,7 @@ const char *mn_strerror(int err)
       [MN_EFREEZED] = "attempt to add a word to a freezed automaton",
       [MN_E2BIG] = "automaton has grown too large",
       [MN_EIO] = "IO error",
+      [MN_ENOMEM] = "out of memory",
    };
 
    if (err >= 0 && (size_t)err < sizeof tbl / sizeof *tbl)
@@ -156,6 +157,15 @@ static uint32_t hash_state(const struct mini_state *const state)
    return (hash * 324027) >> 13;
 }
 
+/* Appends a state to the automaton, unless an identical one already exists.
+ * States are appended as soon as they are minimized, that is, the states of
+ * the suffix of a word that is not shared with the next one are appended
+ * together, deepest first. Iterating over the automaton thus mostly walks
+ * back through contiguous transitions, and jumps elsewhere only to reach
+ * shared suffixes, wherever they were first appended. Laying states out
+ * depth-first instead doesn't enter fewer cache lines per word, so we don't
+ * reorder them.
+ */
 static uint32_t mkstate(struct mini_enc *enc, struct mini_state *state)
 {
    if (!state->nr)
@@ -335,12 +345,222 @@ int mn_enc_dump_file(struct mini_enc *enc, FILE *fp)
  * Decoder
  ******************************************************************************/
 
+/* Word counts of numbered automata are only kept for transitions that are not
+ * the last of their state. The count of a last transition can always be
+ * deduced from that of the transition that leads to its state and from those
+ * of its siblings, and lookups never need it anyway.
+ * The remaining counts are bit-packed by blocks of 64 transitions, each block
+ * using as many bits as its largest count needs.
+ * Since the encoder lays out states bottom-up, large counts are clustered at
+ * the end of the automaton, and most blocks only need a few bits per count.
+ * The directory below locates the count of a transition within its block.
+ */
+struct mn_rank {
+   uint64_t bits;             /* Non-last transitions in this block. */
+   uint32_t offset;           /* Offset of their counts, in bits. */
+   uint32_t width;            /* Number of bits per count. */
+};
+
 struct mini {
-   const uint32_t *counts;
+   const uint64_t *counts;    /* Word counts, if numbered. */
+   const struct mn_rank *ranks;  /* Counts directory. */
    uint32_t nr;               /* Number of transitions. */
+   uint32_t size;             /* Number of words, if numbered. */
+   enum mn_type type;
    uint32_t transitions[];
 };
 
+/* Decoded transition.
+ * Position 0 designates a virtual transition that leads to the start state and
+ * whose count is the total number of words in the automaton, so that all
+ * lookups can begin from there.
+ */
+struct mn_arc {
+   uint32_t dest;       /* Destination state. */
+   uint32_t next;       /* Position of the next transition. */
+   uint32_t count;      /* Number of words reachable, if numbered and not
+                         * last, 0 otherwise. */
+   uint8_t chr;
+   bool last;
+   bool terminal;
+};
+
+static inline unsigned popcount(uint64_t bits)
+{
+   bits -= (bits >> 1) & UINT64_C(0x5555555555555555);
+   bits = (bits & UINT64_C(0x3333333333333333))
+        + ((bits >> 2) & UINT64_C(0x3333333333333333));
+   bits = (bits + (bits >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+   return (bits * UINT64_C(0x0101010101010101)) >> 56;
+}
+
+/* Returns the word count of a transition that is not the last of its state. */
+static inline uint32_t get_count(const struct mini *fsa, uint32_t pos)
+{
+   const struct mn_rank *rank = &fsa->ranks[pos / 64];
+   const uint64_t before = rank->bits & ((UINT64_C(1) << pos % 64) - 1);
+   const uint32_t bit = rank->offset + popcount(before) * rank->width;
+
+   uint64_t val = fsa->counts[bit / 64] >> bit % 64;
+   if (bit % 64 + rank->width > 64)
+      val |= fsa->counts[bit / 64 + 1] << (64 - bit % 64);
+   return val & ((UINT64_C(1) << rank->width) - 1);
+}
+
+static inline void get_arc(const struct mini *fsa, uint32_t pos,
+                           struct mn_arc *arc)
+{
+   const uint32_t trans = fsa->transitions[pos];
+   arc->dest = GET_DEST(trans);
+   arc->next = pos + 1;
+   if (!pos)
+      arc->count = fsa->size;
+   else if (fsa->counts && !IS_LAST(trans))
+      arc->count = get_count(fsa, pos);
+   else
+      arc->count = 0;
+   arc->chr = GET_CHAR(trans);
+   arc->last = IS_LAST(trans);
+   arc->terminal = IS_TERMINAL(trans);
+}
+
+/* Same as get_arc(), but leaves the word count alone, which is costly to
+ * decode. "pos" must not be 0.
+ */
+static inline void get_arc_nocount(const struct mini *fsa, uint32_t pos,
+                                   struct mn_arc *arc)
+{
+   const uint32_t trans = fsa->transitions[pos];
+   arc->dest = GET_DEST(trans);
+   arc->next = pos + 1;
+   arc->chr = GET_CHAR(trans);
+   arc->last = IS_LAST(trans);
+   arc->terminal = IS_TERMINAL(trans);
+}
+
+/* Looks for the transition labelled "chr" among those of the state starting
+ * at "pos". If "index" is not NULL, adds to it the word counts of the
+ * transitions skipped on the way. Returns 0 if there is no such transition,
+ * otherwise decodes it and returns its position.
+ */
+static inline uint32_t find_arc(const struct mini *fsa, uint32_t pos,
+                                uint8_t chr, struct mn_arc *arc,
+                                uint32_t *index)
+{
+   const uint32_t *transitions = fsa->transitions;
+   while (GET_CHAR(transitions[pos]) != chr) {
+      if (IS_LAST(transitions[pos]))
+         return 0;
+      if (index)
+         *index += get_count(fsa, pos);
+      pos++;
+   }
+   get_arc(fsa, pos, arc);
+   return pos;
+}
+
+/* Looks for the transition through which the index-th word reachable from the
+ * state starting at "pos" goes, subtracting from "index" the word counts of
+ * the transitions skipped on the way. Decodes it and returns its position.
+ * The automaton must be numbered, and the index valid, so that we can stop at
+ * the last transition without looking at its count.
+ */
+static inline uint32_t find_nth_arc(const struct mini *fsa, uint32_t pos,
+                                    uint32_t *index, struct mn_arc *arc)
+{
+   uint32_t count;
+
+   while (!IS_LAST(fsa->transitions[pos])
+          && *index > (count = get_count(fsa, pos))) {
+      *index -= count;
+      pos++;
+   }
+   get_arc(fsa, pos, arc);
+   return pos;
+}
+
+/* Appends a count to the bit-packed counts array. */
+static void put_count(uint64_t *counts, uint32_t *bit, uint32_t count,
+                      uint32_t width)
+{
+   counts[*bit / 64] |= (uint64_t)count << *bit % 64;
+   if (*bit % 64 + width > 64)
+      counts[*bit / 64 + 1] |= (uint64_t)count >> (64 - *bit % 64);
+   *bit += width;
+}
+
+/* Reads the word counts of a numbered automaton, keeping only those that are
+ * needed, bit-packed (see struct mn_rank). Counts are read by chunks, so that
+ * we never need to hold the full array in memory.
+ */
+static int mn_load_counts(struct mini **fsap,
+                          int (*read)(void *arg, void *buf, size_t size),
+                          void *arg)
+{
+   const uint32_t nr = (*fsap)->nr;
+
+   uint32_t nr_counts = 0;
+   for (uint32_t pos = 1; pos < nr; pos++)
+      nr_counts += !IS_LAST((*fsap)->transitions[pos]);
+
+   /* Allocate for the worst case, then shrink the allocation when done. The
+    * counts array is padded with a word at the end, see get_count().
+    */
+   const size_t align = _Alignof(struct mn_rank);
+   const size_t nr_ranks = (nr + 63) / 64;
+   size_t ranks_off = offsetof(struct mini, transitions) + sizeof(uint32_t[nr]);
+   ranks_off = (ranks_off + align - 1) / align * align;
+   const size_t counts_off = ranks_off + sizeof(struct mn_rank[nr_ranks]);
+   const size_t max_words = ((size_t)nr_counts * 32 + 63) / 64 + 1;
+
+   struct mini *fsa = realloc(*fsap, counts_off + sizeof(uint64_t[max_words]));
+   if (!fsa)
+      return MN_ENOMEM;
+   *fsap = fsa;
+   struct mn_rank *ranks = (struct mn_rank *)((char *)fsa + ranks_off);
+   uint64_t *counts = (uint64_t *)((char *)fsa + counts_off);
+   memset(counts, 0, sizeof(uint64_t[max_words]));
+
+   uint32_t buf[1024], chunk, bit = 0;
+   for (uint32_t pos = 0; pos < nr; pos += chunk) {
+      chunk = nr - pos < 1024 ? nr - pos : 1024;
+      if (read(arg, buf, sizeof(uint32_t[chunk])))
+         return MN_EIO;
+      for (uint32_t i = 0; i < chunk; i++)
+         buf[i] = ntohl(buf[i]);
+      if (pos == 0)
+         fsa->size = buf[0];
+
+      /* Chunks hold a whole number of blocks. */
+      for (uint32_t blk = 0; blk < chunk; blk += 64) {
+         struct mn_rank *rank = &ranks[(pos + blk) / 64];
+         *rank = (struct mn_rank){.offset = bit};
+         uint32_t end = chunk - blk < 64 ? chunk : blk + 64;
+         for (uint32_t i = blk; i < end; i++) {
+            uint32_t cur = pos + i;
+            if (cur == 0 || IS_LAST(fsa->transitions[cur]))
+               continue;
+            rank->bits |= UINT64_C(1) << cur % 64;
+            while (buf[i] >> rank->width)
+               rank->width++;
+         }
+         for (uint32_t i = blk; i < end; i++) {
+            if (rank->bits >> (pos + i) % 64 & 1)
+               put_count(counts, &bit, buf[i], rank->width);
+         }
+      }
+   }
+
+   const size_t nr_words = (bit + 63) / 64 + 1;
+   fsa = realloc(fsa, counts_off + sizeof(uint64_t[nr_words]));
+   if (fsa)
+      *fsap = fsa;
+   fsa = *fsap;
+   fsa->ranks = (const struct mn_rank *)((char *)fsa + ranks_off);
+   fsa->counts = (const uint64_t *)((char *)fsa + counts_off);
+   return MN_OK;
+}
+
 int mn_load(struct mini **fsap,
             int (*read)(void *arg, void *buf, size_t size),
             void *arg)
@@ -363,26 +583,33 @@ int mn_load(struct mini **fsap,
       return MN_ECORRUPT;
 
    int type = header[2] & 0xff;
-   size_t to_read;
-   if (type == MN_STANDARD)
-      to_read = sizeof(uint32_t[nr]);
-   else if (type == MN_NUMBERED)
-      to_read = sizeof(uint32_t[2][nr]);
-   else
+   if (type != MN_STANDARD && type != MN_NUMBERED)
       return MN_ECORRUPT;
 
-   struct mini *fsa = malloc(offsetof(struct mini, transitions) + to_read);
-   if (read(arg, fsa->transitions, to_read)) {
+   struct mini *fsa = malloc(offsetof(struct mini, transitions)
+                             + sizeof(uint32_t[nr]));
+   if (!fsa)
+      return MN_ENOMEM;
+   if (read(arg, fsa->transitions, sizeof(uint32_t[nr]))) {
       free(fsa);
       return MN_EIO;
    }
-
-   to_read /= sizeof *fsa->transitions;
-   for (size_t i = 0; i < to_read; i++)
+   for (uint32_t i = 0; i < nr; i++)
       fsa->transitions[i] = ntohl(fsa->transitions[i]);
 
-   fsa->counts = (type == MN_NUMBERED) ? &fsa->transitions[nr] : NULL;
+   fsa->counts = NULL;
+   fsa->ranks = NULL;
    fsa->nr = nr;
+   fsa->size = 0;
+   fsa->type = type;
+
+   if (type == MN_NUMBERED) {
+      int ret = mn_load_counts(&fsa, read, arg);
+      if (ret) {
+         free(fsa);
+         return ret;
+      }
+   }
    *fsap = fsa;
    return MN_OK;
 }
@@ -405,7 +632,7 @@ int mn_load_file(struct mini **fsa, FILE *fp)
 
 enum mn_type mn_type(const struct mini *fsa)
 {
-   return fsa->counts ? MN_NUMBERED : MN_STANDARD;
+   return fsa->type;
 }
 
 void mn_free(struct mini *fsa)
@@ -415,94 +642,80 @@ void mn_free(struct mini *fsa)
 
 int mn_contains(const struct mini *fsa, const void *word, size_t len)
 {
-   const uint32_t *transitions = fsa->transitions;
-   uint32_t pos = 0;
+   struct mn_arc arc;
 
+   get_arc(fsa, 0, &arc);
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(transitions[pos]);
-      if (!pos)
+      if (!arc.dest
+          || !find_arc(fsa, arc.dest, ((const uint8_t *)word)[i], &arc, NULL))
          return 0;
-      while (GET_CHAR(transitions[pos]) != ((const uint8_t *)word)[i]) {
-         if (IS_LAST(transitions[pos++]))
-            return 0;
-      }
    }
-   return IS_TERMINAL(transitions[pos]);
+   return arc.terminal;
 }
 
-static uint32_t count_words(const uint32_t *transitions, uint32_t pos)
+static uint32_t count_words(const struct mini *fsa, uint32_t pos)
 {
    uint32_t count = 0;
+   struct mn_arc arc;
 
    if (!pos)
       return 0;
    do {
-      if (IS_TERMINAL(transitions[pos]))
+      get_arc(fsa, pos, &arc);
+      if (arc.terminal)
          count++;
-      count += count_words(transitions, GET_DEST(transitions[pos]));
-   } while (!IS_LAST(transitions[pos++]));
+      count += count_words(fsa, arc.dest);
+      pos = arc.next;
+   } while (!arc.last);
 
    return count;
 }
 
 uint32_t mn_size(const struct mini *fsa)
 {
-   if (fsa->counts)
-      return fsa->counts[0];
-   return count_words(fsa->transitions, GET_DEST(fsa->transitions[0]));
+   struct mn_arc root;
+
+   get_arc(fsa, 0, &root);
+   if (fsa->type == MN_NUMBERED)
+      return root.count;
+   return count_words(fsa, root.dest);
 }
 
 uint32_t mn_locate(const struct mini *fsa, const void *word, size_t len)
 {
-   const uint32_t *transitions = fsa->transitions;
-   const uint32_t *counts = fsa->counts;
-   uint32_t pos = 0;
+   struct mn_arc arc;
    uint32_t index = 0;
 
-   if (!counts)
+   if (fsa->type != MN_NUMBERED)
       return 0;
 
+   get_arc(fsa, 0, &arc);
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(transitions[pos]);
-      if (!pos)
+      if (!arc.dest
+          || !find_arc(fsa, arc.dest, ((const uint8_t *)word)[i], &arc, &index))
          return 0;
-      while (GET_CHAR(transitions[pos]) != ((const uint8_t *)word)[i]) {
-         if (IS_LAST(transitions[pos]))
-            return 0;
-         index += counts[pos++];
-      }
-      if (IS_TERMINAL(transitions[pos]))
+      if (arc.terminal)
          index++;
    }
-   return IS_TERMINAL(transitions[pos]) ? index : 0;
+   return arc.terminal ? index : 0;
 }
 
 size_t mn_extract(const struct mini *fsa, uint32_t index, void *buf)
 {
-   const uint32_t *transitions = fsa->transitions;
-   const uint32_t *counts = fsa->counts;
-   uint32_t pos = 0;
+   struct mn_arc arc;
    size_t len = 0;
 
-   if (!index || !counts || counts[0] < index) {
+   get_arc(fsa, 0, &arc);
+   if (!index || fsa->type != MN_NUMBERED || arc.count < index) {
       ((uint8_t *)buf)[0] = '\0';
       return 0;
    }
 
    do {
-      pos = GET_DEST(transitions[pos]);
-      for (;;) {
-         uint32_t cnt = counts[pos];
-         if (index > cnt) {
-            index -= cnt;
-         } else {
-            ((uint8_t *)buf)[len++] = GET_CHAR(transitions[pos]);
-            if (IS_TERMINAL(transitions[pos]))
-               index--;
-            break;
-         }
-         pos++;
-      }
+      find_nth_arc(fsa, arc.dest, &index, &arc);
+      ((uint8_t *)buf)[len++] = arc.chr;
+      if (arc.terminal)
+         index--;
    } while (index);
 
    ((uint8_t *)buf)[len] = '\0';
@@ -523,6 +736,26 @@ static uint32_t init_none(struct mini_iter *it)
    return 0;
 }
 
+/* Moves the iterator to the first word that follows the current prefix.
+ * Returns 0 if there is no such word.
+ */
+static int skip_to_next_word(struct mini_iter *it)
+{
+   struct mn_arc arc;
+
+   if (it->depth == 0)
+      return init_none(it);
+   for (;;) {
+      get_arc(it->fsa, it->positions[--it->depth], &arc);
+      if (!arc.last)
+         break;
+      if (it->depth == 0)
+         return init_none(it);
+   }
+   it->positions[it->depth] = arc.next;
+   return 1;
+}
+
 uint32_t mn_iter_inits_standard(struct mini_iter *it, const struct mini *fsa,
                                 const uint8_t *word, size_t len)
 {
@@ -532,34 +765,28 @@ uint32_t mn_iter_inits_standard(struct mini_iter *it, const struct mini *fsa,
    it->fsa = fsa;
    it->depth = it->root = 0;
 
-   uint32_t pos = 0;
+   struct mn_arc arc;
+   get_arc(fsa, 0, &arc);
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(fsa->transitions[pos]);
+      uint32_t pos = arc.dest;
       if (!pos)
-         goto find_next_word;
-      int c;
-      while ((c = GET_CHAR(fsa->transitions[pos])) < word[i]) {
-         if (IS_LAST(fsa->transitions[pos++]))
-            goto find_next_word;
+         return skip_to_next_word(it);
+      for (;;) {
+         get_arc(fsa, pos, &arc);
+         if (arc.chr >= word[i])
+            break;
+         if (arc.last)
+            return skip_to_next_word(it);
+         pos = arc.next;
       }
       it->positions[it->depth] = pos;
       it->word[it->depth++] = word[i];
-      if (c > word[i])
+      if (arc.chr > word[i])
          break;
    }
 
    it->depth--;
    return 1;
-
-find_next_word:
-   if (it->depth == 0)
-      return init_none(it);
-   while (IS_LAST(fsa->transitions[it->positions[--it->depth]])) {
-      if (it->depth == 0)
-         return init_none(it);
-   }
-   it->positions[it->depth]++;
-   return 1;
 }
 
 uint32_t mn_iter_inits_numbered(struct mini_iter *it, const struct mini *fsa,
@@ -571,108 +798,86 @@ uint32_t mn_iter_inits_numbered(struct mini_iter *it, const struct mini *fsa,
    it->fsa = fsa;
    it->depth = it->root = 0;
 
-   uint32_t pos = 0, index = 0;
+   /* "end" is the number of words up to the end of the current state, which
+    * gives the count of its last transition.
+    */
+   struct mn_arc arc;
+   uint32_t index = 0, end = fsa->size;
+   get_arc(fsa, 0, &arc);
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(fsa->transitions[pos]);
+      uint32_t pos = arc.dest;
       if (!pos)
          goto find_next_word;
-      int c;
-      while ((c = GET_CHAR(fsa->transitions[pos])) < word[i]) {
-         index += fsa->counts[pos];
-         if (IS_LAST(fsa->transitions[pos++]))
+      for (;;) {
+         get_arc(fsa, pos, &arc);
+         if (arc.chr >= word[i])
+            break;
+         if (arc.last) {
+            index = end;
             goto find_next_word;
+         }
+         index += arc.count;
+         pos = arc.next;
       }
-      if (IS_TERMINAL(fsa->transitions[pos]))
+      if (!arc.last)
+         end = index + arc.count;
+      if (arc.terminal)
          index++;
       it->positions[it->depth] = pos;
       it->word[it->depth++] = word[i];
-      if (c > word[i])
+      if (arc.chr > word[i])
          break;
    }
 
-   if (!IS_TERMINAL(fsa->transitions[pos]))
+   if (!arc.terminal)
       index++;
    it->depth--;
    return index;
 
 find_next_word:
-   if (it->depth == 0)
-      return init_none(it);
-   index++;
-   while (IS_LAST(fsa->transitions[it->positions[--it->depth]])) {
-      if (it->depth == 0)
-         return init_none(it);
-   }
-   it->positions[it->depth]++;
-   return index;
+   return skip_to_next_word(it) ? index + 1 : 0;
 }
 
 uint32_t mn_iter_inits(struct mini_iter *it, const struct mini *fsa,
                        const void *str, size_t len)
 {
-   return fsa->counts ?
+   return fsa->type == MN_NUMBERED ?
       mn_iter_inits_numbered(it, fsa, str, len) :
       mn_iter_inits_standard(it, fsa, str, len);
 }
 
-static uint32_t mn_iter_initp_standard(struct mini_iter *it,
-                                       const struct mini *fsa,
-                                       const uint8_t *prefix, size_t len)
+uint32_t mn_iter_initp(struct mini_iter *it, const struct mini *fsa,
+                       const void *str, size_t len)
 {
-   if (len == 0)
-      return mn_iter_init(it, fsa);
-
-   it->fsa = fsa;
-   it->depth = 0;
+   const uint8_t *prefix = str;
 
-   uint32_t pos = 0;
-   for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(fsa->transitions[pos]);
-      if (!pos)
-         return init_none(it);
-      while (GET_CHAR(fsa->transitions[pos]) != prefix[i]) {
-         if (IS_LAST(fsa->transitions[pos++]))
-            return init_none(it);
-      }
-      it->positions[it->depth] = pos;
-      it->word[it->depth++] = prefix[i];
-   }
-
-   it->root = it->depth--;
-   return 1;
-}
-
-static uint32_t mn_iter_initp_numbered(struct mini_iter *it,
-                                       const struct mini *fsa,
-                                       const uint8_t *prefix, size_t len)
-{
    if (len == 0)
       return mn_iter_init(it, fsa);
 
    it->fsa = fsa;
    it->depth = 0;
 
-   uint32_t pos = 0, index = 0;
+   struct mn_arc arc;
+   uint32_t index = 0;
+   get_arc(fsa, 0, &arc);
    for (size_t i = 0; i < len; i++) {
-      pos = GET_DEST(fsa->transitions[pos]);
+      uint32_t pos = 0;
+      if (arc.dest)
+         pos = find_arc(fsa, arc.dest, prefix[i], &arc,
+                        fsa->type == MN_NUMBERED ? &index : NULL);
       if (!pos)
          return init_none(it);
-      while (GET_CHAR(fsa->transitions[pos]) != prefix[i]) {
-         if (IS_LAST(fsa->transitions[pos]))
-            return init_none(it);
-         index += fsa->counts[pos++];
-      }
-      if (IS_TERMINAL(fsa->transitions[pos]))
+      if (arc.terminal)
          index++;
       it->positions[it->depth] = pos;
       it->word[it->depth++] = prefix[i];
-   };
+   }
 
-   if (!IS_TERMINAL(fsa->transitions[pos]))
+   if (!arc.terminal)
        index++;
 
    it->root = it->depth--;
-   return index;
+   return fsa->type == MN_NUMBERED ? index : 1;
 }
 
 uint32_t mn_iter_init(struct mini_iter *it, const struct mini *fsa)
@@ -680,53 +885,46 @@ uint32_t mn_iter_init(struct mini_iter *it, const struct mini *fsa)
    it->fsa = fsa;
    it->depth = it->root = 0;
 
-   uint32_t pos = GET_DEST(fsa->transitions[0]);
-   if (!pos)
+   struct mn_arc root;
+   get_arc(fsa, 0, &root);
+   if (!root.dest)
       return init_none(it);
-   it->positions[0] = pos;
+   it->positions[0] = root.dest;
    it->root = 0;
    return 1;
 }
 
-uint32_t mn_iter_initp(struct mini_iter *it, const struct mini *fsa,
-                       const void *prefix, size_t len)
-{
-   return fsa->counts ?
-      mn_iter_initp_numbered(it, fsa, prefix, len) :
-      mn_iter_initp_standard(it, fsa, prefix, len);
-}
-
 uint32_t mn_iter_initn(struct mini_iter *it, const struct mini *fsa,
                        uint32_t index)
 {
    it->fsa = fsa;
    it->root = it->depth = 0;
 
-   if (!fsa->counts || index == 0 || index > fsa->counts[0])
+   struct mn_arc arc;
+   get_arc(fsa, 0, &arc);
+   if (fsa->type != MN_NUMBERED || index == 0 || index > arc.count)
       return init_none(it);
 
-   uint32_t pos = 0, index_copy = index;
+   uint32_t index_copy = index;
    do {
-      pos = GET_DEST(fsa->transitions[pos]);
-      for (;;) {
-         uint32_t cnt = fsa->counts[pos];
-         if (index > cnt) {
-            index -= cnt;
-         } else {
-            it->word[it->depth] = GET_CHAR(fsa->transitions[pos]);
-            if (IS_TERMINAL(fsa->transitions[pos]))
-               index--;
-            it->positions[it->depth++] = pos;
-            break;
-         }
-         pos++;
-      }
+      it->positions[it->depth] = find_nth_arc(fsa, arc.dest, &index, &arc);
+      it->word[it->depth++] = arc.chr;
+      if (arc.terminal)
+         index--;
    } while (index);
 
    it->depth--;
    return index_copy;
 }
 
+static const char *mn_iter_fini(struct mini_iter *it, size_t *len)
+{
+   init_none(it);
+   if (len)
+      *len = 0;
+   return NULL;
+}
+
 const char *mn_iter_next(struct mini_iter *it, size_t *len)
 {
    const uint32_t *transitions = it->fsa->transitions;
@@ -737,17 +935,13 @@ const char *mn_iter_next(struct mini_iter *it, size_t *len)
    if (!positions[depth]) {
       while (IS_LAST(transitions[positions[--depth]]))
          if (depth <= it->root)
-            goto fini;
-      if (depth < it->root) {
-      fini:
-         init_none(it);
-         if (len)
-            *len = 0;
-         return NULL;
-      }
+            return mn_iter_fini(it, len);
+      if (depth < it->root)
+         return mn_iter_fini(it, len);
       positions[depth]++;
    }
 
+   it->shared = depth;
    uint32_t transition;
    do {
       transition = transitions[positions[depth]];
@@ -761,6 +955,51 @@ const char *mn_iter_next(struct mini_iter *it, size_t *len)
    return word;
 }
 
+const char *mn_iter_next_filter(struct mini_iter *it, size_t *len,
+                                int (*accept)(void *arg, size_t depth,
+                                              uint8_t chr),
+                                void *arg)
+{
+   const struct mini *fsa = it->fsa;
+   uint32_t *positions = it->positions;
+   size_t depth = it->depth;
+   char *word = it->word;
+   struct mn_arc arc;
+   size_t shared = depth;
+
+   /* If the current word is a leaf, move to the next transition. */
+   if (!positions[depth]) {
+      get_arc(fsa, positions[--depth], &arc);
+      goto next;
+   }
+
+   for (;;) {
+      if (depth < shared)
+         shared = depth;
+      get_arc_nocount(fsa, positions[depth], &arc);
+      if (accept(arg, depth, arc.chr)) {
+         word[depth] = arc.chr;
+         positions[++depth] = arc.dest;
+         if (arc.terminal)
+            break;
+         continue;
+      }
+   next:
+      while (arc.last || depth < it->root) {
+         if (depth <= it->root)
+            return mn_iter_fini(it, len);
+         get_arc_nocount(fsa, positions[--depth], &arc);
+      }
+      positions[depth] = arc.next;
+   }
+
+   it->shared = shared;
+   word[it->depth = depth] = '\0';
+   if (len)
+      *len = depth;
+   return word;
+}
+
 
 /*******************************************************************************
  * Debugging
@@ -782,14 +1021,10 @@ static void mn_dump_txt(const struct mini *fsa, FILE *fp)
 static void mn_dump_tsv(const struct mini *fsa, FILE *fp)
 {
    fputs("char\tterminal\tlast\tdest\tcount\n", fp);
-   for (uint32_t pos = 0; pos < fsa->nr; pos++) {
-      uint32_t trans = fsa->transitions[pos];
-      uint8_t ch = GET_CHAR(trans);
-      bool is_terminal = IS_TERMINAL(trans);
-      bool is_last = IS_LAST(trans);
-      uint32_t dest = GET_DEST(trans);
-      uint32_t count = fsa->counts ? fsa->counts[pos] : 0;
-      fprintf(fp, "0x%x\t%d\t%d\t%"PRIu32"\t%"PRIu32"\n", ch, is_terminal, is_last, dest, count);
+   struct mn_arc arc;
+   for (uint32_t pos = 0; pos < fsa->nr; pos = arc.next) {
+      get_arc(fsa, pos, &arc);
+      fprintf(fp, "0x%x\t%d\t%d\t%"PRIu32"\t%"PRIu32"\n", arc.chr, arc.terminal, arc.last, arc.dest, arc.count);
    }
 }
 
@@ -801,21 +1036,22 @@ static void mn_dump_dot(const struct mini *fsa, FILE *fp)
    uint32_t i = 1;
    while (i < fsa->nr) {
       uint32_t j = i;
+      struct mn_arc arc;
       do {
-         uint32_t dest = GET_DEST(fsa->transitions[j]);
-         unsigned char trans_char = GET_CHAR(fsa->transitions[j]);
+         get_arc(fsa, j, &arc);
          char label[32];
-         if (isprint(trans_char) && trans_char != '"')
-            snprintf(label, sizeof label, "%c", trans_char);
+         if (isprint(arc.chr) && arc.chr != '"')
+            snprintf(label, sizeof label, "%c", arc.chr);
          else
-            snprintf(label, sizeof label, "0x%02x", trans_char);
-         if (fsa->counts)
+            snprintf(label, sizeof label, "0x%02x", arc.chr);
+         if (fsa->type == MN_NUMBERED)
             snprintf(label + strlen(label), sizeof label - strlen(label),
-                     " (%"PRIu32")", fsa->counts[j]);
-         fprintf(fp, "%"PRIu32" -> %"PRIu32" [label=\"%s\"]\n", i, dest, label);
-         if (IS_TERMINAL(fsa->transitions[j]))
-            fprintf(fp, "%"PRIu32" [style=filled];\n", dest);
-      } while (!IS_LAST(fsa->transitions[j++]));
+                     " (%"PRIu32")", arc.count);
+         fprintf(fp, "%"PRIu32" -> %"PRIu32" [label=\"%s\"]\n", i, arc.dest, label);
+         if (arc.terminal)
+            fprintf(fp, "%"PRIu32" [style=filled];\n", arc.dest);
+         j = arc.next;
+      } while (!arc.last);
       i = j;
    }
 
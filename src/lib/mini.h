@@ -24,6 +24,7 @@ enum {
    MN_EFREEZED,   /* Attempt to add a word to a freezed automaton. */
    MN_E2BIG,      /* Automaton has grown too large. */
    MN_EIO,        /* IO error. */
+   MN_ENOMEM,     /* Out of memory. */
 };
 
 /* Returns a string describing an error code. */
@@ -44,7 +45,9 @@ struct mini_enc;
  * If MN_NUMBERED is chosen as the automaton type, a numbered automaton is
  * created instead of a classical one. This makes possible retrieving a word
  * given its ordinal, and retrieving a word ordinal given the word itself. On
- * the other hand, this doubles the automaton size.
+ * the other hand, this doubles the size of the automaton file. Once loaded,
+ * only the word counts that lookups need are kept in memory, bit-packed, which
+ * makes a numbered automaton less than a fifth larger than a standard one.
  */
 struct mini_enc *mn_enc_new(enum mn_type type);
 
@@ -153,6 +156,13 @@ struct mini_iter {
    size_t depth;                              /* Current stack depth. */
    uint32_t positions[MN_MAX_WORD_LEN + 1];   /* Offsets stack. */
    char word[MN_MAX_WORD_LEN + 1];            /* Current word. */
+
+   /* Number of leading bytes of the current word that the last call to
+    * mn_iter_next() or mn_iter_next_filter() left as they were. Consecutive
+    * words often share a long prefix, so this can be used to avoid
+    * processing it again.
+    */
+   size_t shared;
 };
 
 /* Returns an iterator over an automaton, starting at the very first word.
@@ -200,6 +210,21 @@ uint32_t mn_iter_initn(struct mini_iter *, const struct mini *, uint32_t pos);
  */
 const char *mn_iter_next(struct mini_iter *, size_t *len);
 
+/* Same as mn_iter_next(), but skips whole branches of the automaton.
+ * Before following a transition, calls "accept" with its depth, starting at
+ * zero, and its label. If it returns zero, the words that go through this
+ * transition are skipped. Transitions are considered depth-first, in
+ * lexicographic order, so "accept" is called for a transition at depth "d"
+ * only after it has been called last for the transitions that lead to it.
+ * When iteration is resumed after an initialization function positioned the
+ * iterator on a word other than the first one, calls start at the last
+ * transition of this word, at depth "depth".
+ */
+const char *mn_iter_next_filter(struct mini_iter *, size_t *len,
+                                int (*accept)(void *arg, size_t depth,
+                                              uint8_t chr),
+                                void *arg);
+
 
 /*******************************************************************************
  * Debugging.
@@ -209,7 +234,8 @@ const char *mn_iter_next(struct mini_iter *, size_t *len);
 enum mn_dump_format {
    MN_DUMP_TXT,  /* One word per line. */
    MN_DUMP_TSV,  /* TSV file, one line per transition, the first one giving
-                  * the field names. */
+                  * the field names. Word counts are not kept for the last
+                  * transition of each state, so they are reported as 0. */
    MN_DUMP_DOT,  /* DOT file, for visualization with Graphviz. */
 };
 
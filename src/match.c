@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
@@ -9,120 +10,292 @@
 
 static const char glob_chars[] = "*?[]";
 
+/*******************************************************************************
+ * Pagination.
+ ******************************************************************************/
+
+static void set_last_word(struct vb_match_ctx *c, const char *word, size_t len)
+{
+   struct vb_pagination *p = &c->query->pagination;
+
+   memcpy(p->last_word, word, len);
+   p->last_word[len] = '\0';
+   p->last_len = len;
+}
+
+/* Records the first word of the next results page. */
+static void suspend(struct vb_match_ctx *c, uint32_t pos,
+                    const char *word, size_t len)
+{
+   c->query->pagination.last_pos = pos;
+   set_last_word(c, word, len);
+}
+
+/* Reports a word of the current results page, along with its rank, if the
+ * search is ranked. Only fuzzy and top prefix searches rank words by weight
+ * or score, the others by position only.
+ */
+static void report_ranked(struct vb_match_ctx *c, const char *word, size_t len,
+                          uint32_t pos, int32_t weight, int32_t score,
+                          int32_t last_weight)
+{
+   if (c->rank) {
+      c->rank->slot++;
+      c->rank->weight = weight;
+      c->rank->score = score;
+      c->rank->word = word;
+      c->rank->len = len;
+      c->rank->pos = pos;
+      c->rank->last_weight = last_weight;
+      c->rank->after = true;
+   }
+   c->handler(c->arg, word, len);
+}
+
+/* Same as above, for searches that rank words by position. */
+static void report(struct vb_match_ctx *c, const char *word, size_t len,
+                   uint32_t pos)
+{
+   if (c->rank) {
+      c->rank->slot++;
+      c->rank->weight = 0;
+      c->rank->score = 0;
+      c->rank->word = word;
+      c->rank->len = len;
+      c->rank->pos = pos;
+      c->rank->last_weight = 0;
+      c->rank->after = false;
+   }
+   c->handler(c->arg, word, len);
+}
+
+/* Checks, before looking at a word, whether the limits of the query are
+ * reached. The first word is always looked at, so that searches progress. The
+ * clock and the cancellation flag are only checked every 64 words.
+ */
+static bool interrupted(struct vb_match_ctx *c)
+{
+   const struct vb_limits *l = c->limits;
+   if (!l)
+      return false;
+
+   const uint64_t words = c->words++;
+   if (!words)
+      return false;
+   if ((l->max_words && words >= l->max_words)
+       || (l->max_cells && c->cells >= l->max_cells))
+      return true;
+   if (words % 64)
+      return false;
+   return (l->cancel && *l->cancel)
+          || (l->max_ns && vb_now_ns() >= c->deadline);
+}
+
+/* Initializes an iterator at the first word of the current results page. */
+static uint32_t resume(struct vb_iter *it, const struct vb_lexicon *lex,
+                       const struct vb_match_ctx *c)
+{
+   const struct vb_pagination *p = &c->query->pagination;
+
+   if (c->numbered)
+      return vb_iter_initn(it, lex, p->last_pos);
+   vb_iter_inits(it, lex, p->last_word, p->last_len);
+   return p->last_pos;
+}
+
+
 /*******************************************************************************
  * Pattern matching.
  ******************************************************************************/
 
-static int match_exact(const struct mini *lex, struct vb_match_ctx *c)
+static int match_exact(const struct vb_lexicon *lex, struct vb_match_ctx *c)
 {
-   if (mn_contains(lex, c->str, c->len))
-      c->handler(c->arg, c->str, c->len);
+   if (vb_lexicon_contains(lex, c->str, c->len))
+      report(c, c->str, c->len, 0);
+   else
+      VB_STAT(c, rejected_pattern, 1);
+   VB_STAT(c, words_visited, 1);
    c->query->pagination.last_page = true;
    return VB_OK;
 }
 
-static int match_prefix(const struct mini *lex, struct vb_match_ctx *c)
+static int match_prefix(const struct vb_lexicon *lex, struct vb_match_ctx *c)
 {
    bool first_page;
-   struct mini_iter it;
+   struct vb_iter it;
    uint32_t pos = c->query->pagination.last_pos;
 
    if (pos) {
       first_page = false;
-      mn_iter_initn(&it, lex, pos);
+      resume(&it, lex, c);
    } else {
       first_page = true;
-      pos = mn_iter_initp(&it, lex, c->str, c->len);
+      pos = vb_iter_initp(&it, lex, c->str, c->len);
    }
 
    const char *term;
    size_t len;
    size_t page_size = c->query->page_size;
-   while ((term = mn_iter_next(&it, &len))) {
+   while ((term = vb_iter_next(&it, &len))) {
       if (!first_page && (len < c->len || memcmp(c->str, term, c->len)))
          break;
+      if (interrupted(c)) {
+         suspend(c, pos, term, len);
+         return VB_EINTR;
+      }
       if (!page_size--) {
-         c->query->pagination.last_pos = pos;
+         suspend(c, pos, term, len);
          return VB_OK;
       } else {
-         c->handler(c->arg, term, len);
+         report(c, term, len, pos);
       }
+      VB_STAT(c, words_visited, 1);
       pos++;
    }
    c->query->pagination.last_page = true;
    return VB_OK;
 }
 
-static int match_substr(const struct mini *lex, struct vb_match_ctx *c)
+/* Substring and suffix matching over the flat copy of a lexicon. */
+static int match_flat(const struct vb_arena *arena, struct vb_match_ctx *c,
+                      const char *str, size_t len)
 {
-   struct mini_iter it;
+   uint32_t pos = c->query->pagination.last_pos;
+   uint32_t idx = pos ? pos - 1 : 0;
+   /* Words from "from" to the one found, excluded, didn't match. */
+   uint32_t from = idx;
+
+   size_t page_size = c->query->page_size;
+   while ((idx = vb_arena_find(arena, idx, str, len)) < arena->size) {
+      const char *term = &arena->words[arena->offsets[idx]];
+      size_t term_len = arena->offsets[idx + 1] - arena->offsets[idx] - 1;
+      VB_STAT(c, words_visited, idx - from);
+      VB_STAT(c, rejected_pattern, idx - from);
+      /* Words are looked for a match at a time, so the words skipped in
+       * between count towards the limits, but can't interrupt the search.
+       */
+      c->words += idx - from;
+      if (interrupted(c)) {
+         suspend(c, idx + 1, term, term_len);
+         return VB_EINTR;
+      }
+      if (!page_size--) {
+         suspend(c, idx + 1, term, term_len);
+         return VB_OK;
+      }
+      report(c, term, term_len, idx + 1);
+      VB_STAT(c, words_visited, 1);
+      from = ++idx;
+   }
+   VB_STAT(c, words_visited, arena->size - from);
+   VB_STAT(c, rejected_pattern, arena->size - from);
+   c->query->pagination.last_page = true;
+   return VB_OK;
+}
+
+static int match_substr(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   const struct vb_arena *arena = vb_lexicon_arena(lex);
+   if (arena)
+      return match_flat(arena, c, c->str, c->len);
+
+   struct vb_iter it;
    uint32_t pos = c->query->pagination.last_pos;
    if (pos) {
-      mn_iter_initn(&it, lex, pos);
+      resume(&it, lex, c);
    } else {
-      pos = mn_iter_init(&it, lex);
+      pos = vb_iter_init(&it, lex);
    }
 
    const char *term;
    size_t len;
    size_t page_size = c->query->page_size;
-   while ((term = mn_iter_next(&it, &len))) {
+   while ((term = vb_iter_next(&it, &len))) {
+      if (interrupted(c)) {
+         suspend(c, pos, term, len);
+         return VB_EINTR;
+      }
       if (len >= c->len && strstr(term, c->str)) {
          if (!page_size--) {
-            c->query->pagination.last_pos = pos;
+            suspend(c, pos, term, len);
             return VB_OK;
          } else {
-            c->handler(c->arg, term, len);
+            report(c, term, len, pos);
          }
+      } else {
+         VB_STAT(c, rejected_pattern, 1);
       }
+      VB_STAT(c, words_visited, 1);
       pos++;
    }
    c->query->pagination.last_page = true;
    return VB_OK;
 }
 
-static int match_suffix(const struct mini *lex, struct vb_match_ctx *c)
+static int match_suffix(const struct vb_lexicon *lex, struct vb_match_ctx *c)
 {
+   const struct vb_arena *arena = vb_lexicon_arena(lex);
+   if (arena) {
+      /* Look for the suffix followed by the nul byte that ends each word. */
+      char str[MN_MAX_WORD_LEN + 1];
+      memcpy(str, c->str, c->len);
+      str[c->len] = '\0';
+      return match_flat(arena, c, str, c->len + 1);
+   }
+
    uint32_t pos = c->query->pagination.last_pos;
-   struct mini_iter it;
+   struct vb_iter it;
    if (pos) {
-      mn_iter_initn(&it, lex, pos);
+      resume(&it, lex, c);
    } else {
-      pos = mn_iter_init(&it, lex);
+      pos = vb_iter_init(&it, lex);
    }
 
    const char *term;
    size_t len;
    size_t page_size = c->query->page_size;
-   while ((term = mn_iter_next(&it, &len))) {
+   while ((term = vb_iter_next(&it, &len))) {
+      if (interrupted(c)) {
+         suspend(c, pos, term, len);
+         return VB_EINTR;
+      }
       if (len >= c->len && !memcmp(c->str, &term[len - c->len], c->len)) {
          if (!page_size--) {
-            c->query->pagination.last_pos = pos;
+            suspend(c, pos, term, len);
             return VB_OK;
          } else {
-            c->handler(c->arg, term, len);
+            report(c, term, len, pos);
          }
+      } else {
+         VB_STAT(c, rejected_pattern, 1);
       }
+      VB_STAT(c, words_visited, 1);
       pos++;
    }
    c->query->pagination.last_page = true;
    return VB_OK;
 }
 
-static int match_glob(const struct mini *lex, struct vb_match_ctx *c)
+static int match_glob(const struct vb_lexicon *lex, struct vb_match_ctx *c)
 {
-   struct mini_iter it;
+   struct vb_iter it;
    uint32_t pos = c->query->pagination.last_pos;
    size_t pfx_len = strcspn(c->str, glob_chars);
    if (pos) {
-      mn_iter_initn(&it, lex, pos);
+      resume(&it, lex, c);
    } else {
-      pos = mn_iter_initp(&it, lex, c->str, pfx_len);
+      pos = vb_iter_initp(&it, lex, c->str, pfx_len);
    }
 
    int ret = VB_OK;
-   char32_t upat[MN_MAX_WORD_LEN + 1];
-   if (vb_utf8_decode(upat, &c->str[pfx_len], c->len - pfx_len) < 0) {
+   struct vb_glob glob;
+   /* The prefix must be valid too, so that it ends where a character of the
+    * matching words does.
+    */
+   char32_t pfx[MN_MAX_WORD_LEN + 1];
+   const int32_t pfx_chars = vb_utf8_decode(pfx, c->str, pfx_len);
+   if (pfx_chars < 0
+       || vb_glob_compile(&glob, &c->str[pfx_len], c->len - pfx_len)) {
       ret = VB_EQUTF8;
       goto fini;
    }
@@ -130,27 +303,271 @@ static int match_glob(const struct mini *lex, struct vb_match_ctx *c)
    const char *term;
    size_t len;
    size_t page_size = c->query->page_size;
-   while ((term = mn_iter_next(&it, &len))) {
+   while ((term = vb_iter_next(&it, &len))) {
       if (pfx_len && (len < pfx_len || memcmp(term, c->str, pfx_len)))
          break;
-      char32_t uterm[MN_MAX_WORD_LEN + 1];
-      if (vb_utf8_decode(uterm, &term[pfx_len], len - pfx_len) < 0) {
+      if (interrupted(c)) {
+         suspend(c, pos, term, len);
+         ret = VB_EINTR;
+         break;
+      }
+      int match = vb_glob_match_iter(&glob, &it, term, len,
+                                     pfx_len, pfx_chars);
+      if (match < 0) {
          ret = VB_ELUTF8;
          goto fini;
       }
-      if (fc_glob(upat, uterm)) {
+      if (match) {
          if (!page_size--) {
-            c->query->pagination.last_pos = pos;
+            suspend(c, pos, term, len);
+            VB_STAT(c, utf8_bytes, it.utf8_bytes);
             return VB_OK;
          } else {
-            c->handler(c->arg, term, len);
+            report(c, term, len, pos);
          }
+      } else if (c->stats) {
+         /* Find out which of the two filters rejected the word. */
+         if (!glob.invalid
+             && !vb_glob_prefilter(&glob, &term[pfx_len], len - pfx_len))
+            c->stats->rejected_prefilter++;
+         else
+            c->stats->rejected_pattern++;
       }
+      VB_STAT(c, words_visited, 1);
       pos++;
    }
 
 fini:
+   VB_STAT(c, utf8_bytes, it.utf8_bytes);
+   if (ret != VB_EINTR)
+      c->query->pagination.last_page = true;
+   return ret;
+}
+
+/* DFA states along the path of the automaton being walked. */
+struct regex_walk {
+   const struct vb_regex *re;
+   uint64_t pruned;     /* Transitions rejected so far. */
+   uint32_t states[MN_MAX_WORD_LEN + 1];
+};
+
+static int regex_accept(void *arg, size_t depth, uint8_t chr)
+{
+   struct regex_walk *w = arg;
+
+   w->states[depth + 1] = vb_regex_step(w->re, w->states[depth], chr);
+   if (w->states[depth + 1])
+      return 1;
+   w->pruned++;
+   return 0;
+}
+
+/* Walks the DFA of the expression along with the automaton, skipping the
+ * branches of the automaton from which the DFA can't reach an accepting state.
+ * Words reached otherwise, as well as added words, are still checked.
+ */
+static int match_regex(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   struct vb_regex re;
+   int ret = vb_regex_compile(&re, c->str, c->len, c->fold);
+   if (ret) {
+      c->query->pagination.last_page = true;
+      return ret;
+   }
+
+   struct regex_walk w = {.re = &re, .states = {VB_REGEX_START}};
+   struct vb_iter it;
+   if (c->query->pagination.last_pos) {
+      resume(&it, lex, c);
+      /* Walk the DFA up to the transition the iteration restarts from. */
+      const struct mini_iter *mi = &it.it;
+      if (mi->positions[mi->depth])
+         for (size_t i = 0; i < mi->depth; i++)
+            w.states[i + 1] = vb_regex_step(&re, w.states[i], mi->word[i]);
+   } else {
+      vb_iter_init(&it, lex);
+   }
+   vb_iter_filter(&it, regex_accept, &w);
+
+   const char *term;
+   size_t len;
+   size_t page_size = c->query->page_size;
+   while ((term = vb_iter_next(&it, &len))) {
+      if (interrupted(c)) {
+         struct vb_iter pos_it;
+         suspend(c, vb_iter_inits(&pos_it, lex, term, len), term, len);
+         VB_STAT(c, pruned_branches, w.pruned);
+         vb_regex_fini(&re);
+         return VB_EINTR;
+      }
+      /* Words of the base automaton are returned in the iterator buffer, and
+       * the DFA was walked along them. Added words must be checked from
+       * scratch.
+       */
+      if (term == it.it.word ? !re.accepting[w.states[len]]
+                             : !vb_regex_match(&re, term, len)) {
+         VB_STAT(c, words_visited, 1);
+         VB_STAT(c, rejected_pattern, 1);
+         continue;
+      }
+      if (!page_size--) {
+         /* Words in between were skipped, so we have to look for the
+          * ordinal of this one.
+          */
+         struct vb_iter pos_it;
+         suspend(c, vb_iter_inits(&pos_it, lex, term, len), term, len);
+         VB_STAT(c, pruned_branches, w.pruned);
+         vb_regex_fini(&re);
+         return VB_OK;
+      }
+      /* The ordinal of the word is only looked for if it is recorded. */
+      struct vb_iter pos_it;
+      const uint32_t pos = c->rank ? vb_iter_inits(&pos_it, lex, term, len) : 0;
+      report(c, term, len, pos);
+      VB_STAT(c, words_visited, 1);
+   }
+
    c->query->pagination.last_page = true;
+   VB_STAT(c, pruned_branches, w.pruned);
+   vb_regex_fini(&re);
+   return VB_OK;
+}
+
+
+/* Finds the indexes [first, end) of the words of the base automaton of a
+ * lexicon that start with a prefix.
+ */
+static void prefix_range(const struct vb_lexicon *lex,
+                         const char *prefix, size_t len,
+                         uint32_t *first, uint32_t *end)
+{
+   struct mini_iter it;
+   *first = mn_iter_initp(&it, lex->base, prefix, len);
+   if (!*first) {
+      *end = 0;
+      return;
+   }
+   (*first)--;
+
+   /* The first word that doesn't start with the prefix is the first one that
+    * is >= the prefix with its last byte incremented, once trailing 0xff bytes
+    * are removed.
+    */
+   char succ[MN_MAX_WORD_LEN];
+   memcpy(succ, prefix, len);
+   while (len && (uint8_t)succ[len - 1] == 0xff)
+      len--;
+   uint32_t pos = 0;
+   if (len) {
+      succ[len - 1]++;
+      pos = mn_iter_inits(&it, lex->base, succ, len);
+   }
+   *end = pos ? pos - 1 : lex->base_size;
+}
+
+/* A range of word indexes, ranked by the best word it contains. */
+struct top_range {
+   uint32_t start, end;
+   uint32_t best;
+   int32_t score;
+};
+
+static int top_range_cmp(const struct top_range a, const struct top_range b)
+{
+   if (a.score != b.score)
+      return a.score < b.score ? -1 : 1;
+   return a.best > b.best ? -1 : a.best < b.best;
+}
+
+VB_HEAP_DECLARE(top_heap, struct top_range, top_range_cmp)
+
+static int top_heap_add(struct top_heap *heap, struct vb_match_ctx *c,
+                        const struct vb_scores *s, uint32_t start, uint32_t end)
+{
+   if (start == end)
+      return VB_OK;
+   if (heap->size == heap->max) {
+      size_t max = heap->max * 2;
+      struct top_range *data = realloc(heap->data, max * sizeof *data);
+      if (!data)
+         return VB_ENOMEM;
+      heap->data = data;
+      heap->max = max;
+   }
+   const uint32_t best = vb_scores_best(s, start, end);
+   top_heap_push(heap, (struct top_range){
+      .start = start,
+      .end = end,
+      .best = best,
+      .score = s->scores[best],
+   });
+   VB_STAT(c, heap_pushes, 1);
+   return VB_OK;
+}
+
+/* Words are taken best first from a heap of ranges of words. The range of
+ * the words that start with the query string goes first on the heap. Each
+ * time a range is taken, its best word is reported, and the words on either
+ * side of it are put back on the heap as two new ranges. Taking a word thus
+ * costs a few logarithmic operations, whatever the size of the range.
+ * Pages after the first one are found the same way, skipping the words up to
+ * the last one reported, which is recorded in the pagination data.
+ */
+static int match_top_prefix(const struct vb_lexicon *lex,
+                            struct vb_match_ctx *c)
+{
+   struct vb_pagination *p = &c->query->pagination;
+   const struct vb_scores *scores = vb_lexicon_scores(lex);
+   if (!scores) {
+      p->last_page = true;
+      return VB_ESCORES;
+   }
+
+   struct top_heap heap = VB_HEAP_INIT(malloc(64 * sizeof *heap.data), 64);
+   if (!heap.data) {
+      p->last_page = true;
+      return VB_ENOMEM;
+   }
+
+   uint32_t first, end;
+   prefix_range(lex, c->str, c->len, &first, &end);
+   int ret = top_heap_add(&heap, c, scores, first, end);
+
+   const bool first_page = p->last_pos == 0;
+   struct top_range last = {
+      .best = p->last_pos - 1,
+      .score = p->last_weight,
+   };
+   size_t page_size = c->query->page_size;
+   char word[MN_MAX_WORD_LEN + 1];
+   while (!ret && heap.size) {
+      const struct top_range r = top_heap_pop(&heap);
+      if ((ret = top_heap_add(&heap, c, scores, r.start, r.best))
+          || (ret = top_heap_add(&heap, c, scores, r.best + 1, r.end)))
+         break;
+      if (!first_page && top_range_cmp(r, last) >= 0) {
+         VB_STAT(c, words_visited, 1);
+         VB_STAT(c, rejected_page, 1);
+         continue;
+      }
+      /* Words are only counted once past the ones of previous pages, which
+       * are skipped anew by each call.
+       */
+      const bool stop = interrupted(c);
+      if (stop || !page_size--) {
+         p->last_pos = last.best + 1;
+         p->last_weight = last.score;
+         free(heap.data);
+         return stop ? VB_EINTR : VB_OK;
+      }
+      const size_t len = mn_extract(lex->base, r.best + 1, word);
+      report_ranked(c, word, len, r.best + 1, 0, r.score, r.score);
+      VB_STAT(c, words_visited, 1);
+      VB_STAT(c, extracts, 1);
+      last = r;
+   }
+   free(heap.data);
+   p->last_page = true;
    return ret;
 }
 
@@ -159,43 +576,183 @@ fini:
  * Fuzzy matching.
  ******************************************************************************/
 
+/* Turns the value of a metric into a weight. The lower the weight, the better
+ * the match. Candidates that are too far from the query get INT32_MAX.
+ */
+static int32_t fuzzy_weight(enum fc_metric metric, int32_t val,
+                            int32_t len1, int32_t len2, int32_t max_dist)
+{
+   switch (metric) {
+   case FC_LEVENSHTEIN: case FC_DAMERAU:
+      return val > max_dist ? INT32_MAX : val;
+   case FC_LCSUBSTR:
+      return -val;
+   default:
+      return -2. * val / (double)(len1 + len2) * 1000.;
+   }
+}
+
 static int32_t levenshtein_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
 {
-   int32_t ret = fc_memo_levenshtein(m, seq, len);
-   return ret > m->max_dist ? INT32_MAX : ret;
+   return fuzzy_weight(FC_LEVENSHTEIN, fc_memo_levenshtein(m, seq, len),
+                       m->len1, len, m->max_dist);
 }
 
 static int32_t damerau_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
 {
-   int32_t ret = fc_memo_damerau(m, seq, len);
-   return ret > m->max_dist ? INT32_MAX : ret;
+   return fuzzy_weight(FC_DAMERAU, fc_memo_damerau(m, seq, len),
+                       m->len1, len, m->max_dist);
 }
 
 static int32_t lcsubstr_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
 {
-   return -fc_memo_lcsubstr(m, seq, len);
+   return fuzzy_weight(FC_LCSUBSTR, fc_memo_lcsubstr(m, seq, len),
+                       m->len1, len, m->max_dist);
 }
 
 static int32_t lcsubseq_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
 {
-   return -2. * fc_memo_lcsubseq(m, seq, len) / (double)(m->len1 + len) * 1000.;
+   return fuzzy_weight(FC_LCSUBSEQ, fc_memo_lcsubseq(m, seq, len),
+                       m->len1, len, m->max_dist);
 }
 
+/* Candidates are ranked by weight, then by decreasing score, if the lexicon
+ * has scores, then by position. Standard automata have no word ordinals, so we
+ * keep the words themselves, and compare them instead, which gives the same
+ * order.
+ */
 struct vb_match_infos {
    uint32_t pos;
    int32_t weight;
+   int32_t score;
+   const char *word;    /* Standard automata only. */
+   size_t len;
 };
 
 static int vb_match_infos_cmp(const struct vb_match_infos a, const struct vb_match_infos b)
 {
-   if (a.weight == b.weight)
-      return a.pos < b.pos ? -1 : a.pos > b.pos;
-   return a.weight < b.weight ? -1 : a.weight > b.weight;
+   if (a.weight != b.weight)
+      return a.weight < b.weight ? -1 : 1;
+   if (a.score != b.score)
+      return a.score > b.score ? -1 : 1;
+   if (a.word)
+      return lmemcmp(a.word, a.len, b.word, b.len);
+   return a.pos < b.pos ? -1 : a.pos > b.pos;
 }
 
 VB_HEAP_DECLARE(vb_heap, struct vb_match_infos, vb_match_infos_cmp)
 
-static int match_fuzzy(const struct mini *lex, struct vb_match_ctx *c)
+/* Words of a flattened lexicon are scored FC_BATCH_SIZE at a time. Since
+ * the words of a batch are all processed up to the length of the longest one,
+ * they are grouped by length beforehand.
+ */
+struct vb_batch {
+   struct fc_batch fc;
+   const struct vb_arena *arena;
+   const int32_t *scores;     /* NULL if the lexicon has none. */
+   struct vb_stats *stats;    /* Same as in the query. */
+   struct vb_match_ctx *ctx;
+   enum fc_metric metric;
+   int32_t len1;
+   int32_t max_dist;
+   uint8_t nr[MN_MAX_WORD_LEN + 1];
+   uint32_t pos[MN_MAX_WORD_LEN + 1][FC_BATCH_SIZE];
+};
+
+/* Scores the words of length "len2" that are waiting, and pushes those that
+ * qualify on a heap. Returns the number of such words.
+ */
+static size_t vb_batch_flush(struct vb_batch *b, int32_t len2, struct vb_heap *heap,
+                             bool first_page, struct vb_match_infos last_min)
+{
+   char32_t bufs[FC_BATCH_SIZE][MN_MAX_WORD_LEN + 1];
+   const char32_t *seqs[FC_BATCH_SIZE] = {0};
+   int32_t lens[FC_BATCH_SIZE] = {0}, vals[FC_BATCH_SIZE];
+   const int32_t nr = b->nr[len2];
+   size_t count = 0;
+
+   for (int32_t k = 0; k < nr; k++)
+      seqs[k] = vb_arena_chars(b->arena, b->pos[len2][k], bufs[k], &lens[k]);
+   fc_batch_compute(&b->fc, seqs, lens, nr, vals);
+   VB_STAT(b, dp_cells, (uint64_t)b->len1 * len2 * nr);
+   b->ctx->cells += (uint64_t)b->len1 * len2 * nr;
+   for (int32_t k = 0; k < nr; k++) {
+      struct vb_match_infos x = {
+         .pos = b->pos[len2][k] + 1,
+         .weight = fuzzy_weight(b->metric, vals[k], b->len1, len2, b->max_dist),
+         .score = b->scores ? b->scores[b->pos[len2][k]] : 0,
+      };
+      if (x.weight == INT32_MAX) {
+         VB_STAT(b, rejected_distance, 1);
+      } else if (first_page || vb_match_infos_cmp(x, last_min) > 0) {
+         count++;
+         vb_heap_push(heap, x);
+      } else {
+         VB_STAT(b, rejected_page, 1);
+      }
+   }
+   VB_STAT(b, heap_pushes, count);
+   b->nr[len2] = 0;
+   return count;
+}
+
+/* Scores the words at positions [pos, end) of a flattened lexicon. Returns the
+ * number of words pushed on the heap. If the search is interrupted, "pos" is
+ * set to the position of the first word that remains to be scored.
+ */
+static size_t vb_batch_run(struct vb_batch *b, uint32_t *posp, uint32_t end,
+                           struct vb_heap *heap, bool first_page,
+                           struct vb_match_infos last_min)
+{
+   const uint32_t *offsets = b->arena->char_offsets;
+   const bool bounded = b->metric == FC_LEVENSHTEIN || b->metric == FC_DAMERAU;
+   size_t count = 0;
+   uint32_t pos;
+
+   for (pos = *posp; pos < end; pos++) {
+      if (interrupted(b->ctx))
+         break;
+      const int32_t len2 = offsets[pos + 1] - offsets[pos];
+      /* An edit distance is at least the difference in length. */
+      if (bounded && abs(len2 - b->len1) > b->max_dist) {
+         VB_STAT(b, rejected_length, 1);
+         continue;
+      }
+      b->pos[len2][b->nr[len2]] = pos;
+      if (++b->nr[len2] == FC_BATCH_SIZE)
+         count += vb_batch_flush(b, len2, heap, first_page, last_min);
+   }
+   for (int32_t len2 = 0; len2 <= MN_MAX_WORD_LEN; len2++)
+      if (b->nr[len2])
+         count += vb_batch_flush(b, len2, heap, first_page, last_min);
+   VB_STAT(b, words_visited, pos - *posp);
+   *posp = pos;
+   return count;
+}
+
+/* Progress of an interrupted fuzzy search: the best candidates found so far,
+ * by ordinal and weight, the number of candidates that qualified, and the
+ * range of word indexes that remains to be scored. An "end" of zero stands for
+ * the end of the words that share the required prefix.
+ */
+struct vb_partial {
+   bool active;
+   uint32_t next, end;
+   uint32_t count;
+   uint32_t size;
+   struct {
+      uint32_t pos;
+      int32_t weight;
+   } cands[VB_MAX_PAGE_SIZE];
+};
+
+void vb_limits_fini(struct vb_limits *l)
+{
+   free(l->partial);
+   l->partial = NULL;
+}
+
+static int match_fuzzy(const struct vb_lexicon *lex, struct vb_match_ctx *c)
 {
    static const int metrics[] = {
       [VB_LEVENSHTEIN] = FC_LEVENSHTEIN,
@@ -218,75 +775,234 @@ static int match_fuzzy(const struct mini *lex, struct vb_match_ctx *c)
       return VB_EQUTF8;
    }
 
-   struct mini_iter it;
-   uint32_t pos;
+   size_t pfx_len = 0;
    if (c->query->prefix_len && !c->query->pagination.last_pos && c->mode != VB_LCSUBSTR) {
-      size_t pfx_len;
       /* If the required common prefix length is longer than the reference word,
        * there could still be an exact match.
        */
       if (c->query->prefix_len > len1)
          return match_exact(lex, c);
       pfx_len = vb_utf8_bytes(seq1, c->query->prefix_len);
-      pos = mn_iter_initp(&it, lex, c->str, pfx_len);
+   }
+
+   /* If the lexicon has been flattened, candidates are already decoded, so
+    * we don't need to walk the automaton, and can score several of them at
+    * once.
+    */
+   const struct vb_arena *arena = vb_lexicon_arena(lex);
+   if (arena && !arena->chars)
+      arena = NULL;
+
+   /* Searches are resumed from the index of the word they stopped at, in
+    * the range of the words that share the required prefix, which is
+    * recomputed for flattened lexicons. Standard automata have no word
+    * indexes, so their searches are not interrupted.
+    */
+   struct vb_partial *part = c->limits ? c->limits->partial : NULL;
+   const bool resumed = part && part->active
+                        && c->query->pagination.interrupted;
+   c->query->pagination.interrupted = false;
+   if (!c->numbered)
+      c->limits = NULL;
+
+   struct vb_iter it;
+   uint32_t pos = 0, end = 0;
+   if (resumed && arena) {
+      pos = part->next;
+      end = part->end;
+      if (!end) {
+         end = arena->size;
+         if (pfx_len)
+            vb_arena_range(arena, c->str, pfx_len, &(uint32_t){0}, &end);
+      }
+   } else if (resumed) {
+      pos = vb_iter_initn(&it, lex, part->next + 1);
+   } else if (arena) {
+      end = arena->size;
+      if (pfx_len)
+         vb_arena_range(arena, c->str, pfx_len, &pos, &end);
+   } else if (pfx_len) {
+      pos = vb_iter_initp(&it, lex, c->str, pfx_len);
    } else {
-      pos = mn_iter_init(&it, lex);
+      pos = vb_iter_init(&it, lex);
    }
 
    enum fc_metric metric = metrics[c->mode];
-   struct fc_memo m;
-   fc_memo_init(&m, metric, MN_MAX_WORD_LEN, c->query->max_dist);
-   fc_memo_set_ref(&m, seq1, len1);
-   m.compute = compute_fns[metric];
-
+   const bool bounded = metric == FC_LEVENSHTEIN || metric == FC_DAMERAU;
    const char *term;
    size_t len;
    size_t count = 0;
    bool first_page = c->query->pagination.last_pos == 0;
+   int ret = VB_OK;
 
    struct vb_match_infos cands[VB_MAX_PAGE_SIZE];
    struct vb_heap heap = VB_HEAP_INIT(cands, c->query->page_size);
-   
+
+   /* Words of the candidates, for standard automata. There is a spare slot for
+    * the word of a new candidate, which gets the slot of the evicted one.
+    */
+   char words[VB_MAX_PAGE_SIZE + 1][MN_MAX_WORD_LEN + 1];
+   char *spare = words[VB_MAX_PAGE_SIZE];
+
    struct vb_match_infos last_min = {
       .pos = c->query->pagination.last_pos,
       .weight = c->query->pagination.last_weight,
    };
-
-   while ((term = mn_iter_next(&it, &len))) {
-      char32_t seq2[MN_MAX_WORD_LEN + 1];
-      int32_t len2 = vb_utf8_decode(seq2, term, len);
-      if (len2 < 0) {
-         c->query->pagination.last_page = true;
-         return VB_ELUTF8;
+   if (!c->numbered) {
+      last_min.word = c->query->pagination.last_word;
+      last_min.len = c->query->pagination.last_len;
+   }
+   const struct vb_scores *s = vb_lexicon_scores(lex);
+   const int32_t *scores = s ? s->scores : NULL;
+   if (scores && last_min.pos && last_min.pos <= s->size)
+      last_min.score = scores[last_min.pos - 1];
+
+   if (resumed) {
+      count = part->count;
+      heap.size = part->size < heap.max ? part->size : heap.max;
+      for (size_t i = 0; i < heap.size; i++) {
+         cands[i] = (struct vb_match_infos){
+            .pos = part->cands[i].pos,
+            .weight = part->cands[i].weight,
+            .score = scores ? scores[part->cands[i].pos - 1] : 0,
+         };
       }
-      struct vb_match_infos x = {
-         .pos = pos,
-         .weight = fc_memo_compute(&m, seq2, len2),
+   }
+   if (part)
+      part->active = false;
+
+   if (arena) {
+      struct vb_batch b = {
+         .arena = arena,
+         .scores = scores,
+         .stats = c->stats,
+         .ctx = c,
+         .metric = metric,
+         .len1 = len1,
+         .max_dist = c->query->max_dist,
       };
-      if (x.weight != INT32_MAX && (first_page || vb_match_infos_cmp(x, last_min) > 0)) {
-         count++;
-         vb_heap_push(&heap, x);
+      fc_batch_init(&b.fc, metric, MN_MAX_WORD_LEN, c->query->max_dist);
+      fc_batch_set_ref(&b.fc, seq1, len1);
+      count += vb_batch_run(&b, &pos, end, &heap, first_page, last_min);
+      fc_batch_fini(&b.fc);
+      if (pos < end)
+         ret = VB_EINTR;
+   } else {
+      struct fc_memo m;
+      fc_memo_init(&m, metric, MN_MAX_WORD_LEN, c->query->max_dist);
+      fc_memo_set_ref(&m, seq1, len1);
+      m.compute = compute_fns[metric];
+      const size_t restored = count;
+
+      while ((term = vb_iter_next(&it, &len))) {
+         /* Only the first call starts off with an iterator that stops at the
+          * end of the prefix.
+          */
+         if (resumed && pfx_len && (len < pfx_len || memcmp(term, c->str, pfx_len)))
+            break;
+         if (interrupted(c)) {
+            ret = VB_EINTR;
+            break;
+         }
+         int32_t len2;
+         const char32_t *seq2 = vb_iter_chars(&it, term, len, &len2);
+         if (!seq2) {
+            ret = VB_ELUTF8;
+            break;
+         }
+         struct vb_match_infos x = {
+            .pos = pos,
+            .weight = fc_memo_compute(&m, seq2, len2),
+            .score = scores ? scores[pos - 1] : 0,
+            .word = c->numbered ? NULL : term,
+            .len = len,
+         };
+         c->cells = m.cells;
+         if (x.weight == INT32_MAX) {
+            /* The memoized functions check the length difference first. */
+            if (c->stats && bounded && abs(len2 - len1) > c->query->max_dist)
+               c->stats->rejected_length++;
+            else
+               VB_STAT(c, rejected_distance, 1);
+         } else if (first_page || vb_match_infos_cmp(x, last_min) > 0) {
+            count++;
+            if (c->numbered) {
+               vb_heap_push(&heap, x);
+            } else if (heap.size < heap.max) {
+               x.word = memcpy(words[heap.size], term, len + 1);
+               vb_heap_push(&heap, x);
+            } else if (vb_match_infos_cmp(x, heap.data[0]) < 0) {
+               x.word = memcpy(spare, term, len + 1);
+               spare = (char *)heap.data[0].word;
+               vb_heap_push(&heap, x);
+            }
+         } else {
+            VB_STAT(c, rejected_page, 1);
+         }
+         VB_STAT(c, words_visited, 1);
+         pos++;
+      }
+      if (c->stats) {
+         c->stats->dp_cells += m.cells;
+         c->stats->memo_hits += m.hits;
+         c->stats->utf8_bytes += it.utf8_bytes;
+         c->stats->heap_pushes += count - restored;
+      }
+      fc_memo_fini(&m);
+      if (ret && ret != VB_EINTR) {
+         c->query->pagination.last_page = true;
+         return ret;
       }
-      pos++;
    }
 
-   fc_memo_fini(&m);
+   if (ret == VB_EINTR) {
+      if (!part)
+         part = c->limits->partial = malloc(sizeof *part);
+      if (!part)
+         return VB_ENOMEM;
+      c->query->pagination.interrupted = true;
+      part->active = true;
+      part->next = arena ? pos : pos - 1;
+      part->end = arena ? end : 0;
+      part->count = count;
+      part->size = heap.size;
+      for (size_t i = 0; i < heap.size; i++) {
+         part->cands[i].pos = heap.data[i].pos;
+         part->cands[i].weight = heap.data[i].weight;
+      }
+      return VB_EINTR;
+   }
+
    vb_heap_finish(&heap);
 
+   const uint64_t start = c->stats ? vb_now_ns() : 0;
    for (size_t i = 0; i < heap.size; i++) {
-      len = mn_extract(lex, heap.data[i].pos, seq1);
-      c->handler(c->arg, (const char *)seq1, len);
-   }
-   if (heap.size) {
-      c->query->pagination.last_pos = heap.data[heap.size - 1].pos;
-      c->query->pagination.last_weight = heap.data[heap.size - 1].weight;
+      term = heap.data[i].word;
+      len = heap.data[i].len;
+      if (!term && arena) {
+         term = &arena->words[arena->offsets[heap.data[i].pos - 1]];
+         len = arena->offsets[heap.data[i].pos] - arena->offsets[heap.data[i].pos - 1] - 1;
+      } else if (!term) {
+         len = vb_lexicon_extract(lex, heap.data[i].pos, (char *)seq1);
+         term = (const char *)seq1;
+         VB_STAT(c, extracts, 1);
+      }
+      report_ranked(c, term, len, heap.data[i].pos, heap.data[i].weight,
+                    heap.data[i].score, heap.data[i].weight);
+      if (i == heap.size - 1) {
+         c->query->pagination.last_pos = heap.data[i].pos;
+         c->query->pagination.last_weight = heap.data[i].weight;
+         set_last_word(c, term, len);
+      }
    }
+   if (c->stats)
+      c->stats->report_ns += vb_now_ns() - start;
    if (count <= heap.size)
       c->query->pagination.last_page = true;
    return VB_OK;
 }
 
-int (*const vb_match_funcs[])(const struct mini *, struct vb_match_ctx *) = {
+int (*const vb_match_funcs[])(const struct vb_lexicon *, struct vb_match_ctx *) = {
    [VB_EXACT] = match_exact,
    [VB_PREFIX] = match_prefix,
    [VB_SUBSTR] = match_substr,
@@ -296,4 +1012,6 @@ int (*const vb_match_funcs[])(const struct mini *, struct vb_match_ctx *) = {
    [VB_DAMERAU] = match_fuzzy,
    [VB_LCSUBSTR] = match_fuzzy,
    [VB_LCSUBSEQ] = match_fuzzy,
+   [VB_REGEX] = match_regex,
+   [VB_TOP_PREFIX] = match_top_prefix,
 };
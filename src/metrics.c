@@ -0,0 +1,298 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+#include "api.h"
+#include "priv.h"
+
+/* Histogram buckets, see VB_HIST_BUCKETS. */
+#define VB_HIST_SUB_BITS 3
+#define VB_HIST_SUB (1 << VB_HIST_SUB_BITS)
+#define VB_HIST_MAX_BIT 39
+
+_Static_assert(VB_HIST_BUCKETS == (VB_HIST_MAX_BIT - 1) * VB_HIST_SUB,
+              "histogram size mismatch");
+
+static size_t vb_hist_bucket(uint64_t ns)
+{
+   if (ns < 2 * VB_HIST_SUB)
+      return ns;
+   int bit = 0;
+   while (ns >> (bit + 1))
+      bit++;
+   if (bit > VB_HIST_MAX_BIT)
+      return VB_HIST_BUCKETS - 1;
+   const size_t sub = (ns >> (bit - VB_HIST_SUB_BITS)) & (VB_HIST_SUB - 1);
+   return (bit - VB_HIST_SUB_BITS + 1) * VB_HIST_SUB + sub;
+}
+
+/* Largest latency of a bucket. */
+static uint64_t vb_hist_bucket_max(size_t i)
+{
+   if (i < 2 * VB_HIST_SUB)
+      return i;
+   const int bit = i / VB_HIST_SUB + VB_HIST_SUB_BITS - 1;
+   const uint64_t sub = i % VB_HIST_SUB;
+   return ((VB_HIST_SUB + sub + 1) << (bit - VB_HIST_SUB_BITS)) - 1;
+}
+
+/* The counters of a thread are only ever written by this thread, but other
+ * threads read them when taking a snapshot, hence atomic types, which are
+ * only accessed with relaxed loads and stores, and no read-modify-write.
+ */
+struct vb_hist_counters {
+   atomic_uint_least64_t count;
+   atomic_uint_least64_t sum_ns;
+   atomic_uint_least64_t max_ns;
+   atomic_uint_least64_t buckets[VB_HIST_BUCKETS];
+};
+
+/* Metrics of a thread. Blocks are put at the head of a list, and never freed
+ * nor removed from it, so the list can be walked without locking.
+ */
+struct vb_thread_metrics {
+   struct vb_thread_metrics *next;
+   atomic_bool in_use;        /* Whether a running thread owns this block. */
+   atomic_uint_least64_t slow_queries;
+   struct vb_hist_counters latency[VB_MODES_NR][VB_METRICS_PAGES];
+};
+
+static atomic_bool enabled;
+static _Atomic(struct vb_thread_metrics *) all_threads;
+static _Thread_local struct vb_thread_metrics *this_thread;
+
+/* Releases the block of a thread when it exits. */
+static tss_t exit_key;
+static bool exit_key_ok;
+
+static once_flag init_once = ONCE_FLAG_INIT;
+
+static mtx_t hook_lock;
+static atomic_uint_least64_t slow_threshold = UINT64_MAX;
+static void (*slow_hook)(void *arg, const struct vb_query *, enum vb_match_mode,
+                         const struct vb_stats *);
+static void *slow_arg;
+
+static void vb_thread_metrics_release(void *arg)
+{
+   struct vb_thread_metrics *t = arg;
+   atomic_store(&t->in_use, false);
+}
+
+static void vb_metrics_init(void)
+{
+   exit_key_ok = tss_create(&exit_key, vb_thread_metrics_release) == thrd_success;
+   mtx_init(&hook_lock, mtx_plain);
+}
+
+/* Returns the block of the calling thread, or NULL if there isn't enough
+ * memory for it.
+ */
+static struct vb_thread_metrics *vb_thread_metrics(void)
+{
+   if (this_thread)
+      return this_thread;
+   call_once(&init_once, vb_metrics_init);
+
+   struct vb_thread_metrics *t;
+   for (t = atomic_load(&all_threads); t; t = t->next) {
+      bool in_use = false;
+      if (atomic_compare_exchange_strong(&t->in_use, &in_use, true))
+         break;
+   }
+   if (!t) {
+      t = calloc(1, sizeof *t);
+      if (!t)
+         return NULL;
+      atomic_init(&t->in_use, true);
+      t->next = atomic_load(&all_threads);
+      while (!atomic_compare_exchange_weak(&all_threads, &t->next, t))
+         ;
+   }
+   if (exit_key_ok)
+      tss_set(exit_key, t);
+   this_thread = t;
+   return t;
+}
+
+static uint64_t vb_counter_get(atomic_uint_least64_t *c)
+{
+   return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static void vb_counter_set(atomic_uint_least64_t *c, uint64_t val)
+{
+   atomic_store_explicit(c, val, memory_order_relaxed);
+}
+
+static void vb_counter_add(atomic_uint_least64_t *c, uint64_t n)
+{
+   vb_counter_set(c, vb_counter_get(c) + n);
+}
+
+void vb_metrics_enable(bool on)
+{
+   atomic_store(&enabled, on);
+}
+
+bool vb_metrics_enabled(void)
+{
+   return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+void vb_metrics_set_slow_hook(uint64_t threshold_ns,
+                              void (*hook)(void *arg, const struct vb_query *,
+                                           enum vb_match_mode,
+                                           const struct vb_stats *),
+                              void *arg)
+{
+   call_once(&init_once, vb_metrics_init);
+   mtx_lock(&hook_lock);
+   slow_hook = hook;
+   slow_arg = arg;
+   atomic_store(&slow_threshold, threshold_ns);
+   mtx_unlock(&hook_lock);
+}
+
+void vb_metrics_record(const struct vb_query *q, enum vb_match_mode mode,
+                       uint32_t page, const struct vb_stats *st)
+{
+   const uint64_t ns = st->parse_ns + st->search_ns + st->report_ns;
+
+   struct vb_thread_metrics *t = vb_thread_metrics();
+   if (t) {
+      if (page >= VB_METRICS_PAGES)
+         page = VB_METRICS_PAGES - 1;
+      struct vb_hist_counters *h = &t->latency[mode][page];
+      vb_counter_add(&h->count, 1);
+      vb_counter_add(&h->sum_ns, ns);
+      if (ns > vb_counter_get(&h->max_ns))
+         vb_counter_set(&h->max_ns, ns);
+      vb_counter_add(&h->buckets[vb_hist_bucket(ns)], 1);
+   }
+
+   if (ns < atomic_load_explicit(&slow_threshold, memory_order_relaxed))
+      return;
+   if (t)
+      vb_counter_add(&t->slow_queries, 1);
+   mtx_lock(&hook_lock);
+   void (*hook)(void *, const struct vb_query *, enum vb_match_mode,
+                const struct vb_stats *) = slow_hook;
+   void *arg = slow_arg;
+   mtx_unlock(&hook_lock);
+   if (hook)
+      hook(arg, q, mode, st);
+}
+
+void vb_metrics_snapshot(struct vb_metrics *m)
+{
+   memset(m, 0, sizeof *m);
+
+   for (struct vb_thread_metrics *t = atomic_load(&all_threads); t; t = t->next) {
+      m->slow_queries += vb_counter_get(&t->slow_queries);
+      for (size_t mode = 0; mode < VB_MODES_NR; mode++) {
+         for (size_t page = 0; page < VB_METRICS_PAGES; page++) {
+            struct vb_hist_counters *src = &t->latency[mode][page];
+            struct vb_histogram *dest = &m->latency[mode][page];
+            dest->count += vb_counter_get(&src->count);
+            dest->sum_ns += vb_counter_get(&src->sum_ns);
+            const uint64_t max_ns = vb_counter_get(&src->max_ns);
+            if (max_ns > dest->max_ns)
+               dest->max_ns = max_ns;
+            for (size_t i = 0; i < VB_HIST_BUCKETS; i++)
+               dest->buckets[i] += vb_counter_get(&src->buckets[i]);
+         }
+      }
+   }
+}
+
+uint64_t vb_histogram_quantile(const struct vb_histogram *h, double q)
+{
+   /* Buckets are read apart from the total, which might then not match their
+    * sum, if the histogram comes from a snapshot.
+    */
+   uint64_t total = 0;
+   for (size_t i = 0; i < VB_HIST_BUCKETS; i++)
+      total += h->buckets[i];
+   if (!total)
+      return 0;
+
+   uint64_t rank = q <= 0 ? 1 : q >= 1 ? total : (uint64_t)(q * total + 0.5);
+   if (!rank)
+      rank = 1;
+   uint64_t seen = 0;
+   for (size_t i = 0; i < VB_HIST_BUCKETS; i++) {
+      seen += h->buckets[i];
+      if (seen >= rank) {
+         const uint64_t max = vb_hist_bucket_max(i);
+         return max < h->max_ns ? max : h->max_ns;
+      }
+   }
+   return h->max_ns;
+}
+
+/* Appends formatted text to a buffer, as snprintf() would. */
+struct vb_export {
+   char *buf;
+   size_t size;
+   size_t len;
+};
+
+static void vb_export_printf(struct vb_export *e, const char *fmt, ...)
+{
+   va_list ap;
+   va_start(ap, fmt);
+   const size_t avail = e->len < e->size ? e->size - e->len : 0;
+   const int n = vsnprintf(avail ? &e->buf[e->len] : NULL, avail, fmt, ap);
+   va_end(ap);
+   if (n > 0)
+      e->len += n;
+}
+
+size_t vb_metrics_export(const struct vb_metrics *m, char *buf, size_t size)
+{
+   static const char *const modes[] = {
+      [VB_AUTO] = "auto",
+      [VB_EXACT] = "exact",
+      [VB_PREFIX] = "prefix",
+      [VB_SUBSTR] = "substr",
+      [VB_SUFFIX] = "suffix",
+      [VB_GLOB] = "glob",
+      [VB_LEVENSHTEIN] = "levenshtein",
+      [VB_DAMERAU] = "damerau",
+      [VB_LCSUBSTR] = "lcsubstr",
+      [VB_LCSUBSEQ] = "lcsubseq",
+      [VB_REGEX] = "regex",
+      [VB_TOP_PREFIX] = "top_prefix",
+   };
+   _Static_assert(sizeof modes / sizeof *modes == VB_MODES_NR, "missing mode name");
+   static const char *const pages[VB_METRICS_PAGES] = {"1", "2", "3", "4+"};
+   static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+   struct vb_export e = {.buf = buf, .size = size};
+   if (size)
+      buf[0] = '\0';
+
+   vb_export_printf(&e, "# TYPE volubile_search_seconds summary\n");
+   for (size_t mode = 0; mode < VB_MODES_NR; mode++) {
+      for (size_t page = 0; page < VB_METRICS_PAGES; page++) {
+         const struct vb_histogram *h = &m->latency[mode][page];
+         if (!h->count)
+            continue;
+         for (size_t i = 0; i < sizeof quantiles / sizeof *quantiles; i++)
+            vb_export_printf(&e, "volubile_search_seconds{mode=\"%s\",page=\"%s\","
+                             "quantile=\"%g\"} %.9f\n", modes[mode], pages[page],
+                             quantiles[i],
+                             vb_histogram_quantile(h, quantiles[i]) * 1e-9);
+         vb_export_printf(&e, "volubile_search_seconds_sum{mode=\"%s\",page=\"%s\"} %.9f\n",
+                          modes[mode], pages[page], h->sum_ns * 1e-9);
+         vb_export_printf(&e, "volubile_search_seconds_count{mode=\"%s\",page=\"%s\"} %llu\n",
+                          modes[mode], pages[page], (unsigned long long)h->count);
+      }
+   }
+   vb_export_printf(&e, "# TYPE volubile_slow_searches_total counter\n");
+   vb_export_printf(&e, "volubile_slow_searches_total %llu\n",
+                    (unsigned long long)m->slow_queries);
+   return e.len;
+}
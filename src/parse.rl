@@ -82,16 +82,23 @@ static void vb_set_match_mode(struct vb_match_ctx *c)
    }
 }
 
-void vb_parse_query(struct vb_match_ctx *c, char *buf)
+void vb_parse_query(struct vb_match_ctx *c, char buf[static MN_MAX_WORD_LEN + 1])
 {
    if (c->mode == VB_AUTO)
       vb_set_match_mode(c);
 
-   if (c->mode == VB_SUBSTR) { /* We use strstr() in the matching function. */
+   /* Folded queries are nul-terminated too, and glob patterns can be
+    * simplified in place. Regular expressions are folded once compiled, since
+    * folding their source would change the meaning of their classes.
+    */
+   if (c->fold && c->mode != VB_REGEX) {
+      c->len = vb_utf8_fold(buf, c->str, c->len);
+      c->str = buf;
+   } else if (c->mode == VB_SUBSTR) { /* We use strstr() in the matching function. */
       memcpy(buf, c->str, c->len);
       buf[c->len] = '\0';
       c->str = buf;
-   } else if (c->mode == VB_GLOB) {
-      vb_simplify_glob(c, buf);
    }
+   if (c->mode == VB_GLOB)
+      vb_simplify_glob(c, buf);
 }
@@ -2,9 +2,14 @@
 #define VB_PRIV_H
 
 #include <uchar.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #include "api.h"
 #include "lib/mini.h"
 
+_Static_assert(VB_MAX_WORD_LEN == MN_MAX_WORD_LEN, "word length limit mismatch");
+
 struct vb_match_ctx {
    struct vb_query *query;
 
@@ -15,17 +20,449 @@ struct vb_match_ctx {
    const char *str;
    size_t len;
 
+   /* Whether to search the folded index of the lexicon. */
+   bool fold;
+
+   /* Whether the lexicon is a numbered automaton. If not, word ordinals are
+    * not available, and we paginate with words instead.
+    */
+   bool numbered;
+
    void (*handler)(void *arg, const char *token, size_t len);
    void *arg;
+
+   /* Same as in the query. */
+   struct vb_stats *stats;
+
+   /* Same as in the query, and the work done so far by this call: the words
+    * looked at, and the matrix cells computed. "deadline" is only set if the
+    * limits include a wall time.
+    */
+   struct vb_limits *limits;
+   uint64_t deadline;
+   uint64_t words;
+   uint64_t cells;
+
+   /* Where to store the rank of each word reported, or NULL. */
+   struct vb_rank *rank;
+};
+
+/* Rank of a reported word, for merging the results of several searches.
+ * Words come by increasing weight, then by decreasing score, then in the
+ * lexicographic order of the word as searched, which is the folded form of the
+ * reported word when searching the folded index. "slot" is incremented for
+ * each word of the results page, before folded forms are expanded, so the
+ * original words of a folded form share it.
+ */
+struct vb_rank {
+   uint32_t slot;
+   int32_t weight;
+   int32_t score;
+   const char *word;    /* Only valid while the word is being reported. */
+   size_t len;
+
+   /* Pagination data recorded for the word. Searches that rank words by
+    * weight or score resume after the last word of a page, as "after" tells,
+    * the others at the first word of the next page.
+    */
+   uint32_t pos;
+   int32_t last_weight;
+   bool after;
+};
+
+/* Same as vb_lexicon_match(), but also stores the rank of each word reported
+ * in "rank" before reporting it.
+ */
+int vb_lexicon_match_ranked(const struct vb_lexicon *, struct vb_query *,
+                            void (*callback)(void *arg, const char *token, size_t len),
+                            void *arg, struct vb_rank *rank);
+
+/* Adds to a counter of the statistics of a query, if it asked for them. */
+#define VB_STAT(c, field, n) do {                                              \
+   if ((c)->stats)                                                             \
+      (c)->stats->field += (n);                                                \
+} while (0)
+
+/* Whether metrics are being recorded, see vb_metrics_enable(). */
+bool vb_metrics_enabled(void);
+
+/* Records the latency of a search, which is that of all the phases timed in
+ * its statistics, and calls the slow query hook if need be. "page" is the
+ * index of the page fetched, starting at 0.
+ */
+void vb_metrics_record(const struct vb_query *, enum vb_match_mode,
+                       uint32_t page, const struct vb_stats *);
+
+/* Current wall time, in nanoseconds, for timing the phases of a query. */
+static inline uint64_t vb_now_ns(void)
+{
+   struct timespec ts;
+   timespec_get(&ts, TIME_UTC);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Compares two strings that are not nul-terminated. */
+static inline int lmemcmp(const void *str1, size_t len1,
+                          const void *str2, size_t len2)
+{
+   int cmp = memcmp(str1, str2, len1 < len2 ? len1 : len2);
+   if (cmp)
+      return cmp;
+   return len1 < len2 ? -1 : len1 > len2;
+}
+
+/* A word stored outside of the base automaton of a lexicon. */
+struct vb_word {
+   char *str;           /* Nul-terminated. */
+   size_t len;
+
+   /* For added words, number of words of the base automaton that sort before
+    * this one. For removed words, ordinal of this word in the base automaton.
+    */
+   uint32_t pos;
+};
+
+/* Sorted array of words. */
+struct vb_words {
+   struct vb_word *data;
+   size_t size;
+   size_t max;
+};
+
+/* Flat copy of the words of an automaton, in lexicographic order. */
+struct vb_arena {
+   char *words;         /* Concatenated words, each followed by a nul byte. */
+   uint32_t *offsets;   /* Offset of each word, plus the total size. */
+   uint32_t size;       /* Number of words. */
+
+   /* The same words, decoded, for fuzzy matching. Each code point takes
+    * "width" bytes, which is the smallest of 1, 2, or 4 that fits all code
+    * points. NULL if the automaton contains invalid UTF-8 strings.
+    */
+   void *chars;
+   uint32_t *char_offsets;    /* Same as "offsets", in code points. */
+   unsigned width;
 };
 
-extern int (*const vb_match_funcs[VB_MODES_NR])(const struct mini *,
+int vb_arena_new(struct vb_arena **, const struct mini *);
+void vb_arena_free(struct vb_arena *);
+
+/* Returns the code points of the word at the given index, and sets "len" to
+ * their number. They are converted to "buf" if need be, which should be large
+ * enough to hold MN_MAX_WORD_LEN code points.
+ */
+static inline const char32_t *vb_arena_chars(const struct vb_arena *arena,
+                                             uint32_t idx, char32_t *buf,
+                                             int32_t *len)
+{
+   const uint32_t start = arena->char_offsets[idx];
+   *len = arena->char_offsets[idx + 1] - start;
+
+   switch (arena->width) {
+   case 1: {
+      const uint8_t *chars = (const uint8_t *)arena->chars + start;
+      for (int32_t i = 0; i < *len; i++)
+         buf[i] = chars[i];
+      return buf;
+   }
+   case 2: {
+      const uint16_t *chars = (const uint16_t *)arena->chars + start;
+      for (int32_t i = 0; i < *len; i++)
+         buf[i] = chars[i];
+      return buf;
+   }
+   default:
+      return (const char32_t *)arena->chars + start;
+   }
+}
+
+/* Finds the range of words that start with a prefix. */
+void vb_arena_range(const struct vb_arena *, const char *prefix, size_t len,
+                    uint32_t *first, uint32_t *end);
+
+/* Finds the first occurrence of a string in another. */
+const char *vb_memmem(const char *hay, size_t hay_len,
+                      const char *needle, size_t len);
+
+/* Returns the index of the first word, starting at "idx", that contains the
+ * given string, or the number of words if there is none. Since each word is
+ * followed by a nul byte, looking for a string followed by a nul byte finds
+ * words that end with it.
+ */
+uint32_t vb_arena_find(const struct vb_arena *, uint32_t idx,
+                       const char *str, size_t len);
+
+/* Compiled glob pattern. See fc_glob() for the syntax. */
+struct vb_glob {
+   /* Pattern atoms. Consecutive stars are merged. */
+   struct vb_glob_atom {
+      enum { VB_GLOB_CHAR, VB_GLOB_ANY, VB_GLOB_SET, VB_GLOB_STAR } type;
+      union {
+         char32_t c;          /* For VB_GLOB_CHAR. */
+         uint32_t set;        /* For VB_GLOB_SET, index in "sets". */
+      };
+   } atoms[MN_MAX_WORD_LEN];
+   uint32_t nr_atoms;
+
+   /* Groups. ASCII characters are kept in a bitmap, the others in
+    * "set_chars", between "start" and "end".
+    */
+   struct vb_glob_set {
+      uint64_t ascii[2];
+      uint32_t start, end;
+      bool invert;
+   } sets[MN_MAX_WORD_LEN / 2];
+   uint32_t nr_sets;
+   char32_t set_chars[MN_MAX_WORD_LEN];
+   uint32_t nr_set_chars;
+
+   /* Runs of literal characters, encoded as UTF-8 in "bytes", that all
+    * matching words must contain, in order. A fragment at the start or at the
+    * end of the pattern must be at the same place in the word.
+    */
+   struct vb_glob_fragment {
+      uint32_t start, len;
+      bool at_start, at_end;
+   } fragments[MN_MAX_WORD_LEN / 2 + 1];
+   uint32_t nr_fragments;
+   char bytes[MN_MAX_WORD_LEN];
+   uint32_t nr_bytes;
+
+   bool only_literals;  /* No other atoms than literals and stars. */
+   bool invalid;        /* The pattern has an unterminated group. */
+};
+
+/* Compiles a glob pattern. Returns VB_EQUTF8 if it isn't valid UTF-8. */
+int vb_glob_compile(struct vb_glob *, const char *pat, size_t len);
+
+/* Checks if a word matches a compiled pattern. Returns 1 if so, 0 if not, -1
+ * if the word had to be decoded and isn't valid UTF-8. If "valid_utf8" is set,
+ * the word is not checked. Words that lack a literal fragment of the pattern
+ * are rejected without being decoded. Fragments are compared byte-wise, so a
+ * word that encodes one of their characters with more bytes than needed is
+ * rejected too.
+ */
+int vb_glob_match(const struct vb_glob *, const char *word, size_t len,
+                  bool valid_utf8);
+
+/* Checks that a word contains the literal fragments of a pattern, which is
+ * the first test vb_glob_match() does. Returns false if it doesn't, in which
+ * case it can't match.
+ */
+bool vb_glob_prefilter(const struct vb_glob *, const char *word, size_t len);
+
+struct vb_iter;
+
+/* Same as vb_glob_match(), for a word that an iterator returned, of which
+ * only what differs from the previous word is decoded. The first "pfx_len"
+ * bytes of the word, that make up "pfx_chars" code points, are not matched
+ * against the pattern.
+ */
+int vb_glob_match_iter(const struct vb_glob *, struct vb_iter *,
+                       const char *word, size_t len,
+                       size_t pfx_len, int32_t pfx_chars);
+
+/* Regular expression compiled to a DFA over the bytes of UTF-8 strings.
+ * State 0 is the dead state, from which no accepting state can be reached,
+ * and state 1 the start state. Bytes are mapped to classes of bytes that are
+ * never told apart, and transitions are stored in a table with one row per
+ * state and one column per class.
+ */
+struct vb_regex {
+   uint8_t classes[256];
+   uint32_t nr_classes;
+   uint32_t nr_states;
+   uint16_t *delta;
+   bool *accepting;
+};
+
+#define VB_REGEX_START 1
+
+/* Compiles a regular expression. If "fold" is set, the expression matches the
+ * folded forms of the strings it would otherwise match, see vb_utf8_fold(), so
+ * that it can be run on the folded index of a lexicon. Returns VB_EQUTF8 if it
+ * isn't valid UTF-8, VB_EREGEX if it is invalid or too complex.
+ */
+int vb_regex_compile(struct vb_regex *, const char *pat, size_t len,
+                     bool fold);
+
+/* Destructor. */
+void vb_regex_fini(struct vb_regex *);
+
+static inline uint32_t vb_regex_step(const struct vb_regex *re, uint32_t state,
+                                     uint8_t chr)
+{
+   return re->delta[state * re->nr_classes + re->classes[chr]];
+}
+
+/* Checks if a whole string matches. */
+static inline bool vb_regex_match(const struct vb_regex *re, const char *str,
+                                  size_t len)
+{
+   uint32_t state = VB_REGEX_START;
+   for (size_t i = 0; i < len && state; i++)
+      state = vb_regex_step(re, state, str[i]);
+   return re->accepting[state];
+}
+
+/* Folded forms of the words of an automaton, see vb_lexicon_fold(). */
+struct vb_folded {
+   struct mini *fsa;          /* Folded forms, numbered. */
+   struct vb_arena *arena;    /* Flat copy of "fsa", if the lexicon has one. */
+
+   /* Ordinals, in the original automaton, of the words each folded form
+    * stands for. Those of the folded form of ordinal "pos" are between
+    * "starts[pos - 1]" and "starts[pos]" in "words".
+    */
+   uint32_t *starts;
+   uint32_t *words;
+};
+
+int vb_folded_new(struct vb_folded **, const struct mini *);
+void vb_folded_free(struct vb_folded *);
+
+/* Searches the folded index of a lexicon, which must be up to date, and
+ * reports the original words. The query must have been folded already.
+ */
+int vb_folded_match(const struct vb_lexicon *, struct vb_match_ctx *);
+
+/* Scores of the words of an automaton, see vb_lexicon_set_scores(). Words are
+ * ranked by decreasing score, then by index. To find the best word of a range
+ * of indexes quickly, we keep a segment tree over the words: node 1 is the
+ * root, the children of node "i" are nodes (2 i) and (2 i + 1), and the word
+ * of index "idx" is node (size + idx). "best" holds the best word below each
+ * of the other nodes.
+ */
+struct vb_scores {
+   const int32_t *scores;     /* One per word, owned by the caller. */
+   uint32_t size;
+   uint32_t *best;
+};
+
+int vb_scores_new(struct vb_scores **, const int32_t *scores, uint32_t size);
+void vb_scores_free(struct vb_scores *);
+
+/* Returns the index of the best word of indexes [start, end), or UINT32_MAX
+ * if the range is empty.
+ */
+uint32_t vb_scores_best(const struct vb_scores *, uint32_t start, uint32_t end);
+
+struct vb_lexicon {
+   struct mini *base;
+   uint32_t base_size;
+   struct vb_words added;
+   struct vb_words removed;
+   struct vb_arena *arena;    /* See vb_lexicon_flatten(). */
+   struct vb_folded *folded;  /* See vb_lexicon_fold(). */
+   struct vb_scores *scores;  /* See vb_lexicon_set_scores(). */
+   bool valid_utf8;           /* All words were checked to be valid UTF-8. */
+
+   /* Identifies the contents of the lexicon, so that results pages can be
+    * cached. Unique to each lexicon, and changed whenever search results
+    * might change. Views have none, and get 0.
+    */
+   uint64_t id;
+};
+
+/* Initializes a lexicon that only wraps an automaton, and that must not be
+ * modified nor freed.
+ */
+void vb_lexicon_view(struct vb_lexicon *, const struct mini *);
+
+/* Returns the flat copy of the words of a lexicon, if it has one and it is
+ * up to date, otherwise NULL.
+ */
+const struct vb_arena *vb_lexicon_arena(const struct vb_lexicon *);
+
+/* Returns the scores of the words of the base automaton of a lexicon, if it
+ * has some and has no pending edits, otherwise NULL.
+ */
+const struct vb_scores *vb_lexicon_scores(const struct vb_lexicon *);
+
+/* Checks if a lexicon contains a word. */
+bool vb_lexicon_contains(const struct vb_lexicon *, const char *word,
+                         size_t len);
+
+/* Dumps the automaton of an encoder, and loads it back, unless "ret", the
+ * error code mn_enc_add() last returned, is not MN_OK. Frees the encoder.
+ */
+int vb_enc_load(struct mini_enc *, int ret, struct mini **);
+
+/* Same as mn_extract(). */
+size_t vb_lexicon_extract(const struct vb_lexicon *, uint32_t pos,
+                          char [static MN_MAX_WORD_LEN + 1]);
+
+/* Code points of a string that is modified at its end only, as is the word of
+ * an automaton iterator, so that only the part that changed must be decoded
+ * again.
+ */
+struct vb_decoded {
+   char32_t chars[MN_MAX_WORD_LEN + 1];
+   uint16_t index[MN_MAX_WORD_LEN + 1];   /* Code point each byte is part of. */
+   size_t len;                            /* Length of the string, in bytes. */
+};
+
+/* Lexicon iterator. The initialization functions have the same semantics as
+ * their mn_iter_*() counterpart, positions included.
+ */
+struct vb_iter {
+   const struct vb_lexicon *lex;
+   struct mini_iter it;
+
+   const char *word;       /* Next word of the base automaton, if fetched. */
+   size_t len;
+   uint32_t pos;           /* Ordinal of the last fetched base word. */
+
+   size_t added;           /* Next added word. */
+   size_t removed;         /* Next removed word. */
+   const char *prefix;     /* Prefix all added words must start with. */
+   size_t prefix_len;
+
+   /* See vb_iter_filter(). */
+   int (*accept)(void *arg, size_t depth, uint8_t chr);
+   void *arg;
+
+   /* See vb_iter_chars(). "decoded" is the number of leading bytes of the
+    * current word of "it" that "chars" holds the code points of.
+    */
+   struct vb_decoded chars;
+   size_t decoded;
+
+   uint64_t utf8_bytes;    /* Bytes vb_iter_chars() decoded so far. */
+};
+
+uint32_t vb_iter_init(struct vb_iter *, const struct vb_lexicon *);
+uint32_t vb_iter_initp(struct vb_iter *, const struct vb_lexicon *,
+                       const char *prefix, size_t len);
+uint32_t vb_iter_inits(struct vb_iter *, const struct vb_lexicon *,
+                       const char *word, size_t len);
+uint32_t vb_iter_initn(struct vb_iter *, const struct vb_lexicon *,
+                       uint32_t pos);
+const char *vb_iter_next(struct vb_iter *, size_t *len);
+
+/* Makes an iterator skip branches of the base automaton, as does
+ * mn_iter_next_filter(). Added words are not filtered.
+ */
+void vb_iter_filter(struct vb_iter *,
+                    int (*accept)(void *arg, size_t depth, uint8_t chr),
+                    void *arg);
+
+/* Returns the code points of the word an iterator returned last, and sets
+ * "nr" to their number, or returns NULL if the word isn't valid UTF-8. Words
+ * of the base automaton are only decoded from the first byte that differs from
+ * the word decoded previously. Only valid until the next call.
+ */
+const char32_t *vb_iter_chars(struct vb_iter *, const char *word, size_t len,
+                              int32_t *nr);
+
+extern int (*const vb_match_funcs[VB_MODES_NR])(const struct vb_lexicon *,
                                                 struct vb_match_ctx *);
 
 void vb_parse_query(struct vb_match_ctx *, char [static MN_MAX_WORD_LEN + 1]);
 
 /* Decodes a UTF-8 string.
- * "dest" should be large enough to hold (len + 1) code points.
+ * "dest" should be large enough to hold (len + 1) code points. All of them
+ * can be overwritten, even past the end of the decoded string.
  * "len" must be < INT32_MAX.
  * The output string will be nul-terminated.
  * Returns the length of the decoded string on success, -1 otherwise.
@@ -37,9 +474,50 @@ void vb_parse_query(struct vb_match_ctx *, char [static MN_MAX_WORD_LEN + 1]);
 int32_t vb_utf8_decode(char32_t *restrict dest,
                        const char *restrict str, size_t len);
 
+/* Same as vb_utf8_decode(), for strings already checked with vb_utf8_check(),
+ * which are not checked again.
+ */
+int32_t vb_utf8_decode_valid(char32_t *restrict dest,
+                             const char *restrict str, size_t len);
+
+/* Decodes a string into "d", see struct vb_decoded. The first "shared" bytes must be the same as
+ * those of the string "d" holds, and are not decoded again. With "check"
+ * unset, the string is assumed to be valid, as with vb_utf8_decode_valid().
+ * Returns the number of code points, or -1 if the string isn't valid, in which
+ * case "d" no longer holds anything.
+ */
+int32_t vb_utf8_decode_next(struct vb_decoded *d, const char *str, size_t len,
+                            size_t shared, bool check);
+
+/* Checks if a string would be decoded successfully by vb_utf8_decode(). */
+bool vb_utf8_check(const char *str, size_t len);
+
 /* Length, in bytes, of the first "nr" code points of "str" if it was encoded
  * as UTF-8.
  */
 size_t vb_utf8_bytes(const char32_t *str, size_t nr);
 
+/* Encodes a code point as UTF-8, which takes at most 4 bytes. Returns the
+ * number of bytes written.
+ */
+size_t vb_utf8_encode(char *dest, char32_t c);
+
+/* Folds a UTF-8 string, for case- and diacritic-insensitive matching. ASCII
+ * letters, and the letters of the Latin-1, Latin Extended-A, Greek and
+ * Cyrillic blocks are lowercased, and their diacritics removed. Combining
+ * marks are dropped. Bytes that are not part of a well-formed sequence are
+ * kept as they are. The folded string is never longer than the original one,
+ * and is nul-terminated, so "dest" must have room for (len + 1) bytes.
+ * Returns its length.
+ */
+size_t vb_utf8_fold(char *restrict dest, const char *restrict str, size_t len);
+
+/* Code points from this one up are their own folded form. */
+#define VB_FOLD_LIMIT 0x460
+
+/* Folds a single code point, as vb_utf8_fold() does. Returns 0 for combining
+ * marks, which are dropped.
+ */
+char32_t vb_fold_char(char32_t c);
+
 #endif
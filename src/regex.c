@@ -0,0 +1,821 @@
+#include <stdlib.h>
+#include <string.h>
+#include "priv.h"
+
+/* Largest code point matched by "." and negated classes. This is the largest
+ * one that vb_utf8_decode() can return.
+ */
+#define RE_MAX_CHAR 0x1fffff
+
+/* Maximum value of repetition counts. Larger ones wouldn't be useful, since
+ * words are at most that long.
+ */
+#define RE_MAX_REPEAT MN_MAX_WORD_LEN
+
+/* Limits on the size of the automata built from an expression. Above them,
+ * the expression is deemed too complex.
+ */
+#define RE_MAX_NODES (1 << 16)
+#define RE_MAX_STATES (1 << 14)
+
+/*******************************************************************************
+ * Parser.
+ ******************************************************************************/
+
+enum re_type {
+   RE_EMPTY,      /* Matches the empty string. */
+   RE_CLASS,      /* Matches a single character. */
+   RE_CAT,
+   RE_ALT,
+   RE_REPEAT,
+};
+
+/* Node of the syntax tree. Literal characters are classes of a single
+ * character.
+ */
+struct re_ast {
+   enum re_type type;
+   int32_t left, right;    /* Operands. REPEAT only has a left one. */
+   int32_t min, max;       /* Repetition counts. "max" is -1 if unbounded. */
+   uint32_t start, end;    /* Ranges of a class, in "ranges". */
+};
+
+struct re_range {
+   char32_t lo, hi;
+};
+
+/* Maximum number of ranges of all the classes of an expression. Without
+ * folding, the ranges of a class are at most as many as its characters, plus
+ * one once it is inverted. Folding adds those of the folded forms of its
+ * characters, which can be more.
+ */
+#define RE_MAX_RANGES (4 * MN_MAX_WORD_LEN)
+
+/* At most one tree node per character of the expression, plus as many for
+ * joining them.
+ */
+struct re_parser {
+   char32_t pat[MN_MAX_WORD_LEN + 1];
+   int32_t len, pos;
+   struct re_ast ast[2 * MN_MAX_WORD_LEN + 2];
+   int32_t nr_ast;
+   struct re_range ranges[RE_MAX_RANGES + 1];
+   uint32_t nr_ranges;
+   bool fold;              /* Whether to fold classes, see re_fold(). */
+   bool failed;
+};
+
+static int32_t re_node(struct re_parser *p, enum re_type type,
+                       int32_t left, int32_t right)
+{
+   struct re_ast *node = &p->ast[p->nr_ast];
+   *node = (struct re_ast){.type = type, .left = left, .right = right};
+   return p->nr_ast++;
+}
+
+/* Adds a range to the class being parsed. The expression is deemed too complex
+ * if there are too many of them. There is always room for one more range,
+ * which re_normalize() can need.
+ */
+static void re_range(struct re_parser *p, char32_t lo, char32_t hi)
+{
+   if (p->nr_ranges == RE_MAX_RANGES)
+      p->failed = true;
+   else
+      p->ranges[p->nr_ranges++] = (struct re_range){lo, hi};
+}
+
+static int32_t re_class(struct re_parser *p, char32_t lo, char32_t hi)
+{
+   int32_t node = re_node(p, RE_CLASS, -1, -1);
+   p->ast[node].start = p->nr_ranges;
+   re_range(p, lo, hi);
+   p->ast[node].end = p->nr_ranges;
+   return node;
+}
+
+static int re_cmp_ranges(const void *a, const void *b)
+{
+   const struct re_range *x = a, *y = b;
+   return (x->lo > y->lo) - (x->lo < y->lo);
+}
+
+/* Sorts the ranges of a class, merges those that overlap or touch, and
+ * inverts them if need be.
+ */
+static void re_normalize(struct re_parser *p, uint32_t start, bool invert)
+{
+   struct re_range *ranges = &p->ranges[start];
+   uint32_t nr = p->nr_ranges - start, out = 0;
+
+   qsort(ranges, nr, sizeof *ranges, re_cmp_ranges);
+   for (uint32_t i = 0; i < nr; i++) {
+      if (out && ranges[i].lo <= ranges[out - 1].hi + 1) {
+         if (ranges[i].hi > ranges[out - 1].hi)
+            ranges[out - 1].hi = ranges[i].hi;
+      } else {
+         ranges[out++] = ranges[i];
+      }
+   }
+
+   if (invert) {
+      /* Work backwards, since there can be one more range. */
+      char32_t hi = RE_MAX_CHAR;
+      uint32_t nr_inv = out + 1;
+      if (out && ranges[0].lo == 0)
+         nr_inv--;
+      if (out && ranges[out - 1].hi == RE_MAX_CHAR)
+         nr_inv--;
+      uint32_t j = nr_inv;
+      for (uint32_t i = out; i-- > 0;) {
+         const struct re_range r = ranges[i];
+         if (r.hi < hi)
+            ranges[--j] = (struct re_range){r.hi + 1, hi};
+         if (!r.lo)
+            break;
+         hi = r.lo - 1;
+      }
+      if (j)
+         ranges[--j] = (struct re_range){0, hi};
+      out = nr_inv;
+   }
+   p->nr_ranges = start + out;
+}
+
+/* Adds to a class the folded forms of its characters, so that, once inverted
+ * if need be, it matches the folded forms of the characters it would match.
+ * Folded strings only contain folded forms, so the original characters can
+ * stay.
+ */
+static void re_fold(struct re_parser *p, uint32_t start)
+{
+   bool folded[VB_FOLD_LIMIT] = {0};
+   const uint32_t end = p->nr_ranges;
+   for (uint32_t i = start; i < end; i++) {
+      const char32_t hi = p->ranges[i].hi;
+      for (char32_t c = p->ranges[i].lo; c <= hi && c < VB_FOLD_LIMIT; c++) {
+         const char32_t f = vb_fold_char(c);
+         if (f && f != c)
+            folded[f] = true;
+      }
+   }
+   for (char32_t c = 0; c < VB_FOLD_LIMIT; c++) {
+      if (!folded[c])
+         continue;
+      char32_t hi = c;
+      while (hi + 1 < VB_FOLD_LIMIT && folded[hi + 1])
+         hi++;
+      re_range(p, c, hi);
+      c = hi;
+   }
+}
+
+/* Returns a class made of a single character, and of its folded form if
+ * folding. Combining marks are dropped by folding, so they match the empty
+ * string.
+ */
+static int32_t re_literal(struct re_parser *p, char32_t c)
+{
+   if (!p->fold)
+      return re_class(p, c, c);
+   if (!vb_fold_char(c))
+      return re_node(p, RE_EMPTY, -1, -1);
+
+   const uint32_t start = p->nr_ranges;
+   re_range(p, c, c);
+   re_fold(p, start);
+   re_normalize(p, start, false);
+   int32_t node = re_node(p, RE_CLASS, -1, -1);
+   p->ast[node].start = start;
+   p->ast[node].end = p->nr_ranges;
+   return node;
+}
+
+static int32_t re_parse_alt(struct re_parser *p);
+
+/* Reads a character of a class, which can be escaped. */
+static char32_t re_class_char(struct re_parser *p)
+{
+   if (p->pat[p->pos] == '\\' && p->pos + 1 < p->len)
+      p->pos++;
+   return p->pat[p->pos++];
+}
+
+static int32_t re_parse_class(struct re_parser *p)
+{
+   const uint32_t start = p->nr_ranges;
+   const bool invert = p->pos < p->len && p->pat[p->pos] == '^';
+   p->pos += invert;
+
+   /* A closing bracket in first position is a literal. */
+   const int32_t first = p->pos;
+   while (p->pos < p->len && (p->pat[p->pos] != ']' || p->pos == first)) {
+      char32_t lo = re_class_char(p), hi = lo;
+      if (p->pos + 1 < p->len && p->pat[p->pos] == '-'
+          && p->pat[p->pos + 1] != ']') {
+         p->pos++;
+         hi = re_class_char(p);
+         if (hi < lo) {
+            p->failed = true;
+            return -1;
+         }
+      }
+      re_range(p, lo, hi);
+   }
+   if (p->pos == p->len) {
+      p->failed = true;
+      return -1;
+   }
+   p->pos++;
+
+   if (p->fold)
+      re_fold(p, start);
+   if (p->failed)
+      return -1;
+   re_normalize(p, start, invert);
+   int32_t node = re_node(p, RE_CLASS, -1, -1);
+   p->ast[node].start = start;
+   p->ast[node].end = p->nr_ranges;
+   return node;
+}
+
+static int32_t re_parse_atom(struct re_parser *p)
+{
+   const char32_t c = p->pat[p->pos++];
+
+   switch (c) {
+   case '(': {
+      int32_t node = re_parse_alt(p);
+      if (p->failed || p->pos == p->len || p->pat[p->pos] != ')') {
+         p->failed = true;
+         return -1;
+      }
+      p->pos++;
+      return node;
+   }
+   case '*': case '+': case '?': case '{':
+      /* Nothing to repeat. */
+      p->failed = true;
+      return -1;
+   case '.':
+      return re_class(p, 0, RE_MAX_CHAR);
+   case '[':
+      return re_parse_class(p);
+   case '\\':
+      if (p->pos == p->len) {
+         p->failed = true;
+         return -1;
+      }
+      p->pos++;
+      return re_literal(p, p->pat[p->pos - 1]);
+   default:
+      return re_literal(p, c);
+   }
+}
+
+/* Reads a repetition count. Returns -1 if there is none. */
+static int32_t re_parse_count(struct re_parser *p)
+{
+   int32_t n = -1;
+
+   while (p->pos < p->len && p->pat[p->pos] >= '0' && p->pat[p->pos] <= '9') {
+      n = (n < 0 ? 0 : n) * 10 + p->pat[p->pos++] - '0';
+      if (n > RE_MAX_REPEAT) {
+         p->failed = true;
+         return -1;
+      }
+   }
+   return n;
+}
+
+static int32_t re_parse_repeat(struct re_parser *p)
+{
+   int32_t node = re_parse_atom(p);
+
+   while (!p->failed && p->pos < p->len) {
+      int32_t min, max;
+      switch (p->pat[p->pos++]) {
+      case '*':
+         min = 0, max = -1;
+         break;
+      case '+':
+         min = 1, max = -1;
+         break;
+      case '?':
+         min = 0, max = 1;
+         break;
+      case '{':
+         min = max = re_parse_count(p);
+         if (p->pos < p->len && p->pat[p->pos] == ',') {
+            p->pos++;
+            max = re_parse_count(p);
+         }
+         if (p->failed || min < 0 || p->pos == p->len
+             || p->pat[p->pos++] != '}' || (max >= 0 && max < min)) {
+            p->failed = true;
+            return -1;
+         }
+         break;
+      default:
+         p->pos--;
+         return node;
+      }
+      node = re_node(p, RE_REPEAT, node, -1);
+      p->ast[node].min = min;
+      p->ast[node].max = max;
+   }
+   return node;
+}
+
+static int32_t re_parse_cat(struct re_parser *p)
+{
+   int32_t node = -1;
+
+   while (!p->failed && p->pos < p->len && p->pat[p->pos] != '|'
+          && p->pat[p->pos] != ')') {
+      int32_t next = re_parse_repeat(p);
+      node = node < 0 ? next : re_node(p, RE_CAT, node, next);
+   }
+   return node < 0 ? re_node(p, RE_EMPTY, -1, -1) : node;
+}
+
+static int32_t re_parse_alt(struct re_parser *p)
+{
+   int32_t node = re_parse_cat(p);
+
+   while (!p->failed && p->pos < p->len && p->pat[p->pos] == '|') {
+      p->pos++;
+      node = re_node(p, RE_ALT, node, re_parse_cat(p));
+   }
+   return node;
+}
+
+
+/*******************************************************************************
+ * Conversion to a byte-level NFA.
+ ******************************************************************************/
+
+enum re_nfa_type {
+   NFA_MATCH,
+   NFA_BYTES,     /* Moves to "out" on a byte in [lo, hi]. */
+   NFA_SPLIT,     /* Moves to both "out" and "out1" without consuming input. */
+};
+
+struct re_nfa_node {
+   enum re_nfa_type type;
+   uint8_t lo, hi;
+   int32_t out, out1;
+};
+
+struct re_nfa {
+   struct re_nfa_node *nodes;
+   int32_t nr, max;
+   int err;
+};
+
+static int32_t nfa_node(struct re_nfa *n, enum re_nfa_type type,
+                        int32_t out, int32_t out1)
+{
+   if (n->err)
+      return 0;
+   if (n->nr == n->max) {
+      int32_t max = n->max ? n->max * 2 : 256;
+      if (max > RE_MAX_NODES) {
+         n->err = VB_EREGEX;
+         return 0;
+      }
+      struct re_nfa_node *nodes = realloc(n->nodes, max * sizeof *nodes);
+      if (!nodes) {
+         n->err = VB_ENOMEM;
+         return 0;
+      }
+      n->nodes = nodes;
+      n->max = max;
+   }
+   n->nodes[n->nr] = (struct re_nfa_node){
+      .type = type,
+      .out = out,
+      .out1 = out1,
+   };
+   return n->nr++;
+}
+
+/* Adds a path that matches the UTF-8 encodings of the code points in
+ * [lo, hi], as an alternative to "alt" if it is not negative. We split the
+ * range until the encodings of the code points in each subrange form the
+ * cartesian product of byte ranges, as described in Russ Cox, "Regular
+ * Expression Matching in the Wild".
+ */
+static int32_t nfa_utf8(struct re_nfa *n, char32_t lo, char32_t hi,
+                        int32_t next, int32_t alt)
+{
+   static const char32_t max_chars[] = {0x7f, 0x7ff, 0xffff};
+
+   for (size_t i = 0; i < sizeof max_chars / sizeof *max_chars; i++) {
+      if (lo <= max_chars[i] && hi > max_chars[i]) {
+         alt = nfa_utf8(n, lo, max_chars[i], next, alt);
+         return nfa_utf8(n, max_chars[i] + 1, hi, next, alt);
+      }
+   }
+
+   char los[4], his[4];
+   const size_t len = vb_utf8_encode(los, lo);
+   vb_utf8_encode(his, hi);
+   for (size_t i = 1; i < len; i++) {
+      const char32_t m = (UINT32_C(1) << (6 * i)) - 1;
+      if ((lo & ~m) == (hi & ~m))
+         continue;
+      if (lo & m) {
+         alt = nfa_utf8(n, lo, lo | m, next, alt);
+         return nfa_utf8(n, (lo | m) + 1, hi, next, alt);
+      }
+      if ((hi & m) != m) {
+         alt = nfa_utf8(n, lo, (hi & ~m) - 1, next, alt);
+         return nfa_utf8(n, hi & ~m, hi, next, alt);
+      }
+   }
+
+   int32_t node = next;
+   for (size_t i = len; i-- > 0;) {
+      node = nfa_node(n, NFA_BYTES, node, -1);
+      if (!n->err) {
+         n->nodes[node].lo = los[i];
+         n->nodes[node].hi = his[i];
+      }
+   }
+   return alt < 0 ? node : nfa_node(n, NFA_SPLIT, alt, node);
+}
+
+/* Converts a syntax tree to an NFA that moves to "next" once it has matched.
+ * Returns its start node.
+ */
+static int32_t nfa_compile(struct re_nfa *n, const struct re_parser *p,
+                           int32_t idx, int32_t next)
+{
+   const struct re_ast *ast = &p->ast[idx];
+
+   switch (ast->type) {
+   case RE_EMPTY:
+      return next;
+   case RE_CLASS: {
+      int32_t alt = -1;
+      for (uint32_t i = ast->start; i < ast->end; i++)
+         alt = nfa_utf8(n, p->ranges[i].lo, p->ranges[i].hi, next, alt);
+      if (alt < 0) {
+         /* Empty class, matches nothing. */
+         alt = nfa_node(n, NFA_BYTES, next, -1);
+         if (!n->err) {
+            n->nodes[alt].lo = 1;
+            n->nodes[alt].hi = 0;
+         }
+      }
+      return alt;
+   }
+   case RE_CAT:
+      return nfa_compile(n, p, ast->left, nfa_compile(n, p, ast->right, next));
+   case RE_ALT: {
+      int32_t left = nfa_compile(n, p, ast->left, next);
+      return nfa_node(n, NFA_SPLIT, left, nfa_compile(n, p, ast->right, next));
+   }
+   default: {
+      /* Optional copies, then mandatory ones. */
+      int32_t node = next;
+      if (ast->max < 0) {
+         int32_t loop = nfa_node(n, NFA_SPLIT, -1, next);
+         int32_t body = nfa_compile(n, p, ast->left, loop);
+         if (!n->err)
+            n->nodes[loop].out = body;
+         node = loop;
+      } else {
+         for (int32_t i = ast->min; i < ast->max && !n->err; i++)
+            node = nfa_node(n, NFA_SPLIT,
+                            nfa_compile(n, p, ast->left, node), next);
+      }
+      for (int32_t i = 0; i < ast->min && !n->err; i++)
+         node = nfa_compile(n, p, ast->left, node);
+      return node;
+   }
+   }
+}
+
+
+/*******************************************************************************
+ * Conversion to a DFA.
+ ******************************************************************************/
+
+/* Each DFA state is a set of NFA nodes, stored sorted in "sets". */
+struct re_dfa_builder {
+   const struct re_nfa *nfa;
+   struct vb_regex *re;
+   uint8_t reps[256];         /* A byte of each class. */
+
+   int32_t *sets;
+   size_t sets_len, sets_max;
+   size_t *set_offsets;       /* Offset of each state, plus the end. */
+
+   uint32_t max_states;       /* Room in the arrays below and in "delta". */
+   uint32_t *table;           /* Hash table of state numbers + 1. */
+   uint32_t table_mask;
+
+   uint32_t *marks;           /* Closure computation. */
+   uint32_t mark;
+   int32_t *stack;
+   int32_t *buf;
+};
+
+static uint32_t re_hash(const int32_t *set, size_t len)
+{
+   uint32_t h = 2166136261u;
+   for (size_t i = 0; i < len; i++)
+      h = (h ^ (uint32_t)set[i]) * 16777619u;
+   return h;
+}
+
+static int re_cmp_ints(const void *a, const void *b)
+{
+   int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+   return (x > y) - (x < y);
+}
+
+/* Computes the set of nodes reachable from the given ones without consuming
+ * input, keeping only those that do. Writes it sorted to "buf", and returns its
+ * size.
+ */
+static size_t re_closure(struct re_dfa_builder *b, const int32_t *seeds,
+                         size_t nr)
+{
+   const struct re_nfa_node *nodes = b->nfa->nodes;
+   size_t len = 0, top = 0;
+
+   b->mark++;
+   for (size_t i = 0; i < nr; i++)
+      b->stack[top++] = seeds[i];
+   while (top) {
+      const int32_t idx = b->stack[--top];
+      if (b->marks[idx] == b->mark)
+         continue;
+      b->marks[idx] = b->mark;
+      if (nodes[idx].type == NFA_SPLIT) {
+         b->stack[top++] = nodes[idx].out1;
+         b->stack[top++] = nodes[idx].out;
+      } else {
+         b->buf[len++] = idx;
+      }
+   }
+   qsort(b->buf, len, sizeof *b->buf, re_cmp_ints);
+   return len;
+}
+
+/* Makes room for twice as many states. The hash table is kept half empty. */
+static bool re_grow(struct re_dfa_builder *b)
+{
+   struct vb_regex *re = b->re;
+   const uint32_t max = b->max_states * 2;
+
+   size_t *offsets = realloc(b->set_offsets, (max + 1) * sizeof *offsets);
+   if (!offsets)
+      return false;
+   b->set_offsets = offsets;
+   uint16_t *delta = realloc(re->delta,
+                             (size_t)max * re->nr_classes * sizeof *delta);
+   if (!delta)
+      return false;
+   re->delta = delta;
+   uint32_t *table = calloc(2 * max, sizeof *table);
+   if (!table)
+      return false;
+   free(b->table);
+   b->table = table;
+   b->table_mask = 2 * max - 1;
+   b->max_states = max;
+
+   for (uint32_t state = 0; state < re->nr_states; state++) {
+      const size_t off = b->set_offsets[state];
+      uint32_t h = re_hash(&b->sets[off], b->set_offsets[state + 1] - off)
+                 & b->table_mask;
+      while (b->table[h])
+         h = (h + 1) & b->table_mask;
+      b->table[h] = state + 1;
+   }
+   return true;
+}
+
+/* Returns the number of the DFA state made of the nodes in "buf", adding it
+ * if need be, or -1 on failure.
+ */
+static int32_t re_state(struct re_dfa_builder *b, size_t len)
+{
+   struct vb_regex *re = b->re;
+   uint32_t h = re_hash(b->buf, len) & b->table_mask;
+
+   for (; b->table[h]; h = (h + 1) & b->table_mask) {
+      const uint32_t state = b->table[h] - 1;
+      const size_t off = b->set_offsets[state];
+      if (b->set_offsets[state + 1] - off == len
+          && !memcmp(&b->sets[off], b->buf, len * sizeof *b->buf))
+         return state;
+   }
+
+   if (re->nr_states == RE_MAX_STATES)
+      return -1;
+   if (re->nr_states == b->max_states) {
+      if (!re_grow(b))
+         return -1;
+      h = re_hash(b->buf, len) & b->table_mask;
+      while (b->table[h])
+         h = (h + 1) & b->table_mask;
+   }
+   if (b->sets_len + len > b->sets_max) {
+      size_t max = b->sets_max * 2;
+      while (max < b->sets_len + len)
+         max *= 2;
+      int32_t *sets = realloc(b->sets, max * sizeof *sets);
+      if (!sets)
+         return -1;
+      b->sets = sets;
+      b->sets_max = max;
+   }
+
+   memcpy(&b->sets[b->sets_len], b->buf, len * sizeof *b->buf);
+   b->sets_len += len;
+   b->set_offsets[++re->nr_states] = b->sets_len;
+   b->table[h] = re->nr_states;
+   return re->nr_states - 1;
+}
+
+/* Redirects transitions to states from which no accepting state can be
+ * reached to the dead state, so that walks stop as soon as possible.
+ */
+static int re_prune(struct vb_regex *re)
+{
+   const uint32_t nr = re->nr_states, ncl = re->nr_classes;
+   const size_t nr_edges = (size_t)nr * ncl;
+   uint32_t *counts = calloc(nr + 1, sizeof *counts);
+   uint32_t *preds = malloc(nr_edges * sizeof *preds);
+   uint32_t *queue = malloc(nr * sizeof *queue);
+   bool *live = calloc(nr, sizeof *live);
+   int ret = VB_ENOMEM;
+   if (!counts || !preds || !queue || !live)
+      goto fini;
+
+   /* Predecessors of each state. */
+   for (size_t i = 0; i < nr_edges; i++)
+      counts[re->delta[i] + 1]++;
+   for (uint32_t s = 0; s < nr; s++)
+      counts[s + 1] += counts[s];
+   for (size_t i = 0; i < nr_edges; i++)
+      preds[counts[re->delta[i]]++] = i / ncl;
+   for (uint32_t s = nr; s > 0; s--)
+      counts[s] = counts[s - 1];
+   counts[0] = 0;
+
+   uint32_t head = 0, tail = 0;
+   for (uint32_t s = 0; s < nr; s++)
+      if (re->accepting[s])
+         live[queue[tail++] = s] = true;
+   while (head < tail) {
+      const uint32_t s = queue[head++];
+      for (uint32_t i = counts[s]; i < counts[s + 1]; i++)
+         if (!live[preds[i]])
+            live[queue[tail++] = preds[i]] = true;
+   }
+
+   for (size_t i = 0; i < nr_edges; i++)
+      if (!live[re->delta[i]])
+         re->delta[i] = 0;
+   ret = VB_OK;
+
+fini:
+   free(counts);
+   free(preds);
+   free(queue);
+   free(live);
+   return ret;
+}
+
+static int re_build_dfa(struct vb_regex *re, const struct re_nfa *nfa,
+                        int32_t start)
+{
+   /* Bytes that no range tells apart belong to the same class. */
+   bool bounds[257] = {false};
+   for (int32_t i = 0; i < nfa->nr; i++) {
+      if (nfa->nodes[i].type == NFA_BYTES && nfa->nodes[i].lo <= nfa->nodes[i].hi) {
+         bounds[nfa->nodes[i].lo] = true;
+         bounds[nfa->nodes[i].hi + 1] = true;
+      }
+   }
+   struct re_dfa_builder b = {.nfa = nfa, .re = re};
+   re->nr_classes = 0;
+   for (int c = 0; c < 256; c++) {
+      if (c == 0 || bounds[c])
+         b.reps[re->nr_classes++] = c;
+      re->classes[c] = re->nr_classes - 1;
+   }
+
+   b.sets_max = 1024;
+   b.sets = malloc(b.sets_max * sizeof *b.sets);
+   b.max_states = 8;
+   b.set_offsets = malloc((b.max_states + 1) * sizeof *b.set_offsets);
+   re->delta = malloc(b.max_states * re->nr_classes * sizeof *re->delta);
+   b.table_mask = 2 * b.max_states - 1;
+   b.table = calloc(b.table_mask + 1, sizeof *b.table);
+   b.marks = calloc(nfa->nr, sizeof *b.marks);
+   b.stack = malloc(3 * nfa->nr * sizeof *b.stack);
+   b.buf = malloc(nfa->nr * sizeof *b.buf);
+   int32_t *seeds = malloc(nfa->nr * sizeof *seeds);
+
+   int ret = VB_ENOMEM;
+   if (!b.sets || !b.set_offsets || !re->delta || !b.table || !b.marks
+       || !b.stack || !b.buf || !seeds)
+      goto fini;
+
+   /* The dead state, then the start state. */
+   b.set_offsets[0] = 0;
+   re->nr_states = 0;
+   if (re_state(&b, 0) < 0 || re_state(&b, re_closure(&b, &start, 1)) < 0)
+      goto fini;
+
+   for (uint32_t s = 0; s < re->nr_states; s++) {
+      for (uint32_t c = 0; c < re->nr_classes; c++) {
+         const uint8_t rep = b.reps[c];
+         size_t nr = 0;
+         for (size_t i = b.set_offsets[s]; i < b.set_offsets[s + 1]; i++) {
+            const struct re_nfa_node *node = &nfa->nodes[b.sets[i]];
+            if (node->type == NFA_BYTES && node->lo <= rep && rep <= node->hi)
+               seeds[nr++] = node->out;
+         }
+         int32_t next = nr ? re_state(&b, re_closure(&b, seeds, nr)) : 0;
+         if (next < 0) {
+            ret = re->nr_states == RE_MAX_STATES ? VB_EREGEX : VB_ENOMEM;
+            goto fini;
+         }
+         re->delta[s * re->nr_classes + c] = next;
+      }
+   }
+
+   re->accepting = calloc(re->nr_states, sizeof *re->accepting);
+   if (!re->accepting)
+      goto fini;
+   for (uint32_t s = 0; s < re->nr_states; s++)
+      for (size_t i = b.set_offsets[s]; i < b.set_offsets[s + 1]; i++)
+         if (nfa->nodes[b.sets[i]].type == NFA_MATCH)
+            re->accepting[s] = true;
+   ret = re_prune(re);
+
+fini:
+   free(b.sets);
+   free(b.set_offsets);
+   free(b.table);
+   free(b.marks);
+   free(b.stack);
+   free(b.buf);
+   free(seeds);
+   return ret;
+}
+
+
+/*******************************************************************************
+ * Public functions.
+ ******************************************************************************/
+
+int vb_regex_compile(struct vb_regex *re, const char *pat, size_t len,
+                     bool fold)
+{
+   re->delta = NULL;
+   re->accepting = NULL;
+
+   struct re_parser *p = malloc(sizeof *p);
+   if (!p)
+      return VB_ENOMEM;
+   p->len = vb_utf8_decode(p->pat, pat, len);
+   if (p->len < 0) {
+      free(p);
+      return VB_EQUTF8;
+   }
+   p->pos = p->nr_ast = p->nr_ranges = 0;
+   p->fold = fold;
+   p->failed = false;
+
+   int32_t root = re_parse_alt(p);
+   if (p->failed || p->pos != p->len) {
+      free(p);
+      return VB_EREGEX;
+   }
+
+   struct re_nfa nfa = {0};
+   int32_t match = nfa_node(&nfa, NFA_MATCH, -1, -1);
+   int32_t start = nfa_compile(&nfa, p, root, match);
+   free(p);
+
+   int ret = nfa.err ? nfa.err : re_build_dfa(re, &nfa, start);
+   free(nfa.nodes);
+   if (ret)
+      vb_regex_fini(re);
+   return ret;
+}
+
+void vb_regex_fini(struct vb_regex *re)
+{
+   free(re->delta);
+   free(re->accepting);
+}
@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include "priv.h"
+
+/* Of two words, returns the one with the highest score, or the first one if
+ * they have the same. Ranking words this way is a total order, so which of the
+ * two is passed first doesn't matter.
+ */
+static uint32_t vb_scores_better(const int32_t *scores, uint32_t a, uint32_t b)
+{
+   if (scores[a] != scores[b])
+      return scores[a] > scores[b] ? a : b;
+   return a < b ? a : b;
+}
+
+/* Node "i" of the tree, for i >= size, is the word of index (i - size). */
+static uint32_t vb_scores_node(const struct vb_scores *s, uint32_t i)
+{
+   return i >= s->size ? i - s->size : s->best[i];
+}
+
+int vb_scores_new(struct vb_scores **sp, const int32_t *scores, uint32_t size)
+{
+   *sp = NULL;
+
+   struct vb_scores *s = malloc(sizeof *s);
+   if (!s)
+      return VB_ENOMEM;
+   s->best = malloc(sizeof *s->best * (size ? size : 1));
+   if (!s->best) {
+      free(s);
+      return VB_ENOMEM;
+   }
+   s->scores = scores;
+   s->size = size;
+
+   for (uint32_t i = size; i-- > 1; )
+      s->best[i] = vb_scores_better(scores, vb_scores_node(s, 2 * i),
+                                    vb_scores_node(s, 2 * i + 1));
+   *sp = s;
+   return VB_OK;
+}
+
+void vb_scores_free(struct vb_scores *s)
+{
+   if (!s)
+      return;
+   free(s->best);
+   free(s);
+}
+
+uint32_t vb_scores_best(const struct vb_scores *s, uint32_t start, uint32_t end)
+{
+   uint32_t best = UINT32_MAX;
+
+   for (start += s->size, end += s->size; start < end; start >>= 1, end >>= 1) {
+      if (start & 1) {
+         const uint32_t node = vb_scores_node(s, start++);
+         best = best == UINT32_MAX ? node : vb_scores_better(s->scores, best, node);
+      }
+      if (end & 1) {
+         const uint32_t node = vb_scores_node(s, --end);
+         best = best == UINT32_MAX ? node : vb_scores_better(s->scores, best, node);
+      }
+   }
+   return best;
+}
@@ -1,5 +1,9 @@
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "priv.h"
 
 static const unsigned char vb_len_table[256] = {
@@ -38,18 +42,88 @@ static char32_t vb_decode_char(const unsigned char *str, size_t clen)
 }
 #define vb_decode_char(str, len) vb_decode_char((const unsigned char *)(str), len)
 
-int32_t vb_utf8_decode(char32_t *restrict dest,
-                       const char *restrict str, size_t len)
+/* Decodes a run of ASCII characters at the start of a string, if any. Returns
+ * the number of characters decoded. With SSE2, we check and widen 16 bytes at a
+ * time, otherwise 8. When a block is not all ASCII, we still widen it whole,
+ * but only count its leading ASCII bytes. This is why "dest" must have room
+ * for as many code points as there are bytes in "str".
+ */
+static size_t vb_decode_ascii(char32_t *restrict dest,
+                              const unsigned char *restrict str, size_t len)
+{
+   size_t i = 0;
+
+#ifdef __SSE2__
+   const __m128i zero = _mm_setzero_si128();
+   while (i + 16 <= len) {
+      const __m128i bytes = _mm_loadu_si128((const __m128i *)&str[i]);
+      const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      _mm_storeu_si128((__m128i *)&dest[i], _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128((__m128i *)&dest[i + 4], _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128((__m128i *)&dest[i + 8], _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128((__m128i *)&dest[i + 12], _mm_unpackhi_epi16(hi, zero));
+      const unsigned mask = _mm_movemask_epi8(bytes);
+      if (mask)
+         return i + __builtin_ctz(mask);
+      i += 16;
+   }
+#endif
+   while (i + 8 <= len) {
+      uint64_t word;
+      memcpy(&word, &str[i], sizeof word);
+      if (word & UINT64_C(0x8080808080808080))
+         break;
+      for (size_t j = 0; j < 8; j++)
+         dest[i + j] = str[i + j];
+      i += 8;
+   }
+   while (i < len && str[i] < 0x80) {
+      dest[i] = str[i];
+      i++;
+   }
+   return i;
+}
+
+/* When "check" is false, the string is assumed to be valid. */
+static inline int32_t vb_decode(char32_t *restrict dest,
+                                const char *restrict str, size_t len,
+                                bool check)
 {
    assert(len < INT32_MAX);
 
+   const unsigned char *ustr = (const unsigned char *)str;
    int32_t ulen = 0;
 
    for (size_t i = 0; i < len; ) {
+      /* Only take the ASCII path for runs long enough to pay off. */
+      uint64_t word;
+      if (i + 8 <= len && (memcpy(&word, &ustr[i], sizeof word),
+                           !(word & UINT64_C(0x8080808080808080)))) {
+         const size_t n = vb_decode_ascii(&dest[ulen], &ustr[i], len - i);
+         ulen += n;
+         i += n;
+         continue;
+      }
       size_t clen = vb_char_len(str[i]);
-      if (clen == 0 || i + clen > len)
+      if (check && (clen == 0 || i + clen > len))
          return -1;
-      dest[ulen++] = vb_decode_char(&str[i], clen);
+      if (i + 4 <= len) {
+         /* Decode all possible lengths and pick the right one, instead of
+          * branching on the length, which is hard to predict in scripts that
+          * mix ASCII and other characters.
+          */
+         const unsigned char *c = &ustr[i];
+         const char32_t cands[5] = {
+            [1] = c[0],
+            [2] = ((c[0] & 0x1F) << 6) | (c[1] & 0x3F),
+            [3] = ((c[0] & 0x0f) << 12) | ((c[1] & 0x3f) << 6) | (c[2] & 0x3f),
+            [4] = ((c[0] & 0x07) << 18) | ((c[1] & 0x3f) << 12) | ((c[2] & 0x3f) << 6) | (c[3] & 0x3f),
+         };
+         dest[ulen++] = cands[clen];
+      } else {
+         dest[ulen++] = vb_decode_char(&str[i], clen);
+      }
       i += clen;
    }
 
@@ -57,6 +131,68 @@ int32_t vb_utf8_decode(char32_t *restrict dest,
    return ulen;
 }
 
+int32_t vb_utf8_decode(char32_t *restrict dest,
+                       const char *restrict str, size_t len)
+{
+   return vb_decode(dest, str, len, true);
+}
+
+int32_t vb_utf8_decode_valid(char32_t *restrict dest,
+                             const char *restrict str, size_t len)
+{
+   return vb_decode(dest, str, len, false);
+}
+
+int32_t vb_utf8_decode_next(struct vb_decoded *d, const char *str, size_t len,
+                            size_t shared, bool check)
+{
+   /* Start over from the code point the first changed byte belongs to. */
+   if (shared > d->len)
+      shared = d->len;
+   int32_t ulen = 0;
+   size_t i = 0;
+   if (shared) {
+      ulen = d->index[shared];
+      for (i = shared; i > 0 && d->index[i - 1] == ulen; i--)
+         ;
+   }
+
+   while (i < len) {
+      size_t clen = vb_char_len(str[i]);
+      if (check && (clen == 0 || i + clen > len)) {
+         d->len = 0;
+         return -1;
+      }
+      d->chars[ulen] = vb_decode_char(&str[i], clen);
+      for (size_t j = 0; j < clen; j++)
+         d->index[i + j] = ulen;
+      ulen++;
+      i += clen;
+   }
+
+   d->index[len] = ulen;
+   d->chars[ulen] = U'\0';
+   d->len = len;
+   return ulen;
+}
+
+bool vb_utf8_check(const char *str, size_t len)
+{
+   for (size_t i = 0; i < len; ) {
+      uint64_t word;
+      if (i + 8 <= len && (memcpy(&word, &str[i], sizeof word),
+                           !(word & UINT64_C(0x8080808080808080)))) {
+         i += 8;
+         continue;
+      }
+      size_t clen = vb_char_len(str[i]);
+      if (clen == 0 || i + clen > len)
+         return false;
+      i += clen;
+   }
+   return true;
+}
+
 size_t vb_utf8_bytes(const char32_t *str, size_t nr)
 {
    size_t pfx = 0;
@@ -73,3 +209,129 @@ size_t vb_utf8_bytes(const char32_t *str, size_t nr)
    }
    return pfx;
 }
+
+size_t vb_utf8_encode(char *dest, char32_t c)
+{
+   if (c < 0x80) {
+      dest[0] = c;
+      return 1;
+   }
+   if (c < 0x800) {
+      dest[0] = 0xc0 | (c >> 6);
+      dest[1] = 0x80 | (c & 0x3f);
+      return 2;
+   }
+   if (c < 0x10000) {
+      dest[0] = 0xe0 | (c >> 12);
+      dest[1] = 0x80 | ((c >> 6) & 0x3f);
+      dest[2] = 0x80 | (c & 0x3f);
+      return 3;
+   }
+   dest[0] = 0xf0 | (c >> 18);
+   dest[1] = 0x80 | ((c >> 12) & 0x3f);
+   dest[2] = 0x80 | ((c >> 6) & 0x3f);
+   dest[3] = 0x80 | (c & 0x3f);
+   return 4;
+}
+
+/* Base letters of the Latin-1 Supplement, from U+00C0, and of the Latin
+ * Extended-A block, from U+0100. A nul byte stands for a letter that has no
+ * base letter, which is only lowercased.
+ */
+static const char vb_latin1_bases[] =
+   "aaaaaa\0ceeeeiiii\0nooooo\0ouuuuy\0\0"
+   "aaaaaa\0ceeeeiiii\0nooooo\0ouuuuy\0y";
+static const char vb_latin_a_bases[] =
+   "aaaaaacccccccc" "dddd" "eeeeeeeeee" "gggggggg" "hhhh" "iiiiiiiiii"
+   "\0\0" "jj" "kk\0" "llllllllll" "nnnnnn" "\0\0\0" "oooooo" "\0\0"
+   "rrrrrr" "ssssssss" "tttttt" "uuuuuuuuuuuu" "ww" "yyy" "zzzzzz" "s";
+
+_Static_assert(sizeof vb_latin1_bases == 0x40 + 1, "bad table size");
+_Static_assert(sizeof vb_latin_a_bases == 0x80 + 1, "bad table size");
+
+char32_t vb_fold_char(char32_t c)
+{
+   if (c >= 'A' && c <= 'Z')
+      return c + 0x20;
+   if (c < 0xc0)
+      return c;
+   if (c < 0x100) {
+      if (vb_latin1_bases[c - 0xc0])
+         return vb_latin1_bases[c - 0xc0];
+      return c < 0xdf && c != 0xd7 ? c + 0x20 : c;
+   }
+   if (c < 0x180) {
+      if (vb_latin_a_bases[c - 0x100])
+         return vb_latin_a_bases[c - 0x100];
+      return c == 0x138 || c == 0x149 ? c : c | 1;
+   }
+   if (c >= 0x300 && c < 0x370)
+      return 0;
+
+   /* Greek. Accented vowels are mapped to the unaccented lowercase ones. */
+   if (c >= 0x386 && c < 0x3d0) {
+      static const char32_t accented[][2] = {
+         {0x386, 0x3b1}, {0x388, 0x3b5}, {0x389, 0x3b7}, {0x38a, 0x3b9},
+         {0x38c, 0x3bf}, {0x38e, 0x3c5}, {0x38f, 0x3c9}, {0x390, 0x3b9},
+         {0x3aa, 0x3b9}, {0x3ab, 0x3c5}, {0x3ac, 0x3b1}, {0x3ad, 0x3b5},
+         {0x3ae, 0x3b7}, {0x3af, 0x3b9}, {0x3b0, 0x3c5}, {0x3c2, 0x3c3},
+         {0x3ca, 0x3b9}, {0x3cb, 0x3c5}, {0x3cc, 0x3bf}, {0x3cd, 0x3c5},
+         {0x3ce, 0x3c9},
+      };
+      for (size_t i = 0; i < sizeof accented / sizeof *accented; i++)
+         if (accented[i][0] == c)
+            return accented[i][1];
+      return c >= 0x391 && c <= 0x3a9 ? c + 0x20 : c;
+   }
+
+   /* Cyrillic. Only е and и with a diacritic are mapped to the plain letter,
+    * since the other letters with a diacritic are letters of their own.
+    */
+   if (c >= 0x400 && c < 0x460) {
+      if (c < 0x410)
+         c += 0x50;
+      else if (c < 0x430)
+         c += 0x20;
+      if (c == 0x450 || c == 0x451)
+         return 0x435;
+      if (c == 0x45d)
+         return 0x438;
+   }
+   return c;
+}
+
+size_t vb_utf8_fold(char *restrict dest, const char *restrict str, size_t len)
+{
+   const unsigned char *ustr = (const unsigned char *)str;
+   size_t flen = 0;
+
+   for (size_t i = 0; i < len; ) {
+      if (ustr[i] < 0x80) {
+         dest[flen++] = ustr[i] >= 'A' && ustr[i] <= 'Z' ? ustr[i] + 0x20 : ustr[i];
+         i++;
+         continue;
+      }
+      /* Bytes that are not part of a well-formed sequence are kept as they
+       * are.
+       */
+      size_t clen = vb_char_len(str[i]);
+      bool valid = clen && i + clen <= len;
+      for (size_t j = 1; valid && j < clen; j++)
+         valid = (ustr[i + j] & 0xc0) == 0x80;
+      if (!valid) {
+         dest[flen++] = str[i++];
+         continue;
+      }
+      const char32_t c = vb_decode_char(&str[i], clen);
+      const char32_t folded = vb_fold_char(c);
+      if (folded == c) {
+         memcpy(&dest[flen], &str[i], clen);
+         flen += clen;
+      } else if (folded) {
+         flen += vb_utf8_encode(&dest[flen], folded);
+      }
+      i += clen;
+   }
+   dest[flen] = '\0';
+   return flen;
+}
@@ -0,0 +1,98 @@
+#ifndef VB_TEST_FIXTURE_H
+#define VB_TEST_FIXTURE_H
+
+/* Fixture of the tests that search a lexicon of real words. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../volubile.h"
+#include "../src/lib/mini.h"
+
+#define MAX_WORDS 1000
+
+/* The first MAX_WORDS words of "lexicon.txt", once load_words() is called. */
+static char *words[MAX_WORDS];
+static size_t num_words;
+
+static void load_words(void)
+{
+   FILE *fp = fopen("lexicon.txt", "r");
+   assert(fp);
+
+   char line[MN_MAX_WORD_LEN + 2];
+   while (num_words < MAX_WORDS && fgets(line, sizeof line, fp)) {
+      size_t len = strcspn(line, "\n");
+      words[num_words] = malloc(len + 1);
+      memcpy(words[num_words], line, len);
+      words[num_words++][len] = '\0';
+   }
+   fclose(fp);
+}
+
+/* Dumps the automaton of an encoder, frees the encoder, and loads the automaton
+ * back.
+ */
+static struct mini *reload(struct mini_enc *enc)
+{
+   FILE *fp = tmpfile();
+   assert(mn_enc_dump_file(enc, fp) == MN_OK);
+   mn_enc_free(enc);
+   rewind(fp);
+
+   struct mini *fsa;
+   assert(mn_load_file(&fsa, fp) == MN_OK);
+   fclose(fp);
+   return fsa;
+}
+
+/* Builds an automaton from the words for which "present" is set. */
+static struct mini *build_type(const bool *present, enum mn_type type)
+{
+   struct mini_enc *enc = mn_enc_new(type);
+   for (size_t i = 0; i < num_words; i++)
+      if (present[i])
+         assert(mn_enc_add(enc, words[i], strlen(words[i])) == MN_OK);
+   return reload(enc);
+}
+
+static struct mini *build(const bool *present)
+{
+   return build_type(present, MN_NUMBERED);
+}
+
+/* Loads "lexicon.mn", from the current directory. */
+static struct vb_lexicon *load_lexicon(void)
+{
+   FILE *fp = fopen("lexicon.mn", "rb");
+   assert(fp);
+   struct mini *fsa;
+   assert(mn_load_file(&fsa, fp) == MN_OK);
+   fclose(fp);
+
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, fsa) == VB_OK);
+   return lex;
+}
+
+/* Matching words, one per line. */
+struct matches {
+   char buf[1 << 16];
+   size_t len;
+};
+
+static void gather(void *arg, const char *word, size_t len)
+{
+   struct matches *m = arg;
+
+   assert(m->len + len + 1 < sizeof m->buf);
+   memcpy(&m->buf[m->len], word, len);
+   m->len += len;
+   m->buf[m->len++] = '\n';
+   m->buf[m->len] = '\0';
+}
+
+#endif
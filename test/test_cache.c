@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../volubile.h"
+#include "fixture.h"
+
+#define NUM_THREADS 4
+#define NUM_QUERIES 40
+
+/* Queries of all modes, with and without mode selectors. */
+static const char *const queries[NUM_QUERIES] = {
+   "Aa", "Ab*", "#ing", "*ed", "@Aaron", "~Abel", "+Abba", "%Ada",
+   "A?e*", "/A[bc].*/", "Ac", "#ism", "*s", "@Adam", "~Adams", "Ad*",
+   "Ae", "Af*", "#an", "*al", "Ag", "Ah*", "#er", "*ly", "@Alan",
+   "Ai", "Aj*", "#on", "*y", "~Alba", "Ak", "Al*", "#a", "*n", "+Alma",
+   "Am", "An*", "#ie", "*ic", "%Ana",
+};
+
+static struct vb_handle *handle;
+static struct vb_cache *cache;
+static struct matches expected[NUM_QUERIES];
+
+/* Fetches all pages of a query, through the cache or not. */
+static void match_all(const char *str, size_t page_size, bool cached,
+                      struct matches *m)
+{
+   struct vb_query query = VB_QUERY_INIT;
+   query.query = str;
+   query.len = strlen(str);
+   query.page_size = page_size;
+
+   m->len = 0;
+   m->buf[0] = '\0';
+   while (!query.pagination.last_page) {
+      int ret = cached ? vb_cache_match(cache, &query, gather, m)
+                       : vb_handle_match(handle, &query, gather, m);
+      assert(ret == VB_OK);
+   }
+}
+
+static void test_results(void)
+{
+   struct vb_cache_stats st;
+
+   for (int round = 0; round < 3; round++) {
+      for (int i = 0; i < NUM_QUERIES; i++) {
+         static struct matches m;
+         match_all(queries[i], 7, true, &m);
+         assert(!strcmp(m.buf, expected[i].buf));
+      }
+      vb_cache_stats(cache, &st);
+      if (!round)
+         assert(st.hits == 0 && st.misses > 0);
+      else
+         assert(st.hits == round * st.misses);
+   }
+   assert(st.entries == st.misses && st.evictions == 0);
+
+   /* Queries are keyed once their mode selectors are interpreted. */
+   struct matches m;
+   const uint64_t hits = st.hits;
+   struct vb_query query = VB_QUERY_INIT;
+   query.query = "Adam";
+   query.len = 4;
+   query.mode = VB_DAMERAU;
+   query.page_size = 7;
+   assert(vb_cache_match(cache, &query, gather, (m.len = 0, &m)) == VB_OK);
+   vb_cache_stats(cache, &st);
+   assert(st.hits == hits + 1);
+}
+
+static int searcher(void *arg)
+{
+   const int start = *(const int *)arg;
+
+   static _Thread_local struct matches m;
+   for (int round = 0; round < 20; round++) {
+      const int i = (start + round * 7) % NUM_QUERIES;
+      match_all(queries[i], 7, true, &m);
+      assert(!strcmp(m.buf, expected[i].buf));
+   }
+   return 0;
+}
+
+static void test_threads(void)
+{
+   thrd_t threads[NUM_THREADS];
+   int starts[NUM_THREADS];
+   for (int i = 0; i < NUM_THREADS; i++) {
+      starts[i] = rand() % NUM_QUERIES;
+      assert(thrd_create(&threads[i], searcher, &starts[i]) == thrd_success);
+   }
+   for (int i = 0; i < NUM_THREADS; i++)
+      assert(thrd_join(threads[i], NULL) == thrd_success);
+}
+
+/* Pages of a replaced lexicon are never served again. */
+static void test_invalidation(void)
+{
+   struct vb_cache_stats st;
+   vb_cache_stats(cache, &st);
+   const size_t entries = st.entries;
+
+   unsigned ticket;
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_compact(vb_handle_acquire(handle, &ticket), &lex) == VB_OK);
+   vb_handle_release(handle, ticket);
+   assert(vb_lexicon_add(lex, "Aaa", 3) == VB_OK);
+   vb_handle_publish(handle, lex);
+
+   for (int i = 0; i < NUM_QUERIES; i++) {
+      static struct matches m1, m2;
+      match_all(queries[i], 7, true, &m1);
+      match_all(queries[i], 7, false, &m2);
+      assert(!strcmp(m1.buf, m2.buf));
+   }
+   static struct matches m;
+   match_all("Aa*", 7, true, &m);
+   assert(strstr(m.buf, "\nAaa\n") || !strncmp(m.buf, "Aaa\n", 4));
+
+   vb_cache_stats(cache, &st);
+   assert(st.invalidations == entries);
+}
+
+/* The cache doesn't grow beyond its maximum size. */
+static void test_eviction(void)
+{
+   struct vb_cache *small;
+   assert(vb_cache_new(&small, handle, 1 << 14) == VB_OK);
+   for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < NUM_QUERIES; i++) {
+         struct vb_query query = VB_QUERY_INIT;
+         query.query = queries[i];
+         query.len = strlen(queries[i]);
+         query.page_size = VB_MAX_PAGE_SIZE;
+         static struct matches m;
+         while (!query.pagination.last_page)
+            assert(vb_cache_match(small, &query, gather, (m.len = 0, &m)) == VB_OK);
+      }
+   }
+   struct vb_cache_stats st;
+   vb_cache_stats(small, &st);
+   assert(st.size <= 1 << 14 && st.evictions > 0);
+   vb_cache_free(small);
+}
+
+int main(void)
+{
+   srand(time(NULL));
+   assert(vb_handle_new(&handle, load_lexicon()) == VB_OK);
+   assert(vb_cache_new(&cache, handle, 1 << 22) == VB_OK);
+   for (int i = 0; i < NUM_QUERIES; i++)
+      match_all(queries[i], 7, false, &expected[i]);
+
+   test_results();
+   test_threads();
+   test_invalidation();
+   test_eviction();
+
+   vb_cache_free(cache);
+   vb_handle_free(handle);
+}
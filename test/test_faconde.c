@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <time.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../src/lib/faconde.c"
+
+/* Textbook dynamic programming versions of the metrics, which the plain
+ * functions of faconde are checked against, and which are in turn used as
+ * references for the optimized kernels.
+ */
+static int32_t matrix[64][64];
+
+static int32_t ref_distance(const char32_t *seq1, int32_t len1,
+                            const char32_t *seq2, int32_t len2, bool transpos)
+{
+   for (int32_t i = 0; i <= len1; i++)
+      matrix[i][0] = i;
+   for (int32_t j = 0; j <= len2; j++)
+      matrix[0][j] = j;
+   for (int32_t i = 1; i <= len1; i++) {
+      for (int32_t j = 1; j <= len2; j++) {
+         const int32_t cost = seq1[i - 1] != seq2[j - 1];
+         int32_t d = FC_MIN3(matrix[i - 1][j] + 1, matrix[i][j - 1] + 1,
+                             matrix[i - 1][j - 1] + cost);
+         if (transpos && i > 1 && j > 1 && seq1[i - 1] == seq2[j - 2]
+             && seq1[i - 2] == seq2[j - 1])
+            d = FC_MIN(d, matrix[i - 2][j - 2] + 1);
+         matrix[i][j] = d;
+      }
+   }
+   return matrix[len1][len2];
+}
+
+static int32_t ref_lcsubstr(const char32_t *seq1, int32_t len1,
+                            const char32_t *seq2, int32_t len2)
+{
+   int32_t max = 0;
+   for (int32_t i = 0; i < len1; i++) {
+      for (int32_t j = 0; j < len2; j++) {
+         int32_t k = 0;
+         while (i + k < len1 && j + k < len2 && seq1[i + k] == seq2[j + k])
+            k++;
+         max = FC_MAX(max, k);
+      }
+   }
+   return max;
+}
+
+static int32_t ref_lcsubseq(const char32_t *seq1, int32_t len1,
+                            const char32_t *seq2, int32_t len2)
+{
+   for (int32_t i = 0; i <= len1; i++) {
+      for (int32_t j = 0; j <= len2; j++) {
+         if (!i || !j)
+            matrix[i][j] = 0;
+         else if (seq1[i - 1] == seq2[j - 1])
+            matrix[i][j] = matrix[i - 1][j - 1] + 1;
+         else
+            matrix[i][j] = FC_MAX(matrix[i - 1][j], matrix[i][j - 1]);
+      }
+   }
+   return matrix[len1][len2];
+}
+
+/* Random sequence over an alphabet of "nr" characters. Some alphabets are
+ * made of characters > 0xff, which the batched functions handle apart.
+ */
+static int32_t random_seq(char32_t *seq, int32_t max_len, int32_t nr)
+{
+   const char32_t base = rand() % 2 ? 'a' : 0x4e00;
+   const int32_t len = rand() % (max_len + 1);
+   for (int32_t i = 0; i < len; i++)
+      seq[i] = base + rand() % nr;
+   seq[len] = 0;
+   return len;
+}
+
+/* A variant of a sequence with a few random edits, so that distances are
+ * often small.
+ */
+static int32_t mutate(char32_t *dest, const char32_t *seq, int32_t len,
+                      int32_t max_len)
+{
+   memcpy(dest, seq, len * sizeof *seq);
+   for (int n = rand() % 4; n; n--) {
+      const int32_t pos = len ? rand() % len : 0;
+      switch (rand() % 4) {
+      case 0:
+         if (len < max_len) {
+            memmove(&dest[pos + 1], &dest[pos], (len - pos) * sizeof *dest);
+            dest[pos] = 'a' + rand() % 3;
+            len++;
+         }
+         break;
+      case 1:
+         if (len) {
+            memmove(&dest[pos], &dest[pos + 1], (len - pos - 1) * sizeof *dest);
+            len--;
+         }
+         break;
+      case 2:
+         if (pos + 1 < len) {
+            const char32_t c = dest[pos];
+            dest[pos] = dest[pos + 1];
+            dest[pos + 1] = c;
+         }
+         break;
+      default:
+         if (len)
+            dest[pos] = 'a' + rand() % 3;
+         break;
+      }
+   }
+   dest[len] = 0;
+   return len;
+}
+
+static void test_plain(void)
+{
+   char32_t seq1[41], seq2[41];
+
+   for (int i = 0; i < 5000; i++) {
+      const int32_t nr = rand() % 5 + 1;
+      const int32_t len1 = random_seq(seq1, 40, nr);
+      const int32_t len2 = rand() % 2 ? random_seq(seq2, 40, nr)
+                                      : mutate(seq2, seq1, len1, 40);
+
+      assert(fc_levenshtein(seq1, len1, seq2, len2)
+             == ref_distance(seq1, len1, seq2, len2, false));
+      assert(fc_damerau(seq1, len1, seq2, len2)
+             == ref_distance(seq1, len1, seq2, len2, true));
+      assert(fc_lcsubstr(seq1, len1, seq2, len2)
+             == ref_lcsubstr(seq1, len1, seq2, len2));
+      assert(fc_lcsubseq(seq1, len1, seq2, len2)
+             == ref_lcsubseq(seq1, len1, seq2, len2));
+
+      const char32_t *pos;
+      const int32_t sub = fc_lcsubstr_extract(seq1, len1, seq2, len2, &pos);
+      assert(sub == ref_lcsubstr(seq1, len1, seq2, len2));
+      assert(ref_lcsubstr(pos, sub, seq2, len2) == sub);
+   }
+}
+
+/* A bounded kernel must give the exact distance if it is at most its bound,
+ * and something larger than the bound otherwise.
+ */
+static void test_bounded(void)
+{
+   char32_t seq1[41], seq2[41];
+
+   for (int i = 0; i < 20000; i++) {
+      const int32_t nr = rand() % 4 + 1;
+      const int32_t len1 = random_seq(seq1, 12, nr);
+      const int32_t len2 = rand() % 4 ? mutate(seq2, seq1, len1, 40)
+                                      : random_seq(seq2, 12, nr);
+      const int32_t dist = fc_levenshtein(seq1, len1, seq2, len2);
+
+      for (int32_t k = 0; k < 3; k++) {
+         const int32_t ret = fc_lev_bounded[k](seq1, len1, seq2, len2);
+         if (dist <= k)
+            assert(ret == dist);
+         else
+            assert(ret > k);
+      }
+   }
+}
+
+/* The memoized functions reuse the part of the matrix that the previous
+ * sequence shares with the current one, so they are fed sorted sequences,
+ * as when walking an automaton.
+ */
+static int cmp_seqs(const void *a, const void *b)
+{
+   const char32_t *x = a, *y = b;
+   while (*x && *x == *y) {
+      x++;
+      y++;
+   }
+   return *x < *y ? -1 : *x > *y;
+}
+
+#define NR_SEQS 200
+#define MAX_LEN 40
+
+static char32_t seqs[NR_SEQS][MAX_LEN + 1];
+static int32_t lens[NR_SEQS];
+
+static void make_seqs(const char32_t *ref, int32_t ref_len, int32_t nr)
+{
+   for (int i = 0; i < NR_SEQS; i++) {
+      if (rand() % 2)
+         random_seq(seqs[i], MAX_LEN, nr);
+      else
+         mutate(seqs[i], ref, ref_len, MAX_LEN);
+   }
+   qsort(seqs, NR_SEQS, sizeof *seqs, cmp_seqs);
+   for (int i = 0; i < NR_SEQS; i++) {
+      lens[i] = 0;
+      while (seqs[i][lens[i]])
+         lens[i]++;
+   }
+}
+
+static int32_t plain(enum fc_metric metric, const char32_t *seq1, int32_t len1,
+                     const char32_t *seq2, int32_t len2)
+{
+   switch (metric) {
+   case FC_LEVENSHTEIN:
+      return fc_levenshtein(seq1, len1, seq2, len2);
+   case FC_DAMERAU:
+      return fc_damerau(seq1, len1, seq2, len2);
+   case FC_LCSUBSTR:
+      return fc_lcsubstr(seq1, len1, seq2, len2);
+   default:
+      return fc_lcsubseq(seq1, len1, seq2, len2);
+   }
+}
+
+/* Distances larger than the maximum allowed one need only be reported as
+ * such.
+ */
+static void check(enum fc_metric metric, int32_t max_dist, int32_t ret,
+                  int32_t expect)
+{
+   if ((metric == FC_LEVENSHTEIN || metric == FC_DAMERAU) && expect > max_dist)
+      assert(ret > max_dist);
+   else
+      assert(ret == expect);
+}
+
+static void test_memo(void)
+{
+   char32_t ref[MAX_LEN + 1];
+
+   for (int i = 0; i < 200; i++) {
+      const enum fc_metric metric = rand() % FC_METRIC_NR;
+      const int32_t max_dist = rand() % 4;
+      const int32_t nr = rand() % 6 + 1;
+      const int32_t ref_len = random_seq(ref, MAX_LEN, nr);
+      make_seqs(ref, ref_len, nr);
+
+      struct fc_memo m;
+      fc_memo_init(&m, metric, MAX_LEN, max_dist);
+      assert(fc_memo_metric(&m) == metric);
+      fc_memo_set_ref(&m, ref, ref_len);
+      for (int j = 0; j < NR_SEQS; j++)
+         check(metric, max_dist, fc_memo_compute(&m, seqs[j], lens[j]),
+               plain(metric, ref, ref_len, seqs[j], lens[j]));
+      fc_memo_fini(&m);
+   }
+}
+
+static void test_batch(void)
+{
+   char32_t ref[MAX_LEN + 1];
+
+   for (int i = 0; i < 200; i++) {
+      const enum fc_metric metric = rand() % FC_METRIC_NR;
+      const int32_t max_dist = rand() % 4;
+      const int32_t nr = rand() % 6 + 1;
+      const int32_t ref_len = random_seq(ref, MAX_LEN, nr);
+      make_seqs(ref, ref_len, nr);
+
+      struct fc_batch b;
+      fc_batch_init(&b, metric, MAX_LEN, max_dist);
+      fc_batch_set_ref(&b, ref, ref_len);
+      for (int j = 0; j < NR_SEQS; j += FC_BATCH_SIZE) {
+         const int32_t n = FC_MIN(FC_BATCH_SIZE, NR_SEQS - j);
+         const char32_t *batch[FC_BATCH_SIZE];
+         int32_t ret[FC_BATCH_SIZE];
+         for (int32_t k = 0; k < n; k++)
+            batch[k] = seqs[j + k];
+         fc_batch_compute(&b, batch, &lens[j], n, ret);
+         for (int32_t k = 0; k < n; k++)
+            check(metric, max_dist, ret[k],
+                  plain(metric, ref, ref_len, seqs[j + k], lens[j + k]));
+      }
+      fc_batch_fini(&b);
+   }
+}
+
+int main(void)
+{
+   srand(time(NULL));
+   test_plain();
+   test_bounded();
+   test_memo();
+   test_batch();
+}
@@ -0,0 +1,261 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../volubile.h"
+#include "fixture.h"
+
+#define NUM_SHARDS 3
+
+static int32_t scores[MAX_WORDS];
+static int shard_of[MAX_WORDS];
+
+/* Builds a lexicon from the words of a shard, or from all of them if "shard"
+ * is negative. Scores are those of the words, and are kept until the lexicon
+ * of the same shard is built again.
+ */
+static struct vb_lexicon *build_shard(int shard, bool flat)
+{
+   static int32_t all_scores[NUM_SHARDS + 1][MAX_WORDS];
+   int32_t *shard_scores = all_scores[shard + 1];
+   size_t nr = 0;
+
+   bool present[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++) {
+      present[i] = shard < 0 || shard_of[i] == shard;
+      if (present[i])
+         shard_scores[nr++] = scores[i];
+   }
+
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, build(present)) == VB_OK);
+   assert(vb_lexicon_set_scores(lex, shard_scores) == VB_OK);
+   assert(vb_lexicon_fold(lex) == VB_OK);
+   if (flat)
+      assert(vb_lexicon_flatten(lex) == VB_OK);
+   return lex;
+}
+
+static int cmp_words(const void *a, const void *b)
+{
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Checks that words come from the shard they are said to come from. Words of
+ * the list are sorted.
+ */
+static void gather_shard(void *arg, size_t shard, const char *word, size_t len)
+{
+   char buf[MN_MAX_WORD_LEN + 1];
+   memcpy(buf, word, len);
+   buf[len] = '\0';
+   const char *key = buf;
+   char **found = bsearch(&key, words, num_words, sizeof *words, cmp_words);
+   assert(found && shard_of[found - words] == (int)shard);
+   gather(arg, word, len);
+}
+
+static void make_query(char str[static MN_MAX_WORD_LEN + 3], int mode)
+{
+   const char *word = words[rand() % num_words];
+
+   if (mode == VB_GLOB)
+      snprintf(str, MN_MAX_WORD_LEN + 3, "%.1s*%s", word, word + 1);
+   else if (mode == VB_REGEX)
+      snprintf(str, MN_MAX_WORD_LEN + 3, "(.|[%.1s]){%zu,}",
+               isalpha((unsigned char)*word) ? word : "a", strlen(word) / 2);
+   else if (mode == VB_PREFIX || mode == VB_SUBSTR || mode == VB_TOP_PREFIX)
+      snprintf(str, MN_MAX_WORD_LEN + 3, "%.2s", word);
+   else if (mode == VB_SUFFIX)
+      snprintf(str, MN_MAX_WORD_LEN + 3, "%s", word + strlen(word) / 2);
+   else
+      snprintf(str, MN_MAX_WORD_LEN + 3, "%s", word);
+}
+
+/* Checks that the pages of the shards, merged, are the pages of a lexicon made
+ * of all the words.
+ */
+static void check_same(const struct vb_lexicon *all,
+                       const struct vb_lexicon *const *shards,
+                       struct vb_query query)
+{
+   struct matches *m1 = malloc(sizeof *m1), *m2 = malloc(sizeof *m2);
+   assert(m1 && m2);
+
+   /* One of the searches can take an extra, empty page to find out that it
+    * is done.
+    */
+   struct vb_federated_pagination p = {0};
+   while (!query.pagination.last_page || !p.last_page) {
+      m1->len = m2->len = 0;
+      m1->buf[0] = m2->buf[0] = '\0';
+      assert(vb_lexicon_match(all, &query, gather, m1) == VB_OK);
+      assert(vb_federated_match(shards, NUM_SHARDS, &query, &p, gather_shard,
+                                m2) == VB_OK);
+      assert(!strcmp(m1->buf, m2->buf));
+
+      /* Resuming from a token is the same as resuming from the pagination
+       * data itself.
+       */
+      char token[2 + NUM_SHARDS * (15 + VB_MAX_WORD_LEN)];
+      const size_t len = vb_federated_token(&p, token, sizeof token);
+      assert(len <= sizeof token);
+      assert(vb_federated_untoken(&p, token, len) == VB_OK);
+   }
+   free(m1);
+   free(m2);
+}
+
+/* Queries made by the threads of test_threads(). */
+#define NUM_THREADS 4
+#define THREAD_QUERIES 8
+
+struct thread_queries {
+   const struct vb_lexicon *all;
+   const struct vb_lexicon *const *shards;
+   char strs[THREAD_QUERIES][MN_MAX_WORD_LEN + 3];
+   struct vb_query queries[THREAD_QUERIES];
+};
+
+static int check_queries(void *arg)
+{
+   struct thread_queries *t = arg;
+
+   for (int i = 0; i < THREAD_QUERIES; i++)
+      check_same(t->all, t->shards, t->queries[i]);
+   return 0;
+}
+
+/* Pages of the shards, merged, are the pages of a lexicon made of all the
+ * words, whatever the mode.
+ */
+static void test_same(void)
+{
+   for (int round = 0; round < 2; round++) {
+      /* The second round checks flattened lexicons. */
+      struct vb_lexicon *all = build_shard(-1, round);
+      struct vb_lexicon *shards[NUM_SHARDS];
+      for (int i = 0; i < NUM_SHARDS; i++)
+         shards[i] = build_shard(i, round);
+
+      for (int mode = VB_EXACT; mode <= VB_TOP_PREFIX; mode++) {
+         for (int i = 0; i < 6; i++) {
+            char str[MN_MAX_WORD_LEN + 3];
+            make_query(str, mode);
+            struct vb_query query = VB_QUERY_INIT;
+            query.query = str;
+            query.len = strlen(str);
+            query.mode = mode;
+            query.page_size = 4 + rand() % 7;
+            /* Scores are not used by folded searches. */
+            query.fold = i % 2 && mode != VB_TOP_PREFIX;
+            check_same(all, (const struct vb_lexicon *const *)shards, query);
+         }
+      }
+      vb_lexicon_free(all);
+      for (int i = 0; i < NUM_SHARDS; i++)
+         vb_lexicon_free(shards[i]);
+   }
+}
+
+/* Federated searches made at the same time share the threads of the pool. */
+static void test_threads(void)
+{
+   struct vb_lexicon *all = build_shard(-1, true);
+   struct vb_lexicon *shards[NUM_SHARDS];
+   for (int i = 0; i < NUM_SHARDS; i++)
+      shards[i] = build_shard(i, true);
+
+   static struct thread_queries queries[NUM_THREADS];
+   thrd_t threads[NUM_THREADS];
+   for (int t = 0; t < NUM_THREADS; t++) {
+      queries[t].all = all;
+      queries[t].shards = (const struct vb_lexicon *const *)shards;
+      for (int i = 0; i < THREAD_QUERIES; i++) {
+         const int mode = i % 2 ? VB_PREFIX : VB_LEVENSHTEIN;
+         make_query(queries[t].strs[i], mode);
+         struct vb_query *query = &queries[t].queries[i];
+         *query = (struct vb_query)VB_QUERY_INIT;
+         query->query = queries[t].strs[i];
+         query->len = strlen(query->query);
+         query->mode = mode;
+         query->page_size = 1 + rand() % 5;
+      }
+      assert(thrd_create(&threads[t], check_queries, &queries[t]) == thrd_success);
+   }
+   for (int t = 0; t < NUM_THREADS; t++)
+      thrd_join(threads[t], NULL);
+
+   vb_lexicon_free(all);
+   for (int i = 0; i < NUM_SHARDS; i++)
+      vb_lexicon_free(shards[i]);
+}
+
+static void count_shards(void *arg, size_t shard, const char *word, size_t len)
+{
+   size_t *counts = arg;
+
+   (void)word;
+   (void)len;
+   counts[shard]++;
+}
+
+/* Words found in several shards come once per shard, in the shards order. */
+static void test_duplicates(void)
+{
+   for (size_t i = 0; i < num_words; i++)
+      shard_of[i] = 0;
+   struct vb_lexicon *lex = build_shard(0, false);
+   const struct vb_lexicon *shards[] = {lex, lex};
+
+   struct vb_query query = VB_QUERY_INIT;
+   query.query = "Ab";
+   query.len = 2;
+   query.mode = VB_PREFIX;
+   query.page_size = 3;
+   struct vb_federated_pagination p = {0};
+   size_t counts[2] = {0};
+   assert(vb_federated_match(shards, 2, &query, &p, count_shards, counts) == VB_OK);
+   assert(counts[0] == 2 && counts[1] == 1);
+   while (!p.last_page)
+      assert(vb_federated_match(shards, 2, &query, &p, count_shards, counts) == VB_OK);
+   assert(counts[0] == counts[1]);
+
+   /* Pagination data only fits the number of shards it was made for. */
+   assert(vb_federated_match(shards, 1, &query, &p, count_shards, counts) == VB_ESHARDS);
+   char token[2 + 2 * (15 + VB_MAX_WORD_LEN)];
+   const size_t len = vb_federated_token(&p, token, sizeof token);
+   assert(vb_federated_untoken(&p, token, len - 1) == VB_ESHARDS);
+   token[0] = VB_MAX_SHARDS + 1;
+   assert(vb_federated_untoken(&p, token, len) == VB_ESHARDS);
+   vb_lexicon_free(lex);
+}
+
+int main(void)
+{
+   srand(time(NULL));
+   load_words();
+
+   /* Words with the same folded form are put in the same shard, so that
+    * folded searches give the same pages as with a single lexicon.
+    */
+   const unsigned salt = rand();
+   for (size_t i = 0; i < num_words; i++) {
+      unsigned h = salt;
+      for (const char *c = words[i]; *c; c++)
+         h = h * 31 + tolower((unsigned char)*c);
+      shard_of[i] = h % NUM_SHARDS;
+      scores[i] = rand() % 10;
+   }
+
+   test_same();
+   test_threads();
+   test_duplicates();
+   for (size_t i = 0; i < num_words; i++)
+      free(words[i]);
+}
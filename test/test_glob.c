@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../src/priv.h"
+#include "../src/lib/faconde.h"
+
+/* Backtracking matcher, for reference. Works on strings decoded beforehand,
+ * and follows the syntax documented for fc_glob().
+ */
+static bool ref_match(const char32_t *pat, const char32_t *str)
+{
+   for (;; pat++, str++) {
+      switch (*pat) {
+      case '\0':
+         return !*str;
+      case '*':
+         do {
+            if (ref_match(pat + 1, str))
+               return true;
+         } while (*str++);
+         return false;
+      case '?':
+         if (!*str)
+            return false;
+         break;
+      case '[': {
+         const char32_t *p = pat + 1;
+         bool invert = *p == '^';
+         p += invert;
+         bool found = false;
+         const char32_t *first = p;
+         for (; *p && (*p != ']' || p == first); p++)
+            found |= *p == *str;
+         if (!*p || !*str || found == invert)
+            return false;
+         pat = p;
+         break;
+      }
+      default:
+         if (*pat != *str)
+            return false;
+         break;
+      }
+   }
+}
+
+static int match(const char *pat, const char *str)
+{
+   struct vb_glob g;
+   assert(vb_glob_compile(&g, pat, strlen(pat)) == VB_OK);
+   return vb_glob_match(&g, str, strlen(str), false);
+}
+
+static void test_fixed(void)
+{
+   static const struct {
+      const char *pat, *str;
+      int match;
+   } tests[] = {
+      {"", "", 1},
+      {"", "a", 0},
+      {"abc", "abc", 1},
+      {"abc", "abcd", 0},
+      {"*", "", 1},
+      {"a*", "a", 1},
+      {"*a", "ba", 1},
+      {"*a", "ab", 0},
+      {"a*b*c*d", "aXbYcZd", 1},
+      {"a*b*c*d", "abdc", 0},
+      {"*ab*ab", "abab", 1},
+      {"*ab*ab", "aba", 0},
+      {"a?c", "aéc", 1},
+      {"a??c", "aéc", 0},
+      {"[abc]", "b", 1},
+      {"[abc]", "d", 0},
+      {"[^abc]", "a", 0},
+      {"[^abc]", "d", 1},
+      {"[]a]", "]", 1},
+      {"[]a]", "a", 1},
+      {"[^]]", "]", 0},
+      {"[a^]", "^", 1},
+      {"[*?[]", "?", 1},
+      {"a]", "a]", 1},
+      {"[éΔ]x", "Δx", 1},
+      {"[^é]x", "éx", 0},
+      {"[abc", "a", 0},
+      {"*[", "[", 0},
+   };
+
+   for (size_t i = 0; i < sizeof tests / sizeof *tests; i++)
+      assert(match(tests[i].pat, tests[i].str) == tests[i].match);
+
+   struct vb_glob g;
+   assert(vb_glob_compile(&g, "a\xff", 2) == VB_EQUTF8);
+   assert(vb_glob_compile(&g, "a?", 2) == VB_OK);
+   assert(vb_glob_match(&g, "a\xff", 2, false) == -1);
+
+   /* Words lacking a literal fragment are not decoded at all. */
+   assert(vb_glob_compile(&g, "*b?", 3) == VB_OK);
+   assert(vb_glob_match(&g, "a\xff", 2, false) == 0);
+}
+
+/* Compares the results, and those of fc_glob(), with those of the reference
+ * matcher on random patterns and strings made of a small alphabet.
+ */
+static void test_random(void)
+{
+   static const char *const pat_chars[] = {
+      "a", "b", "é", "*", "*", "?", "[", "]", "^",
+   };
+   static const char *const str_chars[] = {
+      "a", "b", "é", "]", "^",
+   };
+   const size_t npat = sizeof pat_chars / sizeof *pat_chars;
+   const size_t nstr = sizeof str_chars / sizeof *str_chars;
+
+   for (int i = 0; i < 2000; i++) {
+      char pat[64] = "", str[64] = "";
+      for (int n = rand() % 8; n; n--)
+         strcat(pat, pat_chars[rand() % npat]);
+
+      struct vb_glob g;
+      assert(vb_glob_compile(&g, pat, strlen(pat)) == VB_OK);
+      char32_t upat[64], ustr[64];
+      vb_utf8_decode(upat, pat, strlen(pat));
+
+      for (int j = 0; j < 50; j++) {
+         str[0] = '\0';
+         for (int n = rand() % 8; n; n--)
+            strcat(str, str_chars[rand() % nstr]);
+         vb_utf8_decode(ustr, str, strlen(str));
+         const bool expect = ref_match(upat, ustr);
+         assert(vb_glob_match(&g, str, strlen(str), true) == expect);
+         assert(fc_glob(upat, ustr) == expect);
+      }
+   }
+}
+
+int main(void)
+{
+   srand(time(NULL));
+   test_fixed();
+   test_random();
+}
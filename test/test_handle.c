@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../volubile.h"
+#include "fixture.h"
+
+#define NUM_READERS 4
+#define NUM_VERSIONS 20
+
+static struct vb_handle *handle;
+static atomic_bool done;
+
+/* Returns a new version of a lexicon, with a different number of words. */
+static struct vb_lexicon *new_version(const struct vb_lexicon *lex, int version)
+{
+   struct vb_lexicon *copy;
+   assert(vb_lexicon_compact(lex, &copy) == VB_OK);
+
+   char word[32];
+   for (int i = 0; i <= version; i++) {
+      int len = snprintf(word, sizeof word, "version%d", i);
+      assert(vb_lexicon_add(copy, word, len) == VB_OK);
+   }
+   return copy;
+}
+
+static void count(void *arg, const char *word, size_t len)
+{
+   (void)word;
+   (void)len;
+   ++*(size_t *)arg;
+}
+
+static int reader(void *arg)
+{
+   (void)arg;
+
+   while (!atomic_load(&done)) {
+      unsigned ticket;
+      const struct vb_lexicon *lex = vb_handle_acquire(handle, &ticket);
+      const uint32_t size = vb_lexicon_size(lex);
+
+      size_t nr = 0;
+      struct vb_query query = VB_QUERY_INIT;
+      query.query = "version";
+      query.len = strlen(query.query);
+      query.mode = VB_PREFIX;
+      query.page_size = VB_MAX_PAGE_SIZE;
+      assert(vb_lexicon_match(lex, &query, count, &nr) == VB_OK);
+      thrd_yield();
+      assert(vb_lexicon_size(lex) == size);
+      vb_handle_release(handle, ticket);
+
+      query.pagination = (struct vb_pagination){0};
+      query.query = "@version";
+      query.len = strlen(query.query);
+      query.mode = VB_AUTO;
+      assert(vb_handle_match(handle, &query, count, &nr) == VB_OK);
+   }
+   return 0;
+}
+
+static void test_publish(void)
+{
+   struct vb_lexicon *lex = load_lexicon();
+   assert(vb_handle_new(&handle, new_version(lex, 0)) == VB_OK);
+
+   thrd_t readers[NUM_READERS];
+   for (int i = 0; i < NUM_READERS; i++)
+      assert(thrd_create(&readers[i], reader, NULL) == thrd_success);
+
+   for (int i = 1; i < NUM_VERSIONS; i++) {
+      vb_handle_publish(handle, new_version(lex, i));
+      thrd_yield();
+   }
+
+   atomic_store(&done, true);
+   for (int i = 0; i < NUM_READERS; i++)
+      thrd_join(readers[i], NULL);
+
+   unsigned ticket;
+   const struct vb_lexicon *last = vb_handle_acquire(handle, &ticket);
+   assert(vb_lexicon_size(last) == vb_lexicon_size(lex) + NUM_VERSIONS);
+   vb_handle_release(handle, ticket);
+
+   vb_handle_free(handle);
+   vb_lexicon_free(lex);
+}
+
+int main(void)
+{
+   test_publish();
+}
@@ -39,8 +39,31 @@ static void test_heap(void)
    free(heap_data);
 }
 
+/* Popping all items must give them in decreasing order. */
+static void test_pop(void)
+{
+   const size_t nums_size = rand() % 3000 + 1;
+   int *nums = malloc(nums_size * sizeof *nums);
+   int *heap_data = malloc(nums_size * sizeof *nums);
+   struct heap heap = VB_HEAP_INIT(heap_data, nums_size);
+
+   for (size_t i = 0; i < nums_size; i++) {
+      nums[i] = rand() % 1000;
+      heap_push(&heap, nums[i]);
+   }
+   qsort(nums, nums_size, sizeof *nums, intpcmp);
+
+   for (size_t i = nums_size; i-- > 0; )
+      assert(heap_pop(&heap) == nums[i]);
+   assert(heap.size == 0);
+
+   free(nums);
+   free(heap_data);
+}
+
 int main(void)
 {
    srand(time(NULL));
    test_heap();
+   test_pop();
 }
@@ -0,0 +1,823 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../volubile.h"
+#include "../src/priv.h"
+#include "../src/lib/mini.h"
+#include "../src/lib/faconde.h"
+#include "fixture.h"
+
+/* Fetches all matching words, at most "max_pages" pages. */
+static void match_all(const struct vb_lexicon *lex, const struct mini *fsa,
+                      const char *str, enum vb_match_mode mode,
+                      size_t page_size, int max_pages, struct matches *m)
+{
+   struct vb_query query = VB_QUERY_INIT;
+   query.query = str;
+   query.len = strlen(str);
+   query.mode = mode;
+   query.page_size = page_size;
+
+   m->len = 0;
+   m->buf[0] = '\0';
+   while (max_pages--) {
+      int ret = lex ? vb_lexicon_match(lex, &query, gather, m)
+                    : vb_match(fsa, &query, gather, m);
+      assert(ret == VB_OK);
+      if (query.pagination.last_page)
+         break;
+   }
+}
+
+/* Builds a query string for a matching mode from a word of the lexicon. */
+static void make_query(char str[static MN_MAX_WORD_LEN + 3], int mode)
+{
+   const char *word = words[rand() % num_words];
+
+   if (mode == VB_GLOB)
+      snprintf(str, MN_MAX_WORD_LEN + 3, "%.1s*%s", word, word + 1);
+   else if (mode == VB_REGEX)
+      snprintf(str, MN_MAX_WORD_LEN + 3, "(.|[%.1s]){%zu,}",
+               isalpha((unsigned char)*word) ? word : "a", strlen(word) / 2);
+   else if (mode == VB_PREFIX || mode == VB_SUBSTR)
+      snprintf(str, MN_MAX_WORD_LEN + 3, "%.2s", word);
+   else if (mode == VB_SUFFIX)
+      snprintf(str, MN_MAX_WORD_LEN + 3, "%s", word + strlen(word) / 2);
+   else
+      snprintf(str, MN_MAX_WORD_LEN + 3, "%s", word);
+}
+
+/* Compares the results of a lexicon with those of an automaton built from
+ * scratch.
+ */
+static void check_same(const struct vb_lexicon *lex, const bool *present)
+{
+   struct mini *fsa = build(present);
+   static struct matches m1, m2;
+
+   uint32_t size = 0;
+   for (size_t i = 0; i < num_words; i++) {
+      size += present[i];
+      assert(vb_lexicon_match(lex, &(struct vb_query){
+         .query = words[i],
+         .len = strlen(words[i]),
+         .mode = VB_EXACT,
+         .page_size = 1,
+      }, gather, (m1.len = 0, &m1)) == VB_OK);
+      assert((m1.len > 0) == present[i]);
+   }
+   assert(vb_lexicon_size(lex) == size);
+
+   /* VB_TOP_PREFIX needs scores, see test_scores(). */
+   for (int i = 0; i < 10; i++) {
+      for (int mode = VB_EXACT; mode < VB_TOP_PREFIX; mode++) {
+         char str[MN_MAX_WORD_LEN + 3];
+         make_query(str, mode);
+         size_t page_size = rand() % VB_MAX_PAGE_SIZE + 1;
+         match_all(lex, NULL, str, mode, page_size, 5, &m1);
+         match_all(NULL, fsa, str, mode, page_size, 5, &m2);
+         assert(!strcmp(m1.buf, m2.buf));
+      }
+   }
+   mn_free(fsa);
+}
+
+/* Checks that the ordinals of a numbered automaton are those of a list of
+ * words, in the order they were added.
+ */
+static void check_ordinals(const struct mini *fsa, char *const *list,
+                           uint32_t nr)
+{
+   assert(mn_size(fsa) == nr);
+
+   char buf[MN_MAX_WORD_LEN + 1];
+   struct mini_iter it;
+   for (uint32_t pos = 1; pos <= nr; pos++) {
+      const char *word = list[pos - 1];
+      const size_t len = strlen(word);
+      assert(mn_locate(fsa, word, len) == pos);
+      assert(mn_extract(fsa, pos, buf) == len && !strcmp(buf, word));
+
+      size_t it_len;
+      assert(mn_iter_initn(&it, fsa, pos) == pos);
+      const char *it_word = mn_iter_next(&it, &it_len);
+      assert(it_word && it_len == len && !memcmp(it_word, word, len));
+   }
+   assert(mn_extract(fsa, nr + 1, buf) == 0 && !*buf);
+   assert(mn_iter_initn(&it, fsa, nr + 1) == 0);
+}
+
+/* Word counts are kept bit-packed by blocks of 64 transitions. Ordinals must
+ * come out as the positions of the words in the lists they were built from.
+ * The second lexicon has a root state of 223 transitions, which straddles
+ * several blocks, and counts of very different widths, so that lookups sum
+ * counts across block boundaries, and decode counts split over two words.
+ */
+static void test_counts(void)
+{
+   struct vb_lexicon *lex = load_lexicon();
+   check_ordinals(lex->base, words, num_words);
+   vb_lexicon_free(lex);
+
+   static char wide[223 * 500][5];
+   static char *list[223 * 500];
+   uint32_t nr = 0;
+   struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+   for (unsigned chr = 0x21; chr <= 0xff; chr++) {
+      const unsigned count = chr % 7 ? 1 + chr % 5 : 500;
+      for (unsigned i = 0; i < count; i++) {
+         wide[nr][0] = chr;
+         wide[nr][1] = '0' + i / 100;
+         wide[nr][2] = '0' + i / 10 % 10;
+         wide[nr][3] = '0' + i % 10;
+         assert(mn_enc_add(enc, wide[nr], 4) == MN_OK);
+         list[nr] = wide[nr];
+         nr++;
+      }
+   }
+   struct mini *fsa = reload(enc);
+   check_ordinals(fsa, list, nr);
+   mn_free(fsa);
+}
+
+static void test_edits(void)
+{
+   bool present[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++)
+      present[i] = rand() % 2;
+
+   /* Substring and suffix searches use the flat copy of the lexicon while it
+    * has no pending edits, and compaction keeps it.
+    */
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, build(present)) == VB_OK);
+   assert(vb_lexicon_flatten(lex) == VB_OK);
+   check_same(lex, present);
+
+   for (int round = 0; round < 5; round++) {
+      for (int i = 0; i < 50; i++) {
+         size_t idx = rand() % num_words;
+         const char *word = words[idx];
+         if (rand() % 2) {
+            assert(vb_lexicon_add(lex, word, strlen(word)) == VB_OK);
+            present[idx] = true;
+         } else {
+            assert(vb_lexicon_remove(lex, word, strlen(word)) == VB_OK);
+            present[idx] = false;
+         }
+      }
+      assert(vb_lexicon_pending(lex) > 0);
+      check_same(lex, present);
+
+      struct vb_lexicon *compacted;
+      assert(vb_lexicon_compact(lex, &compacted) == VB_OK);
+      assert(vb_lexicon_pending(compacted) == 0);
+      check_same(compacted, present);
+      vb_lexicon_free(lex);
+      lex = compacted;
+   }
+   vb_lexicon_free(lex);
+}
+
+/* Standard automata must give the same results pages as numbered ones. */
+static void test_standard(void)
+{
+   bool present[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++)
+      present[i] = true;
+
+   struct mini *numbered = build_type(present, MN_NUMBERED);
+   struct mini *standard = build_type(present, MN_STANDARD);
+   static struct matches m1, m2;
+
+   for (int i = 0; i < 20; i++) {
+      for (int mode = VB_EXACT; mode < VB_TOP_PREFIX; mode++) {
+         char str[MN_MAX_WORD_LEN + 3];
+         make_query(str, mode);
+         size_t page_size = rand() % 5 + 1;
+         match_all(NULL, numbered, str, mode, page_size, 10, &m1);
+         match_all(NULL, standard, str, mode, page_size, 10, &m2);
+         assert(!strcmp(m1.buf, m2.buf));
+      }
+   }
+   mn_free(numbered);
+   mn_free(standard);
+}
+
+static int cmp_words(const void *a, const void *b)
+{
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Flattened lexicons store code points in 1, 2, or 4 bytes, depending on the
+ * largest one. Check that fuzzy matching gives the same results with all
+ * widths.
+ */
+static void test_wide_chars(void)
+{
+   static const char *const prefixes[] = {"", "\u00e9", "\u0394", "\U0001F600"};
+   static struct matches m1, m2;
+
+   for (size_t i = 0; i < sizeof prefixes / sizeof *prefixes; i++) {
+      char *list[MAX_WORDS];
+      size_t nr = num_words < 200 ? num_words : 200;
+      for (size_t j = 0; j < nr; j++) {
+         list[j] = malloc(strlen(words[j]) + strlen(prefixes[i]) + 1);
+         strcat(strcpy(list[j], j % 2 ? prefixes[i] : ""), words[j]);
+      }
+      qsort(list, nr, sizeof *list, cmp_words);
+
+      struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+      for (size_t j = 0; j < nr; j++)
+         assert(mn_enc_add(enc, list[j], strlen(list[j])) == MN_OK);
+      FILE *fp = tmpfile();
+      assert(mn_enc_dump_file(enc, fp) == MN_OK);
+      mn_enc_free(enc);
+      rewind(fp);
+      struct mini *fsa;
+      assert(mn_load_file(&fsa, fp) == MN_OK);
+      fclose(fp);
+
+      struct vb_lexicon *lex;
+      assert(vb_lexicon_new(&lex, fsa) == VB_OK);
+      assert(vb_lexicon_flatten(lex) == VB_OK);
+      for (size_t j = 0; j < 20; j++) {
+         const char *word = list[rand() % nr];
+         for (int mode = VB_LEVENSHTEIN; mode <= VB_LCSUBSEQ; mode++) {
+            match_all(lex, NULL, word, mode, 5, 3, &m1);
+            match_all(NULL, fsa, word, mode, 5, 3, &m2);
+            assert(!strcmp(m1.buf, m2.buf));
+         }
+      }
+      vb_lexicon_free(lex);
+      for (size_t j = 0; j < nr; j++)
+         free(list[j]);
+   }
+}
+
+/* Words are checked to be valid UTF-8 when a lexicon is created, and when
+ * they are added.
+ */
+static void test_bad_utf8(void)
+{
+   static const char *const bad[] = {"abc", "d\xff" "f", "ghi"};
+   struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+   for (size_t i = 0; i < sizeof bad / sizeof *bad; i++)
+      assert(mn_enc_add(enc, bad[i], strlen(bad[i])) == MN_OK);
+   FILE *fp = tmpfile();
+   assert(mn_enc_dump_file(enc, fp) == MN_OK);
+   mn_enc_free(enc);
+   rewind(fp);
+   struct mini *fsa;
+   assert(mn_load_file(&fsa, fp) == MN_OK);
+   fclose(fp);
+
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, fsa) == VB_ELUTF8);
+   assert(!lex);
+   mn_free(fsa);
+
+   bool present[MAX_WORDS] = {true};
+   assert(vb_lexicon_new(&lex, build(present)) == VB_OK);
+   assert(vb_lexicon_add(lex, "d\xff" "f", 3) == VB_EWORD);
+   assert(vb_lexicon_add(lex, "d\xc3", 2) == VB_EWORD);
+   assert(vb_lexicon_add(lex, "d\xc3\xa9", 3) == VB_OK);
+   assert(vb_lexicon_pending(lex) == 1);
+   vb_lexicon_free(lex);
+}
+
+static char *copy_word(const char *word)
+{
+   return strcpy(malloc(strlen(word) + 1), word);
+}
+
+struct fold_entry {
+   char *word, folded[MN_MAX_WORD_LEN + 1];
+   uint32_t pos;
+};
+
+static int cmp_fold_entries(const void *a, const void *b)
+{
+   const struct fold_entry *x = a, *y = b;
+   int cmp = strcmp(x->folded, y->folded);
+   return cmp ? cmp : (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+/* Folded searches must report all the words whose folded form matches the
+ * folded query, grouped by folded form, in the order of the folded forms.
+ */
+static void test_fold(void)
+{
+   /* Add variants of the words that only differ by case or diacritics. */
+   static char *list[3 * MAX_WORDS];
+   size_t nr = 0;
+   for (size_t i = 0; i < num_words; i++) {
+      const char *word = words[i];
+      list[nr++] = copy_word(word);
+      char *other = copy_word(word);
+      other[0] ^= isalpha((unsigned char)other[0]) ? 0x20 : 0;
+      list[nr++] = other;
+      if (strlen(word) + 2 <= MN_MAX_WORD_LEN) {
+         char *accented = malloc(strlen(word) + 2);
+         sprintf(accented, "%s\u00c9", word + 1);
+         list[nr++] = accented;
+      }
+   }
+   qsort(list, nr, sizeof *list, cmp_words);
+   size_t uniq = 0;
+   for (size_t i = 0; i < nr; i++) {
+      if (uniq && !strcmp(list[uniq - 1], list[i]))
+         free(list[i]);
+      else
+         list[uniq++] = list[i];
+   }
+   nr = uniq;
+
+   struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+   for (size_t i = 0; i < nr; i++)
+      assert(mn_enc_add(enc, list[i], strlen(list[i])) == MN_OK);
+   FILE *fp = tmpfile();
+   assert(mn_enc_dump_file(enc, fp) == MN_OK);
+   mn_enc_free(enc);
+   rewind(fp);
+   struct mini *fsa;
+   assert(mn_load_file(&fsa, fp) == MN_OK);
+   fclose(fp);
+
+   static struct fold_entry entries[3 * MAX_WORDS];
+   for (size_t i = 0; i < nr; i++) {
+      entries[i].word = list[i];
+      entries[i].pos = i;
+      vb_utf8_fold(entries[i].folded, list[i], strlen(list[i]));
+   }
+   qsort(entries, nr, sizeof *entries, cmp_fold_entries);
+
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, fsa) == VB_OK);
+   struct vb_query query = VB_QUERY_INIT;
+   query.fold = true;
+   query.query = "a";
+   query.len = 1;
+   assert(vb_lexicon_match(lex, &query, gather, &(struct matches){0}) == VB_EFOLD);
+   assert(vb_lexicon_fold(lex) == VB_OK);
+
+   static struct matches m1, m2;
+   for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < 50; i++) {
+         const struct fold_entry *e = &entries[rand() % nr];
+         char str[MN_MAX_WORD_LEN + 3], folded[MN_MAX_WORD_LEN + 3];
+         const bool prefix = i % 2;
+         snprintf(str, sizeof str, prefix ? "%.2s*" : "%s", e->word);
+         vb_utf8_fold(folded, str, strlen(str) - prefix);
+
+         m1.len = 0;
+         m1.buf[0] = '\0';
+         for (size_t j = 0; j < nr; j++)
+            if (!strncmp(entries[j].folded, folded, strlen(folded))
+                && (prefix || !strcmp(entries[j].folded, folded)))
+               gather(&m1, entries[j].word, strlen(entries[j].word));
+
+         query = (struct vb_query)VB_QUERY_INIT;
+         query.fold = true;
+         query.query = str;
+         query.len = strlen(str);
+         query.page_size = rand() % VB_MAX_PAGE_SIZE + 1;
+         m2.len = 0;
+         m2.buf[0] = '\0';
+         while (!query.pagination.last_page)
+            assert(vb_lexicon_match(lex, &query, gather, &m2) == VB_OK);
+         assert(!strcmp(m1.buf, m2.buf));
+      }
+
+      /* The index is flattened with the lexicon, and rebuilt when it is
+       * compacted.
+       */
+      assert(vb_lexicon_add(lex, "zzz", 3) == VB_OK);
+      query = (struct vb_query)VB_QUERY_INIT;
+      query.fold = true;
+      query.query = "zzz";
+      query.len = 3;
+      assert(vb_lexicon_match(lex, &query, gather, &m2) == VB_EFOLD);
+      assert(vb_lexicon_remove(lex, "zzz", 3) == VB_OK);
+      assert(vb_lexicon_flatten(lex) == VB_OK);
+      struct vb_lexicon *compacted;
+      assert(vb_lexicon_compact(lex, &compacted) == VB_OK);
+      vb_lexicon_free(lex);
+      lex = compacted;
+   }
+
+   /* Fuzzy searches work the same. */
+   query = (struct vb_query)VB_QUERY_INIT;
+   query.fold = true;
+   query.query = "\u00c9LAN";
+   query.len = strlen(query.query);
+   query.mode = VB_LEVENSHTEIN;
+   assert(vb_lexicon_match(lex, &query, gather, &m2) == VB_OK);
+
+   /* Classes of regular expressions match the folded forms of their
+    * characters, here "z" along with "[\]^_`a".
+    */
+   m1.len = 0;
+   m1.buf[0] = '\0';
+   for (size_t j = 0; j < nr; j++) {
+      const char c = entries[j].folded[0];
+      if ((c >= 'Z' && c <= 'a') || c == 'z')
+         gather(&m1, entries[j].word, strlen(entries[j].word));
+   }
+   query = (struct vb_query)VB_QUERY_INIT;
+   query.fold = true;
+   query.query = "[Z-a].*";
+   query.len = strlen(query.query);
+   query.mode = VB_REGEX;
+   m2.len = 0;
+   m2.buf[0] = '\0';
+   while (!query.pagination.last_page)
+      assert(vb_lexicon_match(lex, &query, gather, &m2) == VB_OK);
+   assert(m1.len && !strcmp(m1.buf, m2.buf));
+
+   vb_lexicon_free(lex);
+   for (size_t i = 0; i < nr; i++)
+      free(list[i]);
+}
+
+static int32_t scores[MAX_WORDS];
+static int32_t dists[MAX_WORDS];
+
+/* Ranks word indexes by increasing distance, if computed, then by decreasing
+ * score, then by index.
+ */
+static int cmp_ranks(const void *a, const void *b)
+{
+   const size_t x = *(const size_t *)a, y = *(const size_t *)b;
+
+   if (dists[x] != dists[y])
+      return dists[x] < dists[y] ? -1 : 1;
+   if (scores[x] != scores[y])
+      return scores[x] > scores[y] ? -1 : 1;
+   return x < y ? -1 : x > y;
+}
+
+static void gather_ranked(struct matches *m, const size_t *idxs, size_t nr)
+{
+   m->len = 0;
+   m->buf[0] = '\0';
+   for (size_t i = 0; i < nr; i++)
+      gather(m, words[idxs[i]], strlen(words[idxs[i]]));
+}
+
+static void test_scores(void)
+{
+   bool present[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++) {
+      present[i] = true;
+      /* Few distinct values, so that there are many ties. */
+      scores[i] = rand() % 20 - 5;
+   }
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, build(present)) == VB_OK);
+
+   static struct matches m1, m2;
+   struct vb_query query = VB_QUERY_INIT;
+   query.mode = VB_TOP_PREFIX;
+   assert(vb_lexicon_match(lex, &query, gather, &m1) == VB_ESCORES);
+   assert(vb_lexicon_set_scores(lex, scores) == VB_OK);
+
+   static size_t idxs[MAX_WORDS];
+   for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < 50; i++) {
+         char str[MN_MAX_WORD_LEN + 3] = "";
+         if (i)
+            make_query(str, i % 2 ? VB_PREFIX : VB_EXACT);
+         size_t nr = 0;
+         for (size_t j = 0; j < num_words; j++)
+            if (!strncmp(words[j], str, strlen(str)))
+               idxs[nr++] = j;
+         memset(dists, 0, sizeof dists);
+         qsort(idxs, nr, sizeof *idxs, cmp_ranks);
+         gather_ranked(&m1, idxs, nr);
+         match_all(lex, NULL, str, VB_TOP_PREFIX,
+                   rand() % VB_MAX_PAGE_SIZE + 1, MAX_WORDS, &m2);
+         assert(!strcmp(m1.buf, m2.buf));
+      }
+
+      /* Fuzzy matches of the same weight are ranked by score. */
+      for (int i = 0; i < 20; i++) {
+         const char *word = words[rand() % num_words];
+         char32_t seq1[MN_MAX_WORD_LEN + 1], seq2[MN_MAX_WORD_LEN + 1];
+         const int32_t len1 = vb_utf8_decode(seq1, word, strlen(word));
+         size_t nr = 0;
+         for (size_t j = 0; j < num_words; j++) {
+            const int32_t len2 = vb_utf8_decode(seq2, words[j], strlen(words[j]));
+            dists[j] = fc_levenshtein(seq1, len1, seq2, len2);
+            if (dists[j] <= 3)
+               idxs[nr++] = j;
+         }
+         qsort(idxs, nr, sizeof *idxs, cmp_ranks);
+         gather_ranked(&m1, idxs, nr);
+
+         query = (struct vb_query)VB_QUERY_INIT;
+         query.query = word;
+         query.len = strlen(word);
+         query.mode = VB_LEVENSHTEIN;
+         query.prefix_len = 0;
+         query.page_size = rand() % VB_MAX_PAGE_SIZE + 1;
+         m2.len = 0;
+         m2.buf[0] = '\0';
+         while (!query.pagination.last_page)
+            assert(vb_lexicon_match(lex, &query, gather, &m2) == VB_OK);
+         assert(!strcmp(m1.buf, m2.buf));
+      }
+
+      /* Scores are ignored while there are pending edits. The second round
+       * checks the flattened lexicon.
+       */
+      assert(vb_lexicon_remove(lex, words[0], strlen(words[0])) == VB_OK);
+      query = (struct vb_query)VB_QUERY_INIT;
+      query.mode = VB_TOP_PREFIX;
+      assert(vb_lexicon_match(lex, &query, gather, &m1) == VB_ESCORES);
+      assert(vb_lexicon_add(lex, words[0], strlen(words[0])) == VB_OK);
+      assert(vb_lexicon_flatten(lex) == VB_OK);
+   }
+
+   /* Compaction doesn't carry them over. */
+   struct vb_lexicon *compacted;
+   assert(vb_lexicon_compact(lex, &compacted) == VB_OK);
+   query = (struct vb_query)VB_QUERY_INIT;
+   query.mode = VB_TOP_PREFIX;
+   assert(vb_lexicon_match(compacted, &query, gather, &m1) == VB_ESCORES);
+   vb_lexicon_free(compacted);
+
+   assert(vb_lexicon_set_scores(lex, NULL) == VB_OK);
+   query.pagination = (struct vb_pagination){0};
+   assert(vb_lexicon_match(lex, &query, gather, &m1) == VB_ESCORES);
+   vb_lexicon_free(lex);
+}
+
+/* Fetches all matching words, collecting statistics if "stats" is set, and
+ * returns their number.
+ */
+static size_t match_stats(const struct vb_lexicon *lex, const char *str,
+                          enum vb_match_mode mode, size_t page_size,
+                          struct vb_stats *stats, struct matches *m)
+{
+   struct vb_query query = VB_QUERY_INIT;
+   query.query = str;
+   query.len = strlen(str);
+   query.mode = mode;
+   query.page_size = page_size;
+   query.prefix_len = 0;
+   query.stats = stats;
+
+   m->len = 0;
+   m->buf[0] = '\0';
+   while (!query.pagination.last_page)
+      assert(vb_lexicon_match(lex, &query, gather, m) == VB_OK);
+
+   size_t nr = 0;
+   for (size_t i = 0; i < m->len; i++)
+      nr += m->buf[i] == '\n';
+   return nr;
+}
+
+static void test_stats(void)
+{
+   bool present[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++)
+      present[i] = true;
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, build(present)) == VB_OK);
+
+   static struct matches m1, m2;
+   for (int round = 0; round < 2; round++) {
+      /* The second round checks the flattened lexicon. */
+      const bool flat = round;
+      struct vb_stats total[VB_MODES_NR] = {0};
+
+      for (int mode = VB_EXACT; mode < VB_TOP_PREFIX; mode++) {
+         for (int i = 0; i < 10; i++) {
+            char str[MN_MAX_WORD_LEN + 3];
+            make_query(str, mode);
+            const size_t page_size = rand() % VB_MAX_PAGE_SIZE + 1;
+            struct vb_stats st = {0};
+            const size_t nr = match_stats(lex, str, mode, page_size, &st, &m1);
+            match_stats(lex, str, mode, page_size, NULL, &m2);
+            assert(!strcmp(m1.buf, m2.buf));
+
+            /* Words are either reported or rejected, but fuzzy matching
+             * also drops those that don't make it to a page.
+             */
+            const uint64_t rejected = st.rejected_prefilter
+               + st.rejected_pattern + st.rejected_length
+               + st.rejected_distance + st.rejected_page;
+            if (mode < VB_LEVENSHTEIN || mode > VB_LCSUBSEQ) {
+               assert(st.words_visited == nr + rejected);
+            } else {
+               assert(st.words_visited >= nr + rejected);
+               assert(st.heap_pushes >= nr);
+               assert(st.extracts == (flat ? 0 : nr));
+            }
+
+            struct vb_stats *t = &total[mode];
+            t->rejected_prefilter += st.rejected_prefilter;
+            t->rejected_pattern += st.rejected_pattern;
+            t->rejected_length += st.rejected_length;
+            t->pruned_branches += st.pruned_branches;
+            t->dp_cells += st.dp_cells;
+            t->memo_hits += st.memo_hits;
+            t->utf8_bytes += st.utf8_bytes;
+         }
+      }
+      assert(total[VB_GLOB].rejected_prefilter > 0);
+      assert(total[VB_LEVENSHTEIN].rejected_length > 0);
+
+      /* Words that don't start with the right characters are never reached. */
+      char str[MN_MAX_WORD_LEN + 3];
+      snprintf(str, sizeof str, "A%c.*", "bcdlmnr"[rand() % 7]);
+      struct vb_stats st = {0};
+      const size_t nr = match_stats(lex, str, VB_REGEX, 10, &st, &m1);
+      assert(st.pruned_branches > 0);
+      assert(st.words_visited == nr + st.rejected_pattern);
+      for (int mode = VB_LEVENSHTEIN; mode <= VB_LCSUBSEQ; mode++) {
+         assert(total[mode].dp_cells > 0);
+         /* Only walking the automaton decodes words, and reuses matrix rows
+          * for the prefix shared with the previous word.
+          */
+         assert((total[mode].utf8_bytes > 0) == !flat);
+         assert((total[mode].memo_hits > 0) == !flat);
+      }
+      assert(vb_lexicon_flatten(lex) == VB_OK);
+   }
+
+   /* The best words by score are fetched one by one. */
+   static int32_t scores[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++)
+      scores[i] = rand() % 100;
+   assert(vb_lexicon_set_scores(lex, scores) == VB_OK);
+   struct vb_stats st = {0};
+   const size_t nr = match_stats(lex, "", VB_TOP_PREFIX, 7, &st, &m1);
+   assert(nr == num_words);
+   assert(st.extracts == nr && st.heap_pushes >= nr);
+   vb_lexicon_free(lex);
+}
+
+/* Fetches all matching words, with limits on each call, and returns the number
+ * of calls that were interrupted.
+ */
+static size_t match_limited(const struct vb_lexicon *lex, const char *str,
+                            enum vb_match_mode mode, size_t prefix_len,
+                            struct vb_limits *limits, struct matches *m)
+{
+   struct vb_query query = VB_QUERY_INIT;
+   query.query = str;
+   query.len = strlen(str);
+   query.mode = mode;
+   query.page_size = 7;
+   query.prefix_len = prefix_len;
+   query.limits = limits;
+
+   m->len = 0;
+   m->buf[0] = '\0';
+   size_t interrupted = 0, pages = 0;
+   while (!query.pagination.last_page) {
+      const size_t len = m->len;
+      const int ret = vb_lexicon_match(lex, &query, gather, m);
+      assert(ret == VB_OK || ret == VB_EINTR);
+      interrupted += ret == VB_EINTR;
+      pages += ret == VB_OK;
+
+      size_t nr = 0;
+      for (size_t i = len; i < m->len; i++)
+         nr += m->buf[i] == '\n';
+      assert(nr <= query.page_size);
+   }
+   /* Slices of an interrupted page don't count as pages of their own. */
+   assert(query.pagination.pages == pages);
+   return interrupted;
+}
+
+/* Interrupted searches, resumed as many times as needed, find the same words
+ * as uninterrupted ones.
+ */
+static void test_limits(void)
+{
+   bool present[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++)
+      present[i] = true;
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, build(present)) == VB_OK);
+   static int32_t scores[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++)
+      scores[i] = rand() % 10;
+   assert(vb_lexicon_set_scores(lex, scores) == VB_OK);
+
+   static struct matches m1, m2;
+   static const int canceled = 1;
+   for (int round = 0; round < 2; round++) {
+      /* The second round checks the flattened lexicon. */
+      size_t interrupted = 0;
+      for (int mode = VB_EXACT; mode <= VB_TOP_PREFIX; mode++) {
+         for (int i = 0; i < 6; i++) {
+            char str[MN_MAX_WORD_LEN + 3];
+            make_query(str, mode);
+            if (mode == VB_TOP_PREFIX)
+               str[1] = '\0';
+            const size_t prefix_len = rand() % 2;
+
+            struct vb_limits limits = {0};
+            switch (i % 3) {
+            case 0:
+               limits.max_words = 1 + rand() % 100;
+               break;
+            case 1:
+               limits.max_cells = 1 + rand() % 10000;
+               limits.max_words = 500;
+               break;
+            default:
+               /* Expired deadlines are only noticed every 64 words. */
+               limits.max_ns = 1;
+               limits.cancel = i % 2 ? &canceled : NULL;
+               break;
+            }
+            match_limited(lex, str, mode, prefix_len, NULL, &m1);
+            interrupted += match_limited(lex, str, mode, prefix_len, &limits, &m2);
+            vb_limits_fini(&limits);
+            assert(!strcmp(m1.buf, m2.buf));
+         }
+      }
+      assert(interrupted > 0);
+      assert(vb_lexicon_flatten(lex) == VB_OK);
+   }
+   vb_lexicon_free(lex);
+}
+
+static void ignore(void *arg, const char *word, size_t len)
+{
+   (void)arg;
+   (void)word;
+   (void)len;
+}
+
+struct canceled_search {
+   const struct vb_lexicon *lex;
+   struct vb_limits limits;
+   volatile int cancel;
+};
+
+static int cancelable_search(void *arg)
+{
+   struct canceled_search *cs = arg;
+
+   for (;;) {
+      struct vb_query query = VB_QUERY_INIT;
+      query.query = "Aaron";
+      query.len = 5;
+      query.mode = VB_LEVENSHTEIN;
+      query.prefix_len = 0;
+      query.limits = &cs->limits;
+      if (vb_lexicon_match(cs->lex, &query, ignore, NULL) == VB_EINTR)
+         return 0;
+   }
+}
+
+/* Searches can be canceled from another thread. */
+static void test_cancel(void)
+{
+   bool present[MAX_WORDS];
+   for (size_t i = 0; i < num_words; i++)
+      present[i] = true;
+   struct vb_lexicon *lex;
+   assert(vb_lexicon_new(&lex, build(present)) == VB_OK);
+
+   struct canceled_search cs = {.lex = lex};
+   cs.limits.cancel = &cs.cancel;
+   thrd_t thread;
+   assert(thrd_create(&thread, cancelable_search, &cs) == thrd_success);
+   cs.cancel = 1;
+   assert(thrd_join(thread, NULL) == thrd_success);
+   vb_limits_fini(&cs.limits);
+   vb_lexicon_free(lex);
+}
+
+int main(void)
+{
+   srand(time(NULL));
+   load_words();
+   test_counts();
+   test_edits();
+   test_standard();
+   test_wide_chars();
+   test_bad_utf8();
+   test_fold();
+   test_scores();
+   test_stats();
+   test_limits();
+   test_cancel();
+   for (size_t i = 0; i < num_words; i++)
+      free(words[i]);
+}
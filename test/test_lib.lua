@@ -12,6 +12,7 @@ local MODES = {
    "substr",
    "suffix",
    "glob",
+   "regex",
    "levenshtein",
    "damerau",
    "lcsubstr",
@@ -47,6 +48,7 @@ local function choose_tokens()
    -- Prevent glob pattern simplifications so that the glob matching function
    -- is tested.
    tokens.glob = token:sub(1, x) .. "*" .. token:sub(x + 1)
+   tokens.regex = "(.|" .. token:sub(1, 1):gsub("%W", "") .. "){" .. y .. ",}"
    return tokens, #words
 end
 
@@ -57,13 +59,14 @@ end
 
 local function gather_matches(lexicon, tokens, mode, page_size, num_words)
    local matches = {}
-   local last_pos, last_weight
+   local last_pos, last_weight, last_word
    while true do
       local params = {
          mode = mode,
          page_size = page_size,
          last_pos = last_pos,
          last_weight = last_weight,
+         last_word = last_word,
       }
       local ret = lexicon:match(tokens[mode], params)
       for _, word in ipairs(ret) do
@@ -77,13 +80,14 @@ local function gather_matches(lexicon, tokens, mode, page_size, num_words)
          -- that the current one is the last one, but we should still not
          -- return results if he does.
          params.last_pos, params.last_weight = ret.last_pos, ret.last_weight
+         params.last_word = ret.last_word
          for i = 1, 10 do
             ret = lexicon:match(tokens[mode], params)
             assert(ret.last_page and #ret == 0)
          end
          break
       end
-      last_pos, last_weight = ret.last_pos, ret.last_weight
+      last_pos, last_weight, last_word = ret.last_pos, ret.last_weight, ret.last_word
    end
    return table.concat(matches, "\n")
 end
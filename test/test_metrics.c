@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../volubile.h"
+#include "fixture.h"
+
+#define NUM_THREADS 4
+#define NUM_QUERIES 50
+#define NUM_PAGES 6
+
+static struct vb_lexicon *lex;
+static struct vb_metrics before, after;
+
+static void ignore(void *arg, const char *word, size_t len)
+{
+   (void)arg;
+   (void)word;
+   (void)len;
+}
+
+/* Fetches NUM_PAGES pages of words starting with "A", one at a time. */
+static int searcher(void *arg)
+{
+   (void)arg;
+
+   for (int i = 0; i < NUM_QUERIES; i++) {
+      struct vb_query query = VB_QUERY_INIT;
+      query.query = "A";
+      query.len = 1;
+      query.mode = VB_PREFIX;
+      query.page_size = 1;
+      for (int page = 0; page < NUM_PAGES; page++)
+         assert(vb_lexicon_match(lex, &query, ignore, NULL) == VB_OK);
+      assert(!query.pagination.last_page);
+   }
+   return 0;
+}
+
+static void run_searchers(void)
+{
+   thrd_t threads[NUM_THREADS];
+   for (int i = 0; i < NUM_THREADS; i++)
+      assert(thrd_create(&threads[i], searcher, NULL) == thrd_success);
+   for (int i = 0; i < NUM_THREADS; i++)
+      assert(thrd_join(threads[i], NULL) == thrd_success);
+}
+
+/* Pages from the fourth one on share a histogram. */
+static void test_histograms(void)
+{
+   vb_metrics_snapshot(&before);
+   run_searchers();
+   vb_metrics_snapshot(&after);
+
+   for (int page = 0; page < VB_METRICS_PAGES; page++) {
+      const struct vb_histogram *h0 = &before.latency[VB_PREFIX][page];
+      const struct vb_histogram *h1 = &after.latency[VB_PREFIX][page];
+      const uint64_t pages = page < VB_METRICS_PAGES - 1 ? 1
+                           : NUM_PAGES - VB_METRICS_PAGES + 1;
+      assert(h1->count - h0->count == NUM_THREADS * NUM_QUERIES * pages);
+
+      uint64_t total = 0;
+      for (size_t i = 0; i < VB_HIST_BUCKETS; i++)
+         total += h1->buckets[i];
+      assert(total == h1->count);
+
+      const uint64_t p50 = vb_histogram_quantile(h1, 0.5);
+      const uint64_t p99 = vb_histogram_quantile(h1, 0.99);
+      assert(p50 <= p99 && p99 <= h1->max_ns);
+      assert(vb_histogram_quantile(h1, 1) == h1->max_ns);
+      assert(h1->sum_ns >= h1->max_ns);
+   }
+   for (int mode = 0; mode < VB_MODES_NR; mode++)
+      if (mode != VB_PREFIX)
+         assert(after.latency[mode][0].count == before.latency[mode][0].count);
+
+   /* Blocks of the threads that exited are reused, without losing counts. */
+   run_searchers();
+   vb_metrics_snapshot(&after);
+   assert(after.latency[VB_PREFIX][0].count
+          == before.latency[VB_PREFIX][0].count + 2 * NUM_THREADS * NUM_QUERIES);
+}
+
+struct slow_queries {
+   int calls;
+   enum vb_match_mode mode;
+   uint64_t words_visited;
+};
+
+static void on_slow_query(void *arg, const struct vb_query *q,
+                          enum vb_match_mode mode, const struct vb_stats *st)
+{
+   struct slow_queries *s = arg;
+
+   assert(q->pagination.pages == 1);
+   s->calls++;
+   s->mode = mode;
+   s->words_visited = st->words_visited;
+}
+
+static void test_slow_hook(void)
+{
+   struct slow_queries s = {0};
+   vb_metrics_set_slow_hook(0, on_slow_query, &s);
+   vb_metrics_snapshot(&before);
+
+   /* The hook gets the statistics of the search even if the query doesn't
+    * ask for them, and the mode it resolved to.
+    */
+   struct vb_query query = VB_QUERY_INIT;
+   query.query = "Aa*";
+   query.len = 3;
+   assert(vb_lexicon_match(lex, &query, ignore, NULL) == VB_OK);
+   assert(s.calls == 1 && s.mode == VB_PREFIX && s.words_visited > 0);
+
+   /* The statistics of the query are still added to. */
+   struct vb_stats stats = {0};
+   query = (struct vb_query)VB_QUERY_INIT;
+   query.query = "Aa";
+   query.len = 2;
+   query.mode = VB_SUBSTR;
+   query.stats = &stats;
+   assert(vb_lexicon_match(lex, &query, ignore, NULL) == VB_OK);
+   assert(s.calls == 2 && s.mode == VB_SUBSTR);
+   assert(stats.words_visited == s.words_visited);
+
+   vb_metrics_snapshot(&after);
+   assert(after.slow_queries == before.slow_queries + 2);
+
+   vb_metrics_set_slow_hook(UINT64_MAX, NULL, NULL);
+   query.pagination = (struct vb_pagination){0};
+   assert(vb_lexicon_match(lex, &query, ignore, NULL) == VB_OK);
+   assert(s.calls == 2);
+}
+
+static void test_export(void)
+{
+   vb_metrics_snapshot(&after);
+   const size_t len = vb_metrics_export(&after, NULL, 0);
+   char *buf = malloc(len + 1);
+   assert(vb_metrics_export(&after, buf, len + 1) == len);
+   assert(strlen(buf) == len);
+   assert(strstr(buf, "volubile_search_seconds{mode=\"prefix\",page=\"4+\",quantile=\"0.99\"}"));
+   assert(strstr(buf, "volubile_search_seconds_count{mode=\"substr\",page=\"1\"} "));
+   assert(!strstr(buf, "mode=\"regex\""));
+   assert(strstr(buf, "volubile_slow_searches_total 2\n"));
+
+   /* Truncated output is still terminated. */
+   char small[16];
+   assert(vb_metrics_export(&after, small, sizeof small) == len);
+   assert(strlen(small) == sizeof small - 1);
+   assert(!strncmp(small, buf, sizeof small - 1));
+   free(buf);
+}
+
+int main(void)
+{
+   lex = load_lexicon();
+
+   /* Nothing is recorded until metrics are enabled. */
+   run_searchers();
+   vb_metrics_snapshot(&after);
+   assert(after.latency[VB_PREFIX][0].count == 0);
+
+   vb_metrics_enable(true);
+   test_histograms();
+   test_slow_hook();
+   test_export();
+   vb_metrics_enable(false);
+   vb_lexicon_free(lex);
+}
@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200809L
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../src/priv.h"
+#include "fixture.h"
+
+static bool match(const char *pat, const char *str)
+{
+   struct vb_regex re;
+   assert(vb_regex_compile(&re, pat, strlen(pat), false) == VB_OK);
+   bool ret = vb_regex_match(&re, str, strlen(str));
+   vb_regex_fini(&re);
+   return ret;
+}
+
+static void test_syntax(void)
+{
+   static const struct {
+      const char *pat, *str;
+      bool match;
+   } tests[] = {
+      {"", "", true},
+      {"", "a", false},
+      {"abc", "abc", true},
+      {"abc", "abcd", false},
+      {"a|bc", "bc", true},
+      {"a(b|c)d", "acd", true},
+      {"a(b|c)d", "ad", false},
+      {"a*", "", true},
+      {"a+", "", false},
+      {"ab?c", "ac", true},
+      {"a{2}", "aa", true},
+      {"a{2}", "aaa", false},
+      {"a{2,}", "aaaaa", true},
+      {"a{2,3}", "aaaa", false},
+      {".", "é", true},
+      {".", "\U0001F600", true},
+      {"..", "é", false},
+      {"[a-c]x", "bx", true},
+      {"[^a-c]", "d", true},
+      {"[^a-c]", "b", false},
+      {"[^a]", "é", true},
+      {"[é-ë]", "ê", true},
+      {"[é-ë]", "e", false},
+      {"[\\]]", "]", true},
+      {"[]a]", "]", true},
+      {"[a-]", "-", true},
+      {"\\.", ".", true},
+      {"\\.", "a", false},
+      {"a\\*", "a*", true},
+      {"^$", "^$", true},
+      {"x{0}", "", true},
+      {"[^\\x]*", "abc", true},
+   };
+
+   for (size_t i = 0; i < sizeof tests / sizeof *tests; i++)
+      assert(match(tests[i].pat, tests[i].str) == tests[i].match);
+
+   static const char *const invalid[] = {
+      "(", "a)", "*", "a{", "a{2", "a{3,2}", "a{1000}", "[a", "[c-a]", "\\",
+      "a|*", "a{,2}",
+   };
+   for (size_t i = 0; i < sizeof invalid / sizeof *invalid; i++) {
+      struct vb_regex re;
+      assert(vb_regex_compile(&re, invalid[i], strlen(invalid[i]), false)
+             == VB_EREGEX);
+   }
+
+   struct vb_regex re;
+   assert(vb_regex_compile(&re, "a\xff", 2, false) == VB_EQUTF8);
+   const char *big = "(a|b)*a(a|b){14}";
+   assert(vb_regex_compile(&re, big, strlen(big), false) == VB_EREGEX);
+}
+
+/* Folded expressions match the folded forms of the strings they would match
+ * otherwise, which are the only ones in folded indexes.
+ */
+static void test_fold(void)
+{
+   static const struct {
+      const char *pat, *str;
+      bool match;
+   } tests[] = {
+      {"[A-Z]pple", "apple", true},
+      {"CAFÉ", "cafe", true},
+      {"caf[É]", "cafe", true},
+      {"\\A", "a", true},
+      {"[À-Å]", "a", true},
+      {"[^a]", "a", false},
+      {"[^A]", "a", false},
+      {"[^A]", "b", true},
+      {"[^À-ÿ]", "e", false},
+      {"e\u0301", "e", true},
+      {"ΑΩ", "αω", true},
+      {"[Ё]", "е", true},
+   };
+
+   for (size_t i = 0; i < sizeof tests / sizeof *tests; i++) {
+      struct vb_regex re;
+      const char *pat = tests[i].pat;
+      assert(vb_regex_compile(&re, pat, strlen(pat), true) == VB_OK);
+      const char *str = tests[i].str;
+      assert(vb_regex_match(&re, str, strlen(str)) == tests[i].match);
+      vb_regex_fini(&re);
+   }
+   assert(!match("[A-Z]pple", "apple"));
+}
+
+/* Compares the results with those of the POSIX matcher on random expressions
+ * and strings.
+ */
+static void test_random(void)
+{
+   static const char *const pat_parts[] = {
+      "a", "b", "c", ".", "*", "+", "?", "|", "(", ")", "[ab]", "[^a]",
+      "[a-b]", "{2}", "{1,2}", "{0,}",
+   };
+   const size_t nparts = sizeof pat_parts / sizeof *pat_parts;
+
+   for (int i = 0; i < 3000; i++) {
+      char pat[128] = "", posix[160];
+      for (int n = rand() % 8; n; n--)
+         strcat(pat, pat_parts[rand() % nparts]);
+
+      /* Skip what POSIX rejects or leaves undefined. */
+      snprintf(posix, sizeof posix, "^(%s)$", pat);
+      regex_t preg;
+      if (strstr(pat, "()") || strstr(pat, "(|") || strstr(pat, "|)")
+          || strstr(pat, "||") || pat[0] == '|' || (*pat && pat[strlen(pat) - 1] == '|')
+          || regcomp(&preg, posix, REG_EXTENDED | REG_NOSUB))
+         continue;
+
+      struct vb_regex re;
+      int ret = vb_regex_compile(&re, pat, strlen(pat), false);
+      if (ret) {
+         regfree(&preg);
+         continue;
+      }
+      for (int j = 0; j < 50; j++) {
+         char str[16] = "";
+         for (int n = rand() % 6; n; n--)
+            strcat(str, (const char *[]){"a", "b", "c"}[rand() % 3]);
+         bool expect = !regexec(&preg, str, 0, NULL, 0);
+         assert(vb_regex_match(&re, str, strlen(str)) == expect);
+      }
+      vb_regex_fini(&re);
+      regfree(&preg);
+   }
+}
+
+/* Searching the automaton must give the words a full scan would, across
+ * pages.
+ */
+static void test_automaton(void)
+{
+   static const char *const pats[] = {
+      ".*", "a.*", ".*(ing|ed)", "[^aeiou]{3,}", "(ab|cd).*e?", "x",
+   };
+
+   struct vb_lexicon *lex = load_lexicon();
+   const struct mini *fsa = lex->base;
+
+   static struct matches m1, m2;
+   for (size_t i = 0; i < sizeof pats / sizeof *pats; i++) {
+      struct vb_regex re;
+      assert(vb_regex_compile(&re, pats[i], strlen(pats[i]), false) == VB_OK);
+      struct mini_iter it;
+      const char *word;
+      size_t len;
+      m1.len = 0;
+      m1.buf[0] = '\0';
+      mn_iter_init(&it, fsa);
+      while ((word = mn_iter_next(&it, &len)))
+         if (vb_regex_match(&re, word, len))
+            gather(&m1, word, len);
+      vb_regex_fini(&re);
+
+      struct vb_query query = VB_QUERY_INIT;
+      query.query = pats[i];
+      query.len = strlen(pats[i]);
+      query.mode = VB_REGEX;
+      query.page_size = rand() % VB_MAX_PAGE_SIZE + 1;
+      m2.len = 0;
+      m2.buf[0] = '\0';
+      while (!query.pagination.last_page)
+         assert(vb_match(fsa, &query, gather, &m2) == VB_OK);
+      assert(!strcmp(m1.buf, m2.buf));
+   }
+   vb_lexicon_free(lex);
+}
+
+int main(void)
+{
+   srand(time(NULL));
+   test_syntax();
+   test_fold();
+   test_random();
+   test_automaton();
+}
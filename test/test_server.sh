@@ -0,0 +1,34 @@
+#!/usr/bin/env bash
+
+set -e
+
+dir=$(mktemp -d)
+sock=$dir/volubile.sock
+trap 'kill $server 2>/dev/null || true; rm -rf "$dir"' EXIT
+
+../server/volubile-server -t 2 -fold "$sock" lexicon.mn lexicon.mn &
+server=$!
+for i in $(seq 50); do
+   [ -S "$sock" ] && break
+   sleep 0.1
+done
+
+# The load generator fails if any request does.
+for mode in auto prefix glob regex damerau lcsubstr; do
+   ../server/volubile-load -c 2 -d 4 -t 0.2 -p 3 -m $mode -w lexicon.txt "$sock" > /dev/null
+done
+../server/volubile-load -c 2 -d 4 -t 0.2 -l 2 -fold -w lexicon.txt "$sock" > /dev/null
+
+# More requests in flight than the queue holds are answered all the same.
+../server/volubile-load -c 256 -d 32 -t 0.2 -m damerau -w lexicon.txt "$sock" > /dev/null
+
+../server/volubile-load -metrics "$sock" > "$dir/metrics"
+grep -q '^volubile_search_seconds_count{mode="prefix",page="2"}' "$dir/metrics"
+grep -q '^volubile_server_protocol_errors_total 0$' "$dir/metrics"
+
+# Queued requests are answered, and the socket removed, on shutdown.
+kill -TERM $server
+wait $server
+[ ! -e "$sock" ]
+
+exit 0
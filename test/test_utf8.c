@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include "../src/utf8.c"
+
+/* Straightforward decoder, to check the optimized one against. */
+static int32_t decode(char32_t *dest, const char *str, size_t len)
+{
+   int32_t ulen = 0;
+
+   for (size_t i = 0; i < len; ) {
+      size_t clen = vb_char_len(str[i]);
+      if (clen == 0 || i + clen > len)
+         return -1;
+      dest[ulen++] = vb_decode_char(&str[i], clen);
+      i += clen;
+   }
+   dest[ulen] = U'\0';
+   return ulen;
+}
+
+/* Mostly valid strings, with ASCII runs of various lengths, so that all the
+ * paths of the decoder are taken.
+ */
+static size_t random_string(char *str, size_t max)
+{
+   static const char *const chars[] = {
+      "a", "Z", "0", " ", "é", "ÿ", "Δ", "中", "\U0001F600",
+   };
+   size_t len = 0;
+
+   while (len + 4 < max && rand() % 30) {
+      if (rand() % 2) {
+         size_t run = rand() % 40;
+         while (run-- && len < max)
+            str[len++] = 'a' + rand() % 26;
+      } else {
+         const char *c = chars[rand() % (sizeof chars / sizeof *chars)];
+         memcpy(&str[len], c, strlen(c));
+         len += strlen(c);
+      }
+   }
+   if (rand() % 4 == 0 && len)
+      str[rand() % len] = rand();
+   if (rand() % 4 == 0 && len)
+      len--;
+   return len;
+}
+
+static void test_decode(void)
+{
+   char str[MN_MAX_WORD_LEN];
+   char32_t expect[MN_MAX_WORD_LEN + 1], got[MN_MAX_WORD_LEN + 1];
+
+   for (int i = 0; i < 100000; i++) {
+      size_t len = random_string(str, sizeof str);
+      int32_t ulen = decode(expect, str, len);
+      assert(vb_utf8_decode(got, str, len) == ulen);
+      assert(vb_utf8_check(str, len) == (ulen >= 0));
+      if (ulen >= 0) {
+         assert(!memcmp(got, expect, (ulen + 1) * sizeof *got));
+         assert(vb_utf8_decode_valid(got, str, len) == ulen);
+         assert(!memcmp(got, expect, (ulen + 1) * sizeof *got));
+      }
+   }
+}
+
+/* Decoding strings that differ from the previous one after a random number of
+ * bytes, possibly in the middle of a character, must give the same result as
+ * decoding them from scratch.
+ */
+static void test_decode_next(void)
+{
+   static struct vb_decoded d;
+   char str[MN_MAX_WORD_LEN];
+   char32_t expect[MN_MAX_WORD_LEN + 1];
+   size_t len = 0;
+
+   for (int i = 0; i < 100000; i++) {
+      size_t shared = len ? rand() % (len + 1) : 0;
+      len = shared + random_string(&str[shared], sizeof str - shared);
+      int32_t ulen = decode(expect, str, len);
+      assert(vb_utf8_decode_next(&d, str, len, shared, true) == ulen);
+      if (ulen >= 0)
+         assert(!memcmp(d.chars, expect, (ulen + 1) * sizeof *expect));
+      else
+         len = 0;
+   }
+}
+
+static void test_fold(void)
+{
+   static const char *const tests[][2] = {
+      {"", ""},
+      {"Hello World", "hello world"},
+      {"Élan ÇA ß", "elan ca ß"},
+      {"ÆØÅ æøå Þ", "æoa æoa þ"},
+      {"Łódź Ĳssel", "lodz ĳssel"},
+      {"ĸŉŊŒ", "ĸŉŋœ"},
+      {"e\u0301te\u0300", "ete"},
+      {"ΆΘΗΝΑ ΰς", "αθηνα υσ"},
+      {"ЁЖИК Ѝ Їж", "ежик и їж"},
+      {"中文\U0001F600", "中文\U0001F600"},
+      {"A\xff\xc3", "a\xff\xc3"},
+      {"\xc3" "*É", "\xc3" "*e"},
+   };
+   char buf[64];
+
+   for (size_t i = 0; i < sizeof tests / sizeof *tests; i++) {
+      size_t len = vb_utf8_fold(buf, tests[i][0], strlen(tests[i][0]));
+      assert(len == strlen(tests[i][1]));
+      assert(!strcmp(buf, tests[i][1]));
+   }
+}
+
+int main(void)
+{
+   srand(time(NULL));
+   test_decode();
+   test_decode_next();
+   test_fold();
+}
@@ -21,6 +21,14 @@ enum {
    VB_EQUTF8,     /* Query string is not valid UTF-8. */
    VB_ELUTF8,     /* Lexicon contains an invalid UTF-8 string. */
    VB_EFSA,       /* Lexicon is not a numbered automaton. */
+   VB_EWORD,      /* Attempt to add an empty, too long or non-UTF-8 word. */
+   VB_E2BIG,      /* Lexicon has grown too large. */
+   VB_ENOMEM,     /* Out of memory. */
+   VB_EREGEX,     /* Invalid or too complex regular expression. */
+   VB_EFOLD,      /* Lexicon has no up-to-date folded index. */
+   VB_ESCORES,    /* Lexicon has no up-to-date word scores. */
+   VB_EINTR,      /* Search interrupted, see struct vb_limits. */
+   VB_ESHARDS,    /* Too many shards, or token made for other shards. */
 };
 
 /* Returns a string describing an error code. */
@@ -37,11 +45,88 @@ enum vb_match_mode {
    VB_DAMERAU,       /* Damerau-Levenshtein distance. */
    VB_LCSUBSTR,      /* Longest common substring. */
    VB_LCSUBSEQ,      /* Longest common subsequence. */
+   VB_REGEX,         /* Regular expression matching. */
+   VB_TOP_PREFIX,    /* Prefix matching, highest-scoring words first. */
    
    VB_MODES_NR
 };
 
 #define VB_MAX_PAGE_SIZE 30   /* Maximum allowed number of words per page. */
+#define VB_MAX_WORD_LEN 333   /* Same as MN_MAX_WORD_LEN. */
+
+/* Statistics about the execution of a query, see the "stats" field of struct
+ * vb_query. Counters are added to, and never reset, so that they can be summed
+ * over the pages of a query, or over several queries; the structure should be
+ * zeroed beforehand. A counter that doesn't apply to the matching mode used, or
+ * to the way the lexicon is stored, stays as it is.
+ */
+struct vb_stats {
+   uint64_t words_visited;       /* Words looked at. */
+
+   /* Words looked at but not reported, by reason. Words that come after the
+    * end of the current results page are not counted.
+    */
+   uint64_t rejected_prefilter;  /* Glob: lacks a literal of the pattern. */
+   uint64_t rejected_pattern;    /* Doesn't match the pattern. */
+   uint64_t rejected_length;     /* Fuzzy: length too different. */
+   uint64_t rejected_distance;   /* Fuzzy: too far from the query. */
+   uint64_t rejected_page;       /* Belongs to a previous results page. */
+
+   /* Regex: transitions of the automaton not followed, because no word below
+    * them can match.
+    */
+   uint64_t pruned_branches;
+
+   uint64_t dp_cells;            /* Fuzzy: matrix cells computed. */
+   uint64_t memo_hits;           /* Fuzzy: words that reused matrix rows. */
+   uint64_t utf8_bytes;          /* Bytes of words decoded. */
+   uint64_t heap_pushes;         /* Candidates offered to a ranking heap. */
+   uint64_t extracts;            /* Words fetched by ordinal. */
+
+   /* Wall time spent parsing the query, searching the lexicon, and reporting
+    * the results, in nanoseconds. Results are reported as they are found,
+    * within the search phase, except with fuzzy matching.
+    */
+   uint64_t parse_ns;
+   uint64_t search_ns;
+   uint64_t report_ns;
+};
+
+/* Limits on the work a single call to vb_match() can do, see the "limits"
+ * field of struct vb_query. Zero means no limit. Once a limit is reached, the
+ * call returns VB_EINTR, after reporting the words found so far, and updates
+ * the pagination data so that the next call resumes the search where it
+ * stopped. Each call thus returns at most "page_size" words, but an
+ * interrupted one can return fewer, or none at all: fuzzy searches rank all
+ * the candidates before reporting any, so they keep the best ones found so far
+ * in the limits until they are done. A structure thus holds the progress of
+ * a single search at a time. A fuzzy search resumed with other limits, or
+ * without any, scores its page again from the start.
+ * At least one word is looked at per call, so that searches always progress.
+ * Fuzzy searches of standard automata, which can't be resumed, ignore limits.
+ */
+struct vb_partial;
+
+struct vb_limits {
+   uint64_t max_ns;           /* Wall time, checked every 64 words. */
+   uint64_t max_words;        /* Words looked at. */
+   uint64_t max_cells;        /* Matrix cells computed by fuzzy searches. */
+
+   /* Flag that can be set to non-zero from another thread to interrupt a
+    * search as soon as possible, that is, within 64 words, or NULL. The
+    * library only reads it.
+    */
+   const volatile int *cancel;
+
+   /* Progress of an interrupted fuzzy search, allocated by the library. Must
+    * be NULL the first time the structure is used, and released with
+    * vb_limits_fini() once done with it.
+    */
+   struct vb_partial *partial;
+};
+
+/* Releases the progress kept in limits, but not the structure itself. */
+void vb_limits_fini(struct vb_limits *);
 
 struct vb_query {
    const char *query;         /* Query string and its length. */
@@ -64,6 +149,25 @@ struct vb_query {
     */
    size_t prefix_len;
 
+   /* Whether to ignore case and diacritics, by searching the folded index of
+    * the lexicon (see vb_lexicon_fold()). The query is folded the same way as
+    * the words, and the original words are reported. Results pages are made
+    * of folded forms, so a page holds more than "page_size" words when some
+    * of them have the same folded form.
+    */
+   bool fold;
+
+   /* Where to add statistics about the execution of the query, or NULL if
+    * they are not wanted, which is the default. Collecting them costs a few
+    * counter updates per word.
+    */
+   struct vb_stats *stats;
+
+   /* Limits on the work of each call, or NULL if there are none, which is the
+    * default. See struct vb_limits.
+    */
+   struct vb_limits *limits;
+
    /* State data for paginating matching words. Must be filled with zeroes the
     * first time vb_match() is called. After a call, these values are updated
     * in such a manner that, if vb_match() is called again with this same
@@ -75,6 +179,19 @@ struct vb_query {
       uint32_t last_pos;      /* Position of the last seen word. */
       int32_t last_weight;    /* Lowest rank among the returned words. */
 
+      /* The last seen word itself. Standard automata have no word ordinals,
+       * so searches resume from this word instead of from "last_pos", which
+       * is then only meaningful as far as it is zero or not.
+       */
+      size_t last_len;
+      char last_word[VB_MAX_WORD_LEN + 1];
+
+      uint32_t pages;         /* Number of pages fetched so far. */
+
+      /* Whether the last call interrupted a fuzzy search, whose progress is
+       * kept in the limits of the query.
+       */
+      bool interrupted;
    } pagination;
 };
 
@@ -88,7 +205,10 @@ struct vb_query {
 }
 
 /* Searches a lexicon.
- * The lexicon must be a numbered automaton.
+ * The lexicon can be a standard or a numbered automaton. Both give the same
+ * results. Standard automata are smaller, but fuzzy matching must then copy
+ * the best candidates found so far instead of recording their ordinals, which
+ * is marginally slower.
  * The provided callback function will be called for each matching word. It will
  * be passed the current matching word. On success, returns VB_OK, otherwise an
  * error code.
@@ -97,6 +217,332 @@ int vb_match(const struct mini *lexicon, struct vb_query *,
              void (*handler)(void *arg, const char *token, size_t len),
              void *arg);
 
+
+/*******************************************************************************
+ * Editable lexicons
+ ******************************************************************************/
+
+/* A lexicon made of an immutable automaton (the base), plus the words added to
+ * it and removed from it since it was built. Searching such a lexicon returns
+ * the same results, in the same order, as searching an automaton built from
+ * the edited word list, so edits are visible immediately, without rebuilding
+ * the base. Edits are held in memory, and are meant to be few compared to the
+ * size of the base; vb_lexicon_compact() folds them into a new base.
+ *
+ * Searching a lexicon does not modify it, so several threads can search the
+ * same lexicon concurrently, provided no thread modifies it at the same time.
+ * Pagination data obtained from a lexicon is only valid as long as this
+ * lexicon is not modified.
+ */
+struct vb_lexicon;
+
+/* Creates a new lexicon.
+ * The base automaton must be numbered. On success, the lexicon takes ownership
+ * of it, and it should not be used directly afterwards.
+ * All its words are checked to be valid UTF-8 beforehand, so that searches
+ * don't have to do it again. If one of them is not, VB_ELUTF8 is returned.
+ * This requires traversing the whole automaton.
+ */
+int vb_lexicon_new(struct vb_lexicon **, struct mini *base);
+
+/* Destructor. Also frees the base automaton. */
+void vb_lexicon_free(struct vb_lexicon *);
+
+/* Returns the number of words in a lexicon. */
+uint32_t vb_lexicon_size(const struct vb_lexicon *);
+
+/* Returns the number of edits not yet folded into the base automaton. */
+size_t vb_lexicon_pending(const struct vb_lexicon *);
+
+/* Adds a word to a lexicon. Adding a word that is already present is not an
+ * error. The word must be valid UTF-8.
+ */
+int vb_lexicon_add(struct vb_lexicon *, const char *word, size_t len);
+
+/* Removes a word from a lexicon. Removing a word that is not present is not an
+ * error.
+ */
+int vb_lexicon_remove(struct vb_lexicon *, const char *word, size_t len);
+
+/* Creates a new lexicon whose base automaton contains the words of an existing
+ * one, edits included.
+ * The source lexicon is only read, so it can still be searched while this
+ * function runs, e.g. in a background thread. The new lexicon can then be
+ * substituted for the old one.
+ */
+int vb_lexicon_compact(const struct vb_lexicon *, struct vb_lexicon **);
+
+/* Keeps a flat copy of the words of a lexicon, which makes substring and
+ * suffix searches much faster, since they can then scan a single buffer
+ * instead of walking the automaton. This takes as much memory as the words
+ * themselves, plus 4 bytes per word, which is typically several times the size
+ * of the automaton. The decoded code points of the words are kept too, in 1,
+ * 2 or 4 bytes each depending on the largest one, which makes fuzzy searches
+ * several times faster. The copy is only used while the lexicon has no pending
+ * edits. vb_lexicon_compact() also creates it for the new lexicon if the
+ * source lexicon has one.
+ */
+int vb_lexicon_flatten(struct vb_lexicon *);
+
+/* Builds an index of the folded forms of the words of a lexicon, for case- and
+ * diacritic-insensitive searches. Folding lowercases letters and removes their
+ * diacritics, so that "Élan" and "elan" have the same folded form; see the
+ * README for the details. The index is an automaton of the folded forms, plus
+ * the ordinals of the words each of them stands for, which typically takes a
+ * bit more memory than the base automaton, and is flattened along with the
+ * lexicon. It is only used while the lexicon has no pending edits, and folded
+ * searches fail with VB_EFOLD otherwise. vb_lexicon_compact() also builds it
+ * for the new lexicon if the source lexicon has one.
+ */
+int vb_lexicon_fold(struct vb_lexicon *);
+
+/* Attaches scores to the words of a lexicon, such as their frequency or
+ * popularity. "scores" must hold one score per word of the base automaton, in
+ * the same order, and stay valid as long as the lexicon uses it; it can point
+ * to a file mapped in memory. An index of 4 bytes per word is built, for
+ * finding the highest-scoring words of a range of ordinals.
+ * VB_TOP_PREFIX searches return the words that start with the query string by
+ * decreasing score, and fuzzy searches rank words of equal weight by
+ * decreasing score. Scores are only used while the lexicon has no pending
+ * edits, and VB_TOP_PREFIX searches fail with VB_ESCORES otherwise, as well
+ * as folded ones.
+ * vb_lexicon_compact() doesn't carry them over, since word ordinals change.
+ * Passing NULL detaches them.
+ */
+int vb_lexicon_set_scores(struct vb_lexicon *, const int32_t *scores);
+
+/* Same as vb_match(), but for a lexicon created with vb_lexicon_new(). */
+int vb_lexicon_match(const struct vb_lexicon *, struct vb_query *,
+                     void (*handler)(void *arg, const char *token, size_t len),
+                     void *arg);
+
+
+/*******************************************************************************
+ * Lexicon handles
+ ******************************************************************************/
+
+/* A handle holds the current version of a lexicon, and allows replacing it
+ * with a new one while other threads are searching it. Searches never wait for
+ * a replacement to complete: each of them uses whichever version was current
+ * when it started. A replaced version is freed once all the searches that might
+ * still be using it have finished.
+ */
+struct vb_handle;
+
+/* Creates a new handle. Takes ownership of the provided lexicon. */
+int vb_handle_new(struct vb_handle **, struct vb_lexicon *);
+
+/* Destructor. Also frees the current lexicon. No search must be in progress
+ * when this is called.
+ */
+void vb_handle_free(struct vb_handle *);
+
+/* Makes a lexicon the current one. Takes ownership of it.
+ * Waits until the previous version is not used anymore, and frees it. Several
+ * threads can call this function concurrently; replacements are then
+ * serialized.
+ */
+void vb_handle_publish(struct vb_handle *, struct vb_lexicon *);
+
+/* Prevents the current lexicon from being freed until vb_handle_release() is
+ * called, and returns it. This allows issuing several searches against the
+ * same lexicon version. The value written to "ticket" must be passed to
+ * vb_handle_release().
+ */
+const struct vb_lexicon *vb_handle_acquire(struct vb_handle *,
+                                           unsigned *ticket);
+
+/* Releases a lexicon acquired with vb_handle_acquire(). */
+void vb_handle_release(struct vb_handle *, unsigned ticket);
+
+/* Searches the current lexicon of a handle. Same as vb_lexicon_match()
+ * otherwise. Note that if the lexicon is replaced between two calls that fetch
+ * successive results pages, the second page is computed from the new lexicon,
+ * using pagination data that pertains to the previous one.
+ */
+int vb_handle_match(struct vb_handle *, struct vb_query *,
+                    void (*handler)(void *arg, const char *token, size_t len),
+                    void *arg);
+
+
+/*******************************************************************************
+ * Metrics
+ ******************************************************************************/
+
+/* Once enabled, every search records its latency in a process-wide registry,
+ * in a histogram per matching mode and page number. Each thread records in
+ * histograms of its own, without locking; they are summed when a snapshot is
+ * taken. The histograms of a thread that exits are kept, and reused by the
+ * next thread that searches.
+ * Latencies are the sum of the phases timed in struct vb_stats, so recording
+ * them costs as much as collecting statistics, which are then collected for
+ * each search, whether the query asks for them or not.
+ */
+
+#define VB_METRICS_PAGES 4    /* Pages 1, 2, 3, then all the following ones. */
+
+/* Buckets cover latencies from 0 to 2^40 ns, about 18 minutes, with a relative
+ * error of at most 1/8. Latencies under 16 ns have buckets of their own; the
+ * following powers of two are each split into 8 buckets of equal width.
+ */
+#define VB_HIST_BUCKETS 304
+
+struct vb_histogram {
+   uint64_t count;
+   uint64_t sum_ns;
+   uint64_t max_ns;
+   uint64_t buckets[VB_HIST_BUCKETS];
+};
+
+struct vb_metrics {
+   struct vb_histogram latency[VB_MODES_NR][VB_METRICS_PAGES];
+   uint64_t slow_queries;     /* Searches that reached the slow threshold. */
+};
+
+/* Enables or disables the recording of metrics. Disabled by default. */
+void vb_metrics_enable(bool);
+
+/* Sets a function to be called after each search that took at least
+ * "threshold_ns" nanoseconds, while metrics are enabled. It is passed the
+ * query, whose pagination data is already updated, the matching mode actually
+ * used, and the statistics of the search alone. It is called from the thread
+ * that made the search, so it can be called from several threads at once.
+ * Passing a NULL hook removes it; slow searches are still counted.
+ */
+void vb_metrics_set_slow_hook(uint64_t threshold_ns,
+                              void (*hook)(void *arg, const struct vb_query *,
+                                           enum vb_match_mode,
+                                           const struct vb_stats *),
+                              void *arg);
+
+/* Sums the metrics recorded by all threads so far. Counters are read while
+ * other threads may be updating them, so the histograms of a snapshot are
+ * only consistent with each other up to the searches in progress.
+ */
+void vb_metrics_snapshot(struct vb_metrics *);
+
+/* Returns the latency under which a fraction "q" of the recorded searches
+ * completed, as the largest latency of the bucket it falls in, or 0 if the
+ * histogram is empty.
+ */
+uint64_t vb_histogram_quantile(const struct vb_histogram *, double q);
+
+/* Writes a snapshot in the Prometheus text format, as summaries of the
+ * non-empty histograms, with their median, 90th, 99th and 99.9th percentiles.
+ * Same as snprintf() otherwise: returns the length of the full text, and
+ * writes at most "size" bytes, nul byte included.
+ */
+size_t vb_metrics_export(const struct vb_metrics *, char *buf, size_t size);
+
+
+/*******************************************************************************
+ * Results cache
+ ******************************************************************************/
+
+/* A cache of the results pages of the searches made through a handle, for
+ * workloads where the same queries come again and again. Pages are keyed on
+ * the version of the lexicon, the query string once its mode selectors are
+ * interpreted, the parameters of the query, and its pagination data, and
+ * evicted least recently used first once the cache is full. Replacing the
+ * lexicon of the handle makes the pages of the previous version unreachable;
+ * they are dropped as soon as a search against the new version comes by.
+ * The cache is split into shards that have a lock of their own, so several
+ * threads can use it at the same time with little contention.
+ * Pages served from the cache don't add to the statistics of the query, and
+ * are not recorded in metrics. Only successful searches are cached.
+ */
+struct vb_cache;
+
+/* Creates a new cache in front of a handle, which must outlive it. "max_size"
+ * is the maximum number of bytes the cached pages can take, keys and a few
+ * hundred bytes of overhead per page included.
+ */
+int vb_cache_new(struct vb_cache **, struct vb_handle *, size_t max_size);
+
+/* Destructor. No search must be in progress. Doesn't free the handle. */
+void vb_cache_free(struct vb_cache *);
+
+/* Same as vb_handle_match(), but answers from the cache when possible. */
+int vb_cache_match(struct vb_cache *, struct vb_query *,
+                   void (*handler)(void *arg, const char *token, size_t len),
+                   void *arg);
+
+struct vb_cache_stats {
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t evictions;        /* Pages dropped to make room for others. */
+   uint64_t invalidations;    /* Pages dropped because the lexicon changed. */
+   size_t entries;            /* Pages currently cached. */
+   size_t size;               /* Bytes they take. */
+};
+
+/* Returns the counters of a cache. */
+void vb_cache_stats(struct vb_cache *, struct vb_cache_stats *);
+
+
+/*******************************************************************************
+ * Federated search
+ ******************************************************************************/
+
+/* Several lexicons, or shards, can be searched as one. Each call searches all
+ * the shards in parallel, and merges their results pages into a single one,
+ * whose words come in the order a lexicon made of all the shards would give
+ * them: by increasing weight for fuzzy searches, then by decreasing score for
+ * searches that rank words by score, then in lexicographic order. Words found in several shards come once per shard, in
+ * the order of the shards.
+ * Merging a page leaves each shard at a different point of its own results,
+ * which is found from the pagination data recorded along with each word.
+ * Searches run on a pool of threads shared by all the federated searches,
+ * started as needed and kept for the life of the process. The calling thread
+ * runs one of the searches, and the only one if a single shard is left.
+ * The limits and the statistics of the query are ignored, and so is its
+ * pagination data, which is replaced with the following.
+ */
+#define VB_MAX_SHARDS 16
+
+/* Pagination data of a federated search, made of that of each shard. Must be
+ * filled with zeroes the first time vb_federated_match() is called.
+ */
+struct vb_federated_pagination {
+   bool last_page;            /* Whether we just returned the last page. */
+   uint32_t nr_shards;
+
+   struct vb_shard_cursor {
+      bool last_page;
+      uint32_t last_pos;
+      int32_t last_weight;
+      size_t last_len;
+      char last_word[VB_MAX_WORD_LEN + 1];
+      uint32_t pages;
+   } shards[VB_MAX_SHARDS];
+};
+
+/* Searches "nr" shards, which must always be passed in the same order for a
+ * given query. The handler is passed the index of the shard each word comes
+ * from. Returns VB_ESHARDS if there are more than VB_MAX_SHARDS shards, or if
+ * the pagination data was made for another number of shards. Otherwise, same
+ * as vb_lexicon_match().
+ */
+int vb_federated_match(const struct vb_lexicon *const *shards, size_t nr,
+                       const struct vb_query *,
+                       struct vb_federated_pagination *,
+                       void (*handler)(void *arg, size_t shard,
+                                       const char *token, size_t len),
+                       void *arg);
+
+/* Encodes pagination data into a compact token, for passing it around. Writes
+ * it to "buf" if it is large enough, and returns its size in any case. Tokens
+ * take at most 2 + VB_MAX_SHARDS * (15 + VB_MAX_WORD_LEN) bytes.
+ */
+size_t vb_federated_token(const struct vb_federated_pagination *,
+                          void *buf, size_t size);
+
+/* Decodes a token made by vb_federated_token(). Returns VB_ESHARDS if it is
+ * malformed.
+ */
+int vb_federated_untoken(struct vb_federated_pagination *,
+                         const void *token, size_t len);
+
 #endif
 #line 3 "api.c"
 #line 1 "priv.h"
@@ -104,6 +550,9 @@ int vb_match(const struct mini *lexicon, struct vb_query *,
 #define VB_PRIV_H
 
 #include <uchar.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #line 1 "mini.h"
 #ifndef MINI_H
 #define MINI_H
@@ -131,6 +580,7 @@ enum {
    MN_EFREEZED,   /* Attempt to add a word to a freezed automaton. */
    MN_E2BIG,      /* Automaton has grown too large. */
    MN_EIO,        /* IO error. */
+   MN_ENOMEM,     /* Out of memory. */
 };
 
 /* Returns a string describing an error code. */
@@ -151,7 +601,9 @@ struct mini_enc;
  * If MN_NUMBERED is chosen as the automaton type, a numbered automaton is
  * created instead of a classical one. This makes possible retrieving a word
  * given its ordinal, and retrieving a word ordinal given the word itself. On
- * the other hand, this doubles the automaton size.
+ * the other hand, this doubles the size of the automaton file. Once loaded,
+ * only the word counts that lookups need are kept in memory, bit-packed, which
+ * makes a numbered automaton less than a fifth larger than a standard one.
  */
 struct mini_enc *mn_enc_new(enum mn_type type);
 
@@ -260,6 +712,13 @@ struct mini_iter {
    size_t depth;                              /* Current stack depth. */
    uint32_t positions[MN_MAX_WORD_LEN + 1];   /* Offsets stack. */
    char word[MN_MAX_WORD_LEN + 1];            /* Current word. */
+
+   /* Number of leading bytes of the current word that the last call to
+    * mn_iter_next() or mn_iter_next_filter() left as they were. Consecutive
+    * words often share a long prefix, so this can be used to avoid
+    * processing it again.
+    */
+   size_t shared;
 };
 
 /* Returns an iterator over an automaton, starting at the very first word.
@@ -307,6 +766,21 @@ uint32_t mn_iter_initn(struct mini_iter *, const struct mini *, uint32_t pos);
  */
 const char *mn_iter_next(struct mini_iter *, size_t *len);
 
+/* Same as mn_iter_next(), but skips whole branches of the automaton.
+ * Before following a transition, calls "accept" with its depth, starting at
+ * zero, and its label. If it returns zero, the words that go through this
+ * transition are skipped. Transitions are considered depth-first, in
+ * lexicographic order, so "accept" is called for a transition at depth "d"
+ * only after it has been called last for the transitions that lead to it.
+ * When iteration is resumed after an initialization function positioned the
+ * iterator on a word other than the first one, calls start at the last
+ * transition of this word, at depth "depth".
+ */
+const char *mn_iter_next_filter(struct mini_iter *, size_t *len,
+                                int (*accept)(void *arg, size_t depth,
+                                              uint8_t chr),
+                                void *arg);
+
 
 /*******************************************************************************
  * Debugging.
@@ -316,7 +790,8 @@ const char *mn_iter_next(struct mini_iter *, size_t *len);
 enum mn_dump_format {
    MN_DUMP_TXT,  /* One word per line. */
    MN_DUMP_TSV,  /* TSV file, one line per transition, the first one giving
-                  * the field names. */
+                  * the field names. Word counts are not kept for the last
+                  * transition of each state, so they are reported as 0. */
    MN_DUMP_DOT,  /* DOT file, for visualization with Graphviz. */
 };
 
@@ -324,7 +799,9 @@ enum mn_dump_format {
 int mn_dump(const struct mini *, FILE *, enum mn_dump_format);
 
 #endif
-#line 7 "priv.h"
+#line 10 "priv.h"
+
+_Static_assert(VB_MAX_WORD_LEN == MN_MAX_WORD_LEN, "word length limit mismatch");
 
 struct vb_match_ctx {
    struct vb_query *query;
@@ -336,17 +813,449 @@ struct vb_match_ctx {
    const char *str;
    size_t len;
 
+   /* Whether to search the folded index of the lexicon. */
+   bool fold;
+
+   /* Whether the lexicon is a numbered automaton. If not, word ordinals are
+    * not available, and we paginate with words instead.
+    */
+   bool numbered;
+
    void (*handler)(void *arg, const char *token, size_t len);
    void *arg;
+
+   /* Same as in the query. */
+   struct vb_stats *stats;
+
+   /* Same as in the query, and the work done so far by this call: the words
+    * looked at, and the matrix cells computed. "deadline" is only set if the
+    * limits include a wall time.
+    */
+   struct vb_limits *limits;
+   uint64_t deadline;
+   uint64_t words;
+   uint64_t cells;
+
+   /* Where to store the rank of each word reported, or NULL. */
+   struct vb_rank *rank;
+};
+
+/* Rank of a reported word, for merging the results of several searches.
+ * Words come by increasing weight, then by decreasing score, then in the
+ * lexicographic order of the word as searched, which is the folded form of the
+ * reported word when searching the folded index. "slot" is incremented for
+ * each word of the results page, before folded forms are expanded, so the
+ * original words of a folded form share it.
+ */
+struct vb_rank {
+   uint32_t slot;
+   int32_t weight;
+   int32_t score;
+   const char *word;    /* Only valid while the word is being reported. */
+   size_t len;
+
+   /* Pagination data recorded for the word. Searches that rank words by
+    * weight or score resume after the last word of a page, as "after" tells,
+    * the others at the first word of the next page.
+    */
+   uint32_t pos;
+   int32_t last_weight;
+   bool after;
+};
+
+/* Same as vb_lexicon_match(), but also stores the rank of each word reported
+ * in "rank" before reporting it.
+ */
+int vb_lexicon_match_ranked(const struct vb_lexicon *, struct vb_query *,
+                            void (*callback)(void *arg, const char *token, size_t len),
+                            void *arg, struct vb_rank *rank);
+
+/* Adds to a counter of the statistics of a query, if it asked for them. */
+#define VB_STAT(c, field, n) do {                                              \
+   if ((c)->stats)                                                             \
+      (c)->stats->field += (n);                                                \
+} while (0)
+
+/* Whether metrics are being recorded, see vb_metrics_enable(). */
+bool vb_metrics_enabled(void);
+
+/* Records the latency of a search, which is that of all the phases timed in
+ * its statistics, and calls the slow query hook if need be. "page" is the
+ * index of the page fetched, starting at 0.
+ */
+void vb_metrics_record(const struct vb_query *, enum vb_match_mode,
+                       uint32_t page, const struct vb_stats *);
+
+/* Current wall time, in nanoseconds, for timing the phases of a query. */
+static inline uint64_t vb_now_ns(void)
+{
+   struct timespec ts;
+   timespec_get(&ts, TIME_UTC);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Compares two strings that are not nul-terminated. */
+static inline int lmemcmp(const void *str1, size_t len1,
+                          const void *str2, size_t len2)
+{
+   int cmp = memcmp(str1, str2, len1 < len2 ? len1 : len2);
+   if (cmp)
+      return cmp;
+   return len1 < len2 ? -1 : len1 > len2;
+}
+
+/* A word stored outside of the base automaton of a lexicon. */
+struct vb_word {
+   char *str;           /* Nul-terminated. */
+   size_t len;
+
+   /* For added words, number of words of the base automaton that sort before
+    * this one. For removed words, ordinal of this word in the base automaton.
+    */
+   uint32_t pos;
+};
+
+/* Sorted array of words. */
+struct vb_words {
+   struct vb_word *data;
+   size_t size;
+   size_t max;
+};
+
+/* Flat copy of the words of an automaton, in lexicographic order. */
+struct vb_arena {
+   char *words;         /* Concatenated words, each followed by a nul byte. */
+   uint32_t *offsets;   /* Offset of each word, plus the total size. */
+   uint32_t size;       /* Number of words. */
+
+   /* The same words, decoded, for fuzzy matching. Each code point takes
+    * "width" bytes, which is the smallest of 1, 2, or 4 that fits all code
+    * points. NULL if the automaton contains invalid UTF-8 strings.
+    */
+   void *chars;
+   uint32_t *char_offsets;    /* Same as "offsets", in code points. */
+   unsigned width;
+};
+
+int vb_arena_new(struct vb_arena **, const struct mini *);
+void vb_arena_free(struct vb_arena *);
+
+/* Returns the code points of the word at the given index, and sets "len" to
+ * their number. They are converted to "buf" if need be, which should be large
+ * enough to hold MN_MAX_WORD_LEN code points.
+ */
+static inline const char32_t *vb_arena_chars(const struct vb_arena *arena,
+                                             uint32_t idx, char32_t *buf,
+                                             int32_t *len)
+{
+   const uint32_t start = arena->char_offsets[idx];
+   *len = arena->char_offsets[idx + 1] - start;
+
+   switch (arena->width) {
+   case 1: {
+      const uint8_t *chars = (const uint8_t *)arena->chars + start;
+      for (int32_t i = 0; i < *len; i++)
+         buf[i] = chars[i];
+      return buf;
+   }
+   case 2: {
+      const uint16_t *chars = (const uint16_t *)arena->chars + start;
+      for (int32_t i = 0; i < *len; i++)
+         buf[i] = chars[i];
+      return buf;
+   }
+   default:
+      return (const char32_t *)arena->chars + start;
+   }
+}
+
+/* Finds the range of words that start with a prefix. */
+void vb_arena_range(const struct vb_arena *, const char *prefix, size_t len,
+                    uint32_t *first, uint32_t *end);
+
+/* Finds the first occurrence of a string in another. */
+const char *vb_memmem(const char *hay, size_t hay_len,
+                      const char *needle, size_t len);
+
+/* Returns the index of the first word, starting at "idx", that contains the
+ * given string, or the number of words if there is none. Since each word is
+ * followed by a nul byte, looking for a string followed by a nul byte finds
+ * words that end with it.
+ */
+uint32_t vb_arena_find(const struct vb_arena *, uint32_t idx,
+                       const char *str, size_t len);
+
+/* Compiled glob pattern. See fc_glob() for the syntax. */
+struct vb_glob {
+   /* Pattern atoms. Consecutive stars are merged. */
+   struct vb_glob_atom {
+      enum { VB_GLOB_CHAR, VB_GLOB_ANY, VB_GLOB_SET, VB_GLOB_STAR } type;
+      union {
+         char32_t c;          /* For VB_GLOB_CHAR. */
+         uint32_t set;        /* For VB_GLOB_SET, index in "sets". */
+      };
+   } atoms[MN_MAX_WORD_LEN];
+   uint32_t nr_atoms;
+
+   /* Groups. ASCII characters are kept in a bitmap, the others in
+    * "set_chars", between "start" and "end".
+    */
+   struct vb_glob_set {
+      uint64_t ascii[2];
+      uint32_t start, end;
+      bool invert;
+   } sets[MN_MAX_WORD_LEN / 2];
+   uint32_t nr_sets;
+   char32_t set_chars[MN_MAX_WORD_LEN];
+   uint32_t nr_set_chars;
+
+   /* Runs of literal characters, encoded as UTF-8 in "bytes", that all
+    * matching words must contain, in order. A fragment at the start or at the
+    * end of the pattern must be at the same place in the word.
+    */
+   struct vb_glob_fragment {
+      uint32_t start, len;
+      bool at_start, at_end;
+   } fragments[MN_MAX_WORD_LEN / 2 + 1];
+   uint32_t nr_fragments;
+   char bytes[MN_MAX_WORD_LEN];
+   uint32_t nr_bytes;
+
+   bool only_literals;  /* No other atoms than literals and stars. */
+   bool invalid;        /* The pattern has an unterminated group. */
+};
+
+/* Compiles a glob pattern. Returns VB_EQUTF8 if it isn't valid UTF-8. */
+int vb_glob_compile(struct vb_glob *, const char *pat, size_t len);
+
+/* Checks if a word matches a compiled pattern. Returns 1 if so, 0 if not, -1
+ * if the word had to be decoded and isn't valid UTF-8. If "valid_utf8" is set,
+ * the word is not checked. Words that lack a literal fragment of the pattern
+ * are rejected without being decoded. Fragments are compared byte-wise, so a
+ * word that encodes one of their characters with more bytes than needed is
+ * rejected too.
+ */
+int vb_glob_match(const struct vb_glob *, const char *word, size_t len,
+                  bool valid_utf8);
+
+/* Checks that a word contains the literal fragments of a pattern, which is
+ * the first test vb_glob_match() does. Returns false if it doesn't, in which
+ * case it can't match.
+ */
+bool vb_glob_prefilter(const struct vb_glob *, const char *word, size_t len);
+
+struct vb_iter;
+
+/* Same as vb_glob_match(), for a word that an iterator returned, of which
+ * only what differs from the previous word is decoded. The first "pfx_len"
+ * bytes of the word, that make up "pfx_chars" code points, are not matched
+ * against the pattern.
+ */
+int vb_glob_match_iter(const struct vb_glob *, struct vb_iter *,
+                       const char *word, size_t len,
+                       size_t pfx_len, int32_t pfx_chars);
+
+/* Regular expression compiled to a DFA over the bytes of UTF-8 strings.
+ * State 0 is the dead state, from which no accepting state can be reached,
+ * and state 1 the start state. Bytes are mapped to classes of bytes that are
+ * never told apart, and transitions are stored in a table with one row per
+ * state and one column per class.
+ */
+struct vb_regex {
+   uint8_t classes[256];
+   uint32_t nr_classes;
+   uint32_t nr_states;
+   uint16_t *delta;
+   bool *accepting;
+};
+
+#define VB_REGEX_START 1
+
+/* Compiles a regular expression. If "fold" is set, the expression matches the
+ * folded forms of the strings it would otherwise match, see vb_utf8_fold(), so
+ * that it can be run on the folded index of a lexicon. Returns VB_EQUTF8 if it
+ * isn't valid UTF-8, VB_EREGEX if it is invalid or too complex.
+ */
+int vb_regex_compile(struct vb_regex *, const char *pat, size_t len,
+                     bool fold);
+
+/* Destructor. */
+void vb_regex_fini(struct vb_regex *);
+
+static inline uint32_t vb_regex_step(const struct vb_regex *re, uint32_t state,
+                                     uint8_t chr)
+{
+   return re->delta[state * re->nr_classes + re->classes[chr]];
+}
+
+/* Checks if a whole string matches. */
+static inline bool vb_regex_match(const struct vb_regex *re, const char *str,
+                                  size_t len)
+{
+   uint32_t state = VB_REGEX_START;
+   for (size_t i = 0; i < len && state; i++)
+      state = vb_regex_step(re, state, str[i]);
+   return re->accepting[state];
+}
+
+/* Folded forms of the words of an automaton, see vb_lexicon_fold(). */
+struct vb_folded {
+   struct mini *fsa;          /* Folded forms, numbered. */
+   struct vb_arena *arena;    /* Flat copy of "fsa", if the lexicon has one. */
+
+   /* Ordinals, in the original automaton, of the words each folded form
+    * stands for. Those of the folded form of ordinal "pos" are between
+    * "starts[pos - 1]" and "starts[pos]" in "words".
+    */
+   uint32_t *starts;
+   uint32_t *words;
+};
+
+int vb_folded_new(struct vb_folded **, const struct mini *);
+void vb_folded_free(struct vb_folded *);
+
+/* Searches the folded index of a lexicon, which must be up to date, and
+ * reports the original words. The query must have been folded already.
+ */
+int vb_folded_match(const struct vb_lexicon *, struct vb_match_ctx *);
+
+/* Scores of the words of an automaton, see vb_lexicon_set_scores(). Words are
+ * ranked by decreasing score, then by index. To find the best word of a range
+ * of indexes quickly, we keep a segment tree over the words: node 1 is the
+ * root, the children of node "i" are nodes (2 i) and (2 i + 1), and the word
+ * of index "idx" is node (size + idx). "best" holds the best word below each
+ * of the other nodes.
+ */
+struct vb_scores {
+   const int32_t *scores;     /* One per word, owned by the caller. */
+   uint32_t size;
+   uint32_t *best;
+};
+
+int vb_scores_new(struct vb_scores **, const int32_t *scores, uint32_t size);
+void vb_scores_free(struct vb_scores *);
+
+/* Returns the index of the best word of indexes [start, end), or UINT32_MAX
+ * if the range is empty.
+ */
+uint32_t vb_scores_best(const struct vb_scores *, uint32_t start, uint32_t end);
+
+struct vb_lexicon {
+   struct mini *base;
+   uint32_t base_size;
+   struct vb_words added;
+   struct vb_words removed;
+   struct vb_arena *arena;    /* See vb_lexicon_flatten(). */
+   struct vb_folded *folded;  /* See vb_lexicon_fold(). */
+   struct vb_scores *scores;  /* See vb_lexicon_set_scores(). */
+   bool valid_utf8;           /* All words were checked to be valid UTF-8. */
+
+   /* Identifies the contents of the lexicon, so that results pages can be
+    * cached. Unique to each lexicon, and changed whenever search results
+    * might change. Views have none, and get 0.
+    */
+   uint64_t id;
+};
+
+/* Initializes a lexicon that only wraps an automaton, and that must not be
+ * modified nor freed.
+ */
+void vb_lexicon_view(struct vb_lexicon *, const struct mini *);
+
+/* Returns the flat copy of the words of a lexicon, if it has one and it is
+ * up to date, otherwise NULL.
+ */
+const struct vb_arena *vb_lexicon_arena(const struct vb_lexicon *);
+
+/* Returns the scores of the words of the base automaton of a lexicon, if it
+ * has some and has no pending edits, otherwise NULL.
+ */
+const struct vb_scores *vb_lexicon_scores(const struct vb_lexicon *);
+
+/* Checks if a lexicon contains a word. */
+bool vb_lexicon_contains(const struct vb_lexicon *, const char *word,
+                         size_t len);
+
+/* Dumps the automaton of an encoder, and loads it back, unless "ret", the
+ * error code mn_enc_add() last returned, is not MN_OK. Frees the encoder.
+ */
+int vb_enc_load(struct mini_enc *, int ret, struct mini **);
+
+/* Same as mn_extract(). */
+size_t vb_lexicon_extract(const struct vb_lexicon *, uint32_t pos,
+                          char [static MN_MAX_WORD_LEN + 1]);
+
+/* Code points of a string that is modified at its end only, as is the word of
+ * an automaton iterator, so that only the part that changed must be decoded
+ * again.
+ */
+struct vb_decoded {
+   char32_t chars[MN_MAX_WORD_LEN + 1];
+   uint16_t index[MN_MAX_WORD_LEN + 1];   /* Code point each byte is part of. */
+   size_t len;                            /* Length of the string, in bytes. */
+};
+
+/* Lexicon iterator. The initialization functions have the same semantics as
+ * their mn_iter_*() counterpart, positions included.
+ */
+struct vb_iter {
+   const struct vb_lexicon *lex;
+   struct mini_iter it;
+
+   const char *word;       /* Next word of the base automaton, if fetched. */
+   size_t len;
+   uint32_t pos;           /* Ordinal of the last fetched base word. */
+
+   size_t added;           /* Next added word. */
+   size_t removed;         /* Next removed word. */
+   const char *prefix;     /* Prefix all added words must start with. */
+   size_t prefix_len;
+
+   /* See vb_iter_filter(). */
+   int (*accept)(void *arg, size_t depth, uint8_t chr);
+   void *arg;
+
+   /* See vb_iter_chars(). "decoded" is the number of leading bytes of the
+    * current word of "it" that "chars" holds the code points of.
+    */
+   struct vb_decoded chars;
+   size_t decoded;
+
+   uint64_t utf8_bytes;    /* Bytes vb_iter_chars() decoded so far. */
 };
 
-extern int (*const vb_match_funcs[VB_MODES_NR])(const struct mini *,
+uint32_t vb_iter_init(struct vb_iter *, const struct vb_lexicon *);
+uint32_t vb_iter_initp(struct vb_iter *, const struct vb_lexicon *,
+                       const char *prefix, size_t len);
+uint32_t vb_iter_inits(struct vb_iter *, const struct vb_lexicon *,
+                       const char *word, size_t len);
+uint32_t vb_iter_initn(struct vb_iter *, const struct vb_lexicon *,
+                       uint32_t pos);
+const char *vb_iter_next(struct vb_iter *, size_t *len);
+
+/* Makes an iterator skip branches of the base automaton, as does
+ * mn_iter_next_filter(). Added words are not filtered.
+ */
+void vb_iter_filter(struct vb_iter *,
+                    int (*accept)(void *arg, size_t depth, uint8_t chr),
+                    void *arg);
+
+/* Returns the code points of the word an iterator returned last, and sets
+ * "nr" to their number, or returns NULL if the word isn't valid UTF-8. Words
+ * of the base automaton are only decoded from the first byte that differs from
+ * the word decoded previously. Only valid until the next call.
+ */
+const char32_t *vb_iter_chars(struct vb_iter *, const char *word, size_t len,
+                              int32_t *nr);
+
+extern int (*const vb_match_funcs[VB_MODES_NR])(const struct vb_lexicon *,
                                                 struct vb_match_ctx *);
 
 void vb_parse_query(struct vb_match_ctx *, char [static MN_MAX_WORD_LEN + 1]);
 
 /* Decodes a UTF-8 string.
- * "dest" should be large enough to hold (len + 1) code points.
+ * "dest" should be large enough to hold (len + 1) code points. All of them
+ * can be overwritten, even past the end of the decoded string.
  * "len" must be < INT32_MAX.
  * The output string will be nul-terminated.
  * Returns the length of the decoded string on success, -1 otherwise.
@@ -358,11 +1267,52 @@ void vb_parse_query(struct vb_match_ctx *, char [static MN_MAX_WORD_LEN + 1]);
 int32_t vb_utf8_decode(char32_t *restrict dest,
                        const char *restrict str, size_t len);
 
+/* Same as vb_utf8_decode(), for strings already checked with vb_utf8_check(),
+ * which are not checked again.
+ */
+int32_t vb_utf8_decode_valid(char32_t *restrict dest,
+                             const char *restrict str, size_t len);
+
+/* Decodes a string into "d", see struct vb_decoded. The first "shared" bytes must be the same as
+ * those of the string "d" holds, and are not decoded again. With "check"
+ * unset, the string is assumed to be valid, as with vb_utf8_decode_valid().
+ * Returns the number of code points, or -1 if the string isn't valid, in which
+ * case "d" no longer holds anything.
+ */
+int32_t vb_utf8_decode_next(struct vb_decoded *d, const char *str, size_t len,
+                            size_t shared, bool check);
+
+/* Checks if a string would be decoded successfully by vb_utf8_decode(). */
+bool vb_utf8_check(const char *str, size_t len);
+
 /* Length, in bytes, of the first "nr" code points of "str" if it was encoded
  * as UTF-8.
  */
 size_t vb_utf8_bytes(const char32_t *str, size_t nr);
 
+/* Encodes a code point as UTF-8, which takes at most 4 bytes. Returns the
+ * number of bytes written.
+ */
+size_t vb_utf8_encode(char *dest, char32_t c);
+
+/* Folds a UTF-8 string, for case- and diacritic-insensitive matching. ASCII
+ * letters, and the letters of the Latin-1, Latin Extended-A, Greek and
+ * Cyrillic blocks are lowercased, and their diacritics removed. Combining
+ * marks are dropped. Bytes that are not part of a well-formed sequence are
+ * kept as they are. The folded string is never longer than the original one,
+ * and is nul-terminated, so "dest" must have room for (len + 1) bytes.
+ * Returns its length.
+ */
+size_t vb_utf8_fold(char *restrict dest, const char *restrict str, size_t len);
+
+/* Code points from this one up are their own folded form. */
+#define VB_FOLD_LIMIT 0x460
+
+/* Folds a single code point, as vb_utf8_fold() does. Returns 0 for combining
+ * marks, which are dropped.
+ */
+char32_t vb_fold_char(char32_t c);
+
 #endif
 #line 4 "api.c"
 
@@ -375,6 +1325,14 @@ const char *vb_strerror(int err)
       [VB_EQUTF8] = "query string is not valid UTF-8",
       [VB_ELUTF8] = "lexicon contains an invalid UTF-8 string",
       [VB_EFSA] = "lexicon is not a numbered automaton",
+      [VB_EWORD] = "attempt to add an empty, too long or non-UTF-8 word",
+      [VB_E2BIG] = "lexicon has grown too large",
+      [VB_ENOMEM] = "out of memory",
+      [VB_EREGEX] = "invalid or too complex regular expression",
+      [VB_EFOLD] = "lexicon has no up-to-date folded index",
+      [VB_ESCORES] = "lexicon has no up-to-date word scores",
+      [VB_EINTR] = "search interrupted",
+      [VB_ESHARDS] = "too many shards, or pagination token for other shards",
    };
    
    if (err >= 0 && (size_t)err < sizeof tbl / sizeof *tbl)
@@ -382,13 +1340,39 @@ const char *vb_strerror(int err)
    return "unknown error";
 }
 
-int vb_match(const struct mini *lex, struct vb_query *q,
+int vb_match(const struct mini *fsa, struct vb_query *q,
              void (*callback)(void *arg, const char *token, size_t len),
              void *arg)
 {
-   if (mn_type(lex) != MN_NUMBERED)
-      return VB_EFSA;
+   struct vb_lexicon lex;
+   vb_lexicon_view(&lex, fsa);
+   return vb_lexicon_match(&lex, q, callback, arg);
+}
+
+/* Adds the counters of a search to those of its query. */
+_Static_assert(sizeof(struct vb_stats) % sizeof(uint64_t) == 0,
+               "statistics must be made of counters only");
 
+static void vb_stats_add(struct vb_stats *dest, const struct vb_stats *src)
+{
+   uint64_t *d = (uint64_t *)dest;
+   const uint64_t *s = (const uint64_t *)src;
+
+   for (size_t i = 0; i < sizeof *dest / sizeof *d; i++)
+      d[i] += s[i];
+}
+
+int vb_lexicon_match(const struct vb_lexicon *lex, struct vb_query *q,
+                     void (*callback)(void *arg, const char *token, size_t len),
+                     void *arg)
+{
+   return vb_lexicon_match_ranked(lex, q, callback, arg, NULL);
+}
+
+int vb_lexicon_match_ranked(const struct vb_lexicon *lex, struct vb_query *q,
+                            void (*callback)(void *arg, const char *token, size_t len),
+                            void *arg, struct vb_rank *rank)
+{
    if (q->page_size > VB_MAX_PAGE_SIZE)
       return VB_EPAGE;
 
@@ -400,6 +1384,8 @@ int vb_match(const struct mini *lex, struct vb_query *q,
     */
    if (q->len > MN_MAX_WORD_LEN)
       return VB_E2LONG;
+   if (q->fold && (!lex->folded || vb_lexicon_pending(lex)))
+      return VB_EFOLD;
 
    if (q->page_size == 0 || q->pagination.last_pos == UINT32_MAX)
       q->pagination.last_page = true;
@@ -411,833 +1397,5104 @@ int vb_match(const struct mini *lex, struct vb_query *q,
       .mode = q->mode,
       .str = q->query,
       .len = q->len,
+      .fold = q->fold,
+      .numbered = mn_type(lex->base) == MN_NUMBERED,
       .handler = callback,
       .arg = arg,
+      .stats = q->stats,
+      .limits = q->limits,
+      .rank = rank,
    };
    if (c.mode >= sizeof vb_match_funcs / sizeof *vb_match_funcs)
       c.mode = VB_AUTO;
 
+   /* Metrics need the statistics of this search alone. */
+   struct vb_stats stats;
+   const bool metrics = vb_metrics_enabled();
+   if (metrics) {
+      memset(&stats, 0, sizeof stats);
+      c.stats = &stats;
+   }
+   const uint32_t page = q->pagination.pages;
+
+   /* The search phase is timed as a whole, so the time taken to report the
+    * results, when this is done apart, is subtracted from it afterwards.
+    */
+   uint64_t start = 0, report_ns = 0;
+   if (c.stats || (c.limits && c.limits->max_ns)) {
+      start = vb_now_ns();
+      if (c.stats)
+         report_ns = c.stats->report_ns;
+      if (c.limits)
+         c.deadline = start + c.limits->max_ns;
+   }
+
    char buf[MN_MAX_WORD_LEN + 1];
    vb_parse_query(&c, buf);
 
-   int ret = vb_match_funcs[c.mode](lex, &c);
+   uint64_t parsed = 0;
+   if (c.stats) {
+      parsed = vb_now_ns();
+      c.stats->parse_ns += parsed - start;
+   }
+
+   int ret = c.fold ? vb_folded_match(lex, &c) : vb_match_funcs[c.mode](lex, &c);
    if (q->pagination.last_page)
       q->pagination.last_pos = UINT32_MAX;
 
+   /* Slices of an interrupted page are counted as part of that page. */
+   if (ret != VB_EINTR)
+      q->pagination.pages++;
+
+   if (c.stats)
+      c.stats->search_ns += vb_now_ns() - parsed
+                            - (c.stats->report_ns - report_ns);
+
+   if (metrics) {
+      vb_metrics_record(q, c.mode, page, &stats);
+      if (q->stats)
+         vb_stats_add(q->stats, &stats);
+   }
+
    return ret;
 }
-#line 1 "match.c"
+#line 1 "arena.c"
+#include <stdlib.h>
 #include <string.h>
-#include <stdbool.h>
-#include <assert.h>
-#line 1 "faconde.h"
-#ifndef FACONDE_H
-#define FACONDE_H
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define FC_VERSION "0.1"
+/* Decodes the words of an arena. Leaves "chars" to NULL if one of them is not
+ * valid UTF-8.
+ */
+static int vb_arena_decode(struct vb_arena *arena)
+{
+   char32_t buf[MN_MAX_WORD_LEN + 1];
+   char32_t max_char = 0;
+   uint32_t total = 0;
+
+   /* Find out the number of code points, and how wide they must be. */
+   for (uint32_t idx = 0; idx < arena->size; idx++) {
+      const uint32_t start = arena->offsets[idx];
+      int32_t len = vb_utf8_decode(buf, &arena->words[start],
+                                   arena->offsets[idx + 1] - start - 1);
+      if (len < 0)
+         return VB_OK;
+      for (int32_t i = 0; i < len; i++)
+         if (buf[i] > max_char)
+            max_char = buf[i];
+      total += len;
+   }
+   arena->width = max_char <= UINT8_MAX ? 1 : max_char <= UINT16_MAX ? 2 : 4;
+
+   arena->char_offsets = malloc(sizeof *arena->char_offsets
+                                * ((size_t)arena->size + 1));
+   arena->chars = malloc(total ? (size_t)total * arena->width : 1);
+   if (!arena->char_offsets || !arena->chars)
+      return VB_ENOMEM;
+
+   uint32_t pos = 0;
+   for (uint32_t idx = 0; idx < arena->size; idx++) {
+      const uint32_t start = arena->offsets[idx];
+      int32_t len = vb_utf8_decode(buf, &arena->words[start],
+                                   arena->offsets[idx + 1] - start - 1);
+      arena->char_offsets[idx] = pos;
+      for (int32_t i = 0; i < len; i++, pos++) {
+         switch (arena->width) {
+         case 1:
+            ((uint8_t *)arena->chars)[pos] = buf[i];
+            break;
+         case 2:
+            ((uint16_t *)arena->chars)[pos] = buf[i];
+            break;
+         default:
+            ((char32_t *)arena->chars)[pos] = buf[i];
+            break;
+         }
+      }
+   }
+   arena->char_offsets[arena->size] = pos;
+   return VB_OK;
+}
 
-#include <stdint.h>
-#include <stdbool.h>
-#include <uchar.h>
+int vb_arena_new(struct vb_arena **arenap, const struct mini *fsa)
+{
+   *arenap = NULL;
+
+   struct vb_arena *arena = malloc(sizeof *arena);
+   if (!arena)
+      return VB_ENOMEM;
+   arena->size = mn_size(fsa);
+   arena->offsets = malloc(sizeof *arena->offsets * ((size_t)arena->size + 1));
+   arena->words = NULL;
+   arena->chars = NULL;
+   arena->char_offsets = NULL;
+   if (!arena->offsets)
+      goto oom;
 
-/* Maximum allowed length of a sequence. We don't check internally that this
- * limit is respected. It could be larger, but this is unlikely to be useful.
- * With this value, the worst-case allocation is 64M.
- */
-#define FC_MAX_SEQ_LEN 4096
+   struct mini_iter it;
+   const char *word;
+   size_t len, total = 0, max = 0;
+   uint32_t idx = 0;
+   mn_iter_init(&it, fsa);
+   while ((word = mn_iter_next(&it, &len))) {
+      if (total + len + 1 > UINT32_MAX) {
+         vb_arena_free(arena);
+         return VB_E2BIG;
+      }
+      if (total + len + 1 > max) {
+         size_t new_max = max ? max * 2 : 1 << 16;
+         char *words = realloc(arena->words, new_max);
+         if (!words)
+            goto oom;
+         arena->words = words;
+         max = new_max;
+      }
+      arena->offsets[idx++] = total;
+      memcpy(&arena->words[total], word, len + 1);
+      total += len + 1;
+   }
+   arena->offsets[idx] = total;
 
-/* Check if a string matches a glob pattern.
- * Matching is case-sensitive, and is performed over the whole string. The
- * supported syntax is as follows:
- *
- *  ?         matches a single character
- *  *         matches zero or more characters
- *  [abc]     matches any of the characters a, b, or c
- *  [^abc]    matches any character but a, b, and c
- *
- * Character classes are not supported.
- *
- * The characters `[`, `?`, and `*` are interpreted as literals when in a group.
- * The character `]`, to be included in a group, must be placed in first
- * position. The character `^`, if included in a group and intended to be
- * interpreted as a literal, must not be placed at the beginning of the group.
- * The character `]`, if not preceded by `[`, is interpreted as a literal.
- *
- * If the pattern is invalid, returns false.
- */
-bool fc_glob(const char32_t *pat, const char32_t *str);
+   /* Give back what we don't need. */
+   char *words = realloc(arena->words, total ? total : 1);
+   if (words)
+      arena->words = words;
+
+   int ret = vb_arena_decode(arena);
+   if (ret) {
+      vb_arena_free(arena);
+      return ret;
+   }
+   *arenap = arena;
+   return VB_OK;
 
+oom:
+   vb_arena_free(arena);
+   return VB_ENOMEM;
+}
 
-/*******************************************************************************
- * Levenshtein/Damerau distance
- ******************************************************************************/
+void vb_arena_free(struct vb_arena *arena)
+{
+   if (!arena)
+      return;
+   free(arena->words);
+   free(arena->offsets);
+   free(arena->chars);
+   free(arena->char_offsets);
+   free(arena);
+}
 
-/* Normalization strategies for Levenshtein and Damerau.
- * FC_NORM_LSEQ   Normalize by the length longest sequence.
- * FC_NORM_LALIGN Normalize by the longest alignement between the two input
- *                sequences. This is more expensive (both in terms of space and
- *                time) than FC_NORM_LSEQ, but (arguably) more accurate. For
- *                details, see Heeringa, "Measuring Dialect Pronunciation
- *                Differences using Levenshtein Distance".
+/* Candidate positions are those where both the first and the last byte of the
+ * needle match. With SSE2, we check 16 positions at a time.
  */
-enum fc_norm_method {
-   FC_NORM_LSEQ,
-   FC_NORM_LALIGN,
-};
-
-/* Computes the absolute Levenshtein distance between two sequences. */
-int32_t fc_levenshtein(const char32_t *seq1, int32_t len1,
-                       const char32_t *seq2, int32_t len2);
+const char *vb_memmem(const char *hay, size_t hay_len,
+                      const char *needle, size_t len)
+{
+   if (len == 0)
+      return hay;
+   if (hay_len < len)
+      return NULL;
+
+   const size_t lim = hay_len - len + 1;  /* Number of candidate positions. */
+   size_t i = 0;
+#ifdef __SSE2__
+   const __m128i first = _mm_set1_epi8(needle[0]);
+   const __m128i last = _mm_set1_epi8(needle[len - 1]);
+   for (; i + 16 <= lim; i += 16) {
+      __m128i head = _mm_loadu_si128((const __m128i *)&hay[i]);
+      __m128i tail = _mm_loadu_si128((const __m128i *)&hay[i + len - 1]);
+      unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+         _mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+      while (mask) {
+         unsigned bit = __builtin_ctz(mask);
+         if (!memcmp(&hay[i + bit], needle, len))
+            return &hay[i + bit];
+         mask &= mask - 1;
+      }
+   }
+#endif
+   for (; i < lim; i++)
+      if (hay[i] == needle[0] && !memcmp(&hay[i], needle, len))
+         return &hay[i];
+   return NULL;
+}
 
-/* Computes a normalized Levenshtein distance between two sequences. */
-double fc_nlevenshtein(enum fc_norm_method method,
-                       const char32_t *seq1, int32_t len1,
-                       const char32_t *seq2, int32_t len2);
+uint32_t vb_arena_find(const struct vb_arena *arena, uint32_t idx,
+                       const char *str, size_t len)
+{
+   if (idx >= arena->size)
+      return arena->size;
+
+   const uint32_t start = arena->offsets[idx];
+   const char *hit = vb_memmem(&arena->words[start],
+                               arena->offsets[arena->size] - start, str, len);
+   if (!hit)
+      return arena->size;
+
+   /* Find the last word that starts at or before the hit. */
+   const uint32_t off = hit - arena->words;
+   uint32_t low = idx, high = arena->size;
+   while (low < high) {
+      uint32_t mid = low + ((high - low) >> 1);
+      if (arena->offsets[mid] <= off)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low - 1;
+}
 
-/* Computes the absolute Damerau distance between two sequences. */
-int32_t fc_damerau(const char32_t *seq1, int32_t len1,
-                   const char32_t *seq2, int32_t len2);
+void vb_arena_range(const struct vb_arena *arena, const char *prefix,
+                    size_t len, uint32_t *first, uint32_t *end)
+{
+   uint32_t low = 0, high = arena->size;
+
+   /* First word >= the prefix. */
+   while (low < high) {
+      uint32_t mid = low + ((high - low) >> 1);
+      const char *word = &arena->words[arena->offsets[mid]];
+      size_t word_len = arena->offsets[mid + 1] - arena->offsets[mid] - 1;
+      if (lmemcmp(word, word_len, prefix, len) < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   *first = low;
+
+   /* First word after it that doesn't start with the prefix. */
+   high = arena->size;
+   while (low < high) {
+      uint32_t mid = low + ((high - low) >> 1);
+      const char *word = &arena->words[arena->offsets[mid]];
+      size_t word_len = arena->offsets[mid + 1] - arena->offsets[mid] - 1;
+      if (word_len >= len && !memcmp(word, prefix, len))
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   *end = low;
+}
+#line 1 "cache.c"
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
 
-/* Computes a normalized Damerau distance between two sequences. */
-double fc_ndamerau(enum fc_norm_method method,
-                   const char32_t *seq1, int32_t len1,
-                   const char32_t *seq2, int32_t len2);
+#define VB_CACHE_SHARDS 16
 
-/* Computes the distance between the provided sequences upto a maximum value
- * of 1. If the distance between the sequences is larger than that, a value
- * larger than 1 is returned.
+/* A cached results page. Pages are chained in a hash table, and in a list
+ * ordered from the most recently used to the least recently used one.
  */
-int32_t fc_lev_bounded1(const char32_t *seq1, int32_t len1,
-                        const char32_t *seq2, int32_t len2);
+struct vb_cache_entry {
+   struct vb_cache_entry *next;     /* Next entry of the same bucket. */
+   struct vb_cache_entry *newer;
+   struct vb_cache_entry *older;
+   uint64_t hash;
+   size_t size;                     /* Bytes taken by the entry. */
+
+   /* Pagination data after the page was fetched. */
+   struct vb_pagination pagination;
+
+   /* The key, then the words of the page, each followed by a nul byte. */
+   size_t key_len;
+   size_t words_len;
+   char data[];
+};
 
-/* Same as "fc_lev_bounded1()", but for distance 2. */
-int32_t fc_lev_bounded2(const char32_t *seq1, int32_t len1,
-                        const char32_t *seq2, int32_t len2);
+struct vb_cache_shard {
+   mtx_t lock;
+   uint64_t lexicon;                /* Lexicon the pages come from. */
+   struct vb_cache_entry **buckets;
+   size_t nr_buckets;               /* Power of two. */
+   struct vb_cache_entry *newest;
+   struct vb_cache_entry *oldest;
+   size_t entries;
+   size_t size;
+   size_t max_size;
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t evictions;
+   uint64_t invalidations;
+};
 
-/* Table of pointers to the above functions.
- * The function at index 0 is a dummy one that compares sequences for equality.
- */
-extern int32_t (*const fc_lev_bounded[3])(const char32_t *, int32_t,
-                                          const char32_t *, int32_t);
+struct vb_cache {
+   struct vb_handle *handle;
+   struct vb_cache_shard shards[VB_CACHE_SHARDS];
+};
 
-/* Computes the jaro distance between two sequences.
- * Contrary to the canonical implementation, this returns 0 for identity, and
- * 1 to indicate absolute difference, instead of the reverse.
+/* The fixed part of the key of a page, followed by the query string.
+ * Parameters that the matching mode doesn't use are zeroed, so that they don't
+ * make otherwise identical queries different. Lexicons are numbered automata,
+ * so searches are resumed from the last position and weight alone.
  */
-double fc_jaro(const char32_t *seq1, int32_t len1,
-               const char32_t *seq2, int32_t len2);
+struct vb_cache_key {
+   uint32_t mode;
+   uint32_t fold;
+   uint32_t page_size;
+   int32_t max_dist;
+   uint32_t prefix_len;
+   uint32_t last_pos;
+   int32_t last_weight;
+   uint32_t len;
+};
 
+#define VB_CACHE_MAX_KEY (sizeof(struct vb_cache_key) + MN_MAX_WORD_LEN)
 
-/*******************************************************************************
- * Longest Common Substring and Subsequence
- ******************************************************************************/
+static size_t vb_cache_key(const struct vb_query *q, char key[static VB_CACHE_MAX_KEY])
+{
+   struct vb_match_ctx c = {
+      .query = (struct vb_query *)q,
+      .mode = q->mode < VB_MODES_NR ? q->mode : VB_AUTO,
+      .str = q->query,
+      .len = q->len,
+      .fold = q->fold,
+   };
+   char buf[MN_MAX_WORD_LEN + 1];
+   vb_parse_query(&c, buf);
 
-/* Computes the length of the longest common substring between two sequences. */
-int32_t fc_lcsubstr(const char32_t *seq1, int32_t len1,
-                    const char32_t *seq2, int32_t len2);
+   const bool fuzzy = c.mode >= VB_LEVENSHTEIN && c.mode <= VB_LCSUBSEQ;
+   struct vb_cache_key k = {
+      .mode = c.mode,
+      .fold = c.fold,
+      .page_size = q->page_size,
+      .max_dist = c.mode == VB_LEVENSHTEIN || c.mode == VB_DAMERAU ? q->max_dist : 0,
+      .prefix_len = fuzzy && c.mode != VB_LCSUBSTR ? q->prefix_len : 0,
+      .last_pos = q->pagination.last_pos,
+      .last_weight = q->pagination.last_weight,
+      .len = c.len,
+   };
+   memcpy(key, &k, sizeof k);
+   memcpy(&key[sizeof k], c.str, c.len);
+   return sizeof k + c.len;
+}
 
-/* Like fc_lcsubstr(), but also makes possible the extraction of a longest
- * common substring. If "pos" is not NULL, it is made to point to the leftmost
- * longest common substring in "seq1". If the length of the longest common
- * substring is zero, "pos", if not NULL, is made to point to the end of "seq1".
- */
-int32_t fc_lcsubstr_extract(const char32_t *seq1, int32_t len1,
-                            const char32_t *seq2, int32_t len2,
-                            const char32_t **pos);
+/* FNV-1a. */
+static uint64_t vb_cache_hash(const char *key, size_t len)
+{
+   uint64_t h = UINT64_C(0xcbf29ce484222325);
+   for (size_t i = 0; i < len; i++) {
+      h ^= (uint8_t)key[i];
+      h *= UINT64_C(0x100000001b3);
+   }
+   return h;
+}
 
-/* Computes the length of the longest common subsequence between two
- * sequences.
- */
-int32_t fc_lcsubseq(const char32_t *seq1, int32_t len1,
-                    const char32_t *seq2, int32_t len2);
+static struct vb_cache_entry **vb_cache_bucket(struct vb_cache_shard *sh, uint64_t hash)
+{
+   return &sh->buckets[hash & (sh->nr_buckets - 1)];
+}
 
-/* Normalized version of fc_lcsubseq(). */
-double fc_nlcsubseq(const char32_t *seq1, int32_t len1,
-                    const char32_t *seq2, int32_t len2);
+static struct vb_cache_entry *vb_cache_find(struct vb_cache_shard *sh, uint64_t hash,
+                                            const char *key, size_t len)
+{
+   for (struct vb_cache_entry *e = *vb_cache_bucket(sh, hash); e; e = e->next)
+      if (e->hash == hash && e->key_len == len && !memcmp(e->data, key, len))
+         return e;
+   return NULL;
+}
 
+static void vb_cache_lru_unlink(struct vb_cache_shard *sh, struct vb_cache_entry *e)
+{
+   if (e->newer)
+      e->newer->older = e->older;
+   else
+      sh->newest = e->older;
+   if (e->older)
+      e->older->newer = e->newer;
+   else
+      sh->oldest = e->newer;
+}
 
-/*******************************************************************************
- * Memoized string metrics.
- ******************************************************************************/
+static void vb_cache_lru_push(struct vb_cache_shard *sh, struct vb_cache_entry *e)
+{
+   e->newer = NULL;
+   e->older = sh->newest;
+   if (sh->newest)
+      sh->newest->newer = e;
+   else
+      sh->oldest = e;
+   sh->newest = e;
+}
 
-enum fc_metric {
-   FC_LEVENSHTEIN,
-   FC_DAMERAU,
-   FC_LCSUBSTR,
-   FC_LCSUBSEQ,
+static void vb_cache_remove(struct vb_cache_shard *sh, struct vb_cache_entry *e)
+{
+   struct vb_cache_entry **p = vb_cache_bucket(sh, e->hash);
+   while (*p != e)
+      p = &(*p)->next;
+   *p = e->next;
+   vb_cache_lru_unlink(sh, e);
+   sh->entries--;
+   sh->size -= e->size;
+   free(e);
+}
 
-   FC_METRIC_NR,
-};
+/* Drops all the pages of a shard. */
+static void vb_cache_clear(struct vb_cache_shard *sh)
+{
+   struct vb_cache_entry *e = sh->newest;
+   while (e) {
+      struct vb_cache_entry *older = e->older;
+      free(e);
+      e = older;
+   }
+   memset(sh->buckets, 0, sh->nr_buckets * sizeof *sh->buckets);
+   sh->invalidations += sh->entries;
+   sh->newest = sh->oldest = NULL;
+   sh->entries = 0;
+   sh->size = 0;
+}
 
-struct fc_memo {
-   int32_t (*compute)(struct fc_memo *, const char32_t *, int32_t);
-   void *matrix;           /* Similarity matrix. */
-   int32_t mdim;           /* Matrix dimension. */
-   const char32_t *seq1;   /* Reference sequence. */
-   int32_t len1;           /* Length of the reference sequence. */
-   char32_t *seq2;         /* Previous sequence seen. */
-   int32_t len2;           /* Length of this sequence. */
-   int32_t max_dist;       /* Maximum allowed distance (for Levenshtein). */
-};
+/* Doubles the number of buckets of a shard, if possible. */
+static void vb_cache_grow(struct vb_cache_shard *sh)
+{
+   const size_t nr = sh->nr_buckets * 2;
+   struct vb_cache_entry **buckets = calloc(nr, sizeof *buckets);
+   if (!buckets)
+      return;
+   for (size_t i = 0; i < sh->nr_buckets; i++) {
+      struct vb_cache_entry *e = sh->buckets[i];
+      while (e) {
+         struct vb_cache_entry *next = e->next;
+         e->next = buckets[e->hash & (nr - 1)];
+         buckets[e->hash & (nr - 1)] = e;
+         e = next;
+      }
+   }
+   free(sh->buckets);
+   sh->buckets = buckets;
+   sh->nr_buckets = nr;
+}
 
-/* Initializer.
- * metric: the metric to use.
- * max_len: the maximum possible length of a sequence (or higher). The
- * internal matrix is never reallocated.
- * max_dist: the maximum allowed edit distance (the lower, the faster). This
- * parameter is only used if the chosen metric is Levenshtein or Damerau.
+/* Adds a page to a shard, evicting the least recently used ones as needed.
+ * Takes ownership of the entry.
  */
-void fc_memo_init(struct fc_memo *, enum fc_metric metric,
-                  int32_t max_len, int32_t max_dist);
-
-/* Destructor. */
-void fc_memo_fini(struct fc_memo *);
+static void vb_cache_insert(struct vb_cache_shard *sh, struct vb_cache_entry *e)
+{
+   if (e->size > sh->max_size
+       || vb_cache_find(sh, e->hash, e->data, e->key_len)) {
+      free(e);
+      return;
+   }
+   while (sh->size + e->size > sh->max_size) {
+      vb_cache_remove(sh, sh->oldest);
+      sh->evictions++;
+   }
+   if (sh->entries >= sh->nr_buckets)
+      vb_cache_grow(sh);
+
+   struct vb_cache_entry **bucket = vb_cache_bucket(sh, e->hash);
+   e->next = *bucket;
+   *bucket = e;
+   vb_cache_lru_push(sh, e);
+   sh->entries++;
+   sh->size += e->size;
+}
 
-/* Returns the chosen metric. */
-enum fc_metric fc_memo_metric(const struct fc_memo *);
+int vb_cache_new(struct vb_cache **cachep, struct vb_handle *h, size_t max_size)
+{
+   *cachep = NULL;
+
+   struct vb_cache *cache = calloc(1, sizeof *cache);
+   if (!cache)
+      return VB_ENOMEM;
+   cache->handle = h;
+
+   size_t i;
+   for (i = 0; i < VB_CACHE_SHARDS; i++) {
+      struct vb_cache_shard *sh = &cache->shards[i];
+      sh->nr_buckets = 64;
+      sh->buckets = calloc(sh->nr_buckets, sizeof *sh->buckets);
+      sh->max_size = max_size / VB_CACHE_SHARDS;
+      if (!sh->buckets || mtx_init(&sh->lock, mtx_plain) != thrd_success) {
+         free(sh->buckets);
+         break;
+      }
+   }
+   if (i < VB_CACHE_SHARDS) {
+      while (i--) {
+         mtx_destroy(&cache->shards[i].lock);
+         free(cache->shards[i].buckets);
+      }
+      free(cache);
+      return VB_ENOMEM;
+   }
+   *cachep = cache;
+   return VB_OK;
+}
 
-/* Sets the reference sequence.
- * It is not copied internally, and should then be available until either a new
- * reference sequence is set, or this object is deinitialized. The reference
- * sequence can be changed several times without deinitializing this object
- * first.
- */
-void fc_memo_set_ref(struct fc_memo *, const char32_t *seq1, int32_t len1);
+void vb_cache_free(struct vb_cache *cache)
+{
+   if (!cache)
+      return;
+   for (size_t i = 0; i < VB_CACHE_SHARDS; i++) {
+      struct vb_cache_shard *sh = &cache->shards[i];
+      vb_cache_clear(sh);
+      free(sh->buckets);
+      mtx_destroy(&sh->lock);
+   }
+   free(cache);
+}
 
-/* Compares the reference sequence to a new one. */
-static inline int32_t fc_memo_compute(struct fc_memo *m,
-                                      const char32_t *seq2, int32_t len2)
+void vb_cache_stats(struct vb_cache *cache, struct vb_cache_stats *st)
 {
-   return m->compute(m, seq2, len2);
+   memset(st, 0, sizeof *st);
+   for (size_t i = 0; i < VB_CACHE_SHARDS; i++) {
+      struct vb_cache_shard *sh = &cache->shards[i];
+      mtx_lock(&sh->lock);
+      st->hits += sh->hits;
+      st->misses += sh->misses;
+      st->evictions += sh->evictions;
+      st->invalidations += sh->invalidations;
+      st->entries += sh->entries;
+      st->size += sh->size;
+      mtx_unlock(&sh->lock);
+   }
 }
 
-/* Concrete prototypes for the memoized string metrics functions.
- * The function called must match the chosen metric.
+/* Words of a page being fetched, which are passed on to the caller and kept
+ * for caching the page.
  */
-int32_t fc_memo_levenshtein(struct fc_memo *, const char32_t *, int32_t);
-int32_t fc_memo_damerau(struct fc_memo *, const char32_t *, int32_t);
-int32_t fc_memo_lcsubstr(struct fc_memo *, const char32_t *, int32_t);
-int32_t fc_memo_lcsubseq(struct fc_memo *, const char32_t *, int32_t);
+struct vb_cache_words {
+   char *data;
+   size_t len;
+   size_t max;
+   bool failed;         /* Ran out of memory. */
+   void (*handler)(void *arg, const char *token, size_t len);
+   void *arg;
+};
 
-#endif
-#line 5 "match.c"
-#line 1 "heap.h"
-#ifndef VB_HEAP_H
-#define VB_HEAP_H
+static void vb_cache_gather(void *arg, const char *word, size_t len)
+{
+   struct vb_cache_words *w = arg;
 
-#include <stddef.h>
-#include <stdlib.h>
-#include <assert.h>
+   w->handler(w->arg, word, len);
+   if (w->failed)
+      return;
+   if (w->len + len + 1 > w->max) {
+      size_t max = w->max ? w->max * 2 : 1024;
+      while (w->len + len + 1 > max)
+         max *= 2;
+      char *data = realloc(w->data, max);
+      if (!data) {
+         w->failed = true;
+         return;
+      }
+      w->data = data;
+      w->max = max;
+   }
+   memcpy(&w->data[w->len], word, len);
+   w->data[w->len + len] = '\0';
+   w->len += len + 1;
+}
 
-#define VB_HEAP_INIT(array, max_elems) {.data = array, .max = max_elems}
+/* Calls a handler for each word of a list of nul-terminated words. */
+static void vb_cache_replay(const char *words, size_t len,
+                            void (*handler)(void *arg, const char *token, size_t len),
+                            void *arg)
+{
+   for (size_t pos = 0; pos < len; ) {
+      const size_t word_len = strlen(&words[pos]);
+      handler(arg, &words[pos], word_len);
+      pos += word_len + 1;
+   }
+}
 
-#define VB_HEAP_DECLARE(NAME, T, COMPAR)                                       \
-struct NAME {                                                                  \
-   T *data;                                                                    \
-   size_t size;                                                                \
-   size_t max;                                                                 \
-};                                                                             \
-                                                                               \
-static void NAME##_push(struct NAME *heap, T item)                             \
-{                                                                              \
-   assert(heap->max > 0);                                                      \
-   T *restrict data = heap->data;                                              \
-   const size_t max = heap->max;                                               \
-                                                                               \
-   if (heap->size < max) {                                                     \
-      size_t cur = heap->size;                                                 \
-      while (cur) {                                                            \
-         const size_t par = (cur - 1) >> 1;                                    \
-         if (COMPAR(data[par], item) >= 0)                                     \
-            break;                                                             \
-         data[cur] = data[par];                                                \
-         cur = par;                                                            \
-      }                                                                        \
-      data[cur] = item;                                                        \
-      heap->size++;                                                            \
-   } else if (COMPAR(item, data[0]) < 0) {                                     \
-      size_t cur = 0;                                                          \
-      const size_t lim = max >> 1;                                             \
-      while (cur < lim) {                                                      \
-         size_t child = (cur << 1) + 1;                                        \
-         if (child < max - 1 && COMPAR(data[child], data[child + 1]) < 0)      \
-            child++;                                                           \
-         if (COMPAR(item, data[child]) >= 0)                                   \
-            break;                                                             \
-         data[cur] = data[child];                                              \
-         cur = child;                                                          \
-      }                                                                        \
-      data[cur] = item;                                                        \
-   }                                                                           \
-}                                                                              \
-                                                                               \
-static int NAME##_qsort_cmp_(const void *a, const void *b)                     \
-{                                                                              \
-   return COMPAR(*(const T *)a, *(const T *)b);                                \
-}                                                                              \
-static void NAME##_finish(struct NAME *heap)                                   \
-{                                                                              \
-   qsort(heap->data, heap->size, sizeof *heap->data, NAME##_qsort_cmp_);       \
+int vb_cache_match(struct vb_cache *cache, struct vb_query *q,
+                   void (*handler)(void *arg, const char *token, size_t len),
+                   void *arg)
+{
+   /* Let the search deal with invalid queries and exhausted ones. */
+   if (q->page_size == 0 || q->page_size > VB_MAX_PAGE_SIZE
+       || q->len > MN_MAX_WORD_LEN || q->pagination.last_page
+       || q->pagination.last_pos == UINT32_MAX)
+      return vb_handle_match(cache->handle, q, handler, arg);
+
+   unsigned ticket;
+   const struct vb_lexicon *lex = vb_handle_acquire(cache->handle, &ticket);
+
+   char key[VB_CACHE_MAX_KEY];
+   const size_t key_len = vb_cache_key(q, key);
+   const uint64_t hash = vb_cache_hash(key, key_len);
+   struct vb_cache_shard *sh = &cache->shards[(hash >> 32) % VB_CACHE_SHARDS];
+
+   /* Pages of a previous version of the lexicon are dropped. Searches still
+    * using a previous version while a newer one is cached are not cached.
+    */
+   mtx_lock(&sh->lock);
+   if (lex->id > sh->lexicon) {
+      vb_cache_clear(sh);
+      sh->lexicon = lex->id;
+   }
+   struct vb_cache_entry *e = NULL;
+   if (lex->id == sh->lexicon)
+      e = vb_cache_find(sh, hash, key, key_len);
+   if (e) {
+      /* Copy the page, so that the handler is called without the lock. */
+      char buf[4096];
+      char *words = e->words_len <= sizeof buf ? buf : malloc(e->words_len);
+      if (words) {
+         sh->hits++;
+         vb_cache_lru_unlink(sh, e);
+         vb_cache_lru_push(sh, e);
+         memcpy(words, &e->data[e->key_len], e->words_len);
+         const size_t words_len = e->words_len;
+         const uint32_t pages = q->pagination.pages;
+         q->pagination = e->pagination;
+         q->pagination.pages = pages + 1;
+         mtx_unlock(&sh->lock);
+         vb_handle_release(cache->handle, ticket);
+
+         vb_cache_replay(words, words_len, handler, arg);
+         if (words != buf)
+            free(words);
+         return VB_OK;
+      }
+   }
+   sh->misses++;
+   mtx_unlock(&sh->lock);
+
+   struct vb_cache_words w = {.handler = handler, .arg = arg};
+   int ret = vb_lexicon_match(lex, q, vb_cache_gather, &w);
+   const uint64_t id = lex->id;
+   vb_handle_release(cache->handle, ticket);
+
+   if (ret || w.failed) {
+      free(w.data);
+      return ret;
+   }
+   const size_t size = sizeof *e + key_len + w.len;
+   e = malloc(size);
+   if (e) {
+      e->hash = hash;
+      e->size = size;
+      e->pagination = q->pagination;
+      e->key_len = key_len;
+      e->words_len = w.len;
+      memcpy(e->data, key, key_len);
+      if (w.len)
+         memcpy(&e->data[key_len], w.data, w.len);
+
+      mtx_lock(&sh->lock);
+      if (id == sh->lexicon)
+         vb_cache_insert(sh, e);
+      else
+         free(e);
+      mtx_unlock(&sh->lock);
+   }
+   free(w.data);
+   return VB_OK;
 }
+#line 1 "federate.c"
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
 
-#endif
-#line 8 "match.c"
+/* Results page of a shard. For each slot of the page, we keep the word as
+ * ranked, followed by the words reported for it, each followed by a nul byte,
+ * and the pagination data recorded for it, from which the search of the shard
+ * resumes once the slot is merged.
+ */
+struct vb_shard_page {
+   struct {
+      int32_t weight;
+      int32_t score;
+      size_t start;        /* Offset of the ranked word in "words". */
+      uint32_t nr;         /* Number of words reported. */
+      uint32_t pos;
+      int32_t last_weight;
+      bool after;
+   } slots[VB_MAX_PAGE_SIZE];
+   uint32_t nr_slots;
+   uint32_t taken;         /* Slots merged into the federated page so far. */
+
+   char *words;
+   size_t len;
+   size_t max;
+   bool failed;            /* Ran out of memory. */
+};
 
-static const char glob_chars[] = "*?[]";
+struct vb_shard_search {
+   const struct vb_lexicon *lex;
+   struct vb_query query;  /* Copy of the query, with the shard pagination. */
+   struct vb_rank rank;
+   struct vb_shard_page page;
+   int ret;
 
-/*******************************************************************************
- * Pattern matching.
- ******************************************************************************/
+   /* Link in the queue of the pool, and number of searches of the same call
+    * not yet done.
+    */
+   struct vb_shard_search *next;
+   size_t *pending;
+};
 
-static int match_exact(const struct mini *lex, struct vb_match_ctx *c)
+static void vb_shard_append(struct vb_shard_page *p, const char *word, size_t len)
 {
-   if (mn_contains(lex, c->str, c->len))
-      c->handler(c->arg, c->str, c->len);
-   c->query->pagination.last_page = true;
-   return VB_OK;
+   if (p->len + len + 1 > p->max) {
+      size_t max = p->max ? p->max * 2 : 1024;
+      while (p->len + len + 1 > max)
+         max *= 2;
+      char *words = realloc(p->words, max);
+      if (!words) {
+         p->failed = true;
+         return;
+      }
+      p->words = words;
+      p->max = max;
+   }
+   memcpy(&p->words[p->len], word, len);
+   p->words[p->len + len] = '\0';
+   p->len += len + 1;
 }
 
-static int match_prefix(const struct mini *lex, struct vb_match_ctx *c)
+static void vb_shard_gather(void *arg, const char *word, size_t len)
 {
-   bool first_page;
-   struct mini_iter it;
-   uint32_t pos = c->query->pagination.last_pos;
+   struct vb_shard_search *s = arg;
+   struct vb_shard_page *p = &s->page;
 
-   if (pos) {
-      first_page = false;
-      mn_iter_initn(&it, lex, pos);
-   } else {
-      first_page = true;
-      pos = mn_iter_initp(&it, lex, c->str, c->len);
+   if (p->failed)
+      return;
+   if (s->rank.slot > p->nr_slots) {
+      p->slots[p->nr_slots].weight = s->rank.weight;
+      p->slots[p->nr_slots].score = s->rank.score;
+      p->slots[p->nr_slots].start = p->len;
+      p->slots[p->nr_slots].nr = 0;
+      p->slots[p->nr_slots].pos = s->rank.pos;
+      p->slots[p->nr_slots].last_weight = s->rank.last_weight;
+      p->slots[p->nr_slots].after = s->rank.after;
+      p->nr_slots++;
+      vb_shard_append(p, s->rank.word, s->rank.len);
    }
+   p->slots[p->nr_slots - 1].nr++;
+   vb_shard_append(p, word, len);
+}
 
-   const char *term;
-   size_t len;
-   size_t page_size = c->query->page_size;
-   while ((term = mn_iter_next(&it, &len))) {
-      if (!first_page && (len < c->len || memcmp(c->str, term, c->len)))
-         break;
-      if (!page_size--) {
-         c->query->pagination.last_pos = pos;
-         return VB_OK;
-      } else {
-         c->handler(c->arg, term, len);
-      }
-      pos++;
+static void vb_cursor_load(struct vb_pagination *p,
+                           const struct vb_shard_cursor *cur)
+{
+   memset(p, 0, sizeof *p);
+   p->last_page = cur->last_page;
+   p->last_pos = cur->last_pos;
+   p->last_weight = cur->last_weight;
+   p->last_len = cur->last_len;
+   memcpy(p->last_word, cur->last_word, cur->last_len + 1);
+   p->pages = cur->pages;
+}
+
+static void vb_cursor_save(struct vb_shard_cursor *cur,
+                           const struct vb_pagination *p)
+{
+   cur->last_page = p->last_page;
+   cur->last_pos = p->last_pos;
+   cur->last_weight = p->last_weight;
+   cur->last_len = p->last_len;
+   memcpy(cur->last_word, p->last_word, p->last_len + 1);
+   cur->pages = p->pages;
+}
+
+/* Moves the cursor of a shard whose page was partly merged to the slots left,
+ * as a search for a page made of the slots taken would. Searches that rank
+ * words by weight or score resume after the last slot taken, the others at
+ * the first slot left.
+ */
+static void vb_cursor_take(struct vb_shard_cursor *cur,
+                           const struct vb_shard_page *p)
+{
+   uint32_t i = p->taken - 1;
+   if (!p->slots[i].after)
+      i++;
+   const char *word = &p->words[p->slots[i].start];
+
+   cur->last_page = false;
+   cur->last_pos = p->slots[i].pos;
+   cur->last_weight = p->slots[i].last_weight;
+   cur->last_len = strlen(word);
+   memcpy(cur->last_word, word, cur->last_len + 1);
+   cur->pages++;
+}
+
+static void vb_shard_run(struct vb_shard_search *s)
+{
+   s->ret = vb_lexicon_match_ranked(s->lex, &s->query, vb_shard_gather, s,
+                                    &s->rank);
+   if (!s->ret && s->page.failed)
+      s->ret = VB_ENOMEM;
+}
+
+/* Pool of threads that run the searches of the shards, shared by all the
+ * federated searches. Threads are started as searches are queued, up to one
+ * less than the maximum number of shards, since the calling thread runs
+ * searches too, and are kept for the life of the process.
+ */
+static struct {
+   mtx_t lock;
+   cnd_t work;                      /* Signaled when searches are queued. */
+   cnd_t done;                      /* Broadcast when a search is done. */
+   struct vb_shard_search *queue;
+   size_t nr_queued;
+   size_t nr_threads;
+   size_t nr_idle;
+   bool ok;                         /* Whether the pool could be set up. */
+} vb_pool;
+
+static once_flag vb_pool_once = ONCE_FLAG_INIT;
+
+static void vb_pool_init(void)
+{
+   if (mtx_init(&vb_pool.lock, mtx_plain) != thrd_success)
+      return;
+   if (cnd_init(&vb_pool.work) != thrd_success) {
+      mtx_destroy(&vb_pool.lock);
+      return;
    }
-   c->query->pagination.last_page = true;
-   return VB_OK;
+   if (cnd_init(&vb_pool.done) != thrd_success) {
+      cnd_destroy(&vb_pool.work);
+      mtx_destroy(&vb_pool.lock);
+      return;
+   }
+   vb_pool.ok = true;
 }
 
-static int match_substr(const struct mini *lex, struct vb_match_ctx *c)
+/* Takes the first queued search, if any, or the first one of a call. Must be
+ * called with the lock held.
+ */
+static struct vb_shard_search *vb_pool_take(const size_t *pending)
 {
-   struct mini_iter it;
-   uint32_t pos = c->query->pagination.last_pos;
-   if (pos) {
-      mn_iter_initn(&it, lex, pos);
-   } else {
-      pos = mn_iter_init(&it, lex);
+   struct vb_shard_search **link = &vb_pool.queue;
+   while (*link && pending && (*link)->pending != pending)
+      link = &(*link)->next;
+
+   struct vb_shard_search *s = *link;
+   if (s) {
+      *link = s->next;
+      vb_pool.nr_queued--;
    }
+   return s;
+}
 
-   const char *term;
-   size_t len;
-   size_t page_size = c->query->page_size;
-   while ((term = mn_iter_next(&it, &len))) {
-      if (len >= c->len && strstr(term, c->str)) {
-         if (!page_size--) {
-            c->query->pagination.last_pos = pos;
-            return VB_OK;
-         } else {
-            c->handler(c->arg, term, len);
-         }
+/* Runs a search taken from the queue, and tells its caller once all the
+ * searches of the call are done. Must be called with the lock held.
+ */
+static void vb_pool_run(struct vb_shard_search *s)
+{
+   mtx_unlock(&vb_pool.lock);
+   vb_shard_run(s);
+   mtx_lock(&vb_pool.lock);
+   if (!--*s->pending)
+      cnd_broadcast(&vb_pool.done);
+}
+
+static int vb_pool_worker(void *arg)
+{
+   (void)arg;
+
+   /* Threads are counted as idle from the time they are started. */
+   mtx_lock(&vb_pool.lock);
+   for (;;) {
+      struct vb_shard_search *s = vb_pool_take(NULL);
+      if (s) {
+         vb_pool.nr_idle--;
+         vb_pool_run(s);
+         vb_pool.nr_idle++;
+      } else {
+         cnd_wait(&vb_pool.work, &vb_pool.lock);
       }
-      pos++;
    }
-   c->query->pagination.last_page = true;
-   return VB_OK;
+   return 0;
 }
 
-static int match_suffix(const struct mini *lex, struct vb_match_ctx *c)
+/* Runs the searches flagged in "run", in parallel. A single search, as well
+ * as those no thread of the pool takes, runs in the calling thread.
+ */
+static void vb_shards_run(struct vb_shard_search *searches, size_t nr,
+                          const bool *run)
 {
-   uint32_t pos = c->query->pagination.last_pos;
-   struct mini_iter it;
-   if (pos) {
-      mn_iter_initn(&it, lex, pos);
-   } else {
-      pos = mn_iter_init(&it, lex);
+   struct vb_shard_search *todo[VB_MAX_SHARDS];
+   size_t nr_todo = 0;
+   for (size_t i = 0; i < nr; i++)
+      if (run[i])
+         todo[nr_todo++] = &searches[i];
+   if (nr_todo > 1)
+      call_once(&vb_pool_once, vb_pool_init);
+   if (nr_todo <= 1 || !vb_pool.ok) {
+      for (size_t i = 0; i < nr_todo; i++)
+         vb_shard_run(todo[i]);
+      return;
    }
 
-   const char *term;
-   size_t len;
-   size_t page_size = c->query->page_size;
-   while ((term = mn_iter_next(&it, &len))) {
-      if (len >= c->len && !memcmp(c->str, &term[len - c->len], c->len)) {
-         if (!page_size--) {
-            c->query->pagination.last_pos = pos;
-            return VB_OK;
-         } else {
-            c->handler(c->arg, term, len);
-         }
-      }
-      pos++;
+   /* The first search is made by the calling thread, the others are queued,
+    * and threads are started for those that no idle thread can take.
+    */
+   size_t pending = nr_todo;
+   mtx_lock(&vb_pool.lock);
+   for (size_t i = 1; i < nr_todo; i++) {
+      todo[i]->pending = &pending;
+      todo[i]->next = vb_pool.queue;
+      vb_pool.queue = todo[i];
+      vb_pool.nr_queued++;
    }
-   c->query->pagination.last_page = true;
-   return VB_OK;
+   while (vb_pool.nr_idle < vb_pool.nr_queued
+          && vb_pool.nr_threads < VB_MAX_SHARDS - 1) {
+      thrd_t thread;
+      if (thrd_create(&thread, vb_pool_worker, NULL) != thrd_success)
+         break;
+      thrd_detach(thread);
+      vb_pool.nr_threads++;
+      vb_pool.nr_idle++;
+   }
+   cnd_broadcast(&vb_pool.work);
+   mtx_unlock(&vb_pool.lock);
+
+   vb_shard_run(todo[0]);
+
+   mtx_lock(&vb_pool.lock);
+   pending--;
+   struct vb_shard_search *s;
+   while ((s = vb_pool_take(&pending)))
+      vb_pool_run(s);
+   while (pending)
+      cnd_wait(&vb_pool.done, &vb_pool.lock);
+   mtx_unlock(&vb_pool.lock);
 }
 
-static int match_glob(const struct mini *lex, struct vb_match_ctx *c)
+/* Compares the next slots of two shards. Ties go to the shard that comes first. */
+static int vb_slot_cmp(const struct vb_shard_search *a,
+                       const struct vb_shard_search *b)
 {
-   struct mini_iter it;
-   uint32_t pos = c->query->pagination.last_pos;
-   size_t pfx_len = strcspn(c->str, glob_chars);
-   if (pos) {
-      mn_iter_initn(&it, lex, pos);
-   } else {
-      pos = mn_iter_initp(&it, lex, c->str, pfx_len);
+   const struct vb_shard_page *pa = &a->page, *pb = &b->page;
+   const uint32_t i = pa->taken, j = pb->taken;
+
+   if (pa->slots[i].weight != pb->slots[j].weight)
+      return pa->slots[i].weight < pb->slots[j].weight ? -1 : 1;
+   if (pa->slots[i].score != pb->slots[j].score)
+      return pa->slots[i].score > pb->slots[j].score ? -1 : 1;
+   const char *wa = &pa->words[pa->slots[i].start];
+   const char *wb = &pb->words[pb->slots[j].start];
+   const int cmp = strcmp(wa, wb);
+   if (cmp)
+      return cmp;
+   return a < b ? -1 : a > b;
+}
+
+int vb_federated_match(const struct vb_lexicon *const *shards, size_t nr,
+                       const struct vb_query *q,
+                       struct vb_federated_pagination *p,
+                       void (*handler)(void *arg, size_t shard,
+                                       const char *token, size_t len),
+                       void *arg)
+{
+   if (nr > VB_MAX_SHARDS || (p->nr_shards && p->nr_shards != nr))
+      return VB_ESHARDS;
+   if (q->page_size > VB_MAX_PAGE_SIZE)
+      return VB_EPAGE;
+   p->nr_shards = nr;
+   if (q->page_size == 0 || !nr)
+      p->last_page = true;
+   if (p->last_page)
+      return VB_OK;
+
+   struct vb_shard_search *searches = calloc(nr, sizeof *searches);
+   if (!searches)
+      return VB_ENOMEM;
+
+   bool run[VB_MAX_SHARDS] = {0};
+   for (size_t i = 0; i < nr; i++) {
+      struct vb_shard_search *s = &searches[i];
+      s->lex = shards[i];
+      s->query = *q;
+      s->query.stats = NULL;
+      s->query.limits = NULL;
+      vb_cursor_load(&s->query.pagination, &p->shards[i]);
+      run[i] = !p->shards[i].last_page;
    }
+   vb_shards_run(searches, nr, run);
 
    int ret = VB_OK;
-   char32_t upat[MN_MAX_WORD_LEN + 1];
-   if (vb_utf8_decode(upat, &c->str[pfx_len], c->len - pfx_len) < 0) {
-      ret = VB_EQUTF8;
+   for (size_t i = 0; i < nr && !ret; i++)
+      if (run[i])
+         ret = searches[i].ret;
+   if (ret)
       goto fini;
-   }
 
-   const char *term;
-   size_t len;
-   size_t page_size = c->query->page_size;
-   while ((term = mn_iter_next(&it, &len))) {
-      if (pfx_len && (len < pfx_len || memcmp(term, c->str, pfx_len)))
-         break;
-      char32_t uterm[MN_MAX_WORD_LEN + 1];
-      if (vb_utf8_decode(uterm, &term[pfx_len], len - pfx_len) < 0) {
-         ret = VB_ELUTF8;
-         goto fini;
+   /* Merge the pages, taking the best slot of all shards each time. */
+   for (size_t n = 0; n < q->page_size; n++) {
+      struct vb_shard_search *best = NULL;
+      for (size_t i = 0; i < nr; i++) {
+         struct vb_shard_search *s = &searches[i];
+         if (run[i] && s->page.taken < s->page.nr_slots
+             && (!best || vb_slot_cmp(s, best) < 0))
+            best = s;
       }
-      if (fc_glob(upat, uterm)) {
-         if (!page_size--) {
-            c->query->pagination.last_pos = pos;
-            return VB_OK;
-         } else {
-            c->handler(c->arg, term, len);
-         }
+      if (!best)
+         break;
+
+      struct vb_shard_page *page = &best->page;
+      const size_t shard = best - searches;
+      size_t pos = page->slots[page->taken].start;
+      pos += strlen(&page->words[pos]) + 1;
+      for (uint32_t k = 0; k < page->slots[page->taken].nr; k++) {
+         const size_t len = strlen(&page->words[pos]);
+         handler(arg, shard, &page->words[pos], len);
+         pos += len + 1;
       }
-      pos++;
+      page->taken++;
+   }
+
+   /* Shards whose page was wholly taken carry on from where their search
+    * stopped, and those that weren't taken from at all stay where they are.
+    * The others resume from the slots they recorded.
+    */
+   for (size_t i = 0; i < nr; i++) {
+      struct vb_shard_search *s = &searches[i];
+      if (!run[i])
+         continue;
+      if (s->page.taken == s->page.nr_slots)
+         vb_cursor_save(&p->shards[i], &s->query.pagination);
+      else if (s->page.taken)
+         vb_cursor_take(&p->shards[i], &s->page);
    }
 
+   p->last_page = true;
+   for (size_t i = 0; i < nr; i++)
+      if (!p->shards[i].last_page)
+         p->last_page = false;
+
 fini:
-   c->query->pagination.last_page = true;
+   for (size_t i = 0; i < nr; i++)
+      free(searches[i].page.words);
+   free(searches);
    return ret;
 }
 
 
 /*******************************************************************************
- * Fuzzy matching.
+ * Tokens.
  ******************************************************************************/
 
-static int32_t levenshtein_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
+struct vb_token {
+   uint8_t *buf;
+   size_t size;
+   size_t len;
+};
+
+static void vb_token_put(struct vb_token *t, uint32_t val, int bytes)
 {
-   int32_t ret = fc_memo_levenshtein(m, seq, len);
-   return ret > m->max_dist ? INT32_MAX : ret;
+   for (int i = 0; i < bytes; i++, t->len++)
+      if (t->len < t->size)
+         t->buf[t->len] = val >> (8 * i);
 }
 
-static int32_t damerau_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
+size_t vb_federated_token(const struct vb_federated_pagination *p,
+                          void *buf, size_t size)
 {
-   int32_t ret = fc_memo_damerau(m, seq, len);
-   return ret > m->max_dist ? INT32_MAX : ret;
+   struct vb_token t = {.buf = buf, .size = size};
+
+   vb_token_put(&t, p->nr_shards, 1);
+   vb_token_put(&t, p->last_page, 1);
+   for (uint32_t i = 0; i < p->nr_shards && i < VB_MAX_SHARDS; i++) {
+      const struct vb_shard_cursor *cur = &p->shards[i];
+      vb_token_put(&t, cur->last_page, 1);
+      vb_token_put(&t, cur->last_pos, 4);
+      vb_token_put(&t, (uint32_t)cur->last_weight, 4);
+      vb_token_put(&t, cur->pages, 4);
+      vb_token_put(&t, cur->last_len, 2);
+      for (size_t k = 0; k < cur->last_len; k++)
+         vb_token_put(&t, (uint8_t)cur->last_word[k], 1);
+   }
+   return t.len;
 }
 
-static int32_t lcsubstr_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
+static bool vb_token_get(struct vb_token *t, uint32_t *val, int bytes)
 {
-   return -fc_memo_lcsubstr(m, seq, len);
+   if (t->len + bytes > t->size)
+      return false;
+   *val = 0;
+   for (int i = 0; i < bytes; i++)
+      *val |= (uint32_t)t->buf[t->len++] << (8 * i);
+   return true;
 }
 
-static int32_t lcsubseq_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
+int vb_federated_untoken(struct vb_federated_pagination *p,
+                         const void *token, size_t len)
 {
-   return -2. * fc_memo_lcsubseq(m, seq, len) / (double)(m->len1 + len) * 1000.;
+   struct vb_token t = {.buf = (uint8_t *)token, .size = len};
+   uint32_t nr, last_page;
+
+   memset(p, 0, sizeof *p);
+   if (!vb_token_get(&t, &nr, 1) || nr > VB_MAX_SHARDS
+       || !vb_token_get(&t, &last_page, 1))
+      return VB_ESHARDS;
+   p->nr_shards = nr;
+   p->last_page = last_page;
+
+   for (uint32_t i = 0; i < nr; i++) {
+      struct vb_shard_cursor *cur = &p->shards[i];
+      uint32_t last_pos, weight, pages, word_len;
+      if (!vb_token_get(&t, &last_page, 1) || !vb_token_get(&t, &last_pos, 4)
+          || !vb_token_get(&t, &weight, 4) || !vb_token_get(&t, &pages, 4)
+          || !vb_token_get(&t, &word_len, 2)
+          || word_len > VB_MAX_WORD_LEN || t.len + word_len > t.size)
+         return VB_ESHARDS;
+      cur->last_page = last_page;
+      cur->last_pos = last_pos;
+      cur->last_weight = (int32_t)weight;
+      cur->pages = pages;
+      cur->last_len = word_len;
+      memcpy(cur->last_word, &t.buf[t.len], word_len);
+      cur->last_word[word_len] = '\0';
+      t.len += word_len;
+   }
+   if (t.len != t.size)
+      return VB_ESHARDS;
+   return VB_OK;
 }
+#line 1 "fold.c"
+#include <stdlib.h>
+#include <string.h>
 
-struct vb_match_infos {
-   uint32_t pos;
-   int32_t weight;
+/* A word of the base automaton, folded. */
+struct vb_fold_entry {
+   union {
+      size_t offset;    /* While the buffer of folded words can still move. */
+      const char *str;
+   };
+   uint32_t len;
+   uint32_t pos;     /* Ordinal of the original word. */
 };
 
-static int vb_match_infos_cmp(const struct vb_match_infos a, const struct vb_match_infos b)
+/* Folded forms are sorted, and the words that have the same folded form are
+ * kept in the order of the base automaton.
+ */
+static int vb_fold_entry_cmp(const void *a, const void *b)
 {
-   if (a.weight == b.weight)
-      return a.pos < b.pos ? -1 : a.pos > b.pos;
-   return a.weight < b.weight ? -1 : a.weight > b.weight;
-}
+   const struct vb_fold_entry *x = a, *y = b;
 
-VB_HEAP_DECLARE(vb_heap, struct vb_match_infos, vb_match_infos_cmp)
+   int cmp = lmemcmp(x->str, x->len, y->str, y->len);
+   if (cmp)
+      return cmp;
+   return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
 
-static int match_fuzzy(const struct mini *lex, struct vb_match_ctx *c)
+/* Folds all the words of an automaton. Words whose folded form is empty,
+ * because they are made of combining marks only, are left out.
+ */
+static int vb_fold_words(const struct mini *base, char **bufp,
+                         struct vb_fold_entry **entriesp, uint32_t *nr)
 {
-   static const int metrics[] = {
-      [VB_LEVENSHTEIN] = FC_LEVENSHTEIN,
-      [VB_DAMERAU] = FC_DAMERAU,
-      [VB_LCSUBSTR] = FC_LCSUBSTR,
-      [VB_LCSUBSEQ] = FC_LCSUBSEQ,
-   };
+   const uint32_t size = mn_size(base);
+   struct vb_fold_entry *entries = malloc(sizeof *entries * (size ? size : 1));
+   char *buf = NULL;
+   size_t total = 0, max = 0;
+   *nr = 0;
 
-   static int32_t (*const compute_fns[])(struct fc_memo *, const char32_t *, int32_t) = {
-      [FC_LEVENSHTEIN] = levenshtein_compute,
-      [FC_DAMERAU] = damerau_compute,
-      [FC_LCSUBSTR] = lcsubstr_compute,
-      [FC_LCSUBSEQ] = lcsubseq_compute,
-   };
-
-   char32_t seq1[MN_MAX_WORD_LEN + 1];
-   int32_t len1 = vb_utf8_decode(seq1, c->str, c->len);
-   if (len1 < 0) {
-      c->query->pagination.last_page = true;
-      return VB_EQUTF8;
-   }
+   if (!entries)
+      return VB_ENOMEM;
 
    struct mini_iter it;
-   uint32_t pos;
-   if (c->query->prefix_len && !c->query->pagination.last_pos && c->mode != VB_LCSUBSTR) {
-      size_t pfx_len;
-      /* If the required common prefix length is longer than the reference word,
-       * there could still be an exact match.
-       */
-      if (c->query->prefix_len > len1)
-         return match_exact(lex, c);
-      pfx_len = vb_utf8_bytes(seq1, c->query->prefix_len);
-      pos = mn_iter_initp(&it, lex, c->str, pfx_len);
-   } else {
-      pos = mn_iter_init(&it, lex);
-   }
-
-   enum fc_metric metric = metrics[c->mode];
-   struct fc_memo m;
-   fc_memo_init(&m, metric, MN_MAX_WORD_LEN, c->query->max_dist);
-   fc_memo_set_ref(&m, seq1, len1);
-   m.compute = compute_fns[metric];
-
-   const char *term;
+   const char *word;
    size_t len;
-   size_t count = 0;
-   bool first_page = c->query->pagination.last_pos == 0;
-
-   struct vb_match_infos cands[VB_MAX_PAGE_SIZE];
-   struct vb_heap heap = VB_HEAP_INIT(cands, c->query->page_size);
-   
-   struct vb_match_infos last_min = {
-      .pos = c->query->pagination.last_pos,
-      .weight = c->query->pagination.last_weight,
-   };
-
-   while ((term = mn_iter_next(&it, &len))) {
-      char32_t seq2[MN_MAX_WORD_LEN + 1];
-      int32_t len2 = vb_utf8_decode(seq2, term, len);
-      if (len2 < 0) {
-         c->query->pagination.last_page = true;
-         return VB_ELUTF8;
+   uint32_t pos = 0;
+   mn_iter_init(&it, base);
+   while ((word = mn_iter_next(&it, &len))) {
+      pos++;
+      if (total + len + 1 > max) {
+         size_t new_max = max ? max * 2 : 1 << 16;
+         char *new_buf = realloc(buf, new_max);
+         if (!new_buf) {
+            free(buf);
+            free(entries);
+            return VB_ENOMEM;
+         }
+         buf = new_buf;
+         max = new_max;
       }
-      struct vb_match_infos x = {
+      const size_t flen = vb_utf8_fold(&buf[total], word, len);
+      if (!flen)
+         continue;
+      entries[*nr] = (struct vb_fold_entry){
+         .offset = total,
+         .len = flen,
          .pos = pos,
-         .weight = fc_memo_compute(&m, seq2, len2),
       };
-      if (x.weight != INT32_MAX && (first_page || vb_match_infos_cmp(x, last_min) > 0)) {
-         count++;
-         vb_heap_push(&heap, x);
-      }
-      pos++;
+      (*nr)++;
+      total += flen + 1;
    }
 
-   fc_memo_fini(&m);
-   vb_heap_finish(&heap);
+   for (uint32_t i = 0; i < *nr; i++)
+      entries[i].str = &buf[entries[i].offset];
+   *bufp = buf;
+   *entriesp = entries;
+   return VB_OK;
+}
 
-   for (size_t i = 0; i < heap.size; i++) {
-      len = mn_extract(lex, heap.data[i].pos, seq1);
-      c->handler(c->arg, (const char *)seq1, len);
+int vb_folded_new(struct vb_folded **foldedp, const struct mini *base)
+{
+   *foldedp = NULL;
+
+   char *buf;
+   struct vb_fold_entry *entries;
+   uint32_t nr;
+   int ret = vb_fold_words(base, &buf, &entries, &nr);
+   if (ret)
+      return ret;
+   qsort(entries, nr, sizeof *entries, vb_fold_entry_cmp);
+
+   struct vb_folded *folded = calloc(1, sizeof *folded);
+   struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+   if (folded) {
+      folded->words = malloc(sizeof *folded->words * (nr ? nr : 1));
+      folded->starts = malloc(sizeof *folded->starts * ((size_t)nr + 1));
    }
-   if (heap.size) {
-      c->query->pagination.last_pos = heap.data[heap.size - 1].pos;
-      c->query->pagination.last_weight = heap.data[heap.size - 1].weight;
+   if (!folded || !enc || !folded->words || !folded->starts) {
+      mn_enc_free(enc);
+      ret = VB_ENOMEM;
+      goto fini;
    }
-   if (count <= heap.size)
-      c->query->pagination.last_page = true;
-   return VB_OK;
+
+   /* Words that have the same folded form are consecutive. */
+   uint32_t nr_forms = 0;
+   int mn_ret = MN_OK;
+   for (uint32_t i = 0; i < nr && !mn_ret; i++) {
+      if (!i || lmemcmp(entries[i].str, entries[i].len,
+                        entries[i - 1].str, entries[i - 1].len)) {
+         folded->starts[nr_forms++] = i;
+         mn_ret = mn_enc_add(enc, entries[i].str, entries[i].len);
+      }
+      folded->words[i] = entries[i].pos;
+   }
+   folded->starts[nr_forms] = nr;
+   ret = vb_enc_load(enc, mn_ret, &folded->fsa);
+
+fini:
+   free(buf);
+   free(entries);
+   if (ret)
+      vb_folded_free(folded);
+   else
+      *foldedp = folded;
+   return ret;
 }
 
-int (*const vb_match_funcs[])(const struct mini *, struct vb_match_ctx *) = {
-   [VB_EXACT] = match_exact,
-   [VB_PREFIX] = match_prefix,
-   [VB_SUBSTR] = match_substr,
-   [VB_SUFFIX] = match_suffix,
-   [VB_GLOB] = match_glob,
-   [VB_LEVENSHTEIN] = match_fuzzy,
-   [VB_DAMERAU] = match_fuzzy,
-   [VB_LCSUBSTR] = match_fuzzy,
-   [VB_LCSUBSEQ] = match_fuzzy,
+void vb_folded_free(struct vb_folded *folded)
+{
+   if (!folded)
+      return;
+   mn_free(folded->fsa);
+   vb_arena_free(folded->arena);
+   free(folded->starts);
+   free(folded->words);
+   free(folded);
+}
+
+struct vb_unfold {
+   const struct vb_lexicon *lex;
+   void (*handler)(void *arg, const char *token, size_t len);
+   void *arg;
+   struct vb_stats *stats;
 };
-#line 1 "parse.c"
 
-#line 1 "src/parse.rl"
+/* Reports the words a matching folded form stands for. */
+static void vb_unfold(void *arg, const char *word, size_t len)
+{
+   const struct vb_unfold *u = arg;
+   const struct vb_folded *folded = u->lex->folded;
+   char buf[MN_MAX_WORD_LEN + 1];
+
+   const uint32_t pos = mn_locate(folded->fsa, word, len);
+   for (uint32_t i = folded->starts[pos - 1]; i < folded->starts[pos]; i++) {
+      const size_t orig_len = mn_extract(u->lex->base, folded->words[i], buf);
+      u->handler(u->arg, buf, orig_len);
+      VB_STAT(u, extracts, 1);
+   }
+}
+
+int vb_folded_match(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   struct vb_lexicon view;
+   vb_lexicon_view(&view, lex->folded->fsa);
+   view.arena = lex->folded->arena;
+   view.valid_utf8 = lex->valid_utf8;
+
+   struct vb_unfold u = {
+      .lex = lex,
+      .handler = c->handler,
+      .arg = c->arg,
+      .stats = c->stats,
+   };
+   c->handler = vb_unfold;
+   c->arg = &u;
+   return vb_match_funcs[c->mode](&view, c);
+}
+#line 1 "glob.c"
 #include <string.h>
 
+/* Parses a group, "pat" pointing just after the opening bracket. Returns the
+ * index of the closing bracket, or -1 if there is none.
+ */
+static int32_t vb_glob_set(struct vb_glob *g, const char32_t *pat, int32_t len)
+{
+   struct vb_glob_set *set = &g->sets[g->nr_sets++];
+   int32_t i = 0;
+
+   set->invert = i < len && pat[i] == '^';
+   i += set->invert;
+   set->start = g->nr_set_chars;
+   set->ascii[0] = set->ascii[1] = 0;
+
+   /* A closing bracket in first position is a literal. */
+   for (int32_t first = i; i < len && (pat[i] != ']' || i == first); i++) {
+      if (pat[i] < 0x80)
+         set->ascii[pat[i] >> 6] |= UINT64_C(1) << (pat[i] & 63);
+      else
+         g->set_chars[g->nr_set_chars++] = pat[i];
+   }
+   set->end = g->nr_set_chars;
+   return i < len ? i : -1;
+}
 
-#line 43 "src/parse.rl"
+/* Adds the literal characters of the pattern that precede "end" and that
+ * follow the last wildcard as a required fragment.
+ */
+static void vb_glob_fragment(struct vb_glob *g, const char32_t *pat,
+                             int32_t start, int32_t end, bool at_end)
+{
+   if (start == end)
+      return;
 
+   struct vb_glob_fragment *f = &g->fragments[g->nr_fragments++];
+   f->start = g->nr_bytes;
+   for (int32_t i = start; i < end; i++)
+      g->nr_bytes += vb_utf8_encode(&g->bytes[g->nr_bytes], pat[i]);
+   f->len = g->nr_bytes - f->start;
+   f->at_start = start == 0;
+   f->at_end = at_end;
+}
 
+int vb_glob_compile(struct vb_glob *g, const char *pat, size_t len)
+{
+   char32_t upat[MN_MAX_WORD_LEN + 1];
+   const int32_t ulen = vb_utf8_decode(upat, pat, len);
+   if (ulen < 0)
+      return VB_EQUTF8;
 
-#line 12 "src/parse.c"
-static const char _vb_simplify_glob_actions[] = {
-	0, 1, 0, 1, 1, 1, 2, 1, 
-	3, 1, 4, 1, 5
-};
+   g->nr_atoms = g->nr_sets = g->nr_set_chars = 0;
+   g->nr_fragments = g->nr_bytes = 0;
+   g->only_literals = true;
+   g->invalid = false;
+
+   int32_t lit_start = 0;  /* Start of the current run of literals. */
+   for (int32_t i = 0; i < ulen; i++) {
+      struct vb_glob_atom *atom = &g->atoms[g->nr_atoms];
+
+      switch (upat[i]) {
+      case '*':
+         vb_glob_fragment(g, upat, lit_start, i, false);
+         /* Consecutive stars are the same as a single one. */
+         if (!g->nr_atoms || atom[-1].type != VB_GLOB_STAR) {
+            atom->type = VB_GLOB_STAR;
+            g->nr_atoms++;
+         }
+         lit_start = i + 1;
+         break;
+      case '?':
+         vb_glob_fragment(g, upat, lit_start, i, false);
+         atom->type = VB_GLOB_ANY;
+         g->nr_atoms++;
+         g->only_literals = false;
+         lit_start = i + 1;
+         break;
+      case '[': {
+         vb_glob_fragment(g, upat, lit_start, i, false);
+         int32_t end = vb_glob_set(g, &upat[i + 1], ulen - i - 1);
+         if (end < 0) {
+            g->invalid = true;
+            return VB_OK;
+         }
+         atom->type = VB_GLOB_SET;
+         atom->set = g->nr_sets - 1;
+         g->nr_atoms++;
+         g->only_literals = false;
+         i += end + 1;
+         lit_start = i + 1;
+         break;
+      }
+      default:
+         atom->type = VB_GLOB_CHAR;
+         atom->c = upat[i];
+         g->nr_atoms++;
+         break;
+      }
+   }
+   vb_glob_fragment(g, upat, lit_start, ulen, true);
+   return VB_OK;
+}
 
-static const char _vb_simplify_glob_key_offsets[] = {
-	0, 4, 8, 9, 10, 11, 15, 19
-};
+/* Checks that a word contains the literal fragments of the pattern, in order,
+ * and, for the first and last ones, at the expected place. The fragments are
+ * looked for at the leftmost position possible, so this can only reject words
+ * that wouldn't match anyway. If the pattern has no other atoms than literals
+ * and stars, this is enough to tell whether the word matches.
+ */
+bool vb_glob_prefilter(const struct vb_glob *g, const char *word, size_t len)
+{
+   size_t pos = 0;
+
+   if (!g->nr_atoms)
+      return len == 0;
+
+   for (uint32_t i = 0; i < g->nr_fragments; i++) {
+      const struct vb_glob_fragment *f = &g->fragments[i];
+      const char *bytes = &g->bytes[f->start];
+
+      if (f->at_end) {
+         if (len - pos < f->len || memcmp(&word[len - f->len], bytes, f->len))
+            return false;
+         if (f->at_start && len != f->len)
+            return false;
+         pos = len;
+      } else if (f->at_start) {
+         if (len < f->len || memcmp(word, bytes, f->len))
+            return false;
+         pos = f->len;
+      } else {
+         const char *hit = vb_memmem(&word[pos], len - pos, bytes, f->len);
+         if (!hit)
+            return false;
+         pos = hit - word + f->len;
+      }
+   }
+   return true;
+}
 
-static const char _vb_simplify_glob_trans_keys[] = {
-	42, 63, 91, 93, 42, 63, 91, 93, 
-	42, 42, 42, 42, 63, 91, 93, 42, 
-	63, 91, 93, 42, 0
-};
+static bool vb_glob_in_set(const struct vb_glob *g,
+                           const struct vb_glob_set *set, char32_t c)
+{
+   bool found = false;
 
-static const char _vb_simplify_glob_single_lengths[] = {
-	4, 4, 1, 1, 1, 4, 4, 1
-};
+   if (c < 0x80) {
+      found = set->ascii[c >> 6] & (UINT64_C(1) << (c & 63));
+   } else {
+      for (uint32_t i = set->start; i < set->end; i++) {
+         if (g->set_chars[i] == c) {
+            found = true;
+            break;
+         }
+      }
+   }
+   return found != set->invert;
+}
 
-static const char _vb_simplify_glob_range_lengths[] = {
-	0, 0, 0, 0, 0, 0, 0, 0
-};
+/* Checks if a sequence of atoms that doesn't contain stars matches a string
+ * of the same length.
+ */
+static bool vb_glob_segment(const struct vb_glob *g,
+                            const struct vb_glob_atom *atoms,
+                            const char32_t *str, int32_t len)
+{
+   for (int32_t i = 0; i < len; i++) {
+      switch (atoms[i].type) {
+      case VB_GLOB_CHAR:
+         if (atoms[i].c != str[i])
+            return false;
+         break;
+      case VB_GLOB_SET:
+         if (!vb_glob_in_set(g, &g->sets[atoms[i].set], str[i]))
+            return false;
+         break;
+      default:
+         break;
+      }
+   }
+   return true;
+}
 
-static const char _vb_simplify_glob_index_offsets[] = {
-	0, 5, 10, 12, 14, 16, 21, 26
-};
+/* Number of atoms before the next star, or the end of the pattern. */
+static int32_t vb_glob_segment_len(const struct vb_glob *g, int32_t start)
+{
+   int32_t i = start;
+   while (i < (int32_t)g->nr_atoms && g->atoms[i].type != VB_GLOB_STAR)
+      i++;
+   return i - start;
+}
 
-static const char _vb_simplify_glob_indicies[] = {
-	1, 2, 2, 2, 0, 3, 2, 2, 
-	2, 0, 4, 2, 5, 2, 6, 2, 
-	8, 2, 2, 2, 7, 9, 2, 2, 
-	2, 7, 10, 2, 0
-};
+/* Since every atom but stars matches exactly one character, the pattern can be
+ * seen as a series of fixed-length segments separated by stars. The first one
+ * must match at the start of the string, the last one at its end, and the
+ * others in between, in order, without overlapping. Matching each of them at
+ * the leftmost position possible leaves the most room for the next ones, so we
+ * never need to backtrack.
+ */
+static bool vb_glob_run(const struct vb_glob *g, const char32_t *str,
+                        int32_t len)
+{
+   const struct vb_glob_atom *atoms = g->atoms;
+   const int32_t nr_atoms = g->nr_atoms;
+
+   int32_t seg_len = vb_glob_segment_len(g, 0);
+   if (seg_len == nr_atoms)
+      return len == seg_len && vb_glob_segment(g, atoms, str, len);
+   if (len < seg_len || !vb_glob_segment(g, atoms, str, seg_len))
+      return false;
+
+   int32_t pos = seg_len;          /* In the string. */
+   int32_t i = seg_len + 1;        /* In the pattern, just after a star. */
+
+   /* Same for the last segment. */
+   int32_t last = nr_atoms;
+   while (last > i && atoms[last - 1].type != VB_GLOB_STAR)
+      last--;
+   const int32_t last_len = nr_atoms - last;
+   if (len - pos < last_len
+       || !vb_glob_segment(g, &atoms[last], &str[len - last_len], last_len))
+      return false;
+   const int32_t end = len - last_len;
+
+   while (i < last) {
+      seg_len = vb_glob_segment_len(g, i);
+      for (;;) {
+         if (end - pos < seg_len)
+            return false;
+         if (vb_glob_segment(g, &atoms[i], &str[pos], seg_len))
+            break;
+         pos++;
+      }
+      pos += seg_len;
+      i += seg_len + 1;
+   }
+   return true;
+}
 
-static const char _vb_simplify_glob_trans_targs[] = {
-	1, 5, 3, 2, 2, 4, 4, 6, 
-	5, 7, 7
-};
+int vb_glob_match(const struct vb_glob *g, const char *word, size_t len,
+                  bool valid_utf8)
+{
+   if (g->invalid || !vb_glob_prefilter(g, word, len))
+      return 0;
+   if (g->only_literals)
+      return 1;
+
+   char32_t uword[MN_MAX_WORD_LEN + 1];
+   const int32_t ulen = valid_utf8 ? vb_utf8_decode_valid(uword, word, len)
+                                   : vb_utf8_decode(uword, word, len);
+   if (ulen < 0)
+      return -1;
+   return vb_glob_run(g, uword, ulen);
+}
 
-static const char _vb_simplify_glob_trans_actions[] = {
-	1, 1, 1, 1, 0, 1, 0, 1, 
-	0, 1, 0
+int vb_glob_match_iter(const struct vb_glob *g, struct vb_iter *it,
+                       const char *word, size_t len,
+                       size_t pfx_len, int32_t pfx_chars)
+{
+   if (g->invalid || !vb_glob_prefilter(g, &word[pfx_len], len - pfx_len))
+      return 0;
+   if (g->only_literals)
+      return 1;
+
+   int32_t ulen;
+   const char32_t *uword = vb_iter_chars(it, word, len, &ulen);
+   if (!uword)
+      return -1;
+   return vb_glob_run(g, &uword[pfx_chars], ulen - pfx_chars);
+}
+#line 1 "handle.c"
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+/* Readers register themselves in one of two counters, depending on the parity
+ * of the epoch they observed. A writer that replaces the lexicon then starts a
+ * new epoch, so that new readers register in the other counter, and waits for
+ * the counter of the previous epoch to drop to zero, at which point no reader
+ * can still be using the replaced lexicon. This is a simplified form of RCU.
+ * Readers never wait: they only retry registering if a replacement happens
+ * while they are doing so.
+ */
+struct vb_handle {
+   _Atomic(struct vb_lexicon *) lexicon;
+   atomic_uint epoch;
+   atomic_uint readers[2];
+   mtx_t lock;             /* Serializes writers. */
 };
 
-static const char _vb_simplify_glob_eof_actions[] = {
-	9, 9, 3, 11, 11, 11, 7, 5
-};
+int vb_handle_new(struct vb_handle **hp, struct vb_lexicon *lex)
+{
+   struct vb_handle *h = malloc(sizeof *h);
+   if (!h) {
+      *hp = NULL;
+      return VB_ENOMEM;
+   }
+   if (mtx_init(&h->lock, mtx_plain) != thrd_success) {
+      free(h);
+      *hp = NULL;
+      return VB_ENOMEM;
+   }
+   atomic_init(&h->lexicon, lex);
+   atomic_init(&h->epoch, 0);
+   atomic_init(&h->readers[0], 0);
+   atomic_init(&h->readers[1], 0);
+   *hp = h;
+   return VB_OK;
+}
 
-static const int vb_simplify_glob_start = 0;
+void vb_handle_free(struct vb_handle *h)
+{
+   if (!h)
+      return;
+   vb_lexicon_free(atomic_load(&h->lexicon));
+   mtx_destroy(&h->lock);
+   free(h);
+}
 
-static const int vb_simplify_glob_en_main = 0;
+const struct vb_lexicon *vb_handle_acquire(struct vb_handle *h, unsigned *ticket)
+{
+   for (;;) {
+      unsigned epoch = atomic_load(&h->epoch);
+      atomic_fetch_add(&h->readers[epoch & 1], 1);
+      if (atomic_load(&h->epoch) == epoch) {
+         *ticket = epoch & 1;
+         return atomic_load(&h->lexicon);
+      }
+      atomic_fetch_sub(&h->readers[epoch & 1], 1);
+   }
+}
 
+void vb_handle_release(struct vb_handle *h, unsigned ticket)
+{
+   atomic_fetch_sub(&h->readers[ticket & 1], 1);
+}
 
-#line 46 "src/parse.rl"
+void vb_handle_publish(struct vb_handle *h, struct vb_lexicon *lex)
+{
+   mtx_lock(&h->lock);
+   struct vb_lexicon *old = atomic_exchange(&h->lexicon, lex);
+   unsigned epoch = atomic_fetch_add(&h->epoch, 1);
+   while (atomic_load(&h->readers[epoch & 1]))
+      thrd_yield();
+   mtx_unlock(&h->lock);
+
+   vb_lexicon_free(old);
+}
 
-static void vb_simplify_glob(struct vb_match_ctx *c, char *buf)
+int vb_handle_match(struct vb_handle *h, struct vb_query *q,
+                    void (*callback)(void *arg, const char *token, size_t len),
+                    void *arg)
 {
-   int cs;
-   const char *p = c->str;
-   const char *pe = &p[c->len];
-   const char *const eof = pe;
+   unsigned ticket;
+   const struct vb_lexicon *lex = vb_handle_acquire(h, &ticket);
+   int ret = vb_lexicon_match(lex, q, callback, arg);
+   vb_handle_release(h, ticket);
+   return ret;
+}
+#line 1 "lexicon.c"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 
-   size_t len = 0;
-   
-#line 77 "src/parse.c"
-	{
-	cs = vb_simplify_glob_start;
-	}
+static bool has_edits(const struct vb_lexicon *lex)
+{
+   return lex->added.size || lex->removed.size;
+}
 
-#line 56 "src/parse.rl"
-   
-#line 84 "src/parse.c"
-	{
-	int _klen;
-	unsigned int _trans;
-	const char *_acts;
-	unsigned int _nacts;
-	const char *_keys;
+/* Returns a lexicon identifier never used before. */
+static uint64_t new_id(void)
+{
+   static atomic_uint_least64_t last_id;
+   return atomic_fetch_add(&last_id, 1) + 1;
+}
 
-	if ( p == pe )
-		goto _test_eof;
-_resume:
-	_keys = _vb_simplify_glob_trans_keys + _vb_simplify_glob_key_offsets[cs];
-	_trans = _vb_simplify_glob_index_offsets[cs];
 
-	_klen = _vb_simplify_glob_single_lengths[cs];
-	if ( _klen > 0 ) {
-		const char *_lower = _keys;
-		const char *_mid;
-		const char *_upper = _keys + _klen - 1;
-		while (1) {
-			if ( _upper < _lower )
-				break;
+/*******************************************************************************
+ * Word arrays.
+ ******************************************************************************/
 
-			_mid = _lower + ((_upper-_lower) >> 1);
-			if ( (*p) < *_mid )
-				_upper = _mid - 1;
-			else if ( (*p) > *_mid )
-				_lower = _mid + 1;
-			else {
-				_trans += (unsigned int)(_mid - _keys);
-				goto _match;
-			}
-		}
-		_keys += _klen;
-		_trans += _klen;
-	}
+/* Returns the index of the first word >= the given one. */
+static size_t words_bound(const struct vb_words *ws, const char *str, size_t len)
+{
+   size_t low = 0, high = ws->size;
 
-	_klen = _vb_simplify_glob_range_lengths[cs];
-	if ( _klen > 0 ) {
-		const char *_lower = _keys;
-		const char *_mid;
-		const char *_upper = _keys + (_klen<<1) - 2;
-		while (1) {
-			if ( _upper < _lower )
+   while (low < high) {
+      size_t mid = low + ((high - low) >> 1);
+      if (lmemcmp(ws->data[mid].str, ws->data[mid].len, str, len) < 0)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+static bool words_find(const struct vb_words *ws, const char *str, size_t len,
+                       size_t *idx)
+{
+   *idx = words_bound(ws, str, len);
+   return *idx < ws->size
+       && !lmemcmp(ws->data[*idx].str, ws->data[*idx].len, str, len);
+}
+
+static int words_insert(struct vb_words *ws, size_t idx,
+                        const char *str, size_t len, uint32_t pos)
+{
+   if (ws->size == ws->max) {
+      size_t max = ws->max ? ws->max * 2 : 16;
+      struct vb_word *data = realloc(ws->data, max * sizeof *data);
+      if (!data)
+         return VB_ENOMEM;
+      ws->data = data;
+      ws->max = max;
+   }
+
+   char *copy = malloc(len + 1);
+   if (!copy)
+      return VB_ENOMEM;
+   memcpy(copy, str, len);
+   copy[len] = '\0';
+
+   memmove(&ws->data[idx + 1], &ws->data[idx], (ws->size - idx) * sizeof *ws->data);
+   ws->data[idx] = (struct vb_word){.str = copy, .len = len, .pos = pos};
+   ws->size++;
+   return VB_OK;
+}
+
+static void words_delete(struct vb_words *ws, size_t idx)
+{
+   free(ws->data[idx].str);
+   ws->size--;
+   memmove(&ws->data[idx], &ws->data[idx + 1], (ws->size - idx) * sizeof *ws->data);
+}
+
+static void words_fini(struct vb_words *ws)
+{
+   for (size_t i = 0; i < ws->size; i++)
+      free(ws->data[i].str);
+   free(ws->data);
+}
+
+/* Number of removed words whose ordinal in the base automaton is <= pos. */
+static size_t removed_upto(const struct vb_lexicon *lex, uint32_t pos)
+{
+   size_t low = 0, high = lex->removed.size;
+
+   while (low < high) {
+      size_t mid = low + ((high - low) >> 1);
+      if (lex->removed.data[mid].pos <= pos)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
+}
+
+/* Number of words of the base automaton that sort before the given one. */
+static uint32_t base_before(const struct vb_lexicon *lex,
+                            const char *str, size_t len)
+{
+   struct mini_iter it;
+   uint32_t pos = mn_iter_inits(&it, lex->base, str, len);
+   return pos ? pos - 1 : lex->base_size;
+}
+
+/* Position, in the whole lexicon, of the added word at the given index. */
+static uint32_t added_pos(const struct vb_lexicon *lex, size_t idx)
+{
+   uint32_t before = lex->added.data[idx].pos;
+   return before - removed_upto(lex, before) + idx + 1;
+}
+
+
+/*******************************************************************************
+ * Lexicon.
+ ******************************************************************************/
+
+void vb_lexicon_view(struct vb_lexicon *lex, const struct mini *base)
+{
+   /* Counting the words of a standard automaton requires traversing it, and
+    * we only need the count for applying edits, which such views never have.
+    */
+   *lex = (struct vb_lexicon){
+      .base = (struct mini *)base,
+      .base_size = mn_type(base) == MN_NUMBERED ? mn_size(base) : 0,
+   };
+}
+
+/* Checks that all words of an automaton are valid UTF-8. */
+static bool check_utf8(const struct mini *fsa)
+{
+   struct mini_iter it;
+   const char *word;
+   size_t len;
+
+   mn_iter_init(&it, fsa);
+   while ((word = mn_iter_next(&it, &len)))
+      if (!vb_utf8_check(word, len))
+         return false;
+   return true;
+}
+
+/* Same as vb_lexicon_new(), but doesn't check the words if "valid_utf8" is
+ * set.
+ */
+static int lexicon_new(struct vb_lexicon **lexp, struct mini *base,
+                       bool valid_utf8)
+{
+   *lexp = NULL;
+
+   if (mn_type(base) != MN_NUMBERED)
+      return VB_EFSA;
+   if (!valid_utf8 && !check_utf8(base))
+      return VB_ELUTF8;
+
+   struct vb_lexicon *lex = malloc(sizeof *lex);
+   if (!lex)
+      return VB_ENOMEM;
+   vb_lexicon_view(lex, base);
+   lex->valid_utf8 = true;
+   lex->id = new_id();
+   *lexp = lex;
+   return VB_OK;
+}
+
+int vb_lexicon_new(struct vb_lexicon **lexp, struct mini *base)
+{
+   return lexicon_new(lexp, base, false);
+}
+
+void vb_lexicon_free(struct vb_lexicon *lex)
+{
+   if (!lex)
+      return;
+   words_fini(&lex->added);
+   words_fini(&lex->removed);
+   vb_arena_free(lex->arena);
+   vb_folded_free(lex->folded);
+   vb_scores_free(lex->scores);
+   mn_free(lex->base);
+   free(lex);
+}
+
+uint32_t vb_lexicon_size(const struct vb_lexicon *lex)
+{
+   return lex->base_size + lex->added.size - lex->removed.size;
+}
+
+size_t vb_lexicon_pending(const struct vb_lexicon *lex)
+{
+   return lex->added.size + lex->removed.size;
+}
+
+int vb_lexicon_add(struct vb_lexicon *lex, const char *word, size_t len)
+{
+   if (len == 0 || len > MN_MAX_WORD_LEN || !vb_utf8_check(word, len))
+      return VB_EWORD;
+
+   lex->id = new_id();
+   size_t idx;
+   if (words_find(&lex->removed, word, len, &idx)) {
+      words_delete(&lex->removed, idx);
+      return VB_OK;
+   }
+   if (words_find(&lex->added, word, len, &idx) || mn_contains(lex->base, word, len))
+      return VB_OK;
+   return words_insert(&lex->added, idx, word, len, base_before(lex, word, len));
+}
+
+int vb_lexicon_remove(struct vb_lexicon *lex, const char *word, size_t len)
+{
+   if (len == 0 || len > MN_MAX_WORD_LEN)
+      return VB_OK;
+
+   lex->id = new_id();
+   size_t idx;
+   if (words_find(&lex->added, word, len, &idx)) {
+      words_delete(&lex->added, idx);
+      return VB_OK;
+   }
+   uint32_t pos = mn_locate(lex->base, word, len);
+   if (!pos || words_find(&lex->removed, word, len, &idx))
+      return VB_OK;
+   return words_insert(&lex->removed, idx, word, len, pos);
+}
+
+int vb_lexicon_flatten(struct vb_lexicon *lex)
+{
+   int ret = VB_OK;
+
+   if (!lex->arena)
+      ret = vb_arena_new(&lex->arena, lex->base);
+   if (!ret && lex->folded && !lex->folded->arena)
+      ret = vb_arena_new(&lex->folded->arena, lex->folded->fsa);
+   return ret;
+}
+
+int vb_lexicon_fold(struct vb_lexicon *lex)
+{
+   if (lex->folded)
+      return VB_OK;
+
+   int ret = vb_folded_new(&lex->folded, lex->base);
+   if (!ret && lex->arena)
+      ret = vb_lexicon_flatten(lex);
+   return ret;
+}
+
+int vb_lexicon_set_scores(struct vb_lexicon *lex, const int32_t *scores)
+{
+   struct vb_scores *s = NULL;
+
+   if (scores) {
+      int ret = vb_scores_new(&s, scores, lex->base_size);
+      if (ret)
+         return ret;
+   }
+   vb_scores_free(lex->scores);
+   lex->scores = s;
+   lex->id = new_id();
+   return VB_OK;
+}
+
+const struct vb_scores *vb_lexicon_scores(const struct vb_lexicon *lex)
+{
+   return has_edits(lex) ? NULL : lex->scores;
+}
+
+const struct vb_arena *vb_lexicon_arena(const struct vb_lexicon *lex)
+{
+   return has_edits(lex) ? NULL : lex->arena;
+}
+
+bool vb_lexicon_contains(const struct vb_lexicon *lex, const char *word,
+                         size_t len)
+{
+   if (has_edits(lex)) {
+      size_t idx;
+      if (words_find(&lex->added, word, len, &idx))
+         return true;
+      if (words_find(&lex->removed, word, len, &idx))
+         return false;
+   }
+   return mn_contains(lex->base, word, len);
+}
+
+size_t vb_lexicon_extract(const struct vb_lexicon *lex, uint32_t pos,
+                          char buf[static MN_MAX_WORD_LEN + 1])
+{
+   if (!has_edits(lex))
+      return mn_extract(lex->base, pos, buf);
+
+   struct vb_iter it;
+   const char *word;
+   size_t len;
+   if (!vb_iter_initn(&it, lex, pos) || !(word = vb_iter_next(&it, &len))) {
+      buf[0] = '\0';
+      return 0;
+   }
+   memcpy(buf, word, len + 1);
+   return len;
+}
+
+
+/*******************************************************************************
+ * Compaction.
+ ******************************************************************************/
+
+struct vb_buffer {
+   char *data;
+   size_t size;
+   size_t max;
+};
+
+static int vb_buffer_write(void *arg, const void *data, size_t size)
+{
+   struct vb_buffer *buf = arg;
+
+   if (buf->size + size > buf->max) {
+      size_t max = buf->max ? buf->max : 4096;
+      while (max < buf->size + size)
+         max *= 2;
+      char *new_data = realloc(buf->data, max);
+      if (!new_data)
+         return -1;
+      buf->data = new_data;
+      buf->max = max;
+   }
+   memcpy(&buf->data[buf->size], data, size);
+   buf->size += size;
+   return 0;
+}
+
+static int vb_buffer_read(void *arg, void *data, size_t size)
+{
+   struct vb_buffer *buf = arg;
+
+   if (buf->size + size > buf->max)
+      return -1;
+   memcpy(data, &buf->data[buf->size], size);
+   buf->size += size;
+   return 0;
+}
+
+int vb_enc_load(struct mini_enc *enc, int ret, struct mini **fsap)
+{
+   *fsap = NULL;
+
+   struct vb_buffer buf = {0};
+   if (!ret)
+      ret = mn_enc_dump(enc, vb_buffer_write, &buf);
+   mn_enc_free(enc);
+
+   if (!ret) {
+      buf.max = buf.size;
+      buf.size = 0;
+      ret = mn_load(fsap, vb_buffer_read, &buf);
+   }
+   free(buf.data);
+
+   switch (ret) {
+   case MN_OK:
+      return VB_OK;
+   case MN_E2BIG:
+      return VB_E2BIG;
+   default:
+      return VB_ENOMEM;
+   }
+}
+
+int vb_lexicon_compact(const struct vb_lexicon *lex, struct vb_lexicon **lexp)
+{
+   *lexp = NULL;
+
+   struct mini_enc *enc = mn_enc_new(MN_NUMBERED);
+   if (!enc)
+      return VB_ENOMEM;
+
+   int ret = MN_OK;
+   struct vb_iter it;
+   const char *word;
+   size_t len;
+   vb_iter_init(&it, lex);
+   while ((word = vb_iter_next(&it, &len)) && !ret)
+      ret = mn_enc_add(enc, word, len);
+
+   struct mini *base;
+   if ((ret = vb_enc_load(enc, ret, &base)))
+      return ret;
+
+   /* The words come from a lexicon, so they have already been checked. */
+   ret = lexicon_new(lexp, base, true);
+   if (ret) {
+      mn_free(base);
+      return ret;
+   }
+   if ((lex->arena && (ret = vb_lexicon_flatten(*lexp)))
+       || (lex->folded && (ret = vb_lexicon_fold(*lexp)))) {
+      vb_lexicon_free(*lexp);
+      *lexp = NULL;
+   }
+   return ret;
+}
+
+
+/*******************************************************************************
+ * Iterator.
+ ******************************************************************************/
+
+static void iter_reset(struct vb_iter *it, const struct vb_lexicon *lex)
+{
+   it->lex = lex;
+   it->word = NULL;
+   it->len = 0;
+   it->pos = 0;
+   it->added = 0;
+   it->removed = 0;
+   it->prefix = NULL;
+   it->prefix_len = 0;
+   it->accept = NULL;
+   it->arg = NULL;
+   it->decoded = 0;
+   it->utf8_bytes = 0;
+}
+
+uint32_t vb_iter_init(struct vb_iter *it, const struct vb_lexicon *lex)
+{
+   iter_reset(it, lex);
+   uint32_t pos = mn_iter_init(&it->it, lex->base);
+   return pos || lex->added.size;
+}
+
+uint32_t vb_iter_initp(struct vb_iter *it, const struct vb_lexicon *lex,
+                       const char *prefix, size_t len)
+{
+   iter_reset(it, lex);
+   uint32_t pos = mn_iter_initp(&it->it, lex->base, prefix, len);
+   if (!has_edits(lex))
+      return pos;
+
+   it->prefix = prefix;
+   it->prefix_len = len;
+   it->added = words_bound(&lex->added, prefix, len);
+
+   /* Position of the first word >= the prefix, if it is prefixed by it. */
+   uint32_t before = pos ? pos - 1 : base_before(lex, prefix, len);
+   it->pos = before;
+   it->removed = removed_upto(lex, before);
+
+   if (!pos) {
+      if (it->added == lex->added.size)
+         return 0;
+      const struct vb_word *w = &lex->added.data[it->added];
+      if (w->len < len || memcmp(w->str, prefix, len))
+         return 0;
+   }
+   return before - it->removed + it->added + 1;
+}
+
+uint32_t vb_iter_inits(struct vb_iter *it, const struct vb_lexicon *lex,
+                       const char *word, size_t len)
+{
+   if (!has_edits(lex)) {
+      iter_reset(it, lex);
+      return mn_iter_inits(&it->it, lex->base, word, len);
+   }
+
+   /* Position of the first word >= the given one. */
+   uint32_t before = base_before(lex, word, len);
+   uint32_t pos = before - removed_upto(lex, before)
+                + words_bound(&lex->added, word, len) + 1;
+   return vb_iter_initn(it, lex, pos);
+}
+
+uint32_t vb_iter_initn(struct vb_iter *it, const struct vb_lexicon *lex,
+                       uint32_t pos)
+{
+   iter_reset(it, lex);
+   if (!has_edits(lex))
+      return mn_iter_initn(&it->it, lex->base, pos);
+
+   if (pos == 0 || pos > vb_lexicon_size(lex)) {
+      mn_iter_initn(&it->it, lex->base, 0);
+      return 0;
+   }
+
+   /* Find the number of added words that come before the requested one. */
+   size_t low = 0, high = lex->added.size;
+   while (low < high) {
+      size_t mid = low + ((high - low) >> 1);
+      if (added_pos(lex, mid) < pos)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   it->added = low;
+
+   uint32_t base_pos;
+   if (low < lex->added.size && added_pos(lex, low) == pos) {
+      /* The requested word is an added one. */
+      base_pos = lex->added.data[low].pos + 1;
+      it->removed = removed_upto(lex, base_pos - 1);
+   } else {
+      /* The requested word is in the base automaton. Skip removed words. */
+      base_pos = pos - low;
+      size_t i = 0;
+      while (i < lex->removed.size && lex->removed.data[i].pos <= base_pos) {
+         base_pos++;
+         i++;
+      }
+      it->removed = i;
+   }
+   it->pos = base_pos - 1;
+   mn_iter_initn(&it->it, lex->base, base_pos);
+   return pos;
+}
+
+void vb_iter_filter(struct vb_iter *it,
+                    int (*accept)(void *arg, size_t depth, uint8_t chr),
+                    void *arg)
+{
+   it->accept = accept;
+   it->arg = arg;
+}
+
+static const char *iter_next_base(struct vb_iter *it, size_t *len)
+{
+   const char *word = it->accept
+      ? mn_iter_next_filter(&it->it, len, it->accept, it->arg)
+      : mn_iter_next(&it->it, len);
+   if (it->it.shared < it->decoded)
+      it->decoded = it->it.shared;
+   return word;
+}
+
+const char *vb_iter_next(struct vb_iter *it, size_t *len)
+{
+   const struct vb_lexicon *lex = it->lex;
+   if (!has_edits(lex))
+      return iter_next_base(it, len);
+
+   if (!it->word) {
+      while ((it->word = iter_next_base(it, &it->len))) {
+         /* Filtered words are not consecutive. */
+         if (it->accept) {
+            it->pos = mn_locate(lex->base, it->word, it->len);
+            while (it->removed < lex->removed.size
+                   && lex->removed.data[it->removed].pos < it->pos)
+               it->removed++;
+         } else {
+            it->pos++;
+         }
+         if (it->removed == lex->removed.size || lex->removed.data[it->removed].pos != it->pos)
+            break;
+         it->removed++;
+      }
+   }
+
+   const struct vb_word *added = NULL;
+   if (it->added < lex->added.size) {
+      added = &lex->added.data[it->added];
+      if (it->prefix && (added->len < it->prefix_len || memcmp(added->str, it->prefix, it->prefix_len))) {
+         it->added = lex->added.size;
+         added = NULL;
+      }
+   }
+
+   if (it->word && (!added || lmemcmp(it->word, it->len, added->str, added->len) < 0)) {
+      const char *word = it->word;
+      it->word = NULL;
+      if (len)
+         *len = it->len;
+      return word;
+   }
+   if (added) {
+      it->added++;
+      if (len)
+         *len = added->len;
+      return added->str;
+   }
+   if (len)
+      *len = 0;
+   return NULL;
+}
+
+const char32_t *vb_iter_chars(struct vb_iter *it, const char *word, size_t len,
+                              int32_t *nr)
+{
+   const bool check = !it->lex->valid_utf8;
+
+   /* Added words have nothing in common with the current base word. */
+   if (word != it->it.word)
+      it->decoded = 0;
+   it->utf8_bytes += len - it->decoded;
+   *nr = vb_utf8_decode_next(&it->chars, word, len, it->decoded, check);
+   if (*nr < 0) {
+      it->decoded = 0;
+      return NULL;
+   }
+   it->decoded = word == it->it.word ? len : 0;
+   return it->chars.chars;
+}
+#line 1 "match.c"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#line 1 "faconde.h"
+#ifndef FACONDE_H
+#define FACONDE_H
+
+#define FC_VERSION "0.1"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <uchar.h>
+
+/* Maximum allowed length of a sequence. We don't check internally that this
+ * limit is respected. It could be larger, but this is unlikely to be useful.
+ * With this value, the worst-case allocation is 64M.
+ */
+#define FC_MAX_SEQ_LEN 4096
+
+/* Check if a string matches a glob pattern.
+ * Matching is case-sensitive, and is performed over the whole string. The
+ * supported syntax is as follows:
+ *
+ *  ?         matches a single character
+ *  *         matches zero or more characters
+ *  [abc]     matches any of the characters a, b, or c
+ *  [^abc]    matches any character but a, b, and c
+ *
+ * Character classes are not supported.
+ *
+ * The characters `[`, `?`, and `*` are interpreted as literals when in a group.
+ * The character `]`, to be included in a group, must be placed in first
+ * position. The character `^`, if included in a group and intended to be
+ * interpreted as a literal, must not be placed at the beginning of the group.
+ * The character `]`, if not preceded by `[`, is interpreted as a literal.
+ *
+ * If the pattern is invalid, returns false.
+ */
+bool fc_glob(const char32_t *pat, const char32_t *str);
+
+
+/*******************************************************************************
+ * Levenshtein/Damerau distance
+ ******************************************************************************/
+
+/* Normalization strategies for Levenshtein and Damerau.
+ * FC_NORM_LSEQ   Normalize by the length longest sequence.
+ * FC_NORM_LALIGN Normalize by the longest alignement between the two input
+ *                sequences. This is more expensive (both in terms of space and
+ *                time) than FC_NORM_LSEQ, but (arguably) more accurate. For
+ *                details, see Heeringa, "Measuring Dialect Pronunciation
+ *                Differences using Levenshtein Distance".
+ */
+enum fc_norm_method {
+   FC_NORM_LSEQ,
+   FC_NORM_LALIGN,
+};
+
+/* Computes the absolute Levenshtein distance between two sequences. */
+int32_t fc_levenshtein(const char32_t *seq1, int32_t len1,
+                       const char32_t *seq2, int32_t len2);
+
+/* Computes a normalized Levenshtein distance between two sequences. */
+double fc_nlevenshtein(enum fc_norm_method method,
+                       const char32_t *seq1, int32_t len1,
+                       const char32_t *seq2, int32_t len2);
+
+/* Computes the absolute Damerau distance between two sequences. */
+int32_t fc_damerau(const char32_t *seq1, int32_t len1,
+                   const char32_t *seq2, int32_t len2);
+
+/* Computes a normalized Damerau distance between two sequences. */
+double fc_ndamerau(enum fc_norm_method method,
+                   const char32_t *seq1, int32_t len1,
+                   const char32_t *seq2, int32_t len2);
+
+/* Computes the distance between the provided sequences upto a maximum value
+ * of 1. If the distance between the sequences is larger than that, a value
+ * larger than 1 is returned.
+ */
+int32_t fc_lev_bounded1(const char32_t *seq1, int32_t len1,
+                        const char32_t *seq2, int32_t len2);
+
+/* Same as "fc_lev_bounded1()", but for distance 2. */
+int32_t fc_lev_bounded2(const char32_t *seq1, int32_t len1,
+                        const char32_t *seq2, int32_t len2);
+
+/* Table of pointers to the above functions.
+ * The function at index 0 is a dummy one that compares sequences for equality.
+ */
+extern int32_t (*const fc_lev_bounded[3])(const char32_t *, int32_t,
+                                          const char32_t *, int32_t);
+
+/* Computes the jaro distance between two sequences.
+ * Contrary to the canonical implementation, this returns 0 for identity, and
+ * 1 to indicate absolute difference, instead of the reverse.
+ */
+double fc_jaro(const char32_t *seq1, int32_t len1,
+               const char32_t *seq2, int32_t len2);
+
+
+/*******************************************************************************
+ * Longest Common Substring and Subsequence
+ ******************************************************************************/
+
+/* Computes the length of the longest common substring between two sequences. */
+int32_t fc_lcsubstr(const char32_t *seq1, int32_t len1,
+                    const char32_t *seq2, int32_t len2);
+
+/* Like fc_lcsubstr(), but also makes possible the extraction of a longest
+ * common substring. If "pos" is not NULL, it is made to point to the leftmost
+ * longest common substring in "seq1". If the length of the longest common
+ * substring is zero, "pos", if not NULL, is made to point to the end of "seq1".
+ */
+int32_t fc_lcsubstr_extract(const char32_t *seq1, int32_t len1,
+                            const char32_t *seq2, int32_t len2,
+                            const char32_t **pos);
+
+/* Computes the length of the longest common subsequence between two
+ * sequences.
+ */
+int32_t fc_lcsubseq(const char32_t *seq1, int32_t len1,
+                    const char32_t *seq2, int32_t len2);
+
+/* Normalized version of fc_lcsubseq(). */
+double fc_nlcsubseq(const char32_t *seq1, int32_t len1,
+                    const char32_t *seq2, int32_t len2);
+
+
+/*******************************************************************************
+ * Memoized string metrics.
+ ******************************************************************************/
+
+enum fc_metric {
+   FC_LEVENSHTEIN,
+   FC_DAMERAU,
+   FC_LCSUBSTR,
+   FC_LCSUBSEQ,
+
+   FC_METRIC_NR,
+};
+
+struct fc_memo {
+   int32_t (*compute)(struct fc_memo *, const char32_t *, int32_t);
+   void *matrix;           /* Similarity matrix. */
+   int32_t mdim;           /* Matrix dimension. */
+   const char32_t *seq1;   /* Reference sequence. */
+   int32_t len1;           /* Length of the reference sequence. */
+   char32_t *seq2;         /* Previous sequence seen. */
+   int32_t len2;           /* Length of this sequence. */
+   int32_t max_dist;       /* Maximum allowed distance (for Levenshtein). */
+   uint64_t sig;           /* Characters of the reference sequence, modulo 64. */
+   /* Work done so far, which callers can read and reset as they see fit. */
+   uint64_t cells;         /* Matrix cells computed. */
+   uint64_t hits;          /* Comparisons that reused part of the matrix. */
+};
+
+/* Initializer.
+ * metric: the metric to use.
+ * max_len: the maximum possible length of a sequence (or higher). The
+ * internal matrix is never reallocated.
+ * max_dist: the maximum allowed edit distance (the lower, the faster). This
+ * parameter is only used if the chosen metric is Levenshtein or Damerau.
+ */
+void fc_memo_init(struct fc_memo *, enum fc_metric metric,
+                  int32_t max_len, int32_t max_dist);
+
+/* Destructor. */
+void fc_memo_fini(struct fc_memo *);
+
+/* Returns the chosen metric. */
+enum fc_metric fc_memo_metric(const struct fc_memo *);
+
+/* Sets the reference sequence.
+ * It is not copied internally, and should then be available until either a new
+ * reference sequence is set, or this object is deinitialized. The reference
+ * sequence can be changed several times without deinitializing this object
+ * first.
+ */
+void fc_memo_set_ref(struct fc_memo *, const char32_t *seq1, int32_t len1);
+
+/* Compares the reference sequence to a new one. */
+static inline int32_t fc_memo_compute(struct fc_memo *m,
+                                      const char32_t *seq2, int32_t len2)
+{
+   return m->compute(m, seq2, len2);
+}
+
+/* Concrete prototypes for the memoized string metrics functions.
+ * The function called must match the chosen metric.
+ */
+int32_t fc_memo_levenshtein(struct fc_memo *, const char32_t *, int32_t);
+int32_t fc_memo_damerau(struct fc_memo *, const char32_t *, int32_t);
+int32_t fc_memo_lcsubstr(struct fc_memo *, const char32_t *, int32_t);
+int32_t fc_memo_lcsubseq(struct fc_memo *, const char32_t *, int32_t);
+
+
+/*******************************************************************************
+ * Batched string metrics.
+ ******************************************************************************/
+
+/* Number of sequences compared at once. */
+#define FC_BATCH_SIZE 8
+
+/* Compares a reference sequence to several other sequences at once.
+ * Each sequence gets its own lane in vectors of 16-bit cells, and the matrices
+ * of all sequences are filled in together, one column at a time. This works
+ * best when the sequences of a batch have similar lengths, since all of them
+ * are processed up to the length of the longest one. Contrary to the memoized
+ * functions, nothing is reused from one call to the next.
+ */
+struct fc_batch {
+   enum fc_metric metric;
+   int32_t max_len;     /* Maximum possible length of a sequence. */
+   int32_t max_dist;    /* Maximum allowed distance (for Levenshtein). */
+   int32_t len1;        /* Length of the reference sequence. */
+   void *ids1;          /* Reference sequence, as character identifiers. */
+   void *ids2;          /* Compared sequences, as character identifiers. */
+   void *columns;       /* Last three columns of the matrices. */
+   char32_t *chars;     /* Characters > 0xff of the reference sequence. */
+   int32_t nchars;      /* Number of such characters. */
+};
+
+/* Initializer.
+ * metric: the metric to use.
+ * max_len: the maximum possible length of a sequence (or higher).
+ * max_dist: the maximum allowed edit distance (the lower, the faster). This
+ * parameter is only used if the chosen metric is Levenshtein or Damerau.
+ */
+void fc_batch_init(struct fc_batch *, enum fc_metric metric, int32_t max_len,
+                   int32_t max_dist);
+
+/* Destructor. */
+void fc_batch_fini(struct fc_batch *);
+
+/* Sets the reference sequence.
+ * Contrary to fc_memo_set_ref(), the sequence is not referenced afterwards.
+ */
+void fc_batch_set_ref(struct fc_batch *, const char32_t *seq1, int32_t len1);
+
+/* Compares the reference sequence to "nr" sequences, "nr" being at most
+ * FC_BATCH_SIZE, and writes the results to "ret". These are the values the
+ * memoized functions would return, except for Levenshtein and Damerau
+ * distances larger than the maximum allowed one, which are only guaranteed to
+ * be larger than it.
+ */
+void fc_batch_compute(struct fc_batch *, const char32_t *const seqs[],
+                      const int32_t lens[], int32_t nr, int32_t ret[]);
+
+#endif
+#line 6 "match.c"
+#line 1 "heap.h"
+#ifndef VB_HEAP_H
+#define VB_HEAP_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define VB_HEAP_INIT(array, max_elems) {.data = array, .max = max_elems}
+
+#define VB_HEAP_DECLARE(NAME, T, COMPAR)                                       \
+struct NAME {                                                                  \
+   T *data;                                                                    \
+   size_t size;                                                                \
+   size_t max;                                                                 \
+};                                                                             \
+                                                                               \
+static void NAME##_push(struct NAME *heap, T item)                             \
+{                                                                              \
+   assert(heap->max > 0);                                                      \
+   T *restrict data = heap->data;                                              \
+   const size_t max = heap->max;                                               \
+                                                                               \
+   if (heap->size < max) {                                                     \
+      size_t cur = heap->size;                                                 \
+      while (cur) {                                                            \
+         const size_t par = (cur - 1) >> 1;                                    \
+         if (COMPAR(data[par], item) >= 0)                                     \
+            break;                                                             \
+         data[cur] = data[par];                                                \
+         cur = par;                                                            \
+      }                                                                        \
+      data[cur] = item;                                                        \
+      heap->size++;                                                            \
+   } else if (COMPAR(item, data[0]) < 0) {                                     \
+      size_t cur = 0;                                                          \
+      const size_t lim = max >> 1;                                             \
+      while (cur < lim) {                                                      \
+         size_t child = (cur << 1) + 1;                                        \
+         if (child < max - 1 && COMPAR(data[child], data[child + 1]) < 0)      \
+            child++;                                                           \
+         if (COMPAR(item, data[child]) >= 0)                                   \
+            break;                                                             \
+         data[cur] = data[child];                                              \
+         cur = child;                                                          \
+      }                                                                        \
+      data[cur] = item;                                                        \
+   }                                                                           \
+}                                                                              \
+                                                                               \
+/* Removes the largest item and returns it. The heap must not be empty. */    \
+static T NAME##_pop(struct NAME *heap)                                         \
+{                                                                              \
+   assert(heap->size > 0);                                                     \
+   T *restrict data = heap->data;                                              \
+   const T top = data[0];                                                      \
+   const T item = data[--heap->size];                                          \
+   const size_t size = heap->size;                                             \
+                                                                               \
+   size_t cur = 0;                                                             \
+   for (;;) {                                                                  \
+      size_t child = (cur << 1) + 1;                                           \
+      if (child >= size)                                                       \
+         break;                                                                \
+      if (child + 1 < size && COMPAR(data[child], data[child + 1]) < 0)        \
+         child++;                                                              \
+      if (COMPAR(item, data[child]) >= 0)                                      \
+         break;                                                                \
+      data[cur] = data[child];                                                 \
+      cur = child;                                                             \
+   }                                                                           \
+   data[cur] = item;                                                           \
+   return top;                                                                 \
+}                                                                              \
+                                                                               \
+static int NAME##_qsort_cmp_(const void *a, const void *b)                     \
+{                                                                              \
+   return COMPAR(*(const T *)a, *(const T *)b);                                \
+}                                                                              \
+static void NAME##_finish(struct NAME *heap)                                   \
+{                                                                              \
+   qsort(heap->data, heap->size, sizeof *heap->data, NAME##_qsort_cmp_);       \
+}
+
+#endif
+#line 9 "match.c"
+
+static const char glob_chars[] = "*?[]";
+
+/*******************************************************************************
+ * Pagination.
+ ******************************************************************************/
+
+static void set_last_word(struct vb_match_ctx *c, const char *word, size_t len)
+{
+   struct vb_pagination *p = &c->query->pagination;
+
+   memcpy(p->last_word, word, len);
+   p->last_word[len] = '\0';
+   p->last_len = len;
+}
+
+/* Records the first word of the next results page. */
+static void suspend(struct vb_match_ctx *c, uint32_t pos,
+                    const char *word, size_t len)
+{
+   c->query->pagination.last_pos = pos;
+   set_last_word(c, word, len);
+}
+
+/* Reports a word of the current results page, along with its rank, if the
+ * search is ranked. Only fuzzy and top prefix searches rank words by weight
+ * or score, the others by position only.
+ */
+static void report_ranked(struct vb_match_ctx *c, const char *word, size_t len,
+                          uint32_t pos, int32_t weight, int32_t score,
+                          int32_t last_weight)
+{
+   if (c->rank) {
+      c->rank->slot++;
+      c->rank->weight = weight;
+      c->rank->score = score;
+      c->rank->word = word;
+      c->rank->len = len;
+      c->rank->pos = pos;
+      c->rank->last_weight = last_weight;
+      c->rank->after = true;
+   }
+   c->handler(c->arg, word, len);
+}
+
+/* Same as above, for searches that rank words by position. */
+static void report(struct vb_match_ctx *c, const char *word, size_t len,
+                   uint32_t pos)
+{
+   if (c->rank) {
+      c->rank->slot++;
+      c->rank->weight = 0;
+      c->rank->score = 0;
+      c->rank->word = word;
+      c->rank->len = len;
+      c->rank->pos = pos;
+      c->rank->last_weight = 0;
+      c->rank->after = false;
+   }
+   c->handler(c->arg, word, len);
+}
+
+/* Checks, before looking at a word, whether the limits of the query are
+ * reached. The first word is always looked at, so that searches progress. The
+ * clock and the cancellation flag are only checked every 64 words.
+ */
+static bool interrupted(struct vb_match_ctx *c)
+{
+   const struct vb_limits *l = c->limits;
+   if (!l)
+      return false;
+
+   const uint64_t words = c->words++;
+   if (!words)
+      return false;
+   if ((l->max_words && words >= l->max_words)
+       || (l->max_cells && c->cells >= l->max_cells))
+      return true;
+   if (words % 64)
+      return false;
+   return (l->cancel && *l->cancel)
+          || (l->max_ns && vb_now_ns() >= c->deadline);
+}
+
+/* Initializes an iterator at the first word of the current results page. */
+static uint32_t resume(struct vb_iter *it, const struct vb_lexicon *lex,
+                       const struct vb_match_ctx *c)
+{
+   const struct vb_pagination *p = &c->query->pagination;
+
+   if (c->numbered)
+      return vb_iter_initn(it, lex, p->last_pos);
+   vb_iter_inits(it, lex, p->last_word, p->last_len);
+   return p->last_pos;
+}
+
+
+/*******************************************************************************
+ * Pattern matching.
+ ******************************************************************************/
+
+static int match_exact(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   if (vb_lexicon_contains(lex, c->str, c->len))
+      report(c, c->str, c->len, 0);
+   else
+      VB_STAT(c, rejected_pattern, 1);
+   VB_STAT(c, words_visited, 1);
+   c->query->pagination.last_page = true;
+   return VB_OK;
+}
+
+static int match_prefix(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   bool first_page;
+   struct vb_iter it;
+   uint32_t pos = c->query->pagination.last_pos;
+
+   if (pos) {
+      first_page = false;
+      resume(&it, lex, c);
+   } else {
+      first_page = true;
+      pos = vb_iter_initp(&it, lex, c->str, c->len);
+   }
+
+   const char *term;
+   size_t len;
+   size_t page_size = c->query->page_size;
+   while ((term = vb_iter_next(&it, &len))) {
+      if (!first_page && (len < c->len || memcmp(c->str, term, c->len)))
+         break;
+      if (interrupted(c)) {
+         suspend(c, pos, term, len);
+         return VB_EINTR;
+      }
+      if (!page_size--) {
+         suspend(c, pos, term, len);
+         return VB_OK;
+      } else {
+         report(c, term, len, pos);
+      }
+      VB_STAT(c, words_visited, 1);
+      pos++;
+   }
+   c->query->pagination.last_page = true;
+   return VB_OK;
+}
+
+/* Substring and suffix matching over the flat copy of a lexicon. */
+static int match_flat(const struct vb_arena *arena, struct vb_match_ctx *c,
+                      const char *str, size_t len)
+{
+   uint32_t pos = c->query->pagination.last_pos;
+   uint32_t idx = pos ? pos - 1 : 0;
+   /* Words from "from" to the one found, excluded, didn't match. */
+   uint32_t from = idx;
+
+   size_t page_size = c->query->page_size;
+   while ((idx = vb_arena_find(arena, idx, str, len)) < arena->size) {
+      const char *term = &arena->words[arena->offsets[idx]];
+      size_t term_len = arena->offsets[idx + 1] - arena->offsets[idx] - 1;
+      VB_STAT(c, words_visited, idx - from);
+      VB_STAT(c, rejected_pattern, idx - from);
+      /* Words are looked for a match at a time, so the words skipped in
+       * between count towards the limits, but can't interrupt the search.
+       */
+      c->words += idx - from;
+      if (interrupted(c)) {
+         suspend(c, idx + 1, term, term_len);
+         return VB_EINTR;
+      }
+      if (!page_size--) {
+         suspend(c, idx + 1, term, term_len);
+         return VB_OK;
+      }
+      report(c, term, term_len, idx + 1);
+      VB_STAT(c, words_visited, 1);
+      from = ++idx;
+   }
+   VB_STAT(c, words_visited, arena->size - from);
+   VB_STAT(c, rejected_pattern, arena->size - from);
+   c->query->pagination.last_page = true;
+   return VB_OK;
+}
+
+static int match_substr(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   const struct vb_arena *arena = vb_lexicon_arena(lex);
+   if (arena)
+      return match_flat(arena, c, c->str, c->len);
+
+   struct vb_iter it;
+   uint32_t pos = c->query->pagination.last_pos;
+   if (pos) {
+      resume(&it, lex, c);
+   } else {
+      pos = vb_iter_init(&it, lex);
+   }
+
+   const char *term;
+   size_t len;
+   size_t page_size = c->query->page_size;
+   while ((term = vb_iter_next(&it, &len))) {
+      if (interrupted(c)) {
+         suspend(c, pos, term, len);
+         return VB_EINTR;
+      }
+      if (len >= c->len && strstr(term, c->str)) {
+         if (!page_size--) {
+            suspend(c, pos, term, len);
+            return VB_OK;
+         } else {
+            report(c, term, len, pos);
+         }
+      } else {
+         VB_STAT(c, rejected_pattern, 1);
+      }
+      VB_STAT(c, words_visited, 1);
+      pos++;
+   }
+   c->query->pagination.last_page = true;
+   return VB_OK;
+}
+
+static int match_suffix(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   const struct vb_arena *arena = vb_lexicon_arena(lex);
+   if (arena) {
+      /* Look for the suffix followed by the nul byte that ends each word. */
+      char str[MN_MAX_WORD_LEN + 1];
+      memcpy(str, c->str, c->len);
+      str[c->len] = '\0';
+      return match_flat(arena, c, str, c->len + 1);
+   }
+
+   uint32_t pos = c->query->pagination.last_pos;
+   struct vb_iter it;
+   if (pos) {
+      resume(&it, lex, c);
+   } else {
+      pos = vb_iter_init(&it, lex);
+   }
+
+   const char *term;
+   size_t len;
+   size_t page_size = c->query->page_size;
+   while ((term = vb_iter_next(&it, &len))) {
+      if (interrupted(c)) {
+         suspend(c, pos, term, len);
+         return VB_EINTR;
+      }
+      if (len >= c->len && !memcmp(c->str, &term[len - c->len], c->len)) {
+         if (!page_size--) {
+            suspend(c, pos, term, len);
+            return VB_OK;
+         } else {
+            report(c, term, len, pos);
+         }
+      } else {
+         VB_STAT(c, rejected_pattern, 1);
+      }
+      VB_STAT(c, words_visited, 1);
+      pos++;
+   }
+   c->query->pagination.last_page = true;
+   return VB_OK;
+}
+
+static int match_glob(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   struct vb_iter it;
+   uint32_t pos = c->query->pagination.last_pos;
+   size_t pfx_len = strcspn(c->str, glob_chars);
+   if (pos) {
+      resume(&it, lex, c);
+   } else {
+      pos = vb_iter_initp(&it, lex, c->str, pfx_len);
+   }
+
+   int ret = VB_OK;
+   struct vb_glob glob;
+   /* The prefix must be valid too, so that it ends where a character of the
+    * matching words does.
+    */
+   char32_t pfx[MN_MAX_WORD_LEN + 1];
+   const int32_t pfx_chars = vb_utf8_decode(pfx, c->str, pfx_len);
+   if (pfx_chars < 0
+       || vb_glob_compile(&glob, &c->str[pfx_len], c->len - pfx_len)) {
+      ret = VB_EQUTF8;
+      goto fini;
+   }
+
+   const char *term;
+   size_t len;
+   size_t page_size = c->query->page_size;
+   while ((term = vb_iter_next(&it, &len))) {
+      if (pfx_len && (len < pfx_len || memcmp(term, c->str, pfx_len)))
+         break;
+      if (interrupted(c)) {
+         suspend(c, pos, term, len);
+         ret = VB_EINTR;
+         break;
+      }
+      int match = vb_glob_match_iter(&glob, &it, term, len,
+                                     pfx_len, pfx_chars);
+      if (match < 0) {
+         ret = VB_ELUTF8;
+         goto fini;
+      }
+      if (match) {
+         if (!page_size--) {
+            suspend(c, pos, term, len);
+            VB_STAT(c, utf8_bytes, it.utf8_bytes);
+            return VB_OK;
+         } else {
+            report(c, term, len, pos);
+         }
+      } else if (c->stats) {
+         /* Find out which of the two filters rejected the word. */
+         if (!glob.invalid
+             && !vb_glob_prefilter(&glob, &term[pfx_len], len - pfx_len))
+            c->stats->rejected_prefilter++;
+         else
+            c->stats->rejected_pattern++;
+      }
+      VB_STAT(c, words_visited, 1);
+      pos++;
+   }
+
+fini:
+   VB_STAT(c, utf8_bytes, it.utf8_bytes);
+   if (ret != VB_EINTR)
+      c->query->pagination.last_page = true;
+   return ret;
+}
+
+/* DFA states along the path of the automaton being walked. */
+struct regex_walk {
+   const struct vb_regex *re;
+   uint64_t pruned;     /* Transitions rejected so far. */
+   uint32_t states[MN_MAX_WORD_LEN + 1];
+};
+
+static int regex_accept(void *arg, size_t depth, uint8_t chr)
+{
+   struct regex_walk *w = arg;
+
+   w->states[depth + 1] = vb_regex_step(w->re, w->states[depth], chr);
+   if (w->states[depth + 1])
+      return 1;
+   w->pruned++;
+   return 0;
+}
+
+/* Walks the DFA of the expression along with the automaton, skipping the
+ * branches of the automaton from which the DFA can't reach an accepting state.
+ * Words reached otherwise, as well as added words, are still checked.
+ */
+static int match_regex(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   struct vb_regex re;
+   int ret = vb_regex_compile(&re, c->str, c->len, c->fold);
+   if (ret) {
+      c->query->pagination.last_page = true;
+      return ret;
+   }
+
+   struct regex_walk w = {.re = &re, .states = {VB_REGEX_START}};
+   struct vb_iter it;
+   if (c->query->pagination.last_pos) {
+      resume(&it, lex, c);
+      /* Walk the DFA up to the transition the iteration restarts from. */
+      const struct mini_iter *mi = &it.it;
+      if (mi->positions[mi->depth])
+         for (size_t i = 0; i < mi->depth; i++)
+            w.states[i + 1] = vb_regex_step(&re, w.states[i], mi->word[i]);
+   } else {
+      vb_iter_init(&it, lex);
+   }
+   vb_iter_filter(&it, regex_accept, &w);
+
+   const char *term;
+   size_t len;
+   size_t page_size = c->query->page_size;
+   while ((term = vb_iter_next(&it, &len))) {
+      if (interrupted(c)) {
+         struct vb_iter pos_it;
+         suspend(c, vb_iter_inits(&pos_it, lex, term, len), term, len);
+         VB_STAT(c, pruned_branches, w.pruned);
+         vb_regex_fini(&re);
+         return VB_EINTR;
+      }
+      /* Words of the base automaton are returned in the iterator buffer, and
+       * the DFA was walked along them. Added words must be checked from
+       * scratch.
+       */
+      if (term == it.it.word ? !re.accepting[w.states[len]]
+                             : !vb_regex_match(&re, term, len)) {
+         VB_STAT(c, words_visited, 1);
+         VB_STAT(c, rejected_pattern, 1);
+         continue;
+      }
+      if (!page_size--) {
+         /* Words in between were skipped, so we have to look for the
+          * ordinal of this one.
+          */
+         struct vb_iter pos_it;
+         suspend(c, vb_iter_inits(&pos_it, lex, term, len), term, len);
+         VB_STAT(c, pruned_branches, w.pruned);
+         vb_regex_fini(&re);
+         return VB_OK;
+      }
+      /* The ordinal of the word is only looked for if it is recorded. */
+      struct vb_iter pos_it;
+      const uint32_t pos = c->rank ? vb_iter_inits(&pos_it, lex, term, len) : 0;
+      report(c, term, len, pos);
+      VB_STAT(c, words_visited, 1);
+   }
+
+   c->query->pagination.last_page = true;
+   VB_STAT(c, pruned_branches, w.pruned);
+   vb_regex_fini(&re);
+   return VB_OK;
+}
+
+
+/* Finds the indexes [first, end) of the words of the base automaton of a
+ * lexicon that start with a prefix.
+ */
+static void prefix_range(const struct vb_lexicon *lex,
+                         const char *prefix, size_t len,
+                         uint32_t *first, uint32_t *end)
+{
+   struct mini_iter it;
+   *first = mn_iter_initp(&it, lex->base, prefix, len);
+   if (!*first) {
+      *end = 0;
+      return;
+   }
+   (*first)--;
+
+   /* The first word that doesn't start with the prefix is the first one that
+    * is >= the prefix with its last byte incremented, once trailing 0xff bytes
+    * are removed.
+    */
+   char succ[MN_MAX_WORD_LEN];
+   memcpy(succ, prefix, len);
+   while (len && (uint8_t)succ[len - 1] == 0xff)
+      len--;
+   uint32_t pos = 0;
+   if (len) {
+      succ[len - 1]++;
+      pos = mn_iter_inits(&it, lex->base, succ, len);
+   }
+   *end = pos ? pos - 1 : lex->base_size;
+}
+
+/* A range of word indexes, ranked by the best word it contains. */
+struct top_range {
+   uint32_t start, end;
+   uint32_t best;
+   int32_t score;
+};
+
+static int top_range_cmp(const struct top_range a, const struct top_range b)
+{
+   if (a.score != b.score)
+      return a.score < b.score ? -1 : 1;
+   return a.best > b.best ? -1 : a.best < b.best;
+}
+
+VB_HEAP_DECLARE(top_heap, struct top_range, top_range_cmp)
+
+static int top_heap_add(struct top_heap *heap, struct vb_match_ctx *c,
+                        const struct vb_scores *s, uint32_t start, uint32_t end)
+{
+   if (start == end)
+      return VB_OK;
+   if (heap->size == heap->max) {
+      size_t max = heap->max * 2;
+      struct top_range *data = realloc(heap->data, max * sizeof *data);
+      if (!data)
+         return VB_ENOMEM;
+      heap->data = data;
+      heap->max = max;
+   }
+   const uint32_t best = vb_scores_best(s, start, end);
+   top_heap_push(heap, (struct top_range){
+      .start = start,
+      .end = end,
+      .best = best,
+      .score = s->scores[best],
+   });
+   VB_STAT(c, heap_pushes, 1);
+   return VB_OK;
+}
+
+/* Words are taken best first from a heap of ranges of words. The range of
+ * the words that start with the query string goes first on the heap. Each
+ * time a range is taken, its best word is reported, and the words on either
+ * side of it are put back on the heap as two new ranges. Taking a word thus
+ * costs a few logarithmic operations, whatever the size of the range.
+ * Pages after the first one are found the same way, skipping the words up to
+ * the last one reported, which is recorded in the pagination data.
+ */
+static int match_top_prefix(const struct vb_lexicon *lex,
+                            struct vb_match_ctx *c)
+{
+   struct vb_pagination *p = &c->query->pagination;
+   const struct vb_scores *scores = vb_lexicon_scores(lex);
+   if (!scores) {
+      p->last_page = true;
+      return VB_ESCORES;
+   }
+
+   struct top_heap heap = VB_HEAP_INIT(malloc(64 * sizeof *heap.data), 64);
+   if (!heap.data) {
+      p->last_page = true;
+      return VB_ENOMEM;
+   }
+
+   uint32_t first, end;
+   prefix_range(lex, c->str, c->len, &first, &end);
+   int ret = top_heap_add(&heap, c, scores, first, end);
+
+   const bool first_page = p->last_pos == 0;
+   struct top_range last = {
+      .best = p->last_pos - 1,
+      .score = p->last_weight,
+   };
+   size_t page_size = c->query->page_size;
+   char word[MN_MAX_WORD_LEN + 1];
+   while (!ret && heap.size) {
+      const struct top_range r = top_heap_pop(&heap);
+      if ((ret = top_heap_add(&heap, c, scores, r.start, r.best))
+          || (ret = top_heap_add(&heap, c, scores, r.best + 1, r.end)))
+         break;
+      if (!first_page && top_range_cmp(r, last) >= 0) {
+         VB_STAT(c, words_visited, 1);
+         VB_STAT(c, rejected_page, 1);
+         continue;
+      }
+      /* Words are only counted once past the ones of previous pages, which
+       * are skipped anew by each call.
+       */
+      const bool stop = interrupted(c);
+      if (stop || !page_size--) {
+         p->last_pos = last.best + 1;
+         p->last_weight = last.score;
+         free(heap.data);
+         return stop ? VB_EINTR : VB_OK;
+      }
+      const size_t len = mn_extract(lex->base, r.best + 1, word);
+      report_ranked(c, word, len, r.best + 1, 0, r.score, r.score);
+      VB_STAT(c, words_visited, 1);
+      VB_STAT(c, extracts, 1);
+      last = r;
+   }
+   free(heap.data);
+   p->last_page = true;
+   return ret;
+}
+
+
+/*******************************************************************************
+ * Fuzzy matching.
+ ******************************************************************************/
+
+/* Turns the value of a metric into a weight. The lower the weight, the better
+ * the match. Candidates that are too far from the query get INT32_MAX.
+ */
+static int32_t fuzzy_weight(enum fc_metric metric, int32_t val,
+                            int32_t len1, int32_t len2, int32_t max_dist)
+{
+   switch (metric) {
+   case FC_LEVENSHTEIN: case FC_DAMERAU:
+      return val > max_dist ? INT32_MAX : val;
+   case FC_LCSUBSTR:
+      return -val;
+   default:
+      return -2. * val / (double)(len1 + len2) * 1000.;
+   }
+}
+
+static int32_t levenshtein_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
+{
+   return fuzzy_weight(FC_LEVENSHTEIN, fc_memo_levenshtein(m, seq, len),
+                       m->len1, len, m->max_dist);
+}
+
+static int32_t damerau_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
+{
+   return fuzzy_weight(FC_DAMERAU, fc_memo_damerau(m, seq, len),
+                       m->len1, len, m->max_dist);
+}
+
+static int32_t lcsubstr_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
+{
+   return fuzzy_weight(FC_LCSUBSTR, fc_memo_lcsubstr(m, seq, len),
+                       m->len1, len, m->max_dist);
+}
+
+static int32_t lcsubseq_compute(struct fc_memo *m, const char32_t *seq, int32_t len)
+{
+   return fuzzy_weight(FC_LCSUBSEQ, fc_memo_lcsubseq(m, seq, len),
+                       m->len1, len, m->max_dist);
+}
+
+/* Candidates are ranked by weight, then by decreasing score, if the lexicon
+ * has scores, then by position. Standard automata have no word ordinals, so we
+ * keep the words themselves, and compare them instead, which gives the same
+ * order.
+ */
+struct vb_match_infos {
+   uint32_t pos;
+   int32_t weight;
+   int32_t score;
+   const char *word;    /* Standard automata only. */
+   size_t len;
+};
+
+static int vb_match_infos_cmp(const struct vb_match_infos a, const struct vb_match_infos b)
+{
+   if (a.weight != b.weight)
+      return a.weight < b.weight ? -1 : 1;
+   if (a.score != b.score)
+      return a.score > b.score ? -1 : 1;
+   if (a.word)
+      return lmemcmp(a.word, a.len, b.word, b.len);
+   return a.pos < b.pos ? -1 : a.pos > b.pos;
+}
+
+VB_HEAP_DECLARE(vb_heap, struct vb_match_infos, vb_match_infos_cmp)
+
+/* Words of a flattened lexicon are scored FC_BATCH_SIZE at a time. Since
+ * the words of a batch are all processed up to the length of the longest one,
+ * they are grouped by length beforehand.
+ */
+struct vb_batch {
+   struct fc_batch fc;
+   const struct vb_arena *arena;
+   const int32_t *scores;     /* NULL if the lexicon has none. */
+   struct vb_stats *stats;    /* Same as in the query. */
+   struct vb_match_ctx *ctx;
+   enum fc_metric metric;
+   int32_t len1;
+   int32_t max_dist;
+   uint8_t nr[MN_MAX_WORD_LEN + 1];
+   uint32_t pos[MN_MAX_WORD_LEN + 1][FC_BATCH_SIZE];
+};
+
+/* Scores the words of length "len2" that are waiting, and pushes those that
+ * qualify on a heap. Returns the number of such words.
+ */
+static size_t vb_batch_flush(struct vb_batch *b, int32_t len2, struct vb_heap *heap,
+                             bool first_page, struct vb_match_infos last_min)
+{
+   char32_t bufs[FC_BATCH_SIZE][MN_MAX_WORD_LEN + 1];
+   const char32_t *seqs[FC_BATCH_SIZE] = {0};
+   int32_t lens[FC_BATCH_SIZE] = {0}, vals[FC_BATCH_SIZE];
+   const int32_t nr = b->nr[len2];
+   size_t count = 0;
+
+   for (int32_t k = 0; k < nr; k++)
+      seqs[k] = vb_arena_chars(b->arena, b->pos[len2][k], bufs[k], &lens[k]);
+   fc_batch_compute(&b->fc, seqs, lens, nr, vals);
+   VB_STAT(b, dp_cells, (uint64_t)b->len1 * len2 * nr);
+   b->ctx->cells += (uint64_t)b->len1 * len2 * nr;
+   for (int32_t k = 0; k < nr; k++) {
+      struct vb_match_infos x = {
+         .pos = b->pos[len2][k] + 1,
+         .weight = fuzzy_weight(b->metric, vals[k], b->len1, len2, b->max_dist),
+         .score = b->scores ? b->scores[b->pos[len2][k]] : 0,
+      };
+      if (x.weight == INT32_MAX) {
+         VB_STAT(b, rejected_distance, 1);
+      } else if (first_page || vb_match_infos_cmp(x, last_min) > 0) {
+         count++;
+         vb_heap_push(heap, x);
+      } else {
+         VB_STAT(b, rejected_page, 1);
+      }
+   }
+   VB_STAT(b, heap_pushes, count);
+   b->nr[len2] = 0;
+   return count;
+}
+
+/* Scores the words at positions [pos, end) of a flattened lexicon. Returns the
+ * number of words pushed on the heap. If the search is interrupted, "pos" is
+ * set to the position of the first word that remains to be scored.
+ */
+static size_t vb_batch_run(struct vb_batch *b, uint32_t *posp, uint32_t end,
+                           struct vb_heap *heap, bool first_page,
+                           struct vb_match_infos last_min)
+{
+   const uint32_t *offsets = b->arena->char_offsets;
+   const bool bounded = b->metric == FC_LEVENSHTEIN || b->metric == FC_DAMERAU;
+   size_t count = 0;
+   uint32_t pos;
+
+   for (pos = *posp; pos < end; pos++) {
+      if (interrupted(b->ctx))
+         break;
+      const int32_t len2 = offsets[pos + 1] - offsets[pos];
+      /* An edit distance is at least the difference in length. */
+      if (bounded && abs(len2 - b->len1) > b->max_dist) {
+         VB_STAT(b, rejected_length, 1);
+         continue;
+      }
+      b->pos[len2][b->nr[len2]] = pos;
+      if (++b->nr[len2] == FC_BATCH_SIZE)
+         count += vb_batch_flush(b, len2, heap, first_page, last_min);
+   }
+   for (int32_t len2 = 0; len2 <= MN_MAX_WORD_LEN; len2++)
+      if (b->nr[len2])
+         count += vb_batch_flush(b, len2, heap, first_page, last_min);
+   VB_STAT(b, words_visited, pos - *posp);
+   *posp = pos;
+   return count;
+}
+
+/* Progress of an interrupted fuzzy search: the best candidates found so far,
+ * by ordinal and weight, the number of candidates that qualified, and the
+ * range of word indexes that remains to be scored. An "end" of zero stands for
+ * the end of the words that share the required prefix.
+ */
+struct vb_partial {
+   bool active;
+   uint32_t next, end;
+   uint32_t count;
+   uint32_t size;
+   struct {
+      uint32_t pos;
+      int32_t weight;
+   } cands[VB_MAX_PAGE_SIZE];
+};
+
+void vb_limits_fini(struct vb_limits *l)
+{
+   free(l->partial);
+   l->partial = NULL;
+}
+
+static int match_fuzzy(const struct vb_lexicon *lex, struct vb_match_ctx *c)
+{
+   static const int metrics[] = {
+      [VB_LEVENSHTEIN] = FC_LEVENSHTEIN,
+      [VB_DAMERAU] = FC_DAMERAU,
+      [VB_LCSUBSTR] = FC_LCSUBSTR,
+      [VB_LCSUBSEQ] = FC_LCSUBSEQ,
+   };
+
+   static int32_t (*const compute_fns[])(struct fc_memo *, const char32_t *, int32_t) = {
+      [FC_LEVENSHTEIN] = levenshtein_compute,
+      [FC_DAMERAU] = damerau_compute,
+      [FC_LCSUBSTR] = lcsubstr_compute,
+      [FC_LCSUBSEQ] = lcsubseq_compute,
+   };
+
+   char32_t seq1[MN_MAX_WORD_LEN + 1];
+   int32_t len1 = vb_utf8_decode(seq1, c->str, c->len);
+   if (len1 < 0) {
+      c->query->pagination.last_page = true;
+      return VB_EQUTF8;
+   }
+
+   size_t pfx_len = 0;
+   if (c->query->prefix_len && !c->query->pagination.last_pos && c->mode != VB_LCSUBSTR) {
+      /* If the required common prefix length is longer than the reference word,
+       * there could still be an exact match.
+       */
+      if (c->query->prefix_len > len1)
+         return match_exact(lex, c);
+      pfx_len = vb_utf8_bytes(seq1, c->query->prefix_len);
+   }
+
+   /* If the lexicon has been flattened, candidates are already decoded, so
+    * we don't need to walk the automaton, and can score several of them at
+    * once.
+    */
+   const struct vb_arena *arena = vb_lexicon_arena(lex);
+   if (arena && !arena->chars)
+      arena = NULL;
+
+   /* Searches are resumed from the index of the word they stopped at, in
+    * the range of the words that share the required prefix, which is
+    * recomputed for flattened lexicons. Standard automata have no word
+    * indexes, so their searches are not interrupted.
+    */
+   struct vb_partial *part = c->limits ? c->limits->partial : NULL;
+   const bool resumed = part && part->active
+                        && c->query->pagination.interrupted;
+   c->query->pagination.interrupted = false;
+   if (!c->numbered)
+      c->limits = NULL;
+
+   struct vb_iter it;
+   uint32_t pos = 0, end = 0;
+   if (resumed && arena) {
+      pos = part->next;
+      end = part->end;
+      if (!end) {
+         end = arena->size;
+         if (pfx_len)
+            vb_arena_range(arena, c->str, pfx_len, &(uint32_t){0}, &end);
+      }
+   } else if (resumed) {
+      pos = vb_iter_initn(&it, lex, part->next + 1);
+   } else if (arena) {
+      end = arena->size;
+      if (pfx_len)
+         vb_arena_range(arena, c->str, pfx_len, &pos, &end);
+   } else if (pfx_len) {
+      pos = vb_iter_initp(&it, lex, c->str, pfx_len);
+   } else {
+      pos = vb_iter_init(&it, lex);
+   }
+
+   enum fc_metric metric = metrics[c->mode];
+   const bool bounded = metric == FC_LEVENSHTEIN || metric == FC_DAMERAU;
+   const char *term;
+   size_t len;
+   size_t count = 0;
+   bool first_page = c->query->pagination.last_pos == 0;
+   int ret = VB_OK;
+
+   struct vb_match_infos cands[VB_MAX_PAGE_SIZE];
+   struct vb_heap heap = VB_HEAP_INIT(cands, c->query->page_size);
+
+   /* Words of the candidates, for standard automata. There is a spare slot for
+    * the word of a new candidate, which gets the slot of the evicted one.
+    */
+   char words[VB_MAX_PAGE_SIZE + 1][MN_MAX_WORD_LEN + 1];
+   char *spare = words[VB_MAX_PAGE_SIZE];
+
+   struct vb_match_infos last_min = {
+      .pos = c->query->pagination.last_pos,
+      .weight = c->query->pagination.last_weight,
+   };
+   if (!c->numbered) {
+      last_min.word = c->query->pagination.last_word;
+      last_min.len = c->query->pagination.last_len;
+   }
+   const struct vb_scores *s = vb_lexicon_scores(lex);
+   const int32_t *scores = s ? s->scores : NULL;
+   if (scores && last_min.pos && last_min.pos <= s->size)
+      last_min.score = scores[last_min.pos - 1];
+
+   if (resumed) {
+      count = part->count;
+      heap.size = part->size < heap.max ? part->size : heap.max;
+      for (size_t i = 0; i < heap.size; i++) {
+         cands[i] = (struct vb_match_infos){
+            .pos = part->cands[i].pos,
+            .weight = part->cands[i].weight,
+            .score = scores ? scores[part->cands[i].pos - 1] : 0,
+         };
+      }
+   }
+   if (part)
+      part->active = false;
+
+   if (arena) {
+      struct vb_batch b = {
+         .arena = arena,
+         .scores = scores,
+         .stats = c->stats,
+         .ctx = c,
+         .metric = metric,
+         .len1 = len1,
+         .max_dist = c->query->max_dist,
+      };
+      fc_batch_init(&b.fc, metric, MN_MAX_WORD_LEN, c->query->max_dist);
+      fc_batch_set_ref(&b.fc, seq1, len1);
+      count += vb_batch_run(&b, &pos, end, &heap, first_page, last_min);
+      fc_batch_fini(&b.fc);
+      if (pos < end)
+         ret = VB_EINTR;
+   } else {
+      struct fc_memo m;
+      fc_memo_init(&m, metric, MN_MAX_WORD_LEN, c->query->max_dist);
+      fc_memo_set_ref(&m, seq1, len1);
+      m.compute = compute_fns[metric];
+      const size_t restored = count;
+
+      while ((term = vb_iter_next(&it, &len))) {
+         /* Only the first call starts off with an iterator that stops at the
+          * end of the prefix.
+          */
+         if (resumed && pfx_len && (len < pfx_len || memcmp(term, c->str, pfx_len)))
+            break;
+         if (interrupted(c)) {
+            ret = VB_EINTR;
+            break;
+         }
+         int32_t len2;
+         const char32_t *seq2 = vb_iter_chars(&it, term, len, &len2);
+         if (!seq2) {
+            ret = VB_ELUTF8;
+            break;
+         }
+         struct vb_match_infos x = {
+            .pos = pos,
+            .weight = fc_memo_compute(&m, seq2, len2),
+            .score = scores ? scores[pos - 1] : 0,
+            .word = c->numbered ? NULL : term,
+            .len = len,
+         };
+         c->cells = m.cells;
+         if (x.weight == INT32_MAX) {
+            /* The memoized functions check the length difference first. */
+            if (c->stats && bounded && abs(len2 - len1) > c->query->max_dist)
+               c->stats->rejected_length++;
+            else
+               VB_STAT(c, rejected_distance, 1);
+         } else if (first_page || vb_match_infos_cmp(x, last_min) > 0) {
+            count++;
+            if (c->numbered) {
+               vb_heap_push(&heap, x);
+            } else if (heap.size < heap.max) {
+               x.word = memcpy(words[heap.size], term, len + 1);
+               vb_heap_push(&heap, x);
+            } else if (vb_match_infos_cmp(x, heap.data[0]) < 0) {
+               x.word = memcpy(spare, term, len + 1);
+               spare = (char *)heap.data[0].word;
+               vb_heap_push(&heap, x);
+            }
+         } else {
+            VB_STAT(c, rejected_page, 1);
+         }
+         VB_STAT(c, words_visited, 1);
+         pos++;
+      }
+      if (c->stats) {
+         c->stats->dp_cells += m.cells;
+         c->stats->memo_hits += m.hits;
+         c->stats->utf8_bytes += it.utf8_bytes;
+         c->stats->heap_pushes += count - restored;
+      }
+      fc_memo_fini(&m);
+      if (ret && ret != VB_EINTR) {
+         c->query->pagination.last_page = true;
+         return ret;
+      }
+   }
+
+   if (ret == VB_EINTR) {
+      if (!part)
+         part = c->limits->partial = malloc(sizeof *part);
+      if (!part)
+         return VB_ENOMEM;
+      c->query->pagination.interrupted = true;
+      part->active = true;
+      part->next = arena ? pos : pos - 1;
+      part->end = arena ? end : 0;
+      part->count = count;
+      part->size = heap.size;
+      for (size_t i = 0; i < heap.size; i++) {
+         part->cands[i].pos = heap.data[i].pos;
+         part->cands[i].weight = heap.data[i].weight;
+      }
+      return VB_EINTR;
+   }
+
+   vb_heap_finish(&heap);
+
+   const uint64_t start = c->stats ? vb_now_ns() : 0;
+   for (size_t i = 0; i < heap.size; i++) {
+      term = heap.data[i].word;
+      len = heap.data[i].len;
+      if (!term && arena) {
+         term = &arena->words[arena->offsets[heap.data[i].pos - 1]];
+         len = arena->offsets[heap.data[i].pos] - arena->offsets[heap.data[i].pos - 1] - 1;
+      } else if (!term) {
+         len = vb_lexicon_extract(lex, heap.data[i].pos, (char *)seq1);
+         term = (const char *)seq1;
+         VB_STAT(c, extracts, 1);
+      }
+      report_ranked(c, term, len, heap.data[i].pos, heap.data[i].weight,
+                    heap.data[i].score, heap.data[i].weight);
+      if (i == heap.size - 1) {
+         c->query->pagination.last_pos = heap.data[i].pos;
+         c->query->pagination.last_weight = heap.data[i].weight;
+         set_last_word(c, term, len);
+      }
+   }
+   if (c->stats)
+      c->stats->report_ns += vb_now_ns() - start;
+   if (count <= heap.size)
+      c->query->pagination.last_page = true;
+   return VB_OK;
+}
+
+int (*const vb_match_funcs[])(const struct vb_lexicon *, struct vb_match_ctx *) = {
+   [VB_EXACT] = match_exact,
+   [VB_PREFIX] = match_prefix,
+   [VB_SUBSTR] = match_substr,
+   [VB_SUFFIX] = match_suffix,
+   [VB_GLOB] = match_glob,
+   [VB_LEVENSHTEIN] = match_fuzzy,
+   [VB_DAMERAU] = match_fuzzy,
+   [VB_LCSUBSTR] = match_fuzzy,
+   [VB_LCSUBSEQ] = match_fuzzy,
+   [VB_REGEX] = match_regex,
+   [VB_TOP_PREFIX] = match_top_prefix,
+};
+#line 1 "metrics.c"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+/* Histogram buckets, see VB_HIST_BUCKETS. */
+#define VB_HIST_SUB_BITS 3
+#define VB_HIST_SUB (1 << VB_HIST_SUB_BITS)
+#define VB_HIST_MAX_BIT 39
+
+_Static_assert(VB_HIST_BUCKETS == (VB_HIST_MAX_BIT - 1) * VB_HIST_SUB,
+              "histogram size mismatch");
+
+static size_t vb_hist_bucket(uint64_t ns)
+{
+   if (ns < 2 * VB_HIST_SUB)
+      return ns;
+   int bit = 0;
+   while (ns >> (bit + 1))
+      bit++;
+   if (bit > VB_HIST_MAX_BIT)
+      return VB_HIST_BUCKETS - 1;
+   const size_t sub = (ns >> (bit - VB_HIST_SUB_BITS)) & (VB_HIST_SUB - 1);
+   return (bit - VB_HIST_SUB_BITS + 1) * VB_HIST_SUB + sub;
+}
+
+/* Largest latency of a bucket. */
+static uint64_t vb_hist_bucket_max(size_t i)
+{
+   if (i < 2 * VB_HIST_SUB)
+      return i;
+   const int bit = i / VB_HIST_SUB + VB_HIST_SUB_BITS - 1;
+   const uint64_t sub = i % VB_HIST_SUB;
+   return ((VB_HIST_SUB + sub + 1) << (bit - VB_HIST_SUB_BITS)) - 1;
+}
+
+/* The counters of a thread are only ever written by this thread, but other
+ * threads read them when taking a snapshot, hence atomic types, which are
+ * only accessed with relaxed loads and stores, and no read-modify-write.
+ */
+struct vb_hist_counters {
+   atomic_uint_least64_t count;
+   atomic_uint_least64_t sum_ns;
+   atomic_uint_least64_t max_ns;
+   atomic_uint_least64_t buckets[VB_HIST_BUCKETS];
+};
+
+/* Metrics of a thread. Blocks are put at the head of a list, and never freed
+ * nor removed from it, so the list can be walked without locking.
+ */
+struct vb_thread_metrics {
+   struct vb_thread_metrics *next;
+   atomic_bool in_use;        /* Whether a running thread owns this block. */
+   atomic_uint_least64_t slow_queries;
+   struct vb_hist_counters latency[VB_MODES_NR][VB_METRICS_PAGES];
+};
+
+static atomic_bool enabled;
+static _Atomic(struct vb_thread_metrics *) all_threads;
+static _Thread_local struct vb_thread_metrics *this_thread;
+
+/* Releases the block of a thread when it exits. */
+static tss_t exit_key;
+static bool exit_key_ok;
+
+static once_flag init_once = ONCE_FLAG_INIT;
+
+static mtx_t hook_lock;
+static atomic_uint_least64_t slow_threshold = UINT64_MAX;
+static void (*slow_hook)(void *arg, const struct vb_query *, enum vb_match_mode,
+                         const struct vb_stats *);
+static void *slow_arg;
+
+static void vb_thread_metrics_release(void *arg)
+{
+   struct vb_thread_metrics *t = arg;
+   atomic_store(&t->in_use, false);
+}
+
+static void vb_metrics_init(void)
+{
+   exit_key_ok = tss_create(&exit_key, vb_thread_metrics_release) == thrd_success;
+   mtx_init(&hook_lock, mtx_plain);
+}
+
+/* Returns the block of the calling thread, or NULL if there isn't enough
+ * memory for it.
+ */
+static struct vb_thread_metrics *vb_thread_metrics(void)
+{
+   if (this_thread)
+      return this_thread;
+   call_once(&init_once, vb_metrics_init);
+
+   struct vb_thread_metrics *t;
+   for (t = atomic_load(&all_threads); t; t = t->next) {
+      bool in_use = false;
+      if (atomic_compare_exchange_strong(&t->in_use, &in_use, true))
+         break;
+   }
+   if (!t) {
+      t = calloc(1, sizeof *t);
+      if (!t)
+         return NULL;
+      atomic_init(&t->in_use, true);
+      t->next = atomic_load(&all_threads);
+      while (!atomic_compare_exchange_weak(&all_threads, &t->next, t))
+         ;
+   }
+   if (exit_key_ok)
+      tss_set(exit_key, t);
+   this_thread = t;
+   return t;
+}
+
+static uint64_t vb_counter_get(atomic_uint_least64_t *c)
+{
+   return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static void vb_counter_set(atomic_uint_least64_t *c, uint64_t val)
+{
+   atomic_store_explicit(c, val, memory_order_relaxed);
+}
+
+static void vb_counter_add(atomic_uint_least64_t *c, uint64_t n)
+{
+   vb_counter_set(c, vb_counter_get(c) + n);
+}
+
+void vb_metrics_enable(bool on)
+{
+   atomic_store(&enabled, on);
+}
+
+bool vb_metrics_enabled(void)
+{
+   return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+void vb_metrics_set_slow_hook(uint64_t threshold_ns,
+                              void (*hook)(void *arg, const struct vb_query *,
+                                           enum vb_match_mode,
+                                           const struct vb_stats *),
+                              void *arg)
+{
+   call_once(&init_once, vb_metrics_init);
+   mtx_lock(&hook_lock);
+   slow_hook = hook;
+   slow_arg = arg;
+   atomic_store(&slow_threshold, threshold_ns);
+   mtx_unlock(&hook_lock);
+}
+
+void vb_metrics_record(const struct vb_query *q, enum vb_match_mode mode,
+                       uint32_t page, const struct vb_stats *st)
+{
+   const uint64_t ns = st->parse_ns + st->search_ns + st->report_ns;
+
+   struct vb_thread_metrics *t = vb_thread_metrics();
+   if (t) {
+      if (page >= VB_METRICS_PAGES)
+         page = VB_METRICS_PAGES - 1;
+      struct vb_hist_counters *h = &t->latency[mode][page];
+      vb_counter_add(&h->count, 1);
+      vb_counter_add(&h->sum_ns, ns);
+      if (ns > vb_counter_get(&h->max_ns))
+         vb_counter_set(&h->max_ns, ns);
+      vb_counter_add(&h->buckets[vb_hist_bucket(ns)], 1);
+   }
+
+   if (ns < atomic_load_explicit(&slow_threshold, memory_order_relaxed))
+      return;
+   if (t)
+      vb_counter_add(&t->slow_queries, 1);
+   mtx_lock(&hook_lock);
+   void (*hook)(void *, const struct vb_query *, enum vb_match_mode,
+                const struct vb_stats *) = slow_hook;
+   void *arg = slow_arg;
+   mtx_unlock(&hook_lock);
+   if (hook)
+      hook(arg, q, mode, st);
+}
+
+void vb_metrics_snapshot(struct vb_metrics *m)
+{
+   memset(m, 0, sizeof *m);
+
+   for (struct vb_thread_metrics *t = atomic_load(&all_threads); t; t = t->next) {
+      m->slow_queries += vb_counter_get(&t->slow_queries);
+      for (size_t mode = 0; mode < VB_MODES_NR; mode++) {
+         for (size_t page = 0; page < VB_METRICS_PAGES; page++) {
+            struct vb_hist_counters *src = &t->latency[mode][page];
+            struct vb_histogram *dest = &m->latency[mode][page];
+            dest->count += vb_counter_get(&src->count);
+            dest->sum_ns += vb_counter_get(&src->sum_ns);
+            const uint64_t max_ns = vb_counter_get(&src->max_ns);
+            if (max_ns > dest->max_ns)
+               dest->max_ns = max_ns;
+            for (size_t i = 0; i < VB_HIST_BUCKETS; i++)
+               dest->buckets[i] += vb_counter_get(&src->buckets[i]);
+         }
+      }
+   }
+}
+
+uint64_t vb_histogram_quantile(const struct vb_histogram *h, double q)
+{
+   /* Buckets are read apart from the total, which might then not match their
+    * sum, if the histogram comes from a snapshot.
+    */
+   uint64_t total = 0;
+   for (size_t i = 0; i < VB_HIST_BUCKETS; i++)
+      total += h->buckets[i];
+   if (!total)
+      return 0;
+
+   uint64_t rank = q <= 0 ? 1 : q >= 1 ? total : (uint64_t)(q * total + 0.5);
+   if (!rank)
+      rank = 1;
+   uint64_t seen = 0;
+   for (size_t i = 0; i < VB_HIST_BUCKETS; i++) {
+      seen += h->buckets[i];
+      if (seen >= rank) {
+         const uint64_t max = vb_hist_bucket_max(i);
+         return max < h->max_ns ? max : h->max_ns;
+      }
+   }
+   return h->max_ns;
+}
+
+/* Appends formatted text to a buffer, as snprintf() would. */
+struct vb_export {
+   char *buf;
+   size_t size;
+   size_t len;
+};
+
+static void vb_export_printf(struct vb_export *e, const char *fmt, ...)
+{
+   va_list ap;
+   va_start(ap, fmt);
+   const size_t avail = e->len < e->size ? e->size - e->len : 0;
+   const int n = vsnprintf(avail ? &e->buf[e->len] : NULL, avail, fmt, ap);
+   va_end(ap);
+   if (n > 0)
+      e->len += n;
+}
+
+size_t vb_metrics_export(const struct vb_metrics *m, char *buf, size_t size)
+{
+   static const char *const modes[] = {
+      [VB_AUTO] = "auto",
+      [VB_EXACT] = "exact",
+      [VB_PREFIX] = "prefix",
+      [VB_SUBSTR] = "substr",
+      [VB_SUFFIX] = "suffix",
+      [VB_GLOB] = "glob",
+      [VB_LEVENSHTEIN] = "levenshtein",
+      [VB_DAMERAU] = "damerau",
+      [VB_LCSUBSTR] = "lcsubstr",
+      [VB_LCSUBSEQ] = "lcsubseq",
+      [VB_REGEX] = "regex",
+      [VB_TOP_PREFIX] = "top_prefix",
+   };
+   _Static_assert(sizeof modes / sizeof *modes == VB_MODES_NR, "missing mode name");
+   static const char *const pages[VB_METRICS_PAGES] = {"1", "2", "3", "4+"};
+   static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+   struct vb_export e = {.buf = buf, .size = size};
+   if (size)
+      buf[0] = '\0';
+
+   vb_export_printf(&e, "# TYPE volubile_search_seconds summary\n");
+   for (size_t mode = 0; mode < VB_MODES_NR; mode++) {
+      for (size_t page = 0; page < VB_METRICS_PAGES; page++) {
+         const struct vb_histogram *h = &m->latency[mode][page];
+         if (!h->count)
+            continue;
+         for (size_t i = 0; i < sizeof quantiles / sizeof *quantiles; i++)
+            vb_export_printf(&e, "volubile_search_seconds{mode=\"%s\",page=\"%s\","
+                             "quantile=\"%g\"} %.9f\n", modes[mode], pages[page],
+                             quantiles[i],
+                             vb_histogram_quantile(h, quantiles[i]) * 1e-9);
+         vb_export_printf(&e, "volubile_search_seconds_sum{mode=\"%s\",page=\"%s\"} %.9f\n",
+                          modes[mode], pages[page], h->sum_ns * 1e-9);
+         vb_export_printf(&e, "volubile_search_seconds_count{mode=\"%s\",page=\"%s\"} %llu\n",
+                          modes[mode], pages[page], (unsigned long long)h->count);
+      }
+   }
+   vb_export_printf(&e, "# TYPE volubile_slow_searches_total counter\n");
+   vb_export_printf(&e, "volubile_slow_searches_total %llu\n",
+                    (unsigned long long)m->slow_queries);
+   return e.len;
+}
+#line 1 "parse.c"
+
+#line 1 "src/parse.rl"
+#include <string.h>
+
+
+#line 43 "src/parse.rl"
+
+
+
+#line 12 "src/parse.c"
+static const char _vb_simplify_glob_actions[] = {
+	0, 1, 0, 1, 1, 1, 2, 1, 
+	3, 1, 4, 1, 5
+};
+
+static const char _vb_simplify_glob_key_offsets[] = {
+	0, 4, 8, 9, 10, 11, 15, 19
+};
+
+static const char _vb_simplify_glob_trans_keys[] = {
+	42, 63, 91, 93, 42, 63, 91, 93, 
+	42, 42, 42, 42, 63, 91, 93, 42, 
+	63, 91, 93, 42, 0
+};
+
+static const char _vb_simplify_glob_single_lengths[] = {
+	4, 4, 1, 1, 1, 4, 4, 1
+};
+
+static const char _vb_simplify_glob_range_lengths[] = {
+	0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const char _vb_simplify_glob_index_offsets[] = {
+	0, 5, 10, 12, 14, 16, 21, 26
+};
+
+static const char _vb_simplify_glob_indicies[] = {
+	1, 2, 2, 2, 0, 3, 2, 2, 
+	2, 0, 4, 2, 5, 2, 6, 2, 
+	8, 2, 2, 2, 7, 9, 2, 2, 
+	2, 7, 10, 2, 0
+};
+
+static const char _vb_simplify_glob_trans_targs[] = {
+	1, 5, 3, 2, 2, 4, 4, 6, 
+	5, 7, 7
+};
+
+static const char _vb_simplify_glob_trans_actions[] = {
+	1, 1, 1, 1, 0, 1, 0, 1, 
+	0, 1, 0
+};
+
+static const char _vb_simplify_glob_eof_actions[] = {
+	9, 9, 3, 11, 11, 11, 7, 5
+};
+
+static const int vb_simplify_glob_start = 0;
+
+static const int vb_simplify_glob_en_main = 0;
+
+
+#line 46 "src/parse.rl"
+
+static void vb_simplify_glob(struct vb_match_ctx *c, char *buf)
+{
+   int cs;
+   const char *p = c->str;
+   const char *pe = &p[c->len];
+   const char *const eof = pe;
+
+   size_t len = 0;
+   
+#line 77 "src/parse.c"
+	{
+	cs = vb_simplify_glob_start;
+	}
+
+#line 56 "src/parse.rl"
+   
+#line 84 "src/parse.c"
+	{
+	int _klen;
+	unsigned int _trans;
+	const char *_acts;
+	unsigned int _nacts;
+	const char *_keys;
+
+	if ( p == pe )
+		goto _test_eof;
+_resume:
+	_keys = _vb_simplify_glob_trans_keys + _vb_simplify_glob_key_offsets[cs];
+	_trans = _vb_simplify_glob_index_offsets[cs];
+
+	_klen = _vb_simplify_glob_single_lengths[cs];
+	if ( _klen > 0 ) {
+		const char *_lower = _keys;
+		const char *_mid;
+		const char *_upper = _keys + _klen - 1;
+		while (1) {
+			if ( _upper < _lower )
+				break;
+
+			_mid = _lower + ((_upper-_lower) >> 1);
+			if ( (*p) < *_mid )
+				_upper = _mid - 1;
+			else if ( (*p) > *_mid )
+				_lower = _mid + 1;
+			else {
+				_trans += (unsigned int)(_mid - _keys);
+				goto _match;
+			}
+		}
+		_keys += _klen;
+		_trans += _klen;
+	}
+
+	_klen = _vb_simplify_glob_range_lengths[cs];
+	if ( _klen > 0 ) {
+		const char *_lower = _keys;
+		const char *_mid;
+		const char *_upper = _keys + (_klen<<1) - 2;
+		while (1) {
+			if ( _upper < _lower )
 				break;
 
-			_mid = _lower + (((_upper-_lower) >> 1) & ~1);
-			if ( (*p) < _mid[0] )
-				_upper = _mid - 2;
-			else if ( (*p) > _mid[1] )
-				_lower = _mid + 2;
-			else {
-				_trans += (unsigned int)((_mid - _keys)>>1);
-				goto _match;
-			}
+			_mid = _lower + (((_upper-_lower) >> 1) & ~1);
+			if ( (*p) < _mid[0] )
+				_upper = _mid - 2;
+			else if ( (*p) > _mid[1] )
+				_lower = _mid + 2;
+			else {
+				_trans += (unsigned int)((_mid - _keys)>>1);
+				goto _match;
+			}
+		}
+		_trans += _klen;
+	}
+
+_match:
+	_trans = _vb_simplify_glob_indicies[_trans];
+	cs = _vb_simplify_glob_trans_targs[_trans];
+
+	if ( _vb_simplify_glob_trans_actions[_trans] == 0 )
+		goto _again;
+
+	_acts = _vb_simplify_glob_actions + _vb_simplify_glob_trans_actions[_trans];
+	_nacts = (unsigned int) *_acts++;
+	while ( _nacts-- > 0 )
+	{
+		switch ( *_acts++ )
+		{
+	case 0:
+#line 8 "src/parse.rl"
+	{
+   buf[len++] = (*p);
+}
+	break;
+#line 162 "src/parse.c"
+		}
+	}
+
+_again:
+	if ( ++p != pe )
+		goto _resume;
+	_test_eof: {}
+	if ( p == eof )
+	{
+	const char *__acts = _vb_simplify_glob_actions + _vb_simplify_glob_eof_actions[cs];
+	unsigned int __nacts = (unsigned int) *__acts++;
+	while ( __nacts-- > 0 ) {
+		switch ( *__acts++ ) {
+	case 1:
+#line 16 "src/parse.rl"
+	{
+   c->mode = VB_PREFIX;
+   c->str = buf;
+   c->len = len - 1;
+}
+	break;
+	case 2:
+#line 21 "src/parse.rl"
+	{
+   buf[len - 1] = '\0';    /* We use strstr() in the matching function. */
+   c->mode = VB_SUBSTR;
+   c->str = buf + 1;
+   c->len = len - 2;
+}
+	break;
+	case 3:
+#line 27 "src/parse.rl"
+	{
+   c->mode = VB_SUFFIX;
+   c->str = buf + 1;
+   c->len = len - 1;
+}
+	break;
+	case 4:
+#line 32 "src/parse.rl"
+	{
+   c->mode = VB_EXACT;
+}
+	break;
+	case 5:
+#line 35 "src/parse.rl"
+	{
+   c->mode = VB_GLOB;
+   c->str = buf;
+   c->len = len;
+}
+	break;
+#line 215 "src/parse.c"
 		}
-		_trans += _klen;
 	}
+	}
+
+	}
+
+#line 57 "src/parse.rl"
+
+   (void)vb_simplify_glob_en_main;
+}
+
+static void vb_set_match_mode(struct vb_match_ctx *c)
+{
+   if (c->len == 0) {
+      c->mode = VB_EXACT;
+      return;
+   }
+
+   switch (*c->str) {
+   #define _(C, NAME)                                                          \
+   case C:                                                                     \
+      c->mode = VB_##NAME;                                                     \
+      c->str++;                                                                \
+      c->len--;                                                                \
+      break;
+   _('+', LCSUBSTR)
+   _('@', DAMERAU)
+   _('#', SUBSTR)
+   #undef _
+   default:
+      c->mode = VB_GLOB;
+      break;
+   }
+}
+
+void vb_parse_query(struct vb_match_ctx *c, char buf[static MN_MAX_WORD_LEN + 1])
+{
+   if (c->mode == VB_AUTO)
+      vb_set_match_mode(c);
+
+   /* Folded queries are nul-terminated too, and glob patterns can be
+    * simplified in place. Regular expressions are folded once compiled, since
+    * folding their source would change the meaning of their classes.
+    */
+   if (c->fold && c->mode != VB_REGEX) {
+      c->len = vb_utf8_fold(buf, c->str, c->len);
+      c->str = buf;
+   } else if (c->mode == VB_SUBSTR) { /* We use strstr() in the matching function. */
+      memcpy(buf, c->str, c->len);
+      buf[c->len] = '\0';
+      c->str = buf;
+   }
+   if (c->mode == VB_GLOB)
+      vb_simplify_glob(c, buf);
+}
+#line 1 "regex.c"
+#include <stdlib.h>
+#include <string.h>
+
+/* Largest code point matched by "." and negated classes. This is the largest
+ * one that vb_utf8_decode() can return.
+ */
+#define RE_MAX_CHAR 0x1fffff
+
+/* Maximum value of repetition counts. Larger ones wouldn't be useful, since
+ * words are at most that long.
+ */
+#define RE_MAX_REPEAT MN_MAX_WORD_LEN
+
+/* Limits on the size of the automata built from an expression. Above them,
+ * the expression is deemed too complex.
+ */
+#define RE_MAX_NODES (1 << 16)
+#define RE_MAX_STATES (1 << 14)
+
+/*******************************************************************************
+ * Parser.
+ ******************************************************************************/
+
+enum re_type {
+   RE_EMPTY,      /* Matches the empty string. */
+   RE_CLASS,      /* Matches a single character. */
+   RE_CAT,
+   RE_ALT,
+   RE_REPEAT,
+};
+
+/* Node of the syntax tree. Literal characters are classes of a single
+ * character.
+ */
+struct re_ast {
+   enum re_type type;
+   int32_t left, right;    /* Operands. REPEAT only has a left one. */
+   int32_t min, max;       /* Repetition counts. "max" is -1 if unbounded. */
+   uint32_t start, end;    /* Ranges of a class, in "ranges". */
+};
+
+struct re_range {
+   char32_t lo, hi;
+};
+
+/* Maximum number of ranges of all the classes of an expression. Without
+ * folding, the ranges of a class are at most as many as its characters, plus
+ * one once it is inverted. Folding adds those of the folded forms of its
+ * characters, which can be more.
+ */
+#define RE_MAX_RANGES (4 * MN_MAX_WORD_LEN)
+
+/* At most one tree node per character of the expression, plus as many for
+ * joining them.
+ */
+struct re_parser {
+   char32_t pat[MN_MAX_WORD_LEN + 1];
+   int32_t len, pos;
+   struct re_ast ast[2 * MN_MAX_WORD_LEN + 2];
+   int32_t nr_ast;
+   struct re_range ranges[RE_MAX_RANGES + 1];
+   uint32_t nr_ranges;
+   bool fold;              /* Whether to fold classes, see re_fold(). */
+   bool failed;
+};
+
+static int32_t re_node(struct re_parser *p, enum re_type type,
+                       int32_t left, int32_t right)
+{
+   struct re_ast *node = &p->ast[p->nr_ast];
+   *node = (struct re_ast){.type = type, .left = left, .right = right};
+   return p->nr_ast++;
+}
+
+/* Adds a range to the class being parsed. The expression is deemed too complex
+ * if there are too many of them. There is always room for one more range,
+ * which re_normalize() can need.
+ */
+static void re_range(struct re_parser *p, char32_t lo, char32_t hi)
+{
+   if (p->nr_ranges == RE_MAX_RANGES)
+      p->failed = true;
+   else
+      p->ranges[p->nr_ranges++] = (struct re_range){lo, hi};
+}
+
+static int32_t re_class(struct re_parser *p, char32_t lo, char32_t hi)
+{
+   int32_t node = re_node(p, RE_CLASS, -1, -1);
+   p->ast[node].start = p->nr_ranges;
+   re_range(p, lo, hi);
+   p->ast[node].end = p->nr_ranges;
+   return node;
+}
+
+static int re_cmp_ranges(const void *a, const void *b)
+{
+   const struct re_range *x = a, *y = b;
+   return (x->lo > y->lo) - (x->lo < y->lo);
+}
+
+/* Sorts the ranges of a class, merges those that overlap or touch, and
+ * inverts them if need be.
+ */
+static void re_normalize(struct re_parser *p, uint32_t start, bool invert)
+{
+   struct re_range *ranges = &p->ranges[start];
+   uint32_t nr = p->nr_ranges - start, out = 0;
+
+   qsort(ranges, nr, sizeof *ranges, re_cmp_ranges);
+   for (uint32_t i = 0; i < nr; i++) {
+      if (out && ranges[i].lo <= ranges[out - 1].hi + 1) {
+         if (ranges[i].hi > ranges[out - 1].hi)
+            ranges[out - 1].hi = ranges[i].hi;
+      } else {
+         ranges[out++] = ranges[i];
+      }
+   }
+
+   if (invert) {
+      /* Work backwards, since there can be one more range. */
+      char32_t hi = RE_MAX_CHAR;
+      uint32_t nr_inv = out + 1;
+      if (out && ranges[0].lo == 0)
+         nr_inv--;
+      if (out && ranges[out - 1].hi == RE_MAX_CHAR)
+         nr_inv--;
+      uint32_t j = nr_inv;
+      for (uint32_t i = out; i-- > 0;) {
+         const struct re_range r = ranges[i];
+         if (r.hi < hi)
+            ranges[--j] = (struct re_range){r.hi + 1, hi};
+         if (!r.lo)
+            break;
+         hi = r.lo - 1;
+      }
+      if (j)
+         ranges[--j] = (struct re_range){0, hi};
+      out = nr_inv;
+   }
+   p->nr_ranges = start + out;
+}
+
+/* Adds to a class the folded forms of its characters, so that, once inverted
+ * if need be, it matches the folded forms of the characters it would match.
+ * Folded strings only contain folded forms, so the original characters can
+ * stay.
+ */
+static void re_fold(struct re_parser *p, uint32_t start)
+{
+   bool folded[VB_FOLD_LIMIT] = {0};
+   const uint32_t end = p->nr_ranges;
+   for (uint32_t i = start; i < end; i++) {
+      const char32_t hi = p->ranges[i].hi;
+      for (char32_t c = p->ranges[i].lo; c <= hi && c < VB_FOLD_LIMIT; c++) {
+         const char32_t f = vb_fold_char(c);
+         if (f && f != c)
+            folded[f] = true;
+      }
+   }
+   for (char32_t c = 0; c < VB_FOLD_LIMIT; c++) {
+      if (!folded[c])
+         continue;
+      char32_t hi = c;
+      while (hi + 1 < VB_FOLD_LIMIT && folded[hi + 1])
+         hi++;
+      re_range(p, c, hi);
+      c = hi;
+   }
+}
+
+/* Returns a class made of a single character, and of its folded form if
+ * folding. Combining marks are dropped by folding, so they match the empty
+ * string.
+ */
+static int32_t re_literal(struct re_parser *p, char32_t c)
+{
+   if (!p->fold)
+      return re_class(p, c, c);
+   if (!vb_fold_char(c))
+      return re_node(p, RE_EMPTY, -1, -1);
+
+   const uint32_t start = p->nr_ranges;
+   re_range(p, c, c);
+   re_fold(p, start);
+   re_normalize(p, start, false);
+   int32_t node = re_node(p, RE_CLASS, -1, -1);
+   p->ast[node].start = start;
+   p->ast[node].end = p->nr_ranges;
+   return node;
+}
+
+static int32_t re_parse_alt(struct re_parser *p);
+
+/* Reads a character of a class, which can be escaped. */
+static char32_t re_class_char(struct re_parser *p)
+{
+   if (p->pat[p->pos] == '\\' && p->pos + 1 < p->len)
+      p->pos++;
+   return p->pat[p->pos++];
+}
+
+static int32_t re_parse_class(struct re_parser *p)
+{
+   const uint32_t start = p->nr_ranges;
+   const bool invert = p->pos < p->len && p->pat[p->pos] == '^';
+   p->pos += invert;
+
+   /* A closing bracket in first position is a literal. */
+   const int32_t first = p->pos;
+   while (p->pos < p->len && (p->pat[p->pos] != ']' || p->pos == first)) {
+      char32_t lo = re_class_char(p), hi = lo;
+      if (p->pos + 1 < p->len && p->pat[p->pos] == '-'
+          && p->pat[p->pos + 1] != ']') {
+         p->pos++;
+         hi = re_class_char(p);
+         if (hi < lo) {
+            p->failed = true;
+            return -1;
+         }
+      }
+      re_range(p, lo, hi);
+   }
+   if (p->pos == p->len) {
+      p->failed = true;
+      return -1;
+   }
+   p->pos++;
+
+   if (p->fold)
+      re_fold(p, start);
+   if (p->failed)
+      return -1;
+   re_normalize(p, start, invert);
+   int32_t node = re_node(p, RE_CLASS, -1, -1);
+   p->ast[node].start = start;
+   p->ast[node].end = p->nr_ranges;
+   return node;
+}
+
+static int32_t re_parse_atom(struct re_parser *p)
+{
+   const char32_t c = p->pat[p->pos++];
+
+   switch (c) {
+   case '(': {
+      int32_t node = re_parse_alt(p);
+      if (p->failed || p->pos == p->len || p->pat[p->pos] != ')') {
+         p->failed = true;
+         return -1;
+      }
+      p->pos++;
+      return node;
+   }
+   case '*': case '+': case '?': case '{':
+      /* Nothing to repeat. */
+      p->failed = true;
+      return -1;
+   case '.':
+      return re_class(p, 0, RE_MAX_CHAR);
+   case '[':
+      return re_parse_class(p);
+   case '\\':
+      if (p->pos == p->len) {
+         p->failed = true;
+         return -1;
+      }
+      p->pos++;
+      return re_literal(p, p->pat[p->pos - 1]);
+   default:
+      return re_literal(p, c);
+   }
+}
+
+/* Reads a repetition count. Returns -1 if there is none. */
+static int32_t re_parse_count(struct re_parser *p)
+{
+   int32_t n = -1;
+
+   while (p->pos < p->len && p->pat[p->pos] >= '0' && p->pat[p->pos] <= '9') {
+      n = (n < 0 ? 0 : n) * 10 + p->pat[p->pos++] - '0';
+      if (n > RE_MAX_REPEAT) {
+         p->failed = true;
+         return -1;
+      }
+   }
+   return n;
+}
+
+static int32_t re_parse_repeat(struct re_parser *p)
+{
+   int32_t node = re_parse_atom(p);
+
+   while (!p->failed && p->pos < p->len) {
+      int32_t min, max;
+      switch (p->pat[p->pos++]) {
+      case '*':
+         min = 0, max = -1;
+         break;
+      case '+':
+         min = 1, max = -1;
+         break;
+      case '?':
+         min = 0, max = 1;
+         break;
+      case '{':
+         min = max = re_parse_count(p);
+         if (p->pos < p->len && p->pat[p->pos] == ',') {
+            p->pos++;
+            max = re_parse_count(p);
+         }
+         if (p->failed || min < 0 || p->pos == p->len
+             || p->pat[p->pos++] != '}' || (max >= 0 && max < min)) {
+            p->failed = true;
+            return -1;
+         }
+         break;
+      default:
+         p->pos--;
+         return node;
+      }
+      node = re_node(p, RE_REPEAT, node, -1);
+      p->ast[node].min = min;
+      p->ast[node].max = max;
+   }
+   return node;
+}
+
+static int32_t re_parse_cat(struct re_parser *p)
+{
+   int32_t node = -1;
+
+   while (!p->failed && p->pos < p->len && p->pat[p->pos] != '|'
+          && p->pat[p->pos] != ')') {
+      int32_t next = re_parse_repeat(p);
+      node = node < 0 ? next : re_node(p, RE_CAT, node, next);
+   }
+   return node < 0 ? re_node(p, RE_EMPTY, -1, -1) : node;
+}
+
+static int32_t re_parse_alt(struct re_parser *p)
+{
+   int32_t node = re_parse_cat(p);
+
+   while (!p->failed && p->pos < p->len && p->pat[p->pos] == '|') {
+      p->pos++;
+      node = re_node(p, RE_ALT, node, re_parse_cat(p));
+   }
+   return node;
+}
+
+
+/*******************************************************************************
+ * Conversion to a byte-level NFA.
+ ******************************************************************************/
+
+enum re_nfa_type {
+   NFA_MATCH,
+   NFA_BYTES,     /* Moves to "out" on a byte in [lo, hi]. */
+   NFA_SPLIT,     /* Moves to both "out" and "out1" without consuming input. */
+};
+
+struct re_nfa_node {
+   enum re_nfa_type type;
+   uint8_t lo, hi;
+   int32_t out, out1;
+};
+
+struct re_nfa {
+   struct re_nfa_node *nodes;
+   int32_t nr, max;
+   int err;
+};
+
+static int32_t nfa_node(struct re_nfa *n, enum re_nfa_type type,
+                        int32_t out, int32_t out1)
+{
+   if (n->err)
+      return 0;
+   if (n->nr == n->max) {
+      int32_t max = n->max ? n->max * 2 : 256;
+      if (max > RE_MAX_NODES) {
+         n->err = VB_EREGEX;
+         return 0;
+      }
+      struct re_nfa_node *nodes = realloc(n->nodes, max * sizeof *nodes);
+      if (!nodes) {
+         n->err = VB_ENOMEM;
+         return 0;
+      }
+      n->nodes = nodes;
+      n->max = max;
+   }
+   n->nodes[n->nr] = (struct re_nfa_node){
+      .type = type,
+      .out = out,
+      .out1 = out1,
+   };
+   return n->nr++;
+}
+
+/* Adds a path that matches the UTF-8 encodings of the code points in
+ * [lo, hi], as an alternative to "alt" if it is not negative. We split the
+ * range until the encodings of the code points in each subrange form the
+ * cartesian product of byte ranges, as described in Russ Cox, "Regular
+ * Expression Matching in the Wild".
+ */
+static int32_t nfa_utf8(struct re_nfa *n, char32_t lo, char32_t hi,
+                        int32_t next, int32_t alt)
+{
+   static const char32_t max_chars[] = {0x7f, 0x7ff, 0xffff};
+
+   for (size_t i = 0; i < sizeof max_chars / sizeof *max_chars; i++) {
+      if (lo <= max_chars[i] && hi > max_chars[i]) {
+         alt = nfa_utf8(n, lo, max_chars[i], next, alt);
+         return nfa_utf8(n, max_chars[i] + 1, hi, next, alt);
+      }
+   }
+
+   char los[4], his[4];
+   const size_t len = vb_utf8_encode(los, lo);
+   vb_utf8_encode(his, hi);
+   for (size_t i = 1; i < len; i++) {
+      const char32_t m = (UINT32_C(1) << (6 * i)) - 1;
+      if ((lo & ~m) == (hi & ~m))
+         continue;
+      if (lo & m) {
+         alt = nfa_utf8(n, lo, lo | m, next, alt);
+         return nfa_utf8(n, (lo | m) + 1, hi, next, alt);
+      }
+      if ((hi & m) != m) {
+         alt = nfa_utf8(n, lo, (hi & ~m) - 1, next, alt);
+         return nfa_utf8(n, hi & ~m, hi, next, alt);
+      }
+   }
+
+   int32_t node = next;
+   for (size_t i = len; i-- > 0;) {
+      node = nfa_node(n, NFA_BYTES, node, -1);
+      if (!n->err) {
+         n->nodes[node].lo = los[i];
+         n->nodes[node].hi = his[i];
+      }
+   }
+   return alt < 0 ? node : nfa_node(n, NFA_SPLIT, alt, node);
+}
+
+/* Converts a syntax tree to an NFA that moves to "next" once it has matched.
+ * Returns its start node.
+ */
+static int32_t nfa_compile(struct re_nfa *n, const struct re_parser *p,
+                           int32_t idx, int32_t next)
+{
+   const struct re_ast *ast = &p->ast[idx];
+
+   switch (ast->type) {
+   case RE_EMPTY:
+      return next;
+   case RE_CLASS: {
+      int32_t alt = -1;
+      for (uint32_t i = ast->start; i < ast->end; i++)
+         alt = nfa_utf8(n, p->ranges[i].lo, p->ranges[i].hi, next, alt);
+      if (alt < 0) {
+         /* Empty class, matches nothing. */
+         alt = nfa_node(n, NFA_BYTES, next, -1);
+         if (!n->err) {
+            n->nodes[alt].lo = 1;
+            n->nodes[alt].hi = 0;
+         }
+      }
+      return alt;
+   }
+   case RE_CAT:
+      return nfa_compile(n, p, ast->left, nfa_compile(n, p, ast->right, next));
+   case RE_ALT: {
+      int32_t left = nfa_compile(n, p, ast->left, next);
+      return nfa_node(n, NFA_SPLIT, left, nfa_compile(n, p, ast->right, next));
+   }
+   default: {
+      /* Optional copies, then mandatory ones. */
+      int32_t node = next;
+      if (ast->max < 0) {
+         int32_t loop = nfa_node(n, NFA_SPLIT, -1, next);
+         int32_t body = nfa_compile(n, p, ast->left, loop);
+         if (!n->err)
+            n->nodes[loop].out = body;
+         node = loop;
+      } else {
+         for (int32_t i = ast->min; i < ast->max && !n->err; i++)
+            node = nfa_node(n, NFA_SPLIT,
+                            nfa_compile(n, p, ast->left, node), next);
+      }
+      for (int32_t i = 0; i < ast->min && !n->err; i++)
+         node = nfa_compile(n, p, ast->left, node);
+      return node;
+   }
+   }
+}
 
-_match:
-	_trans = _vb_simplify_glob_indicies[_trans];
-	cs = _vb_simplify_glob_trans_targs[_trans];
 
-	if ( _vb_simplify_glob_trans_actions[_trans] == 0 )
-		goto _again;
+/*******************************************************************************
+ * Conversion to a DFA.
+ ******************************************************************************/
 
-	_acts = _vb_simplify_glob_actions + _vb_simplify_glob_trans_actions[_trans];
-	_nacts = (unsigned int) *_acts++;
-	while ( _nacts-- > 0 )
-	{
-		switch ( *_acts++ )
-		{
-	case 0:
-#line 8 "src/parse.rl"
-	{
-   buf[len++] = (*p);
+/* Each DFA state is a set of NFA nodes, stored sorted in "sets". */
+struct re_dfa_builder {
+   const struct re_nfa *nfa;
+   struct vb_regex *re;
+   uint8_t reps[256];         /* A byte of each class. */
+
+   int32_t *sets;
+   size_t sets_len, sets_max;
+   size_t *set_offsets;       /* Offset of each state, plus the end. */
+
+   uint32_t max_states;       /* Room in the arrays below and in "delta". */
+   uint32_t *table;           /* Hash table of state numbers + 1. */
+   uint32_t table_mask;
+
+   uint32_t *marks;           /* Closure computation. */
+   uint32_t mark;
+   int32_t *stack;
+   int32_t *buf;
+};
+
+static uint32_t re_hash(const int32_t *set, size_t len)
+{
+   uint32_t h = 2166136261u;
+   for (size_t i = 0; i < len; i++)
+      h = (h ^ (uint32_t)set[i]) * 16777619u;
+   return h;
 }
-	break;
-#line 162 "src/parse.c"
-		}
-	}
 
-_again:
-	if ( ++p != pe )
-		goto _resume;
-	_test_eof: {}
-	if ( p == eof )
-	{
-	const char *__acts = _vb_simplify_glob_actions + _vb_simplify_glob_eof_actions[cs];
-	unsigned int __nacts = (unsigned int) *__acts++;
-	while ( __nacts-- > 0 ) {
-		switch ( *__acts++ ) {
-	case 1:
-#line 16 "src/parse.rl"
-	{
-   c->mode = VB_PREFIX;
-   c->str = buf;
-   c->len = len - 1;
+static int re_cmp_ints(const void *a, const void *b)
+{
+   int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+   return (x > y) - (x < y);
 }
-	break;
-	case 2:
-#line 21 "src/parse.rl"
-	{
-   buf[len - 1] = '\0';    /* We use strstr() in the matching function. */
-   c->mode = VB_SUBSTR;
-   c->str = buf + 1;
-   c->len = len - 2;
+
+/* Computes the set of nodes reachable from the given ones without consuming
+ * input, keeping only those that do. Writes it sorted to "buf", and returns its
+ * size.
+ */
+static size_t re_closure(struct re_dfa_builder *b, const int32_t *seeds,
+                         size_t nr)
+{
+   const struct re_nfa_node *nodes = b->nfa->nodes;
+   size_t len = 0, top = 0;
+
+   b->mark++;
+   for (size_t i = 0; i < nr; i++)
+      b->stack[top++] = seeds[i];
+   while (top) {
+      const int32_t idx = b->stack[--top];
+      if (b->marks[idx] == b->mark)
+         continue;
+      b->marks[idx] = b->mark;
+      if (nodes[idx].type == NFA_SPLIT) {
+         b->stack[top++] = nodes[idx].out1;
+         b->stack[top++] = nodes[idx].out;
+      } else {
+         b->buf[len++] = idx;
+      }
+   }
+   qsort(b->buf, len, sizeof *b->buf, re_cmp_ints);
+   return len;
 }
-	break;
-	case 3:
-#line 27 "src/parse.rl"
-	{
-   c->mode = VB_SUFFIX;
-   c->str = buf + 1;
-   c->len = len - 1;
+
+/* Makes room for twice as many states. The hash table is kept half empty. */
+static bool re_grow(struct re_dfa_builder *b)
+{
+   struct vb_regex *re = b->re;
+   const uint32_t max = b->max_states * 2;
+
+   size_t *offsets = realloc(b->set_offsets, (max + 1) * sizeof *offsets);
+   if (!offsets)
+      return false;
+   b->set_offsets = offsets;
+   uint16_t *delta = realloc(re->delta,
+                             (size_t)max * re->nr_classes * sizeof *delta);
+   if (!delta)
+      return false;
+   re->delta = delta;
+   uint32_t *table = calloc(2 * max, sizeof *table);
+   if (!table)
+      return false;
+   free(b->table);
+   b->table = table;
+   b->table_mask = 2 * max - 1;
+   b->max_states = max;
+
+   for (uint32_t state = 0; state < re->nr_states; state++) {
+      const size_t off = b->set_offsets[state];
+      uint32_t h = re_hash(&b->sets[off], b->set_offsets[state + 1] - off)
+                 & b->table_mask;
+      while (b->table[h])
+         h = (h + 1) & b->table_mask;
+      b->table[h] = state + 1;
+   }
+   return true;
 }
-	break;
-	case 4:
-#line 32 "src/parse.rl"
-	{
-   c->mode = VB_EXACT;
+
+/* Returns the number of the DFA state made of the nodes in "buf", adding it
+ * if need be, or -1 on failure.
+ */
+static int32_t re_state(struct re_dfa_builder *b, size_t len)
+{
+   struct vb_regex *re = b->re;
+   uint32_t h = re_hash(b->buf, len) & b->table_mask;
+
+   for (; b->table[h]; h = (h + 1) & b->table_mask) {
+      const uint32_t state = b->table[h] - 1;
+      const size_t off = b->set_offsets[state];
+      if (b->set_offsets[state + 1] - off == len
+          && !memcmp(&b->sets[off], b->buf, len * sizeof *b->buf))
+         return state;
+   }
+
+   if (re->nr_states == RE_MAX_STATES)
+      return -1;
+   if (re->nr_states == b->max_states) {
+      if (!re_grow(b))
+         return -1;
+      h = re_hash(b->buf, len) & b->table_mask;
+      while (b->table[h])
+         h = (h + 1) & b->table_mask;
+   }
+   if (b->sets_len + len > b->sets_max) {
+      size_t max = b->sets_max * 2;
+      while (max < b->sets_len + len)
+         max *= 2;
+      int32_t *sets = realloc(b->sets, max * sizeof *sets);
+      if (!sets)
+         return -1;
+      b->sets = sets;
+      b->sets_max = max;
+   }
+
+   memcpy(&b->sets[b->sets_len], b->buf, len * sizeof *b->buf);
+   b->sets_len += len;
+   b->set_offsets[++re->nr_states] = b->sets_len;
+   b->table[h] = re->nr_states;
+   return re->nr_states - 1;
 }
-	break;
-	case 5:
-#line 35 "src/parse.rl"
-	{
-   c->mode = VB_GLOB;
-   c->str = buf;
-   c->len = len;
+
+/* Redirects transitions to states from which no accepting state can be
+ * reached to the dead state, so that walks stop as soon as possible.
+ */
+static int re_prune(struct vb_regex *re)
+{
+   const uint32_t nr = re->nr_states, ncl = re->nr_classes;
+   const size_t nr_edges = (size_t)nr * ncl;
+   uint32_t *counts = calloc(nr + 1, sizeof *counts);
+   uint32_t *preds = malloc(nr_edges * sizeof *preds);
+   uint32_t *queue = malloc(nr * sizeof *queue);
+   bool *live = calloc(nr, sizeof *live);
+   int ret = VB_ENOMEM;
+   if (!counts || !preds || !queue || !live)
+      goto fini;
+
+   /* Predecessors of each state. */
+   for (size_t i = 0; i < nr_edges; i++)
+      counts[re->delta[i] + 1]++;
+   for (uint32_t s = 0; s < nr; s++)
+      counts[s + 1] += counts[s];
+   for (size_t i = 0; i < nr_edges; i++)
+      preds[counts[re->delta[i]]++] = i / ncl;
+   for (uint32_t s = nr; s > 0; s--)
+      counts[s] = counts[s - 1];
+   counts[0] = 0;
+
+   uint32_t head = 0, tail = 0;
+   for (uint32_t s = 0; s < nr; s++)
+      if (re->accepting[s])
+         live[queue[tail++] = s] = true;
+   while (head < tail) {
+      const uint32_t s = queue[head++];
+      for (uint32_t i = counts[s]; i < counts[s + 1]; i++)
+         if (!live[preds[i]])
+            live[queue[tail++] = preds[i]] = true;
+   }
+
+   for (size_t i = 0; i < nr_edges; i++)
+      if (!live[re->delta[i]])
+         re->delta[i] = 0;
+   ret = VB_OK;
+
+fini:
+   free(counts);
+   free(preds);
+   free(queue);
+   free(live);
+   return ret;
 }
-	break;
-#line 215 "src/parse.c"
-		}
-	}
-	}
 
-	}
+static int re_build_dfa(struct vb_regex *re, const struct re_nfa *nfa,
+                        int32_t start)
+{
+   /* Bytes that no range tells apart belong to the same class. */
+   bool bounds[257] = {false};
+   for (int32_t i = 0; i < nfa->nr; i++) {
+      if (nfa->nodes[i].type == NFA_BYTES && nfa->nodes[i].lo <= nfa->nodes[i].hi) {
+         bounds[nfa->nodes[i].lo] = true;
+         bounds[nfa->nodes[i].hi + 1] = true;
+      }
+   }
+   struct re_dfa_builder b = {.nfa = nfa, .re = re};
+   re->nr_classes = 0;
+   for (int c = 0; c < 256; c++) {
+      if (c == 0 || bounds[c])
+         b.reps[re->nr_classes++] = c;
+      re->classes[c] = re->nr_classes - 1;
+   }
 
-#line 57 "src/parse.rl"
+   b.sets_max = 1024;
+   b.sets = malloc(b.sets_max * sizeof *b.sets);
+   b.max_states = 8;
+   b.set_offsets = malloc((b.max_states + 1) * sizeof *b.set_offsets);
+   re->delta = malloc(b.max_states * re->nr_classes * sizeof *re->delta);
+   b.table_mask = 2 * b.max_states - 1;
+   b.table = calloc(b.table_mask + 1, sizeof *b.table);
+   b.marks = calloc(nfa->nr, sizeof *b.marks);
+   b.stack = malloc(3 * nfa->nr * sizeof *b.stack);
+   b.buf = malloc(nfa->nr * sizeof *b.buf);
+   int32_t *seeds = malloc(nfa->nr * sizeof *seeds);
+
+   int ret = VB_ENOMEM;
+   if (!b.sets || !b.set_offsets || !re->delta || !b.table || !b.marks
+       || !b.stack || !b.buf || !seeds)
+      goto fini;
 
-   (void)vb_simplify_glob_en_main;
+   /* The dead state, then the start state. */
+   b.set_offsets[0] = 0;
+   re->nr_states = 0;
+   if (re_state(&b, 0) < 0 || re_state(&b, re_closure(&b, &start, 1)) < 0)
+      goto fini;
+
+   for (uint32_t s = 0; s < re->nr_states; s++) {
+      for (uint32_t c = 0; c < re->nr_classes; c++) {
+         const uint8_t rep = b.reps[c];
+         size_t nr = 0;
+         for (size_t i = b.set_offsets[s]; i < b.set_offsets[s + 1]; i++) {
+            const struct re_nfa_node *node = &nfa->nodes[b.sets[i]];
+            if (node->type == NFA_BYTES && node->lo <= rep && rep <= node->hi)
+               seeds[nr++] = node->out;
+         }
+         int32_t next = nr ? re_state(&b, re_closure(&b, seeds, nr)) : 0;
+         if (next < 0) {
+            ret = re->nr_states == RE_MAX_STATES ? VB_EREGEX : VB_ENOMEM;
+            goto fini;
+         }
+         re->delta[s * re->nr_classes + c] = next;
+      }
+   }
+
+   re->accepting = calloc(re->nr_states, sizeof *re->accepting);
+   if (!re->accepting)
+      goto fini;
+   for (uint32_t s = 0; s < re->nr_states; s++)
+      for (size_t i = b.set_offsets[s]; i < b.set_offsets[s + 1]; i++)
+         if (nfa->nodes[b.sets[i]].type == NFA_MATCH)
+            re->accepting[s] = true;
+   ret = re_prune(re);
+
+fini:
+   free(b.sets);
+   free(b.set_offsets);
+   free(b.table);
+   free(b.marks);
+   free(b.stack);
+   free(b.buf);
+   free(seeds);
+   return ret;
 }
 
-static void vb_set_match_mode(struct vb_match_ctx *c)
+
+/*******************************************************************************
+ * Public functions.
+ ******************************************************************************/
+
+int vb_regex_compile(struct vb_regex *re, const char *pat, size_t len,
+                     bool fold)
 {
-   if (c->len == 0) {
-      c->mode = VB_EXACT;
-      return;
+   re->delta = NULL;
+   re->accepting = NULL;
+
+   struct re_parser *p = malloc(sizeof *p);
+   if (!p)
+      return VB_ENOMEM;
+   p->len = vb_utf8_decode(p->pat, pat, len);
+   if (p->len < 0) {
+      free(p);
+      return VB_EQUTF8;
+   }
+   p->pos = p->nr_ast = p->nr_ranges = 0;
+   p->fold = fold;
+   p->failed = false;
+
+   int32_t root = re_parse_alt(p);
+   if (p->failed || p->pos != p->len) {
+      free(p);
+      return VB_EREGEX;
    }
 
-   switch (*c->str) {
-   #define _(C, NAME)                                                          \
-   case C:                                                                     \
-      c->mode = VB_##NAME;                                                     \
-      c->str++;                                                                \
-      c->len--;                                                                \
-      break;
-   _('+', LCSUBSTR)
-   _('@', DAMERAU)
-   _('#', SUBSTR)
-   #undef _
-   default:
-      c->mode = VB_GLOB;
-      break;
+   struct re_nfa nfa = {0};
+   int32_t match = nfa_node(&nfa, NFA_MATCH, -1, -1);
+   int32_t start = nfa_compile(&nfa, p, root, match);
+   free(p);
+
+   int ret = nfa.err ? nfa.err : re_build_dfa(re, &nfa, start);
+   free(nfa.nodes);
+   if (ret)
+      vb_regex_fini(re);
+   return ret;
+}
+
+void vb_regex_fini(struct vb_regex *re)
+{
+   free(re->delta);
+   free(re->accepting);
+}
+#line 1 "scores.c"
+#include <stdlib.h>
+
+/* Of two words, returns the one with the highest score, or the first one if
+ * they have the same. Ranking words this way is a total order, so which of the
+ * two is passed first doesn't matter.
+ */
+static uint32_t vb_scores_better(const int32_t *scores, uint32_t a, uint32_t b)
+{
+   if (scores[a] != scores[b])
+      return scores[a] > scores[b] ? a : b;
+   return a < b ? a : b;
+}
+
+/* Node "i" of the tree, for i >= size, is the word of index (i - size). */
+static uint32_t vb_scores_node(const struct vb_scores *s, uint32_t i)
+{
+   return i >= s->size ? i - s->size : s->best[i];
+}
+
+int vb_scores_new(struct vb_scores **sp, const int32_t *scores, uint32_t size)
+{
+   *sp = NULL;
+
+   struct vb_scores *s = malloc(sizeof *s);
+   if (!s)
+      return VB_ENOMEM;
+   s->best = malloc(sizeof *s->best * (size ? size : 1));
+   if (!s->best) {
+      free(s);
+      return VB_ENOMEM;
    }
+   s->scores = scores;
+   s->size = size;
+
+   for (uint32_t i = size; i-- > 1; )
+      s->best[i] = vb_scores_better(scores, vb_scores_node(s, 2 * i),
+                                    vb_scores_node(s, 2 * i + 1));
+   *sp = s;
+   return VB_OK;
 }
 
-void vb_parse_query(struct vb_match_ctx *c, char *buf)
+void vb_scores_free(struct vb_scores *s)
 {
-   if (c->mode == VB_AUTO)
-      vb_set_match_mode(c);
+   if (!s)
+      return;
+   free(s->best);
+   free(s);
+}
 
-   if (c->mode == VB_SUBSTR) { /* We use strstr() in the matching function. */
-      memcpy(buf, c->str, c->len);
-      buf[c->len] = '\0';
-      c->str = buf;
-   } else if (c->mode == VB_GLOB) {
-      vb_simplify_glob(c, buf);
+uint32_t vb_scores_best(const struct vb_scores *s, uint32_t start, uint32_t end)
+{
+   uint32_t best = UINT32_MAX;
+
+   for (start += s->size, end += s->size; start < end; start >>= 1, end >>= 1) {
+      if (start & 1) {
+         const uint32_t node = vb_scores_node(s, start++);
+         best = best == UINT32_MAX ? node : vb_scores_better(s->scores, best, node);
+      }
+      if (end & 1) {
+         const uint32_t node = vb_scores_node(s, --end);
+         best = best == UINT32_MAX ? node : vb_scores_better(s->scores, best, node);
+      }
    }
+   return best;
 }
 #line 1 "utf8.c"
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static const unsigned char vb_len_table[256] = {
    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
@@ -1275,18 +6532,88 @@ static char32_t vb_decode_char(const unsigned char *str, size_t clen)
 }
 #define vb_decode_char(str, len) vb_decode_char((const unsigned char *)(str), len)
 
-int32_t vb_utf8_decode(char32_t *restrict dest,
-                       const char *restrict str, size_t len)
+/* Decodes a run of ASCII characters at the start of a string, if any. Returns
+ * the number of characters decoded. With SSE2, we check and widen 16 bytes at a
+ * time, otherwise 8. When a block is not all ASCII, we still widen it whole,
+ * but only count its leading ASCII bytes. This is why "dest" must have room
+ * for as many code points as there are bytes in "str".
+ */
+static size_t vb_decode_ascii(char32_t *restrict dest,
+                              const unsigned char *restrict str, size_t len)
+{
+   size_t i = 0;
+
+#ifdef __SSE2__
+   const __m128i zero = _mm_setzero_si128();
+   while (i + 16 <= len) {
+      const __m128i bytes = _mm_loadu_si128((const __m128i *)&str[i]);
+      const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      _mm_storeu_si128((__m128i *)&dest[i], _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128((__m128i *)&dest[i + 4], _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128((__m128i *)&dest[i + 8], _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128((__m128i *)&dest[i + 12], _mm_unpackhi_epi16(hi, zero));
+      const unsigned mask = _mm_movemask_epi8(bytes);
+      if (mask)
+         return i + __builtin_ctz(mask);
+      i += 16;
+   }
+#endif
+   while (i + 8 <= len) {
+      uint64_t word;
+      memcpy(&word, &str[i], sizeof word);
+      if (word & UINT64_C(0x8080808080808080))
+         break;
+      for (size_t j = 0; j < 8; j++)
+         dest[i + j] = str[i + j];
+      i += 8;
+   }
+   while (i < len && str[i] < 0x80) {
+      dest[i] = str[i];
+      i++;
+   }
+   return i;
+}
+
+/* When "check" is false, the string is assumed to be valid. */
+static inline int32_t vb_decode(char32_t *restrict dest,
+                                const char *restrict str, size_t len,
+                                bool check)
 {
    assert(len < INT32_MAX);
 
+   const unsigned char *ustr = (const unsigned char *)str;
    int32_t ulen = 0;
 
    for (size_t i = 0; i < len; ) {
+      /* Only take the ASCII path for runs long enough to pay off. */
+      uint64_t word;
+      if (i + 8 <= len && (memcpy(&word, &ustr[i], sizeof word),
+                           !(word & UINT64_C(0x8080808080808080)))) {
+         const size_t n = vb_decode_ascii(&dest[ulen], &ustr[i], len - i);
+         ulen += n;
+         i += n;
+         continue;
+      }
       size_t clen = vb_char_len(str[i]);
-      if (clen == 0 || i + clen > len)
+      if (check && (clen == 0 || i + clen > len))
          return -1;
-      dest[ulen++] = vb_decode_char(&str[i], clen);
+      if (i + 4 <= len) {
+         /* Decode all possible lengths and pick the right one, instead of
+          * branching on the length, which is hard to predict in scripts that
+          * mix ASCII and other characters.
+          */
+         const unsigned char *c = &ustr[i];
+         const char32_t cands[5] = {
+            [1] = c[0],
+            [2] = ((c[0] & 0x1F) << 6) | (c[1] & 0x3F),
+            [3] = ((c[0] & 0x0f) << 12) | ((c[1] & 0x3f) << 6) | (c[2] & 0x3f),
+            [4] = ((c[0] & 0x07) << 18) | ((c[1] & 0x3f) << 12) | ((c[2] & 0x3f) << 6) | (c[3] & 0x3f),
+         };
+         dest[ulen++] = cands[clen];
+      } else {
+         dest[ulen++] = vb_decode_char(&str[i], clen);
+      }
       i += clen;
    }
 
@@ -1294,6 +6621,68 @@ int32_t vb_utf8_decode(char32_t *restrict dest,
    return ulen;
 }
 
+int32_t vb_utf8_decode(char32_t *restrict dest,
+                       const char *restrict str, size_t len)
+{
+   return vb_decode(dest, str, len, true);
+}
+
+int32_t vb_utf8_decode_valid(char32_t *restrict dest,
+                             const char *restrict str, size_t len)
+{
+   return vb_decode(dest, str, len, false);
+}
+
+int32_t vb_utf8_decode_next(struct vb_decoded *d, const char *str, size_t len,
+                            size_t shared, bool check)
+{
+   /* Start over from the code point the first changed byte belongs to. */
+   if (shared > d->len)
+      shared = d->len;
+   int32_t ulen = 0;
+   size_t i = 0;
+   if (shared) {
+      ulen = d->index[shared];
+      for (i = shared; i > 0 && d->index[i - 1] == ulen; i--)
+         ;
+   }
+
+   while (i < len) {
+      size_t clen = vb_char_len(str[i]);
+      if (check && (clen == 0 || i + clen > len)) {
+         d->len = 0;
+         return -1;
+      }
+      d->chars[ulen] = vb_decode_char(&str[i], clen);
+      for (size_t j = 0; j < clen; j++)
+         d->index[i + j] = ulen;
+      ulen++;
+      i += clen;
+   }
+
+   d->index[len] = ulen;
+   d->chars[ulen] = U'\0';
+   d->len = len;
+   return ulen;
+}
+
+bool vb_utf8_check(const char *str, size_t len)
+{
+   for (size_t i = 0; i < len; ) {
+      uint64_t word;
+      if (i + 8 <= len && (memcpy(&word, &str[i], sizeof word),
+                           !(word & UINT64_C(0x8080808080808080)))) {
+         i += 8;
+         continue;
+      }
+      size_t clen = vb_char_len(str[i]);
+      if (clen == 0 || i + clen > len)
+         return false;
+      i += clen;
+   }
+   return true;
+}
+
 size_t vb_utf8_bytes(const char32_t *str, size_t nr)
 {
    size_t pfx = 0;
@@ -1310,3 +6699,129 @@ size_t vb_utf8_bytes(const char32_t *str, size_t nr)
    }
    return pfx;
 }
+
+size_t vb_utf8_encode(char *dest, char32_t c)
+{
+   if (c < 0x80) {
+      dest[0] = c;
+      return 1;
+   }
+   if (c < 0x800) {
+      dest[0] = 0xc0 | (c >> 6);
+      dest[1] = 0x80 | (c & 0x3f);
+      return 2;
+   }
+   if (c < 0x10000) {
+      dest[0] = 0xe0 | (c >> 12);
+      dest[1] = 0x80 | ((c >> 6) & 0x3f);
+      dest[2] = 0x80 | (c & 0x3f);
+      return 3;
+   }
+   dest[0] = 0xf0 | (c >> 18);
+   dest[1] = 0x80 | ((c >> 12) & 0x3f);
+   dest[2] = 0x80 | ((c >> 6) & 0x3f);
+   dest[3] = 0x80 | (c & 0x3f);
+   return 4;
+}
+
+/* Base letters of the Latin-1 Supplement, from U+00C0, and of the Latin
+ * Extended-A block, from U+0100. A nul byte stands for a letter that has no
+ * base letter, which is only lowercased.
+ */
+static const char vb_latin1_bases[] =
+   "aaaaaa\0ceeeeiiii\0nooooo\0ouuuuy\0\0"
+   "aaaaaa\0ceeeeiiii\0nooooo\0ouuuuy\0y";
+static const char vb_latin_a_bases[] =
+   "aaaaaacccccccc" "dddd" "eeeeeeeeee" "gggggggg" "hhhh" "iiiiiiiiii"
+   "\0\0" "jj" "kk\0" "llllllllll" "nnnnnn" "\0\0\0" "oooooo" "\0\0"
+   "rrrrrr" "ssssssss" "tttttt" "uuuuuuuuuuuu" "ww" "yyy" "zzzzzz" "s";
+
+_Static_assert(sizeof vb_latin1_bases == 0x40 + 1, "bad table size");
+_Static_assert(sizeof vb_latin_a_bases == 0x80 + 1, "bad table size");
+
+char32_t vb_fold_char(char32_t c)
+{
+   if (c >= 'A' && c <= 'Z')
+      return c + 0x20;
+   if (c < 0xc0)
+      return c;
+   if (c < 0x100) {
+      if (vb_latin1_bases[c - 0xc0])
+         return vb_latin1_bases[c - 0xc0];
+      return c < 0xdf && c != 0xd7 ? c + 0x20 : c;
+   }
+   if (c < 0x180) {
+      if (vb_latin_a_bases[c - 0x100])
+         return vb_latin_a_bases[c - 0x100];
+      return c == 0x138 || c == 0x149 ? c : c | 1;
+   }
+   if (c >= 0x300 && c < 0x370)
+      return 0;
+
+   /* Greek. Accented vowels are mapped to the unaccented lowercase ones. */
+   if (c >= 0x386 && c < 0x3d0) {
+      static const char32_t accented[][2] = {
+         {0x386, 0x3b1}, {0x388, 0x3b5}, {0x389, 0x3b7}, {0x38a, 0x3b9},
+         {0x38c, 0x3bf}, {0x38e, 0x3c5}, {0x38f, 0x3c9}, {0x390, 0x3b9},
+         {0x3aa, 0x3b9}, {0x3ab, 0x3c5}, {0x3ac, 0x3b1}, {0x3ad, 0x3b5},
+         {0x3ae, 0x3b7}, {0x3af, 0x3b9}, {0x3b0, 0x3c5}, {0x3c2, 0x3c3},
+         {0x3ca, 0x3b9}, {0x3cb, 0x3c5}, {0x3cc, 0x3bf}, {0x3cd, 0x3c5},
+         {0x3ce, 0x3c9},
+      };
+      for (size_t i = 0; i < sizeof accented / sizeof *accented; i++)
+         if (accented[i][0] == c)
+            return accented[i][1];
+      return c >= 0x391 && c <= 0x3a9 ? c + 0x20 : c;
+   }
+
+   /* Cyrillic. Only е and и with a diacritic are mapped to the plain letter,
+    * since the other letters with a diacritic are letters of their own.
+    */
+   if (c >= 0x400 && c < 0x460) {
+      if (c < 0x410)
+         c += 0x50;
+      else if (c < 0x430)
+         c += 0x20;
+      if (c == 0x450 || c == 0x451)
+         return 0x435;
+      if (c == 0x45d)
+         return 0x438;
+   }
+   return c;
+}
+
+size_t vb_utf8_fold(char *restrict dest, const char *restrict str, size_t len)
+{
+   const unsigned char *ustr = (const unsigned char *)str;
+   size_t flen = 0;
+
+   for (size_t i = 0; i < len; ) {
+      if (ustr[i] < 0x80) {
+         dest[flen++] = ustr[i] >= 'A' && ustr[i] <= 'Z' ? ustr[i] + 0x20 : ustr[i];
+         i++;
+         continue;
+      }
+      /* Bytes that are not part of a well-formed sequence are kept as they
+       * are.
+       */
+      size_t clen = vb_char_len(str[i]);
+      bool valid = clen && i + clen <= len;
+      for (size_t j = 1; valid && j < clen; j++)
+         valid = (ustr[i + j] & 0xc0) == 0x80;
+      if (!valid) {
+         dest[flen++] = str[i++];
+         continue;
+      }
+      const char32_t c = vb_decode_char(&str[i], clen);
+      const char32_t folded = vb_fold_char(c);
+      if (folded == c) {
+         memcpy(&dest[flen], &str[i], clen);
+         flen += clen;
+      } else if (folded) {
+         flen += vb_utf8_encode(&dest[flen], folded);
+      }
+      i += clen;
+   }
+   dest[flen] = '\0';
+   return flen;
+}
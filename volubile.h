@@ -18,6 +18,14 @@ enum {
    VB_EQUTF8,     /* Query string is not valid UTF-8. */
    VB_ELUTF8,     /* Lexicon contains an invalid UTF-8 string. */
    VB_EFSA,       /* Lexicon is not a numbered automaton. */
+   VB_EWORD,      /* Attempt to add an empty, too long or non-UTF-8 word. */
+   VB_E2BIG,      /* Lexicon has grown too large. */
+   VB_ENOMEM,     /* Out of memory. */
+   VB_EREGEX,     /* Invalid or too complex regular expression. */
+   VB_EFOLD,      /* Lexicon has no up-to-date folded index. */
+   VB_ESCORES,    /* Lexicon has no up-to-date word scores. */
+   VB_EINTR,      /* Search interrupted, see struct vb_limits. */
+   VB_ESHARDS,    /* Too many shards, or token made for other shards. */
 };
 
 /* Returns a string describing an error code. */
@@ -34,11 +42,88 @@ enum vb_match_mode {
    VB_DAMERAU,       /* Damerau-Levenshtein distance. */
    VB_LCSUBSTR,      /* Longest common substring. */
    VB_LCSUBSEQ,      /* Longest common subsequence. */
+   VB_REGEX,         /* Regular expression matching. */
+   VB_TOP_PREFIX,    /* Prefix matching, highest-scoring words first. */
    
    VB_MODES_NR
 };
 
 #define VB_MAX_PAGE_SIZE 30   /* Maximum allowed number of words per page. */
+#define VB_MAX_WORD_LEN 333   /* Same as MN_MAX_WORD_LEN. */
+
+/* Statistics about the execution of a query, see the "stats" field of struct
+ * vb_query. Counters are added to, and never reset, so that they can be summed
+ * over the pages of a query, or over several queries; the structure should be
+ * zeroed beforehand. A counter that doesn't apply to the matching mode used, or
+ * to the way the lexicon is stored, stays as it is.
+ */
+struct vb_stats {
+   uint64_t words_visited;       /* Words looked at. */
+
+   /* Words looked at but not reported, by reason. Words that come after the
+    * end of the current results page are not counted.
+    */
+   uint64_t rejected_prefilter;  /* Glob: lacks a literal of the pattern. */
+   uint64_t rejected_pattern;    /* Doesn't match the pattern. */
+   uint64_t rejected_length;     /* Fuzzy: length too different. */
+   uint64_t rejected_distance;   /* Fuzzy: too far from the query. */
+   uint64_t rejected_page;       /* Belongs to a previous results page. */
+
+   /* Regex: transitions of the automaton not followed, because no word below
+    * them can match.
+    */
+   uint64_t pruned_branches;
+
+   uint64_t dp_cells;            /* Fuzzy: matrix cells computed. */
+   uint64_t memo_hits;           /* Fuzzy: words that reused matrix rows. */
+   uint64_t utf8_bytes;          /* Bytes of words decoded. */
+   uint64_t heap_pushes;         /* Candidates offered to a ranking heap. */
+   uint64_t extracts;            /* Words fetched by ordinal. */
+
+   /* Wall time spent parsing the query, searching the lexicon, and reporting
+    * the results, in nanoseconds. Results are reported as they are found,
+    * within the search phase, except with fuzzy matching.
+    */
+   uint64_t parse_ns;
+   uint64_t search_ns;
+   uint64_t report_ns;
+};
+
+/* Limits on the work a single call to vb_match() can do, see the "limits"
+ * field of struct vb_query. Zero means no limit. Once a limit is reached, the
+ * call returns VB_EINTR, after reporting the words found so far, and updates
+ * the pagination data so that the next call resumes the search where it
+ * stopped. Each call thus returns at most "page_size" words, but an
+ * interrupted one can return fewer, or none at all: fuzzy searches rank all
+ * the candidates before reporting any, so they keep the best ones found so far
+ * in the limits until they are done. A structure thus holds the progress of
+ * a single search at a time. A fuzzy search resumed with other limits, or
+ * without any, scores its page again from the start.
+ * At least one word is looked at per call, so that searches always progress.
+ * Fuzzy searches of standard automata, which can't be resumed, ignore limits.
+ */
+struct vb_partial;
+
+struct vb_limits {
+   uint64_t max_ns;           /* Wall time, checked every 64 words. */
+   uint64_t max_words;        /* Words looked at. */
+   uint64_t max_cells;        /* Matrix cells computed by fuzzy searches. */
+
+   /* Flag that can be set to non-zero from another thread to interrupt a
+    * search as soon as possible, that is, within 64 words, or NULL. The
+    * library only reads it.
+    */
+   const volatile int *cancel;
+
+   /* Progress of an interrupted fuzzy search, allocated by the library. Must
+    * be NULL the first time the structure is used, and released with
+    * vb_limits_fini() once done with it.
+    */
+   struct vb_partial *partial;
+};
+
+/* Releases the progress kept in limits, but not the structure itself. */
+void vb_limits_fini(struct vb_limits *);
 
 struct vb_query {
    const char *query;         /* Query string and its length. */
@@ -61,6 +146,25 @@ struct vb_query {
     */
    size_t prefix_len;
 
+   /* Whether to ignore case and diacritics, by searching the folded index of
+    * the lexicon (see vb_lexicon_fold()). The query is folded the same way as
+    * the words, and the original words are reported. Results pages are made
+    * of folded forms, so a page holds more than "page_size" words when some
+    * of them have the same folded form.
+    */
+   bool fold;
+
+   /* Where to add statistics about the execution of the query, or NULL if
+    * they are not wanted, which is the default. Collecting them costs a few
+    * counter updates per word.
+    */
+   struct vb_stats *stats;
+
+   /* Limits on the work of each call, or NULL if there are none, which is the
+    * default. See struct vb_limits.
+    */
+   struct vb_limits *limits;
+
    /* State data for paginating matching words. Must be filled with zeroes the
     * first time vb_match() is called. After a call, these values are updated
     * in such a manner that, if vb_match() is called again with this same
@@ -72,6 +176,19 @@ struct vb_query {
       uint32_t last_pos;      /* Position of the last seen word. */
       int32_t last_weight;    /* Lowest rank among the returned words. */
 
+      /* The last seen word itself. Standard automata have no word ordinals,
+       * so searches resume from this word instead of from "last_pos", which
+       * is then only meaningful as far as it is zero or not.
+       */
+      size_t last_len;
+      char last_word[VB_MAX_WORD_LEN + 1];
+
+      uint32_t pages;         /* Number of pages fetched so far. */
+
+      /* Whether the last call interrupted a fuzzy search, whose progress is
+       * kept in the limits of the query.
+       */
+      bool interrupted;
    } pagination;
 };
 
@@ -85,7 +202,10 @@ struct vb_query {
 }
 
 /* Searches a lexicon.
- * The lexicon must be a numbered automaton.
+ * The lexicon can be a standard or a numbered automaton. Both give the same
+ * results. Standard automata are smaller, but fuzzy matching must then copy
+ * the best candidates found so far instead of recording their ordinals, which
+ * is marginally slower.
  * The provided callback function will be called for each matching word. It will
  * be passed the current matching word. On success, returns VB_OK, otherwise an
  * error code.
@@ -94,4 +214,330 @@ int vb_match(const struct mini *lexicon, struct vb_query *,
              void (*handler)(void *arg, const char *token, size_t len),
              void *arg);
 
+
+/*******************************************************************************
+ * Editable lexicons
+ ******************************************************************************/
+
+/* A lexicon made of an immutable automaton (the base), plus the words added to
+ * it and removed from it since it was built. Searching such a lexicon returns
+ * the same results, in the same order, as searching an automaton built from
+ * the edited word list, so edits are visible immediately, without rebuilding
+ * the base. Edits are held in memory, and are meant to be few compared to the
+ * size of the base; vb_lexicon_compact() folds them into a new base.
+ *
+ * Searching a lexicon does not modify it, so several threads can search the
+ * same lexicon concurrently, provided no thread modifies it at the same time.
+ * Pagination data obtained from a lexicon is only valid as long as this
+ * lexicon is not modified.
+ */
+struct vb_lexicon;
+
+/* Creates a new lexicon.
+ * The base automaton must be numbered. On success, the lexicon takes ownership
+ * of it, and it should not be used directly afterwards.
+ * All its words are checked to be valid UTF-8 beforehand, so that searches
+ * don't have to do it again. If one of them is not, VB_ELUTF8 is returned.
+ * This requires traversing the whole automaton.
+ */
+int vb_lexicon_new(struct vb_lexicon **, struct mini *base);
+
+/* Destructor. Also frees the base automaton. */
+void vb_lexicon_free(struct vb_lexicon *);
+
+/* Returns the number of words in a lexicon. */
+uint32_t vb_lexicon_size(const struct vb_lexicon *);
+
+/* Returns the number of edits not yet folded into the base automaton. */
+size_t vb_lexicon_pending(const struct vb_lexicon *);
+
+/* Adds a word to a lexicon. Adding a word that is already present is not an
+ * error. The word must be valid UTF-8.
+ */
+int vb_lexicon_add(struct vb_lexicon *, const char *word, size_t len);
+
+/* Removes a word from a lexicon. Removing a word that is not present is not an
+ * error.
+ */
+int vb_lexicon_remove(struct vb_lexicon *, const char *word, size_t len);
+
+/* Creates a new lexicon whose base automaton contains the words of an existing
+ * one, edits included.
+ * The source lexicon is only read, so it can still be searched while this
+ * function runs, e.g. in a background thread. The new lexicon can then be
+ * substituted for the old one.
+ */
+int vb_lexicon_compact(const struct vb_lexicon *, struct vb_lexicon **);
+
+/* Keeps a flat copy of the words of a lexicon, which makes substring and
+ * suffix searches much faster, since they can then scan a single buffer
+ * instead of walking the automaton. This takes as much memory as the words
+ * themselves, plus 4 bytes per word, which is typically several times the size
+ * of the automaton. The decoded code points of the words are kept too, in 1,
+ * 2 or 4 bytes each depending on the largest one, which makes fuzzy searches
+ * several times faster. The copy is only used while the lexicon has no pending
+ * edits. vb_lexicon_compact() also creates it for the new lexicon if the
+ * source lexicon has one.
+ */
+int vb_lexicon_flatten(struct vb_lexicon *);
+
+/* Builds an index of the folded forms of the words of a lexicon, for case- and
+ * diacritic-insensitive searches. Folding lowercases letters and removes their
+ * diacritics, so that "Élan" and "elan" have the same folded form; see the
+ * README for the details. The index is an automaton of the folded forms, plus
+ * the ordinals of the words each of them stands for, which typically takes a
+ * bit more memory than the base automaton, and is flattened along with the
+ * lexicon. It is only used while the lexicon has no pending edits, and folded
+ * searches fail with VB_EFOLD otherwise. vb_lexicon_compact() also builds it
+ * for the new lexicon if the source lexicon has one.
+ */
+int vb_lexicon_fold(struct vb_lexicon *);
+
+/* Attaches scores to the words of a lexicon, such as their frequency or
+ * popularity. "scores" must hold one score per word of the base automaton, in
+ * the same order, and stay valid as long as the lexicon uses it; it can point
+ * to a file mapped in memory. An index of 4 bytes per word is built, for
+ * finding the highest-scoring words of a range of ordinals.
+ * VB_TOP_PREFIX searches return the words that start with the query string by
+ * decreasing score, and fuzzy searches rank words of equal weight by
+ * decreasing score. Scores are only used while the lexicon has no pending
+ * edits, and VB_TOP_PREFIX searches fail with VB_ESCORES otherwise, as well
+ * as folded ones.
+ * vb_lexicon_compact() doesn't carry them over, since word ordinals change.
+ * Passing NULL detaches them.
+ */
+int vb_lexicon_set_scores(struct vb_lexicon *, const int32_t *scores);
+
+/* Same as vb_match(), but for a lexicon created with vb_lexicon_new(). */
+int vb_lexicon_match(const struct vb_lexicon *, struct vb_query *,
+                     void (*handler)(void *arg, const char *token, size_t len),
+                     void *arg);
+
+
+/*******************************************************************************
+ * Lexicon handles
+ ******************************************************************************/
+
+/* A handle holds the current version of a lexicon, and allows replacing it
+ * with a new one while other threads are searching it. Searches never wait for
+ * a replacement to complete: each of them uses whichever version was current
+ * when it started. A replaced version is freed once all the searches that might
+ * still be using it have finished.
+ */
+struct vb_handle;
+
+/* Creates a new handle. Takes ownership of the provided lexicon. */
+int vb_handle_new(struct vb_handle **, struct vb_lexicon *);
+
+/* Destructor. Also frees the current lexicon. No search must be in progress
+ * when this is called.
+ */
+void vb_handle_free(struct vb_handle *);
+
+/* Makes a lexicon the current one. Takes ownership of it.
+ * Waits until the previous version is not used anymore, and frees it. Several
+ * threads can call this function concurrently; replacements are then
+ * serialized.
+ */
+void vb_handle_publish(struct vb_handle *, struct vb_lexicon *);
+
+/* Prevents the current lexicon from being freed until vb_handle_release() is
+ * called, and returns it. This allows issuing several searches against the
+ * same lexicon version. The value written to "ticket" must be passed to
+ * vb_handle_release().
+ */
+const struct vb_lexicon *vb_handle_acquire(struct vb_handle *,
+                                           unsigned *ticket);
+
+/* Releases a lexicon acquired with vb_handle_acquire(). */
+void vb_handle_release(struct vb_handle *, unsigned ticket);
+
+/* Searches the current lexicon of a handle. Same as vb_lexicon_match()
+ * otherwise. Note that if the lexicon is replaced between two calls that fetch
+ * successive results pages, the second page is computed from the new lexicon,
+ * using pagination data that pertains to the previous one.
+ */
+int vb_handle_match(struct vb_handle *, struct vb_query *,
+                    void (*handler)(void *arg, const char *token, size_t len),
+                    void *arg);
+
+
+/*******************************************************************************
+ * Metrics
+ ******************************************************************************/
+
+/* Once enabled, every search records its latency in a process-wide registry,
+ * in a histogram per matching mode and page number. Each thread records in
+ * histograms of its own, without locking; they are summed when a snapshot is
+ * taken. The histograms of a thread that exits are kept, and reused by the
+ * next thread that searches.
+ * Latencies are the sum of the phases timed in struct vb_stats, so recording
+ * them costs as much as collecting statistics, which are then collected for
+ * each search, whether the query asks for them or not.
+ */
+
+#define VB_METRICS_PAGES 4    /* Pages 1, 2, 3, then all the following ones. */
+
+/* Buckets cover latencies from 0 to 2^40 ns, about 18 minutes, with a relative
+ * error of at most 1/8. Latencies under 16 ns have buckets of their own; the
+ * following powers of two are each split into 8 buckets of equal width.
+ */
+#define VB_HIST_BUCKETS 304
+
+struct vb_histogram {
+   uint64_t count;
+   uint64_t sum_ns;
+   uint64_t max_ns;
+   uint64_t buckets[VB_HIST_BUCKETS];
+};
+
+struct vb_metrics {
+   struct vb_histogram latency[VB_MODES_NR][VB_METRICS_PAGES];
+   uint64_t slow_queries;     /* Searches that reached the slow threshold. */
+};
+
+/* Enables or disables the recording of metrics. Disabled by default. */
+void vb_metrics_enable(bool);
+
+/* Sets a function to be called after each search that took at least
+ * "threshold_ns" nanoseconds, while metrics are enabled. It is passed the
+ * query, whose pagination data is already updated, the matching mode actually
+ * used, and the statistics of the search alone. It is called from the thread
+ * that made the search, so it can be called from several threads at once.
+ * Passing a NULL hook removes it; slow searches are still counted.
+ */
+void vb_metrics_set_slow_hook(uint64_t threshold_ns,
+                              void (*hook)(void *arg, const struct vb_query *,
+                                           enum vb_match_mode,
+                                           const struct vb_stats *),
+                              void *arg);
+
+/* Sums the metrics recorded by all threads so far. Counters are read while
+ * other threads may be updating them, so the histograms of a snapshot are
+ * only consistent with each other up to the searches in progress.
+ */
+void vb_metrics_snapshot(struct vb_metrics *);
+
+/* Returns the latency under which a fraction "q" of the recorded searches
+ * completed, as the largest latency of the bucket it falls in, or 0 if the
+ * histogram is empty.
+ */
+uint64_t vb_histogram_quantile(const struct vb_histogram *, double q);
+
+/* Writes a snapshot in the Prometheus text format, as summaries of the
+ * non-empty histograms, with their median, 90th, 99th and 99.9th percentiles.
+ * Same as snprintf() otherwise: returns the length of the full text, and
+ * writes at most "size" bytes, nul byte included.
+ */
+size_t vb_metrics_export(const struct vb_metrics *, char *buf, size_t size);
+
+
+/*******************************************************************************
+ * Results cache
+ ******************************************************************************/
+
+/* A cache of the results pages of the searches made through a handle, for
+ * workloads where the same queries come again and again. Pages are keyed on
+ * the version of the lexicon, the query string once its mode selectors are
+ * interpreted, the parameters of the query, and its pagination data, and
+ * evicted least recently used first once the cache is full. Replacing the
+ * lexicon of the handle makes the pages of the previous version unreachable;
+ * they are dropped as soon as a search against the new version comes by.
+ * The cache is split into shards that have a lock of their own, so several
+ * threads can use it at the same time with little contention.
+ * Pages served from the cache don't add to the statistics of the query, and
+ * are not recorded in metrics. Only successful searches are cached.
+ */
+struct vb_cache;
+
+/* Creates a new cache in front of a handle, which must outlive it. "max_size"
+ * is the maximum number of bytes the cached pages can take, keys and a few
+ * hundred bytes of overhead per page included.
+ */
+int vb_cache_new(struct vb_cache **, struct vb_handle *, size_t max_size);
+
+/* Destructor. No search must be in progress. Doesn't free the handle. */
+void vb_cache_free(struct vb_cache *);
+
+/* Same as vb_handle_match(), but answers from the cache when possible. */
+int vb_cache_match(struct vb_cache *, struct vb_query *,
+                   void (*handler)(void *arg, const char *token, size_t len),
+                   void *arg);
+
+struct vb_cache_stats {
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t evictions;        /* Pages dropped to make room for others. */
+   uint64_t invalidations;    /* Pages dropped because the lexicon changed. */
+   size_t entries;            /* Pages currently cached. */
+   size_t size;               /* Bytes they take. */
+};
+
+/* Returns the counters of a cache. */
+void vb_cache_stats(struct vb_cache *, struct vb_cache_stats *);
+
+
+/*******************************************************************************
+ * Federated search
+ ******************************************************************************/
+
+/* Several lexicons, or shards, can be searched as one. Each call searches all
+ * the shards in parallel, and merges their results pages into a single one,
+ * whose words come in the order a lexicon made of all the shards would give
+ * them: by increasing weight for fuzzy searches, then by decreasing score for
+ * searches that rank words by score, then in lexicographic order. Words found in several shards come once per shard, in
+ * the order of the shards.
+ * Merging a page leaves each shard at a different point of its own results,
+ * which is found from the pagination data recorded along with each word.
+ * Searches run on a pool of threads shared by all the federated searches,
+ * started as needed and kept for the life of the process. The calling thread
+ * runs one of the searches, and the only one if a single shard is left.
+ * The limits and the statistics of the query are ignored, and so is its
+ * pagination data, which is replaced with the following.
+ */
+#define VB_MAX_SHARDS 16
+
+/* Pagination data of a federated search, made of that of each shard. Must be
+ * filled with zeroes the first time vb_federated_match() is called.
+ */
+struct vb_federated_pagination {
+   bool last_page;            /* Whether we just returned the last page. */
+   uint32_t nr_shards;
+
+   struct vb_shard_cursor {
+      bool last_page;
+      uint32_t last_pos;
+      int32_t last_weight;
+      size_t last_len;
+      char last_word[VB_MAX_WORD_LEN + 1];
+      uint32_t pages;
+   } shards[VB_MAX_SHARDS];
+};
+
+/* Searches "nr" shards, which must always be passed in the same order for a
+ * given query. The handler is passed the index of the shard each word comes
+ * from. Returns VB_ESHARDS if there are more than VB_MAX_SHARDS shards, or if
+ * the pagination data was made for another number of shards. Otherwise, same
+ * as vb_lexicon_match().
+ */
+int vb_federated_match(const struct vb_lexicon *const *shards, size_t nr,
+                       const struct vb_query *,
+                       struct vb_federated_pagination *,
+                       void (*handler)(void *arg, size_t shard,
+                                       const char *token, size_t len),
+                       void *arg);
+
+/* Encodes pagination data into a compact token, for passing it around. Writes
+ * it to "buf" if it is large enough, and returns its size in any case. Tokens
+ * take at most 2 + VB_MAX_SHARDS * (15 + VB_MAX_WORD_LEN) bytes.
+ */
+size_t vb_federated_token(const struct vb_federated_pagination *,
+                          void *buf, size_t size);
+
+/* Decodes a token made by vb_federated_token(). Returns VB_ESHARDS if it is
+ * malformed.
+ */
+int vb_federated_untoken(struct vb_federated_pagination *,
+                         const void *token, size_t len);
+
 #endif